@@ -0,0 +1,400 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Decode, filter and aggregate the binary DIMSE trace files of mppsrecv
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"   /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstd.h"       /* for OFStandard functions */
+#include "dcmtk/ofstd/ofconapp.h"    /* for OFConsoleApplication */
+#include "dcmtk/ofstd/ofstream.h"    /* for OFStringStream et al. */
+#include "dcmtk/dcmdata/dcuid.h"     /* for dcmtk version name */
+#include "dcmtk/dcmdata/cmdlnarg.h"  /* for prepareCmdLineArgs */
+#include "dcmtk/dcmnet/dimse.h"      /* for T_DIMSE_Command */
+#include "dmppstrace.h"              /* for DcmMppsTraceRecord */
+
+#include <stdio.h>
+#include <time.h>
+#include <map>
+
+
+/* general definitions */
+
+#define OFFIS_CONSOLE_APPLICATION "dimsetrace"
+
+static OFLogger dimsetraceLogger = OFLog::getLogger("dcmtk.apps." OFFIS_CONSOLE_APPLICATION);
+
+static char rcsid[] = "$dcmtk: " OFFIS_CONSOLE_APPLICATION " v"
+  OFFIS_DCMTK_VERSION " " OFFIS_DCMTK_RELEASEDATE " $";
+
+
+/* exit codes for this command line tool */
+/* (EXIT_SUCCESS and EXIT_FAILURE are standard codes) */
+
+// general
+#define EXITCODE_NO_ERROR                         0
+#define EXITCODE_COMMANDLINE_SYNTAX_ERROR         1
+
+// input file errors
+#define EXITCODE_CANNOT_READ_INPUT_FILE          20
+#define EXITCODE_INVALID_INPUT_FILE              21
+
+
+/* records per read from a trace file */
+#define READ_BATCH_SIZE 1024
+
+
+/* record filter */
+struct TraceFilter
+{
+    TraceFilter()
+      : commandField(0)
+      , aeTitle(NULL)
+      , associationID(0)
+      , instanceUID(NULL)
+      , failuresOnly(OFFalse)
+      , minLatency(0)
+    {
+    }
+
+    Uint16 commandField;
+    const char *aeTitle;
+    Uint32 associationID;
+    const char *instanceUID;
+    OFBool failuresOnly;
+    Uint32 minLatency;
+};
+
+/* aggregated records of one command and calling AE title */
+struct TraceSummary
+{
+    TraceSummary()
+      : count(0)
+      , failures(0)
+      , bytes(0)
+      , latencySum(0)
+      , latencyMax(0)
+    {
+    }
+
+    unsigned long count;
+    unsigned long failures;
+    double bytes;
+    double latencySum;
+    Uint32 latencyMax;
+};
+
+
+/* returns a fixed-size string field of a record as a string */
+static OFString getField(const char *field,
+                         const size_t size)
+{
+    size_t length = 0;
+    while ((length < size) && (field[length] != '\0'))
+        ++length;
+    return OFString(field, length);
+}
+
+
+/* returns the name of a command field */
+static OFString getCommandName(const Uint16 commandField)
+{
+    switch (commandField)
+    {
+        case DIMSE_C_ECHO_RQ:
+            return "C-ECHO-RQ";
+        case DIMSE_N_CREATE_RQ:
+            return "N-CREATE-RQ";
+        case DIMSE_N_SET_RQ:
+            return "N-SET-RQ";
+        default:
+        {
+            char buffer[16];
+            OFStandard::snprintf(buffer, sizeof(buffer), "0x%04x", OFstatic_cast(unsigned int, commandField));
+            return buffer;
+        }
+    }
+}
+
+
+/* parses a command given on the command line */
+static OFBool parseCommand(const OFString &text,
+                           Uint16 &commandField)
+{
+    if (text == "echo")
+        commandField = DIMSE_C_ECHO_RQ;
+    else if (text == "create")
+        commandField = DIMSE_N_CREATE_RQ;
+    else if (text == "set")
+        commandField = DIMSE_N_SET_RQ;
+    else
+    {
+        unsigned int value = 0;
+        if ((sscanf(text.c_str(), "%x", &value) != 1) || (value == 0) || (value > 0xffff))
+            return OFFalse;
+        commandField = OFstatic_cast(Uint16, value);
+    }
+    return OFTrue;
+}
+
+
+/* returns whether a request failed or was not answered with success */
+static OFBool isFailure(const DcmMppsTraceRecord &record)
+{
+    return !(record.flags & DCMMPPS_TRACE_RESPONSE_SENT) || (record.flags & DCMMPPS_TRACE_HANDLER_FAILED) ||
+        (record.status != STATUS_Success);
+}
+
+
+/* returns whether a record passes the filter */
+static OFBool matches(const DcmMppsTraceRecord &record,
+                      const TraceFilter &filter)
+{
+    if ((filter.commandField != 0) && (record.commandField != filter.commandField))
+        return OFFalse;
+    if ((filter.aeTitle != NULL) && (getField(record.callingAETitle, sizeof(record.callingAETitle)) != filter.aeTitle))
+        return OFFalse;
+    if ((filter.associationID != 0) && (record.associationID != filter.associationID))
+        return OFFalse;
+    if ((filter.instanceUID != NULL) && (getField(record.sopInstanceUID, sizeof(record.sopInstanceUID)) != filter.instanceUID))
+        return OFFalse;
+    if (filter.failuresOnly && !isFailure(record))
+        return OFFalse;
+    return (record.latency >= filter.minLatency);
+}
+
+
+/* prints a record as one line */
+static void printRecord(const DcmMppsTraceRecord &record)
+{
+    char timestamp[32];
+    const time_t seconds = OFstatic_cast(time_t, record.seconds);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+
+    char status[32];
+    if (record.flags & DCMMPPS_TRACE_RESPONSE_SENT)
+        OFStandard::snprintf(status, sizeof(status), "0x%04x", OFstatic_cast(unsigned int, record.status));
+    else
+        OFStandard::strlcpy(status, "none", sizeof(status));
+    if (record.flags & DCMMPPS_TRACE_HANDLER_FAILED)
+        OFStandard::strlcat(status, " (failed)", sizeof(status));
+
+    char line[512];
+    OFStandard::snprintf(line, sizeof(line), "%s.%06u assoc %u %-11s msg %u pc %u status %s %u bytes %u us AE \"%s\" %s %s",
+        timestamp, OFstatic_cast(unsigned int, record.nanoseconds / 1000), OFstatic_cast(unsigned int, record.associationID),
+        getCommandName(record.commandField).c_str(), OFstatic_cast(unsigned int, record.messageID),
+        OFstatic_cast(unsigned int, record.presentationContextID), status,
+        OFstatic_cast(unsigned int, record.datasetSize), OFstatic_cast(unsigned int, record.latency),
+        getField(record.callingAETitle, sizeof(record.callingAETitle)).c_str(),
+        getField(record.sopClassUID, sizeof(record.sopClassUID)).c_str(),
+        getField(record.sopInstanceUID, sizeof(record.sopInstanceUID)).c_str());
+    COUT << line << OFendl;
+}
+
+
+/* reads the records of a trace file, prints or aggregates the ones passing the filter */
+static int processFile(const char *filename,
+                       const TraceFilter &filter,
+                       STD_NAMESPACE map<OFString, TraceSummary> *summary)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        OFLOG_FATAL(dimsetraceLogger, "cannot open " << filename << ": "
+            << OFStandard::getLastSystemErrorCode().message());
+        return EXITCODE_CANNOT_READ_INPUT_FILE;
+    }
+    DcmMppsTraceHeader header;
+    if ((fread(&header, sizeof(header), 1, file) != 1) ||
+        (memcmp(header.magic, DCMMPPS_TRACE_MAGIC, sizeof(header.magic)) != 0))
+    {
+        OFLOG_FATAL(dimsetraceLogger, filename << " is not a DIMSE trace file");
+        fclose(file);
+        return EXITCODE_INVALID_INPUT_FILE;
+    }
+    // the numbers are in the byte order of the writing host
+    if ((header.version != DCMMPPS_TRACE_VERSION) || (header.recordSize != sizeof(DcmMppsTraceRecord)))
+    {
+        OFLOG_FATAL(dimsetraceLogger, filename << " has an unsupported record layout (written by a different"
+            " version or on a host with a different byte order)");
+        fclose(file);
+        return EXITCODE_INVALID_INPUT_FILE;
+    }
+    OFLOG_DEBUG(dimsetraceLogger, filename << ": " << header.count << " of " << header.capacity << " records used");
+
+    static DcmMppsTraceRecord records[READ_BATCH_SIZE];
+    Uint32 remaining = header.count;
+    while (remaining > 0)
+    {
+        const size_t wanted = (remaining < READ_BATCH_SIZE) ? OFstatic_cast(size_t, remaining) : READ_BATCH_SIZE;
+        const size_t count = fread(records, sizeof(DcmMppsTraceRecord), wanted, file);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const DcmMppsTraceRecord &record = records[i];
+            if (!matches(record, filter))
+                continue;
+            if (summary == NULL)
+                printRecord(record);
+            else
+            {
+                TraceSummary &entry = (*summary)[getCommandName(record.commandField) + " \"" +
+                    getField(record.callingAETitle, sizeof(record.callingAETitle)) + "\""];
+                ++entry.count;
+                if (isFailure(record))
+                    ++entry.failures;
+                entry.bytes += record.datasetSize;
+                entry.latencySum += record.latency;
+                if (record.latency > entry.latencyMax)
+                    entry.latencyMax = record.latency;
+            }
+        }
+        if (count < wanted)
+        {
+            OFLOG_WARN(dimsetraceLogger, filename << " is truncated, " << (remaining - count) << " records missing");
+            break;
+        }
+        remaining -= OFstatic_cast(Uint32, count);
+    }
+    fclose(file);
+    return EXITCODE_NO_ERROR;
+}
+
+
+/* main program */
+
+#define SHORTCOL 4
+#define LONGCOL 21
+
+int main(int argc, char *argv[])
+{
+    TraceFilter opt_filter;
+    OFBool opt_summary = OFFalse;
+    OFList<const char *> opt_files;
+
+    OFConsoleApplication app(OFFIS_CONSOLE_APPLICATION , "Decode the binary DIMSE trace files of mppsrecv", rcsid);
+    OFCommandLine cmd;
+
+    cmd.setParamColumn(LONGCOL + SHORTCOL + 4);
+    cmd.addParam("tracefile", "trace file (see mppsrecv --trace-file), oldest first",
+                 OFCmdParam::PM_MultiMandatory);
+
+    cmd.setOptionColumns(LONGCOL, SHORTCOL);
+    cmd.addGroup("general options:", LONGCOL, SHORTCOL + 2);
+      cmd.addOption("--help",                  "-h",      "print this help text and exit", OFCommandLine::AF_Exclusive);
+      cmd.addOption("--version",                          "print version information and exit", OFCommandLine::AF_Exclusive);
+      OFLog::addOptions(cmd);
+
+    cmd.addGroup("filter options:");
+      cmd.addOption("--command",               "-c",   1, "[c]ommand: string",
+                                                          "only requests with command c (echo, create,\n"
+                                                          "set or hexadecimal command field)");
+      cmd.addOption("--aetitle",               "-aet", 1, "[a]etitle: string",
+                                                          "only requests from calling AE title a");
+      cmd.addOption("--association",           "-as",  1, "[n]umber: integer",
+                                                          "only requests of association n");
+      cmd.addOption("--instance-uid",          "-uid", 1, "[u]id: string",
+                                                          "only requests for SOP Instance UID u");
+      cmd.addOption("--failures",              "-fl",     "only requests that failed or were not answered\n"
+                                                          "with status success");
+      cmd.addOption("--min-latency",           "-ml",  1, "[u]sec: integer",
+                                                          "only requests handled in u microseconds or more");
+    cmd.addGroup("output options:");
+      cmd.addOption("--summary",               "-s",      "print number of requests, failures, dataset\n"
+                                                          "bytes and average/maximum latency per command\n"
+                                                          "and calling AE title instead of the requests");
+
+    /* evaluate command line */
+    prepareCmdLineArgs(argc, argv, OFFIS_CONSOLE_APPLICATION);
+    if (app.parseCommandLine(cmd, argc, argv))
+    {
+        /* check exclusive options first */
+        if (cmd.hasExclusiveOption())
+        {
+            if (cmd.findOption("--version"))
+            {
+                app.printHeader(OFTrue /*print host identifier*/);
+                COUT << OFendl << "External libraries used: none" << OFendl;
+                return EXITCODE_NO_ERROR;
+            }
+        }
+
+        /* general options */
+        OFLog::configureFromCommandLine(cmd, app);
+
+        if (cmd.findOption("--command"))
+        {
+            const char *command = NULL;
+            app.checkValue(cmd.getValue(command));
+            if (!parseCommand(command, opt_filter.commandField))
+            {
+                OFLOG_FATAL(dimsetraceLogger, "invalid command: " << command);
+                return EXITCODE_COMMANDLINE_SYNTAX_ERROR;
+            }
+        }
+        if (cmd.findOption("--aetitle"))
+            app.checkValue(cmd.getValue(opt_filter.aeTitle));
+        if (cmd.findOption("--association"))
+        {
+            OFCmdUnsignedInt association = 0;
+            app.checkValue(cmd.getValueAndCheckMin(association, 1));
+            opt_filter.associationID = OFstatic_cast(Uint32, association);
+        }
+        if (cmd.findOption("--instance-uid"))
+            app.checkValue(cmd.getValue(opt_filter.instanceUID));
+        if (cmd.findOption("--failures"))
+            opt_filter.failuresOnly = OFTrue;
+        if (cmd.findOption("--min-latency"))
+        {
+            OFCmdUnsignedInt latency = 0;
+            app.checkValue(cmd.getValueAndCheckMin(latency, 1));
+            opt_filter.minLatency = OFstatic_cast(Uint32, latency);
+        }
+        if (cmd.findOption("--summary"))
+            opt_summary = OFTrue;
+
+        /* command line parameters */
+        const int count = cmd.getParamCount();
+        for (int i = 1; i <= count; i++)
+        {
+            const char *filename = NULL;
+            cmd.getParam(i, filename);
+            opt_files.push_back(filename);
+        }
+    }
+
+    /* print resource identifier */
+    OFLOG_DEBUG(dimsetraceLogger, rcsid << OFendl);
+
+    /* decode the trace files in the given order */
+    STD_NAMESPACE map<OFString, TraceSummary> summary;
+    for (OFListIterator(const char *) it = opt_files.begin(); it != opt_files.end(); ++it)
+    {
+        const int result = processFile(*it, opt_filter, opt_summary ? &summary : NULL);
+        if (result != EXITCODE_NO_ERROR)
+            return result;
+    }
+
+    if (opt_summary)
+    {
+        COUT << "command      AE title           requests  failures       bytes  avg us  max us" << OFendl;
+        for (STD_NAMESPACE map<OFString, TraceSummary>::const_iterator it = summary.begin(); it != summary.end(); ++it)
+        {
+            const TraceSummary &entry = it->second;
+            const size_t separator = it->first.find(' ');
+            char line[256];
+            OFStandard::snprintf(line, sizeof(line), "%-12s %-18s %8lu  %8lu  %10.0f  %6.0f  %6u",
+                it->first.substr(0, separator).c_str(), it->first.substr(separator + 1).c_str(),
+                entry.count, entry.failures, entry.bytes, entry.latencySum / OFstatic_cast(double, entry.count),
+                OFstatic_cast(unsigned int, entry.latencyMax));
+            COUT << line << OFendl;
+        }
+    }
+
+    return EXITCODE_NO_ERROR;
+}
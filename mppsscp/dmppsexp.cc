@@ -0,0 +1,355 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Streaming export of MPPS events as newline-delimited JSON
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppsexp.h"
+#include "dmppsprobe.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_ERROR() */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+/* time the writer thread waits for new events, i.e. the maximum batching delay */
+#define FLUSH_INTERVAL_MSEC 50
+
+// ----------------------------------------------------------------------------
+
+/* append a string value as a JSON string literal */
+static void appendJSONString(const OFString &value,
+                             OFString &output)
+{
+  output += '"';
+  for (size_t i = 0; i < value.length(); i++)
+  {
+    const unsigned char c = OFstatic_cast(unsigned char, value[i]);
+    if ((c == '"') || (c == '\\'))
+    {
+      output += '\\';
+      output += OFstatic_cast(char, c);
+    }
+    else if (c < 0x20)
+    {
+      char escaped[8];
+      OFStandard::snprintf(escaped, sizeof(escaped), "\\u%04x", OFstatic_cast(unsigned int, c));
+      output += escaped;
+    }
+    else
+      output += OFstatic_cast(char, c);
+  }
+  output += '"';
+}
+
+
+/* append a "name":"value" pair (preceded by a comma) */
+static void appendJSONMember(const char *name,
+                             const OFString &value,
+                             OFString &output)
+{
+  output += ",\"";
+  output += name;
+  output += "\":";
+  appendJSONString(value, output);
+}
+
+
+DcmMppsEventExporter::DcmMppsEventExporter()
+  : OFThread()
+  , m_filename()
+  , m_fd(-1)
+  , m_isPipe(OFFalse)
+  , m_fileSize(0)
+  , m_maxFileSize(0)
+  , m_maxFiles(5)
+  , m_running(OFFalse)
+  , m_stopRequested(OFFalse)
+  , m_rings(DCMMPPS_EXPORT_BUFFER_SIZE)
+  , m_partialRing(DCMSVC_RING_MAX_THREADS)
+{
+}
+
+
+DcmMppsEventExporter::~DcmMppsEventExporter()
+{
+  close();
+}
+
+
+void DcmMppsEventExporter::setRotation(const size_t maxSize,
+                                       const unsigned int maxFiles)
+{
+  m_maxFileSize = maxSize;
+  m_maxFiles = maxFiles;
+}
+
+
+OFCondition DcmMppsEventExporter::open(const OFString &filename)
+{
+  if (m_running)
+    return EC_IllegalCall;
+
+  struct stat info;
+  m_filename = filename;
+  m_isPipe = (stat(filename.c_str(), &info) == 0) && S_ISFIFO(info.st_mode);
+  if (!m_isPipe && !openOutput())
+  {
+    DCMNET_ERROR("Cannot open MPPS export file " << filename << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot open MPPS export file");
+  }
+
+  m_stopRequested = OFFalse;
+  if (start() != 0)
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot start MPPS export thread");
+  m_running = OFTrue;
+  DCMNET_INFO("Exporting MPPS events to " << (m_isPipe ? "named pipe " : "file ") << filename);
+  return EC_Normal;
+}
+
+
+void DcmMppsEventExporter::close()
+{
+  if (m_running)
+  {
+    m_stopRequested = OFTrue;
+    join();
+    m_running = OFFalse;
+  }
+  if (m_fd >= 0)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+
+void DcmMppsEventExporter::exportEvent(const DcmMppsEventType eventType,
+                                       const DcmMppsInstance &instance,
+                                       const DcmMppsStepStatus previousStatus,
+                                       const OFString &callingAETitle)
+{
+  DcmMppsExportRing *ring = m_rings.getThreadRing();
+  if (ring == NULL)
+  {
+    DCMNET_WARN("Too many threads for MPPS export, events of this thread are not exported");
+    return;
+  }
+  OFString line;
+  formatEvent(eventType, instance, previousStatus, callingAETitle, line);
+  const OFBool queued = ring->push(line.c_str(), line.length());
+  DCMMPPS_PROBE2(export__queued, line.length(), queued);
+  if (!queued)
+    DCMNET_DEBUG("MPPS export buffer full, event for " << instance.sopInstanceUID << " dropped");
+}
+
+
+void DcmMppsEventExporter::formatEvent(const DcmMppsEventType eventType,
+                                       const DcmMppsInstance &instance,
+                                       const DcmMppsStepStatus previousStatus,
+                                       const OFString &callingAETitle,
+                                       OFString &output)
+{
+  // time of the event in UTC with milliseconds, e.g. 2016-08-01T12:34:56.789Z
+  struct timeval now;
+  struct tm utc;
+  gettimeofday(&now, NULL);
+  const time_t seconds = now.tv_sec;
+  gmtime_r(&seconds, &utc);
+  char timestamp[32];
+  OFStandard::snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+    utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+    OFstatic_cast(int, now.tv_usec / 1000));
+
+  output += "{\"time\":\"";
+  output += timestamp;
+  output += "\",\"event\":\"";
+  output += (eventType == DCMMPPS_EVENT_CREATE) ? "N-CREATE" : "N-SET";
+  output += '"';
+  appendJSONMember("sopInstanceUID", instance.sopInstanceUID, output);
+  appendJSONMember("status", DcmMppsInstance::statusName(instance.status), output);
+  if (previousStatus != DCMMPPS_STATUS_ABSENT)
+    appendJSONMember("previousStatus", DcmMppsInstance::statusName(previousStatus), output);
+  appendJSONMember("patientID", instance.patientID, output);
+  appendJSONMember("patientName", instance.patientName, output);
+  output += ",\"accessionNumbers\":[";
+  for (size_t i = 0; i < instance.accessionNumbers.size(); i++)
+  {
+    if (i > 0)
+      output += ',';
+    appendJSONString(instance.accessionNumbers[i], output);
+  }
+  output += ']';
+  appendJSONMember("stationAETitle", instance.stationAETitle, output);
+  appendJSONMember("modality", instance.modality, output);
+  appendJSONMember("procedureStepID", instance.procedureStepID, output);
+  appendJSONMember("startDate", instance.startDate, output);
+  appendJSONMember("startTime", instance.startTime, output);
+  appendJSONMember("endDate", instance.endDate, output);
+  appendJSONMember("endTime", instance.endTime, output);
+  appendJSONMember("callingAETitle", callingAETitle, output);
+  output += "}\n";
+}
+
+
+size_t DcmMppsEventExporter::getNumberOfDroppedEvents()
+{
+  return m_rings.getNumberOfDropped();
+}
+
+
+void DcmMppsEventExporter::run()
+{
+  // SIGPIPE (reader of the pipe gone) is sent to the writing thread. Block it in this
+  // thread only, so that writev() fails with EPIPE instead of the process being
+  // terminated, without changing the signal disposition of the whole process
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  while (!m_stopRequested)
+  {
+    // write in batches, i.e. only wait if there was nothing to write
+    if (writeBufferedData() == 0)
+      OFStandard::milliSleep(FLUSH_INTERVAL_MSEC);
+  }
+  // write what is left, but do not wait for a pipe reader forever
+  while (writeBufferedData() > 0)
+    ;
+}
+
+
+size_t DcmMppsEventExporter::writeBufferedData()
+{
+  struct iovec iov[2 * DCMSVC_RING_MAX_THREADS];
+  size_t order[DCMSVC_RING_MAX_THREADS];
+  size_t available[DCMSVC_RING_MAX_THREADS];
+  int numVectors = 0;
+  size_t total = 0;
+
+  // collect the buffered data of all rings, each ring contributes at most two
+  // vectors (if its data wraps around the end of the buffer). A ring whose data
+  // has only partly been written by the last call comes first, so that the rest
+  // of its line directly follows the part already written.
+  const size_t numRings = m_rings.getNumberOfRings();
+  size_t numOrdered = 0;
+  if (m_partialRing < numRings)
+    order[numOrdered++] = m_partialRing;
+  for (size_t i = 0; i < numRings; i++)
+  {
+    if (i != m_partialRing)
+      order[numOrdered++] = i;
+  }
+  for (size_t i = 0; i < numRings; i++)
+  {
+    const DcmMppsExportRing *ring = m_rings.getRing(order[i]);
+    available[i] = ring->getAvailable();
+    size_t offset = 0;
+    while (offset < available[i])
+    {
+      size_t length = 0;
+      const char *data = ring->peek(offset, available[i] - offset, length);
+      iov[numVectors].iov_base = OFconst_cast(char *, data);
+      iov[numVectors].iov_len = length;
+      ++numVectors;
+      offset += length;
+    }
+    total += available[i];
+  }
+  if ((total == 0) || !openOutput())
+    return 0;
+
+  const ssize_t written = writev(m_fd, iov, numVectors);
+  if (written <= 0)
+  {
+    if ((written < 0) && (errno == EPIPE))
+    {
+      // the reader of the pipe has gone away, reopen as soon as there is a new one
+      ::close(m_fd);
+      m_fd = -1;
+    }
+    else if ((written < 0) && (errno != EAGAIN) && (errno != EINTR))
+      DCMNET_ERROR("Cannot write MPPS export: " << OFStandard::getLastSystemErrorCode().message());
+    return 0;
+  }
+
+  // release the written data, rings are consumed in the order of the vectors
+  size_t remaining = OFstatic_cast(size_t, written);
+  m_partialRing = DCMSVC_RING_MAX_THREADS;
+  for (size_t i = 0; (i < numRings) && (remaining > 0); i++)
+  {
+    const size_t consumed = (available[i] < remaining) ? available[i] : remaining;
+    m_rings.getRing(order[i])->consume(consumed);
+    remaining -= consumed;
+    if (consumed < available[i])
+      m_partialRing = order[i];
+  }
+
+  m_fileSize += OFstatic_cast(size_t, written);
+  // only rotate on a batch boundary, so that no line is split across files
+  if (OFstatic_cast(size_t, written) == total)
+    rotateOutput();
+  return OFstatic_cast(size_t, written);
+}
+
+
+OFBool DcmMppsEventExporter::openOutput()
+{
+  if (m_fd >= 0)
+    return OFTrue;
+  if (m_isPipe)
+  {
+    // fails with ENXIO as long as there is no reader
+    m_fd = ::open(m_filename.c_str(), O_WRONLY | O_NONBLOCK);
+  }
+  else
+  {
+    m_fd = ::open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    struct stat info;
+    m_fileSize = ((m_fd >= 0) && (fstat(m_fd, &info) == 0)) ? OFstatic_cast(size_t, info.st_size) : 0;
+  }
+  return (m_fd >= 0);
+}
+
+
+void DcmMppsEventExporter::rotateOutput()
+{
+  if (m_isPipe || (m_maxFileSize == 0) || (m_fileSize < m_maxFileSize))
+    return;
+
+  ::close(m_fd);
+  m_fd = -1;
+  // shift the older files, i.e. "name.1" becomes "name.2" and so on
+  char from[1024];
+  char to[1024];
+  for (unsigned int i = m_maxFiles; i > 1; i--)
+  {
+    OFStandard::snprintf(from, sizeof(from), "%s.%u", m_filename.c_str(), i - 1);
+    OFStandard::snprintf(to, sizeof(to), "%s.%u", m_filename.c_str(), i);
+    rename(from, to);
+  }
+  if (m_maxFiles > 0)
+  {
+    OFStandard::snprintf(to, sizeof(to), "%s.1", m_filename.c_str());
+    rename(m_filename.c_str(), to);
+  }
+  else
+    unlink(m_filename.c_str());
+  openOutput();
+}
@@ -0,0 +1,169 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Streaming export of MPPS events as newline-delimited JSON
+ *
+ */
+
+#ifndef DMPPSEXP_H
+#define DMPPSEXP_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFThread, OFMutex */
+#include "dcmtk/ofstd/ofcond.h"
+
+#include "dmppsstor.h"              /* for DcmMppsInstance */
+#include "dsvcring.h"               /* for DcmSvcRing, DcmSvcRingRegistry */
+
+/** Default capacity of the buffer of each producing thread in bytes (power of two)
+ */
+#define DCMMPPS_EXPORT_BUFFER_SIZE (1 << 20)
+
+/** Kind of an exported MPPS event
+ */
+enum DcmMppsEventType
+{
+  /// a new instance has been created (N-CREATE)
+  DCMMPPS_EVENT_CREATE,
+  /// an instance has been updated (N-SET)
+  DCMMPPS_EVENT_SET
+};
+
+/** Byte ring of the JSON lines of one producing thread
+ */
+typedef DcmSvcRing<char> DcmMppsExportRing;
+
+/** Exporter writing one JSON object per line for each accepted N-CREATE and N-SET to
+ *  a (rotating) file or to a named pipe. Each producing thread formats its events into
+ *  its own lock-free ring buffer. A single writer thread collects the buffered data of
+ *  all rings and writes it with one writev() call per batch. After a partial write
+ *  (e.g.\ to a full pipe), the ring that was cut off is continued first, so that lines
+ *  never interleave. If the output cannot keep up, the events that do not fit into the
+ *  ring are dropped (and counted) rather than blocking the SCP.
+ */
+class DcmMppsEventExporter : public OFThread
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsEventExporter();
+
+  /** destructor. Flushes buffered events and stops the writer thread, see close().
+   */
+  virtual ~DcmMppsEventExporter();
+
+  /** Set the maximum size of the output file. If exceeded, the file is renamed to
+   *  "<filename>.1" (older files are shifted) and a new file is started. Not used for
+   *  named pipes.
+   *  @param maxSize  [in] maximum file size in bytes, 0 for no rotation
+   *  @param maxFiles [in] number of rotated files to keep
+   */
+  void setRotation(const size_t maxSize,
+                   const unsigned int maxFiles);
+
+  /** Open the output and start the writer thread. If the output is a named pipe, it
+   *  is (re-)opened as soon as a reader is present.
+   *  @param filename [in] The output file or named pipe
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition open(const OFString &filename);
+
+  /** Flush all buffered events, stop the writer thread and close the output
+   */
+  void close();
+
+  /** Export an event (may be called by any thread)
+   *  @param eventType      [in] The kind of event
+   *  @param instance       [in] The instance after the event
+   *  @param previousStatus [in] The status before the event (ABSENT if not known)
+   *  @param callingAETitle [in] AE title of the SCU that caused the event
+   */
+  void exportEvent(const DcmMppsEventType eventType,
+                   const DcmMppsInstance &instance,
+                   const DcmMppsStepStatus previousStatus,
+                   const OFString &callingAETitle);
+
+  /** Format an event as a single line of JSON (including the trailing newline)
+   *  @param eventType      [in]    The kind of event
+   *  @param instance       [in]    The instance after the event
+   *  @param previousStatus [in]    The status before the event (ABSENT if not known)
+   *  @param callingAETitle [in]    AE title of the SCU that caused the event
+   *  @param output         [inout] The string to append the line to
+   */
+  static void formatEvent(const DcmMppsEventType eventType,
+                          const DcmMppsInstance &instance,
+                          const DcmMppsStepStatus previousStatus,
+                          const OFString &callingAETitle,
+                          OFString &output);
+
+  /** Returns the number of events dropped so far because a buffer was full
+   *  @return number of dropped events
+   */
+  size_t getNumberOfDroppedEvents();
+
+  protected:
+
+  /** Thread entry point, writes buffered events until close() is called
+   */
+  virtual void run();
+
+  /** Write all data currently buffered in the rings
+   *  @return number of bytes written
+   */
+  size_t writeBufferedData();
+
+  /** Open the output file or pipe if not yet open
+   *  @return OFTrue if the output is open, OFFalse otherwise
+   */
+  OFBool openOutput();
+
+  /** Rotate the output file if it exceeds the maximum size
+   */
+  void rotateOutput();
+
+  private:
+
+  /// file name of the output
+  OFString m_filename;
+
+  /// output file descriptor, -1 if not open
+  int m_fd;
+
+  /// OFTrue if the output is a named pipe
+  OFBool m_isPipe;
+
+  /// number of bytes written to the current output file
+  size_t m_fileSize;
+
+  /// maximum file size before rotation, 0 for no rotation
+  size_t m_maxFileSize;
+
+  /// number of rotated files to keep
+  unsigned int m_maxFiles;
+
+  /// OFTrue while the writer thread is running
+  OFBool m_running;
+
+  /// set by close() to end the writer thread
+  volatile OFBool m_stopRequested;
+
+  /// the ring of each producing thread
+  DcmSvcRingRegistry<DcmMppsExportRing> m_rings;
+
+  /// index of the ring whose data was only partly written by the last writev() (e.g.\ to
+  /// a full pipe), DCMSVC_RING_MAX_THREADS if none. Only used by the writer thread.
+  size_t m_partialRing;
+
+  // private undefined copy constructor
+  DcmMppsEventExporter(const DcmMppsEventExporter &);
+
+  // private undefined assignment operator
+  DcmMppsEventExporter &operator=(const DcmMppsEventExporter &);
+
+};
+
+#endif // DMPPSEXP_H
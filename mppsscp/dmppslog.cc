@@ -0,0 +1,258 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Asynchronous logging of DIMSE message dumps
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppslog.h"
+#include "dmppsprobe.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmdata/dcostrmb.h" /* for DcmOutputBufferStream */
+#include "dcmtk/dcmdata/dcistrmb.h" /* for DcmInputBufferStream */
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_INFO() */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+/* time the writer thread waits for new records */
+#define POLL_INTERVAL_MSEC 20
+
+// ----------------------------------------------------------------------------
+
+DcmMppsLogRing::DcmMppsLogRing(const size_t capacity)
+  : DcmSvcRing<char>(capacity)
+  , record(NULL)
+  , recordCapacity(0)
+{
+}
+
+
+DcmMppsLogRing::~DcmMppsLogRing()
+{
+  delete[] record;
+}
+
+
+void DcmMppsLogRing::reserveRecord(const size_t length)
+{
+  if (length > recordCapacity)
+  {
+    delete[] record;
+    record = new char[length];
+    recordCapacity = length;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+/* encode a dataset (Little Endian Explicit) into a buffer of exactly its length */
+static OFBool encodeDataset(DcmDataset &dataset,
+                            char *buffer,
+                            const Uint32 length)
+{
+  DcmOutputBufferStream stream(buffer, length);
+  dataset.transferInit();
+  // do not touch the group length elements of the dataset of the SCP
+  const OFCondition cond = dataset.write(stream, EXS_LittleEndianExplicit, EET_ExplicitLength, NULL, EGL_noChange);
+  dataset.transferEnd();
+  void *data = NULL;
+  offile_off_t written = 0;
+  stream.flushBuffer(data, written);
+  return cond.good() && (written == OFstatic_cast(offile_off_t, length));
+}
+
+
+/* decode a dataset encoded by encodeDataset() */
+static OFBool decodeDataset(DcmDataset &dataset,
+                            const char *buffer,
+                            const Uint32 length)
+{
+  DcmInputBufferStream stream;
+  stream.setBuffer(buffer, length);
+  stream.setEos();
+  dataset.clear();
+  dataset.transferInit();
+  const OFCondition cond = dataset.read(stream, EXS_LittleEndianExplicit, EGL_noChange);
+  dataset.transferEnd();
+  return cond.good();
+}
+
+// ----------------------------------------------------------------------------
+
+DcmMppsAsyncLogger::DcmMppsAsyncLogger()
+  : OFThread()
+  , m_running(OFFalse)
+  , m_stopRequested(OFFalse)
+  , m_reportedDrops(0)
+  , m_record(NULL)
+  , m_recordCapacity(0)
+  , m_dataset()
+  , m_rings(DCMMPPS_LOG_BUFFER_SIZE)
+{
+}
+
+
+DcmMppsAsyncLogger::~DcmMppsAsyncLogger()
+{
+  stopLogging();
+  delete[] m_record;
+}
+
+
+OFCondition DcmMppsAsyncLogger::startLogging()
+{
+  if (m_running)
+    return EC_IllegalCall;
+  m_stopRequested = OFFalse;
+  if (start() != 0)
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot start logging thread");
+  m_running = OFTrue;
+  return EC_Normal;
+}
+
+
+void DcmMppsAsyncLogger::stopLogging()
+{
+  if (m_running)
+  {
+    m_stopRequested = OFTrue;
+    join();
+    m_running = OFFalse;
+  }
+}
+
+
+void DcmMppsAsyncLogger::dumpMessage(const OFLogger::LogLevel level,
+                                     const T_DIMSE_Message &message,
+                                     const enum DIMSE_direction direction,
+                                     DcmDataset *dataset,
+                                     const T_ASC_PresentationContextID presID)
+{
+  if (!DCM_dcmnetLogger.isEnabledFor(level))
+    return;
+  DcmMppsLogRing *ring = m_rings.getThreadRing();
+  if (ring == NULL)
+  {
+    DCMNET_WARN("Too many threads for asynchronous logging, messages of this thread are not dumped");
+    return;
+  }
+  DcmMppsLogRecord record;
+  record.level = level;
+  record.message = message;
+  record.direction = direction;
+  record.presID = presID;
+  record.hasDataset = (dataset != NULL);
+  record.datasetLength = 0;
+  if (dataset != NULL)
+    record.datasetLength = dataset->calcElementLength(EXS_LittleEndianExplicit, EET_ExplicitLength);
+  const size_t length = sizeof(record) + record.datasetLength;
+  OFBool queued = OFFalse;
+  if (length > ring->getCapacity())
+    ring->countDrop();
+  else
+  {
+    // encoding is much cheaper than formatting the complete dataset as text, and
+    // unlike a copy of the dataset it does not allocate anything
+    ring->reserveRecord(length);
+    if ((dataset != NULL) && !encodeDataset(*dataset, ring->record + sizeof(record), record.datasetLength))
+    {
+      record.hasDataset = OFFalse;
+      record.datasetLength = 0;
+    }
+    memcpy(ring->record, &record, sizeof(record));
+    queued = ring->push(ring->record, sizeof(record) + record.datasetLength);
+  }
+  DCMMPPS_PROBE2(log__queued, OFstatic_cast(int, level), queued);
+}
+
+
+void DcmMppsAsyncLogger::dumpMessage(const OFLogger::LogLevel level,
+                                     const T_DIMSE_N_CreateRQ &request,
+                                     DcmDataset *dataset,
+                                     const T_ASC_PresentationContextID presID)
+{
+  T_DIMSE_Message message;
+  bzero((char*)&message, sizeof(message));
+  message.CommandField = DIMSE_N_CREATE_RQ;
+  message.msg.NCreateRQ = request;
+  dumpMessage(level, message, DIMSE_INCOMING, dataset, presID);
+}
+
+
+void DcmMppsAsyncLogger::dumpMessage(const OFLogger::LogLevel level,
+                                     const T_DIMSE_N_SetRQ &request,
+                                     DcmDataset *dataset,
+                                     const T_ASC_PresentationContextID presID)
+{
+  T_DIMSE_Message message;
+  bzero((char*)&message, sizeof(message));
+  message.CommandField = DIMSE_N_SET_RQ;
+  message.msg.NSetRQ = request;
+  dumpMessage(level, message, DIMSE_INCOMING, dataset, presID);
+}
+
+
+size_t DcmMppsAsyncLogger::getNumberOfDroppedRecords()
+{
+  return m_rings.getNumberOfDropped();
+}
+
+
+void DcmMppsAsyncLogger::run()
+{
+  while (!m_stopRequested)
+  {
+    if (writeRecords() == 0)
+      OFStandard::milliSleep(POLL_INTERVAL_MSEC);
+  }
+  // log what is left
+  while (writeRecords() > 0)
+    ;
+}
+
+
+size_t DcmMppsAsyncLogger::writeRecords()
+{
+  size_t count = 0;
+  const size_t numRings = m_rings.getNumberOfRings();
+  for (size_t i = 0; i < numRings; i++)
+  {
+    // the producer adds complete records, i.e. the dataset follows its record
+    DcmMppsLogRing *ring = m_rings.getRing(i);
+    while (ring->getAvailable() > 0)
+    {
+      DcmMppsLogRecord record;
+      ring->pop(OFreinterpret_cast(char *, &record), sizeof(record));
+      DcmDataset *dataset = NULL;
+      if (record.hasDataset)
+      {
+        if (record.datasetLength > m_recordCapacity)
+        {
+          delete[] m_record;
+          m_record = new char[record.datasetLength];
+          m_recordCapacity = record.datasetLength;
+        }
+        ring->pop(m_record, record.datasetLength);
+        if (decodeDataset(m_dataset, m_record, record.datasetLength))
+          dataset = &m_dataset;
+      }
+      OFString tempStr;
+      DIMSE_dumpMessage(tempStr, record.message, record.direction, dataset, record.presID);
+      DCM_dcmnetLogger.forcedLog(record.level, tempStr);
+      ++count;
+    }
+  }
+  // report drops once per batch rather than for each dropped record
+  const size_t dropped = getNumberOfDroppedRecords();
+  if (dropped > m_reportedDrops)
+  {
+    DCMNET_WARN("Asynchronous logging cannot keep up, " << (dropped - m_reportedDrops)
+      << " message dumps dropped");
+    m_reportedDrops = dropped;
+  }
+  return count;
+}
@@ -0,0 +1,193 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Asynchronous logging of DIMSE message dumps
+ *
+ */
+
+#ifndef DMPPSLOG_H
+#define DMPPSLOG_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFThread, OFMutex */
+#include "dcmtk/ofstd/ofcond.h"
+#include "dcmtk/oflog/oflog.h"      /* for OFLogger */
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+#include "dcmtk/dcmnet/dimse.h"     /* for T_DIMSE_Message */
+
+#include "dsvcring.h"               /* for DcmSvcRing, DcmSvcRingRegistry */
+
+/** Capacity of the ring of each logging thread in bytes (power of two)
+ */
+#define DCMMPPS_LOG_BUFFER_SIZE (1 << 21)
+
+/** DIMSE message dump whose formatting has been deferred to the writer thread. In the
+ *  ring, the record is followed by the encoded dataset (if any).
+ */
+struct DcmMppsLogRecord
+{
+  /// level the dump is logged with
+  OFLogger::LogLevel level;
+
+  /// the message (command)
+  T_DIMSE_Message message;
+
+  /// direction of the message
+  enum DIMSE_direction direction;
+
+  /// presentation context ID of the message
+  T_ASC_PresentationContextID presID;
+
+  /// OFTrue if the dataset of the message is dumped
+  OFBool hasDataset;
+
+  /// length of the dataset following the record (Little Endian Explicit) in bytes
+  Uint32 datasetLength;
+};
+
+/** Byte ring of the log records of one producing thread, with the buffer in which the
+ *  thread composes its records
+ */
+struct DcmMppsLogRing : public DcmSvcRing<char>
+{
+  /** constructor
+   *  @param capacity [in] size of the ring in bytes, must be a power of two
+   */
+  DcmMppsLogRing(const size_t capacity);
+
+  /** destructor
+   */
+  ~DcmMppsLogRing();
+
+  /** Make sure that the record buffer has at least the given size (called by the
+   *  producing thread only)
+   *  @param length [in] The minimum size in bytes
+   */
+  void reserveRecord(const size_t length);
+
+  /// buffer in which the producing thread composes a record, reused for all records
+  char *record;
+  /// size of the record buffer in bytes
+  size_t recordCapacity;
+};
+
+/** Logger that formats DIMSE message dumps (which, with a dataset, is as costly as
+ *  decoding it) in a writer thread instead of the network thread. A dump request only
+ *  copies the message and encodes the dataset (without any allocation once the record
+ *  buffer of the thread is large enough) into the lock-free ring of the calling
+ *  thread; the writer thread decodes the dataset again, formats the records with
+ *  DIMSE_dumpMessage() and passes the text to the dcmnet logger, so that neither the
+ *  formatting nor the I/O of the log appenders delays the SCP. If the writer cannot
+ *  keep up and the ring of a thread is full, further dumps are dropped (and counted)
+ *  rather than blocking. Since the dumps are logged later, they may appear after log
+ *  messages that were issued after them.
+ */
+class DcmMppsAsyncLogger : public OFThread
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsAsyncLogger();
+
+  /** destructor. Logs the remaining records and stops the writer thread, see
+   *  stopLogging().
+   */
+  virtual ~DcmMppsAsyncLogger();
+
+  /** Start the writer thread
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition startLogging();
+
+  /** Log all remaining records and stop the writer thread
+   */
+  void stopLogging();
+
+  /** Dump a message asynchronously (may be called by any thread). Nothing is done if
+   *  the dcmnet logger is not enabled for the level.
+   *  @param level     [in] The log level
+   *  @param message   [in] The message
+   *  @param direction [in] Direction of the message
+   *  @param dataset   [in] The dataset of the message (encoded), NULL if not dumped
+   *  @param presID    [in] The presentation context ID
+   */
+  void dumpMessage(const OFLogger::LogLevel level,
+                   const T_DIMSE_Message &message,
+                   const enum DIMSE_direction direction,
+                   DcmDataset *dataset,
+                   const T_ASC_PresentationContextID presID);
+
+  /** Dump a received N-CREATE request asynchronously, see dumpMessage()
+   *  @param level   [in] The log level
+   *  @param request [in] The request
+   *  @param dataset [in] The dataset of the request (encoded), NULL if not dumped
+   *  @param presID  [in] The presentation context ID
+   */
+  void dumpMessage(const OFLogger::LogLevel level,
+                   const T_DIMSE_N_CreateRQ &request,
+                   DcmDataset *dataset,
+                   const T_ASC_PresentationContextID presID);
+
+  /** Dump a received N-SET request asynchronously, see dumpMessage()
+   *  @param level   [in] The log level
+   *  @param request [in] The request
+   *  @param dataset [in] The dataset of the request (encoded), NULL if not dumped
+   *  @param presID  [in] The presentation context ID
+   */
+  void dumpMessage(const OFLogger::LogLevel level,
+                   const T_DIMSE_N_SetRQ &request,
+                   DcmDataset *dataset,
+                   const T_ASC_PresentationContextID presID);
+
+  /** Returns the number of dumps dropped so far because a ring was full
+   *  @return number of dropped dumps
+   */
+  size_t getNumberOfDroppedRecords();
+
+  protected:
+
+  /** Thread entry point, logs records until stopLogging() is called
+   */
+  virtual void run();
+
+  /** Format and log all records currently in the rings
+   *  @return number of records logged
+   */
+  size_t writeRecords();
+
+  private:
+
+  /// OFTrue while the writer thread is running
+  OFBool m_running;
+
+  /// set by stopLogging() to end the writer thread
+  volatile OFBool m_stopRequested;
+
+  /// number of dropped records already reported by the writer thread
+  size_t m_reportedDrops;
+
+  /// buffer for the record being logged by the writer thread
+  char *m_record;
+
+  /// size of m_record in bytes
+  size_t m_recordCapacity;
+
+  /// dataset decoded from the ring by the writer thread, reused for all records
+  DcmDataset m_dataset;
+
+  /// the ring of each producing thread
+  DcmSvcRingRegistry<DcmMppsLogRing> m_rings;
+
+  // private undefined copy constructor
+  DcmMppsAsyncLogger(const DcmMppsAsyncLogger &);
+
+  // private undefined assignment operator
+  DcmMppsAsyncLogger &operator=(const DcmMppsAsyncLogger &);
+
+};
+
+#endif // DMPPSLOG_H
@@ -0,0 +1,66 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Runtime counters of the SCP and their export in the Prometheus text format
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppsmetr.h"
+#include "dcmtk/dcmnet/dimse.h"     /* for DIMSE_C_ECHO_RQ et al. */
+
+// ----------------------------------------------------------------------------
+
+/* request command fields, in the order of DcmMppsMetricsCommand (without "other") */
+static const Uint16 commandFields[] =
+{
+  DIMSE_C_ECHO_RQ,
+  DIMSE_N_CREATE_RQ,
+  DIMSE_N_SET_RQ
+};
+
+static const char *const commandNames[DCMMPPS_METRICS_COMMANDS] =
+{
+  "C-ECHO",
+  "N-CREATE",
+  "N-SET",
+  "other"
+};
+
+static const char *const phaseNames[DCMMPPS_PHASES] =
+{
+  "accept",
+  "negotiation",
+  "command_receive",
+  "dataset_receive",
+  "handler",
+  "response_send"
+};
+
+static const char *const payloadNames[DCMMPPS_PAYLOADS] =
+{
+  "N-CREATE",
+  "N-SET"
+};
+
+const DcmSvcMetricsNames DcmMppsMetrics::names =
+{
+  "mppsscp_",
+  commandFields,
+  commandNames,
+  DCMMPPS_METRICS_COMMANDS,
+  phaseNames,
+  DCMMPPS_PHASES,
+  payloadNames,
+  DCMMPPS_PAYLOADS
+};
+
+// ----------------------------------------------------------------------------
+
+DcmMppsMetrics::DcmMppsMetrics()
+  : DcmSvcMetrics(names)
+{
+}
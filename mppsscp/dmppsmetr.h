@@ -0,0 +1,81 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Runtime counters of the SCP and their export in the Prometheus text format
+ *
+ */
+
+#ifndef DMPPSMETR_H
+#define DMPPSMETR_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dsvcmetr.h"               /* for DcmSvcMetrics */
+
+/** Commands counted separately (requests, the responses are counted with them)
+ */
+enum DcmMppsMetricsCommand
+{
+  /// C-ECHO
+  DCMMPPS_METRICS_C_ECHO,
+  /// N-CREATE
+  DCMMPPS_METRICS_N_CREATE,
+  /// N-SET
+  DCMMPPS_METRICS_N_SET,
+  /// any other (unsupported) command
+  DCMMPPS_METRICS_OTHER_COMMAND,
+  /// number of counted commands
+  DCMMPPS_METRICS_COMMANDS
+};
+
+/** Phases of an association and of its requests, whose durations are recorded
+ */
+enum DcmMppsMetricsPhase
+{
+  /// from accepting the TCP connection to the received A-ASSOCIATE-RQ
+  DCMMPPS_PHASE_ACCEPT,
+  /// from the received A-ASSOCIATE-RQ to the sent A-ASSOCIATE-AC
+  DCMMPPS_PHASE_NEGOTIATION,
+  /// from the first data of a command to the received command
+  DCMMPPS_PHASE_COMMAND_RECEIVE,
+  /// receiving the dataset of a request
+  DCMMPPS_PHASE_DATASET_RECEIVE,
+  /// handling a request, excluding receiving its dataset and sending the response
+  DCMMPPS_PHASE_HANDLER,
+  /// sending the response to a request (or handing it to the transport layer)
+  DCMMPPS_PHASE_RESPONSE_SEND,
+  /// number of phases
+  DCMMPPS_PHASES
+};
+
+/** Requests whose datasets are profiled, see DcmSvcPayloadHistograms
+ */
+enum DcmMppsMetricsPayload
+{
+  /// dataset of N-CREATE requests
+  DCMMPPS_PAYLOAD_N_CREATE,
+  /// dataset of N-SET requests
+  DCMMPPS_PAYLOAD_N_SET,
+  /// number of profiled requests
+  DCMMPPS_PAYLOADS
+};
+
+/** Runtime metrics of the MPPS SCP, i.e.\ the common metrics (see DcmSvcMetrics) of the
+ *  commands, phases and datasets above
+ */
+class DcmMppsMetrics : public DcmSvcMetrics
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsMetrics();
+
+  /// commands, phases and profiled datasets, indexed by the enums above
+  static const DcmSvcMetricsNames names;
+
+};
+
+#endif // DMPPSMETR_H
@@ -0,0 +1,70 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Pool of reusable dataset containers for the DIMSE receive path
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppspool.h"
+
+DcmDatasetPool::DcmDatasetPool(const size_t maxPooled)
+  : m_idle()
+  , m_maxPooled(maxPooled)
+  , m_numContainerAllocations(0)
+  , m_numAcquisitions(0)
+{
+  // release() must not need to grow the vector
+  m_idle.reserve(m_maxPooled);
+}
+
+
+DcmDatasetPool::~DcmDatasetPool()
+{
+  for (size_t i = 0; i < m_idle.size(); i++)
+    delete m_idle[i];
+}
+
+
+DcmDataset *DcmDatasetPool::acquire()
+{
+  ++m_numAcquisitions;
+  if (m_idle.empty())
+  {
+    ++m_numContainerAllocations;
+    return new DcmDataset();
+  }
+  DcmDataset *dataset = m_idle.back();
+  m_idle.pop_back();
+  return dataset;
+}
+
+
+void DcmDatasetPool::release(DcmDataset *dataset)
+{
+  if (dataset == NULL)
+    return;
+  if (m_idle.size() < m_maxPooled)
+  {
+    // free the elements now, so that an idle dataset does not keep a large message
+    dataset->clear();
+    m_idle.push_back(dataset);
+  }
+  else
+    delete dataset;
+}
+
+
+size_t DcmDatasetPool::getNumberOfContainerAllocations() const
+{
+  return m_numContainerAllocations;
+}
+
+
+size_t DcmDatasetPool::getNumberOfAcquisitions() const
+{
+  return m_numAcquisitions;
+}
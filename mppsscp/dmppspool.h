@@ -0,0 +1,87 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Pool of reusable dataset containers for the DIMSE receive path
+ *
+ */
+
+#ifndef DMPPSPOOL_H
+#define DMPPSPOOL_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofvector.h"
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+
+/** Default number of idle datasets kept by DcmDatasetPool
+ */
+#define DCMMPPS_DEFAULT_POOLED_DATASETS 4
+
+/** Pool of dataset containers that are cleared and reused for each received message
+ *  instead of creating a new DcmFileFormat (with meta header and dataset) per message.
+ *  The pool is not thread-safe, i.e.\ each thread (SCP) uses its own pool. The
+ *  elements of a dataset are still created by dcmdata while parsing, since dcmdata
+ *  does not provide a way to supply their storage.
+ */
+class DcmDatasetPool
+{
+
+  public:
+
+  /** constructor
+   *  @param maxPooled [in] maximum number of idle datasets to keep, further released
+   *                        datasets are deleted
+   */
+  DcmDatasetPool(const size_t maxPooled = DCMMPPS_DEFAULT_POOLED_DATASETS);
+
+  /** destructor. Deletes all idle datasets.
+   */
+  ~DcmDatasetPool();
+
+  /** Get an empty dataset, either an idle one or a newly created one
+   *  @return the dataset, to be given back with release()
+   */
+  DcmDataset *acquire();
+
+  /** Give back a dataset obtained by acquire(). The dataset is cleared and kept for
+   *  reuse, or deleted if the pool is full.
+   *  @param dataset [in] The dataset, may be NULL
+   */
+  void release(DcmDataset *dataset);
+
+  /** Returns the number of dataset containers created by the pool so far. In steady
+   *  state, this number does not increase any more. The elements of the datasets are
+   *  not pooled and not counted here.
+   *  @return number of created dataset containers
+   */
+  size_t getNumberOfContainerAllocations() const;
+
+  /** Returns the number of calls of acquire() so far
+   *  @return number of acquired datasets
+   */
+  size_t getNumberOfAcquisitions() const;
+
+  private:
+
+  /// idle datasets, capacity is reserved for maxPooled entries
+  OFVector<DcmDataset *> m_idle;
+
+  /// maximum number of idle datasets
+  size_t m_maxPooled;
+
+  /// number of dataset containers created
+  size_t m_numContainerAllocations;
+
+  /// number of calls of acquire()
+  size_t m_numAcquisitions;
+
+  // private undefined copy constructor
+  DcmDatasetPool(const DcmDatasetPool &);
+
+  // private undefined assignment operator
+  DcmDatasetPool &operator=(const DcmDatasetPool &);
+
+};
+
+#endif // DMPPSPOOL_H
@@ -0,0 +1,72 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Static tracepoints (USDT probes) of the SCP
+ *
+ */
+
+#ifndef DMPPSPROBE_H
+#define DMPPSPROBE_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+/*
+ *  The probes are compiled in if <sys/sdt.h> of SystemTap is available, or if WITH_SDT
+ *  is defined for a compiler without __has_include. They can be disabled by defining
+ *  WITHOUT_SDT (e.g. "make LOCALDEFS=-DWITHOUT_SDT"). A probe is a single NOP until a
+ *  tracer attaches to it, e.g.
+ *
+ *    bpftrace -e 'usdt:./mppsrecv:mppsscp:command__received { @[arg2] = count(); }'
+ *
+ *  The arguments are kept to integers and existing strings, so that they are cheap to
+ *  provide while no tracer is attached. All probes of the provider "mppsscp" start with
+ *  the association ID (counted from 1 per SCP thread):
+ *
+ *    association__received     (assocID, calling AE title, peer address, peer max PDU)
+ *    association__acknowledged (assocID, accepted presentation contexts, max send PDV)
+ *    association__refused      (assocID, refuse reason, see DcmRefuseReasonType)
+ *    association__ended        (assocID, 0 = released, 1 = aborted by peer, 2 = error)
+ *    command__received         (assocID, message ID, command field, presentation context ID)
+ *    dataset__received         (assocID, message ID, dataset bytes or 0 if not known, 0 = error)
+ *    instance__stored          (assocID, message ID, command field, status)
+ *    event__exported           (assocID, message ID, event type)
+ *    response__sent            (assocID, message ID, command field, status, 0 = error)
+ *
+ *  and, without association ID, the queues between the SCP and its writer threads:
+ *
+ *    export__queued            (event bytes, 0 = dropped because the buffer is full)
+ *    log__queued               (log level, 0 = dropped because the ring is full)
+ */
+
+#if !defined(WITH_SDT) && !defined(WITHOUT_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define WITH_SDT
+#endif
+#endif
+
+#if defined(WITH_SDT) && !defined(WITHOUT_SDT)
+#include <sys/sdt.h>
+
+#define DCMMPPS_PROBE1(name, a1) \
+  DTRACE_PROBE1(mppsscp, name, a1)
+#define DCMMPPS_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2(mppsscp, name, a1, a2)
+#define DCMMPPS_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(mppsscp, name, a1, a2, a3)
+#define DCMMPPS_PROBE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4(mppsscp, name, a1, a2, a3, a4)
+#define DCMMPPS_PROBE5(name, a1, a2, a3, a4, a5) \
+  DTRACE_PROBE5(mppsscp, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define DCMMPPS_PROBE1(name, a1)
+#define DCMMPPS_PROBE2(name, a1, a2)
+#define DCMMPPS_PROBE3(name, a1, a2, a3)
+#define DCMMPPS_PROBE4(name, a1, a2, a3, a4)
+#define DCMMPPS_PROBE5(name, a1, a2, a3, a4, a5)
+
+#endif
+
+#endif // DMPPSPROBE_H
@@ -0,0 +1,300 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Local (Unix domain socket) query interface for the MPPS store
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppsqry.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_ERROR() */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* timeout for poll() in the server loop, i.e. maximum delay of stop() */
+#define POLL_TIMEOUT_MSEC   500
+
+/* timeout for reading the request line from a client */
+#define RECEIVE_TIMEOUT_SEC 2
+
+DcmMppsQueryServer::DcmMppsQueryServer(DcmMppsStore &store)
+  : OFThread()
+  , m_store(store)
+  , m_socket(-1)
+  , m_socketPath()
+  , m_stopRequested(OFFalse)
+{
+}
+
+
+DcmMppsQueryServer::~DcmMppsQueryServer()
+{
+  stop();
+}
+
+
+OFCondition DcmMppsQueryServer::listen(const OFString &socketPath)
+{
+  if (m_socket >= 0)
+    return EC_IllegalCall;
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (socketPath.empty() || (socketPath.length() >= sizeof(address.sun_path)))
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Invalid file name for MPPS query socket");
+  address.sun_family = AF_UNIX;
+  OFStandard::strlcpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path));
+
+  m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_socket < 0)
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot create MPPS query socket");
+
+  // remove a stale socket of a previous run
+  unlink(socketPath.c_str());
+  if ((bind(m_socket, OFreinterpret_cast(struct sockaddr *, &address), sizeof(address)) < 0) ||
+      (::listen(m_socket, 8) < 0))
+  {
+    DCMNET_ERROR("Cannot bind MPPS query socket " << socketPath << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    close(m_socket);
+    m_socket = -1;
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot bind MPPS query socket");
+  }
+  m_socketPath = socketPath;
+  m_stopRequested = OFFalse;
+
+  if (start() != 0)
+  {
+    close(m_socket);
+    m_socket = -1;
+    unlink(m_socketPath.c_str());
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot start MPPS query thread");
+  }
+  DCMNET_INFO("Serving MPPS queries on " << m_socketPath);
+  return EC_Normal;
+}
+
+
+void DcmMppsQueryServer::stop()
+{
+  if (m_socket < 0)
+    return;
+  m_stopRequested = OFTrue;
+  join();
+  close(m_socket);
+  m_socket = -1;
+  unlink(m_socketPath.c_str());
+}
+
+
+void DcmMppsQueryServer::run()
+{
+  struct pollfd pfd;
+  while (!m_stopRequested)
+  {
+    pfd.fd = m_socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    const int ready = poll(&pfd, 1, POLL_TIMEOUT_MSEC);
+    // let the retention timers advance even if no requests are received
+    m_store.expireInstances();
+    if ((ready < 0) && (errno != EINTR))
+    {
+      DCMNET_ERROR("MPPS query socket failed, no longer serving queries");
+      break;
+    }
+    if ((ready > 0) && (pfd.revents & POLLIN))
+    {
+      const int clientSocket = accept(m_socket, NULL, NULL);
+      if (clientSocket >= 0)
+      {
+        handleConnection(clientSocket);
+        close(clientSocket);
+      }
+    }
+  }
+}
+
+
+void DcmMppsQueryServer::handleConnection(int clientSocket)
+{
+  // make sure that a client that never sends a request cannot block the server
+  struct timeval timeout;
+  timeout.tv_sec = RECEIVE_TIMEOUT_SEC;
+  timeout.tv_usec = 0;
+  setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // read the request line
+  char buffer[DCMMPPS_MAX_QUERY_LENGTH];
+  size_t length = 0;
+  OFBool complete = OFFalse;
+  while (!complete && (length < sizeof(buffer)))
+  {
+    const ssize_t bytes = recv(clientSocket, buffer + length, sizeof(buffer) - length, 0);
+    if (bytes <= 0)
+      break;
+    const char *newline = OFstatic_cast(const char *, memchr(buffer + length, '\n', bytes));
+    length += OFstatic_cast(size_t, bytes);
+    if (newline != NULL)
+    {
+      length = OFstatic_cast(size_t, newline - buffer);
+      complete = OFTrue;
+    }
+  }
+  if ((length > 0) && (buffer[length - 1] == '\r'))
+    --length;
+
+  OFString response;
+  DcmMppsQuery query;
+  if (!complete)
+    response = "ERROR incomplete or too long request\n";
+  else if (OFString(buffer, length) == "STATS")
+  {
+    OFVector<DcmMppsShardStatistics> statistics;
+    m_store.getShardStatistics(statistics);
+    for (size_t i = 0; i < statistics.size(); i++)
+      formatStatistics(i, statistics[i], response);
+    char trailer[64];
+    OFStandard::snprintf(trailer, sizeof(trailer), "END %lu\n",
+      OFstatic_cast(unsigned long, statistics.size()));
+    response += trailer;
+  }
+  else if (!parseRequest(OFString(buffer, length), query))
+    response = "ERROR invalid request\n";
+  else
+  {
+    OFVector<DcmMppsInstance> results;
+    const OFBool all = m_store.findInstances(query, results);
+    // format the results without holding any lock of the store
+    for (size_t i = 0; i < results.size(); i++)
+      formatInstance(results[i], response);
+    char trailer[64];
+    OFStandard::snprintf(trailer, sizeof(trailer), "END %lu%s\n",
+      OFstatic_cast(unsigned long, results.size()), all ? "" : " TRUNCATED");
+    response += trailer;
+  }
+
+  // send the response, the client may have gone away in the meantime
+  const char *data = response.c_str();
+  size_t remaining = response.length();
+  while (remaining > 0)
+  {
+    const ssize_t bytes = send(clientSocket, data, remaining, MSG_NOSIGNAL);
+    if (bytes <= 0)
+      break;
+    data += bytes;
+    remaining -= OFstatic_cast(size_t, bytes);
+  }
+}
+
+
+OFBool DcmMppsQueryServer::parseRequest(const OFString &line,
+                                        DcmMppsQuery &query)
+{
+  // KEY MAXRESULTS VALUE
+  const size_t keyEnd = line.find(' ');
+  if (keyEnd == OFString_npos)
+    return OFFalse;
+  const size_t maxEnd = line.find(' ', keyEnd + 1);
+  if (maxEnd == OFString_npos)
+    return OFFalse;
+
+  const OFString key = line.substr(0, keyEnd);
+  if (key == "UID")
+    query.key = DCMMPPS_QUERY_INSTANCE_UID;
+  else if (key == "PATIENT")
+    query.key = DCMMPPS_QUERY_PATIENT_ID;
+  else if (key == "ACCESSION")
+    query.key = DCMMPPS_QUERY_ACCESSION_NUMBER;
+  else if (key == "STATION")
+    query.key = DCMMPPS_QUERY_STATION_AETITLE;
+  else if (key == "STATUS")
+    query.key = DCMMPPS_QUERY_STATUS;
+  else if (key == "DATE")
+    query.key = DCMMPPS_QUERY_START_DATE;
+  else
+    return OFFalse;
+
+  const OFString maxResults = line.substr(keyEnd + 1, maxEnd - keyEnd - 1);
+  if (maxResults.empty() || (maxResults.find_first_not_of("0123456789") != OFString_npos))
+    return OFFalse;
+  query.maxResults = OFstatic_cast(size_t, atol(maxResults.c_str()));
+
+  query.value = line.substr(maxEnd + 1);
+  query.upperValue.clear();
+  if (query.key == DCMMPPS_QUERY_START_DATE)
+  {
+    const size_t dash = query.value.find('-');
+    if (dash == OFString_npos)
+      query.upperValue = query.value;
+    else
+    {
+      query.upperValue = query.value.substr(dash + 1);
+      query.value.erase(dash);
+    }
+  }
+  else if (query.value.empty())
+    return OFFalse;
+  return OFTrue;
+}
+
+
+void DcmMppsQueryServer::formatInstance(const DcmMppsInstance &instance,
+                                        OFString &output)
+{
+  output += instance.sopInstanceUID;
+  output += '\t';
+  output += DcmMppsInstance::statusName(instance.status);
+  output += '\t';
+  output += instance.patientID;
+  output += '\t';
+  output += instance.patientName;
+  output += '\t';
+  for (size_t i = 0; i < instance.accessionNumbers.size(); i++)
+  {
+    if (i > 0)
+      output += '\\';
+    output += instance.accessionNumbers[i];
+  }
+  output += '\t';
+  output += instance.stationAETitle;
+  output += '\t';
+  output += instance.modality;
+  output += '\t';
+  output += instance.startDate;
+  output += '\t';
+  output += instance.startTime;
+  output += '\t';
+  output += instance.endDate;
+  output += '\t';
+  output += instance.endTime;
+  output += '\n';
+}
+
+
+void DcmMppsQueryServer::formatStatistics(const size_t shard,
+                                          const DcmMppsShardStatistics &statistics,
+                                          OFString &output)
+{
+  // shard, instances, memory, arena blocks, read locks/contentions, write locks/contentions
+  char line[256];
+  OFStandard::snprintf(line, sizeof(line), "%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+    OFstatic_cast(unsigned long, shard),
+    OFstatic_cast(unsigned long, statistics.numberOfInstances),
+    OFstatic_cast(unsigned long, statistics.memoryUsage),
+    OFstatic_cast(unsigned long, statistics.arenaBlocks),
+    statistics.readLocks, statistics.readContentions,
+    statistics.writeLocks, statistics.writeContentions);
+  output += line;
+}
@@ -0,0 +1,117 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Local (Unix domain socket) query interface for the MPPS store
+ *
+ */
+
+#ifndef DMPPSQRY_H
+#define DMPPSQRY_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFThread */
+#include "dcmtk/ofstd/ofcond.h"
+
+#include "dmppsstor.h"              /* for DcmMppsStore */
+
+/** Maximum length of a query request line (including the newline)
+ */
+#define DCMMPPS_MAX_QUERY_LENGTH 1024
+
+/** Thread answering queries on the MPPS store via a Unix domain socket. Each connection
+ *  carries a single request line of the form
+ *  <pre>
+ *    KEY MAXRESULTS VALUE
+ *  </pre>
+ *  where KEY is one of UID, PATIENT, ACCESSION, STATION, STATUS or DATE, and VALUE is
+ *  the rest of the line. For DATE, VALUE is a range "YYYYMMDD-YYYYMMDD" (either bound
+ *  may be omitted). The response consists of one tab-separated line per instance (see
+ *  formatInstance()), followed by "END n" (or "END n TRUNCATED") or by a single
+ *  "ERROR text" line. The request "STATS" returns one line per shard of the store (see
+ *  formatStatistics()) followed by "END n". Connections are served one at a time.
+ */
+class DcmMppsQueryServer : public OFThread
+{
+
+  public:
+
+  /** constructor
+   *  @param store [in] The store to be queried. Must exist as long as the server runs.
+   */
+  DcmMppsQueryServer(DcmMppsStore &store);
+
+  /** destructor. Stops the server thread if still running, see stop().
+   */
+  virtual ~DcmMppsQueryServer();
+
+  /** Create the socket and start serving queries in a separate thread. An existing
+   *  file with the same name is removed.
+   *  @param socketPath [in] File name of the Unix domain socket
+   *  @return EC_Normal if the server was started, an error code otherwise
+   */
+  OFCondition listen(const OFString &socketPath);
+
+  /** Stop the server thread, close and remove the socket
+   */
+  void stop();
+
+  /** Parse a request line
+   *  @param line  [in]  The request line (without newline)
+   *  @param query [out] The parsed query
+   *  @return OFTrue if the request is valid, OFFalse otherwise
+   */
+  static OFBool parseRequest(const OFString &line,
+                             DcmMppsQuery &query);
+
+  /** Append the response line for an instance to a string
+   *  @param instance [in]    The instance to format
+   *  @param output   [inout] The string to append the line to
+   */
+  static void formatInstance(const DcmMppsInstance &instance,
+                             OFString &output);
+
+  /** Append the response line for the statistics of a shard to a string
+   *  @param shard      [in]    Index of the shard
+   *  @param statistics [in]    The statistics of the shard
+   *  @param output     [inout] The string to append the line to
+   */
+  static void formatStatistics(const size_t shard,
+                               const DcmMppsShardStatistics &statistics,
+                               OFString &output);
+
+  protected:
+
+  /** Thread entry point, serves connections until stop() is called
+   */
+  virtual void run();
+
+  /** Read a request from a connected client, answer it and close the connection
+   *  @param clientSocket [in] The connected socket
+   */
+  void handleConnection(int clientSocket);
+
+  private:
+
+  /// the store to be queried
+  DcmMppsStore &m_store;
+
+  /// listening socket, -1 if not open
+  int m_socket;
+
+  /// file name of the socket
+  OFString m_socketPath;
+
+  /// set by stop() to end the server loop
+  volatile OFBool m_stopRequested;
+
+  // private undefined copy constructor
+  DcmMppsQueryServer(const DcmMppsQueryServer &);
+
+  // private undefined assignment operator
+  DcmMppsQueryServer &operator=(const DcmMppsQueryServer &);
+
+};
+
+#endif // DMPPSQRY_H
@@ -0,0 +1,397 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Received dataset kept in its encoded form with an index of top-level elements
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppsraw.h"
+#include "dmppsval.h"                 /* for DCMMPPS_TAG() */
+#include "dcmtk/dcmdata/dcistrmb.h"   /* for DcmInputBufferStream */
+#include "dcmtk/dcmnet/diutil.h"      /* for DCMNET_DEBUG() */
+
+/* tags of the item and delimitation items */
+#define TAG_ITEM                    DCMMPPS_TAG(0xfffe, 0xe000)
+#define TAG_ITEM_DELIMITATION       DCMMPPS_TAG(0xfffe, 0xe00d)
+#define TAG_SEQUENCE_DELIMITATION   DCMMPPS_TAG(0xfffe, 0xe0dd)
+
+/* returns whether an explicit VR uses a reserved field and a 32 bit length */
+static OFBool isLongVR(const char *vr)
+{
+  // OB, OD, OF, OL, OV, OW, SQ, SV, UC, UN, UR, UT, UV
+  switch (vr[0])
+  {
+    case 'O':
+      return (vr[1] == 'B') || (vr[1] == 'D') || (vr[1] == 'F') || (vr[1] == 'L') || (vr[1] == 'V') || (vr[1] == 'W');
+    case 'S':
+      return (vr[1] == 'Q') || (vr[1] == 'V');
+    case 'U':
+      return (vr[1] == 'C') || (vr[1] == 'N') || (vr[1] == 'R') || (vr[1] == 'T') || (vr[1] == 'V');
+    default:
+      return OFFalse;
+  }
+}
+
+
+DcmMppsRawDataset::DcmMppsRawDataset()
+  : m_buffer("mppsspool")
+  , m_data(NULL)
+  , m_length(0)
+  , m_xfer(EXS_Unknown)
+  , m_explicitVR(OFFalse)
+  , m_bigEndian(OFFalse)
+  , m_indexed(OFFalse)
+  , m_elements()
+{
+}
+
+
+DcmMppsRawDataset::~DcmMppsRawDataset()
+{
+}
+
+
+void DcmMppsRawDataset::setSpooling(const size_t threshold,
+                                    const OFString &directory)
+{
+  m_buffer.setSpooling(threshold, directory);
+}
+
+
+size_t DcmMppsRawDataset::getSpoolThreshold() const
+{
+  return m_buffer.getSpoolThreshold();
+}
+
+
+void DcmMppsRawDataset::clear()
+{
+  m_buffer.clear();
+  m_data = NULL;
+  m_length = 0;
+  m_xfer = EXS_Unknown;
+  m_indexed = OFFalse;
+  m_elements.clear();
+}
+
+
+OFCondition DcmMppsRawDataset::append(const void *data,
+                                      const size_t length)
+{
+  return m_buffer.append(data, length);
+}
+
+
+OFCondition DcmMppsRawDataset::finish(const E_TransferSyntax xfer)
+{
+  m_elements.clear();
+  m_indexed = OFFalse;
+  m_xfer = xfer;
+  OFCondition cond = m_buffer.finish();
+  m_data = m_buffer.getData();
+  m_length = m_buffer.getLength();
+  return cond;
+}
+
+
+OFBool DcmMppsRawDataset::isSpooled() const
+{
+  return m_buffer.isSpooled();
+}
+
+
+OFCondition DcmMppsRawDataset::index(const E_TransferSyntax xfer)
+{
+  OFCondition cond = finish(xfer);
+  if (cond.bad())
+    return cond;
+
+  // a deflated dataset has to be inflated (and thus decoded) as a whole
+  const DcmXfer xferInfo(xfer);
+  if (xferInfo.getStreamCompression() != ESC_none)
+    return EC_Normal;
+  m_explicitVR = xferInfo.isExplicitVR();
+  m_bigEndian = (xferInfo.getByteOrder() == EBO_BigEndian);
+
+  OFBool sorted = OFTrue;
+  OFBool parsed = OFTrue;
+  size_t pos = 0;
+  while (pos < m_length)
+  {
+    DcmMppsRawElement element;
+    size_t headerLength = 0;
+    Uint32 valueLength = 0;
+    element.offset = pos;
+    if (!readHeader(pos, element.tag, headerLength, valueLength))
+    {
+      parsed = OFFalse;
+      break;
+    }
+    element.valueOffset = pos + headerLength;
+    if (valueLength == DCM_UndefinedLength)
+    {
+      // skip the items to find the end of the value
+      size_t end = element.valueOffset;
+      if (!skipItems(end, 1, element.empty))
+      {
+        parsed = OFFalse;
+        break;
+      }
+      element.valueLength = end - 8 /* sequence delimitation item */ - element.valueOffset;
+      element.totalLength = end - pos;
+    }
+    else
+    {
+      if (valueLength > m_length - element.valueOffset)
+      {
+        parsed = OFFalse;
+        break;
+      }
+      element.valueLength = valueLength;
+      element.totalLength = headerLength + valueLength;
+      element.empty = (valueLength == 0);
+    }
+    if (!m_elements.empty() && (element.tag <= m_elements.back().tag))
+      sorted = OFFalse;
+    m_elements.push_back(element);
+    pos += element.totalLength;
+  }
+
+  // the binary search (and the validator) rely on the order required by the standard.
+  // A dataset that cannot be indexed is decoded as a whole instead, which reports the
+  // error if the encoding is really invalid.
+  if (!parsed)
+  {
+    DCMNET_DEBUG("Received dataset cannot be indexed at offset " << pos << ", decoding it as a whole");
+    m_elements.clear();
+  }
+  else if (sorted)
+    m_indexed = OFTrue;
+  else
+  {
+    DCMNET_DEBUG("Received dataset is not sorted by tag, cannot be accessed without decoding");
+    m_elements.clear();
+  }
+  return EC_Normal;
+}
+
+
+OFBool DcmMppsRawDataset::isIndexed() const
+{
+  return m_indexed;
+}
+
+
+E_TransferSyntax DcmMppsRawDataset::getTransferSyntax() const
+{
+  return m_xfer;
+}
+
+
+const char *DcmMppsRawDataset::getData() const
+{
+  return m_data;
+}
+
+
+size_t DcmMppsRawDataset::getLength() const
+{
+  return m_length;
+}
+
+
+size_t DcmMppsRawDataset::getNumberOfElements() const
+{
+  return m_elements.size();
+}
+
+
+const DcmMppsRawElement &DcmMppsRawDataset::getElement(const size_t idx) const
+{
+  return m_elements[idx];
+}
+
+
+const DcmMppsRawElement *DcmMppsRawDataset::findElement(const Uint32 tag) const
+{
+  size_t lower = 0;
+  size_t upper = m_elements.size();
+  while (lower < upper)
+  {
+    const size_t middle = lower + (upper - lower) / 2;
+    if (m_elements[middle].tag < tag)
+      lower = middle + 1;
+    else
+      upper = middle;
+  }
+  if ((lower < m_elements.size()) && (m_elements[lower].tag == tag))
+    return &m_elements[lower];
+  return NULL;
+}
+
+
+const char *DcmMppsRawDataset::getValue(const DcmMppsRawElement &element) const
+{
+  return m_data + element.valueOffset;
+}
+
+
+OFCondition DcmMppsRawDataset::decodeElements(const Uint32 *tags,
+                                              const size_t count,
+                                              DcmItem &target) const
+{
+  if (!m_indexed)
+    return EC_IllegalCall;
+  for (size_t i = 0; i < count; i++)
+  {
+    const DcmMppsRawElement *element = findElement(tags[i]);
+    if (element == NULL)
+      continue;
+    // each element (including all items of a sequence) is a valid dataset on its own
+    DcmDataset part;
+    OFCondition cond = readPart(element->offset, element->totalLength, part);
+    if (cond.bad())
+      return cond;
+    DcmElement *decoded = part.remove(OFstatic_cast(unsigned long, 0));
+    if ((decoded != NULL) && target.insert(decoded, OFTrue /*replaceOld*/).bad())
+      delete decoded;
+  }
+  return EC_Normal;
+}
+
+
+OFCondition DcmMppsRawDataset::decodeAll(DcmDataset &target) const
+{
+  return readPart(0, m_length, target);
+}
+
+
+OFBool DcmMppsRawDataset::readHeader(const size_t pos,
+                                     Uint32 &tag,
+                                     size_t &headerLength,
+                                     Uint32 &valueLength) const
+{
+  if ((pos > m_length) || (m_length - pos < 8))
+    return OFFalse;
+  const Uint16 group = readUint16(pos);
+  tag = DCMMPPS_TAG(group, readUint16(pos + 2));
+  // items and delimitation items never have a VR
+  if (!m_explicitVR || (group == 0xfffe))
+  {
+    valueLength = readUint32(pos + 4);
+    headerLength = 8;
+  }
+  else if (isLongVR(m_data + pos + 4))
+  {
+    if (m_length - pos < 12)
+      return OFFalse;
+    valueLength = readUint32(pos + 8);
+    headerLength = 12;
+  }
+  else
+  {
+    valueLength = readUint16(pos + 6);
+    headerLength = 8;
+  }
+  return OFTrue;
+}
+
+
+OFBool DcmMppsRawDataset::skipItems(size_t &pos,
+                                    const unsigned int depth,
+                                    OFBool &empty) const
+{
+  if (depth > DCMMPPS_RAW_MAX_DEPTH)
+    return OFFalse;
+  empty = OFTrue;
+  for (;;)
+  {
+    Uint32 tag = 0;
+    size_t headerLength = 0;
+    Uint32 length = 0;
+    if (!readHeader(pos, tag, headerLength, length))
+      return OFFalse;
+    pos += headerLength;
+    if (tag == TAG_SEQUENCE_DELIMITATION)
+      return OFTrue;
+    if (tag != TAG_ITEM)
+      return OFFalse;
+    empty = OFFalse;
+    if (length == DCM_UndefinedLength)
+    {
+      if (!skipElements(pos, depth + 1))
+        return OFFalse;
+    }
+    else if (length > m_length - pos)
+      return OFFalse;
+    else
+      pos += length;
+  }
+}
+
+
+OFBool DcmMppsRawDataset::skipElements(size_t &pos,
+                                       const unsigned int depth) const
+{
+  if (depth > DCMMPPS_RAW_MAX_DEPTH)
+    return OFFalse;
+  for (;;)
+  {
+    Uint32 tag = 0;
+    size_t headerLength = 0;
+    Uint32 length = 0;
+    if (!readHeader(pos, tag, headerLength, length))
+      return OFFalse;
+    pos += headerLength;
+    if (tag == TAG_ITEM_DELIMITATION)
+      return OFTrue;
+    if (length == DCM_UndefinedLength)
+    {
+      OFBool empty;
+      if (!skipItems(pos, depth + 1, empty))
+        return OFFalse;
+    }
+    else if (length > m_length - pos)
+      return OFFalse;
+    else
+      pos += length;
+  }
+}
+
+
+Uint16 DcmMppsRawDataset::readUint16(const size_t pos) const
+{
+  const unsigned char *p = OFreinterpret_cast(const unsigned char *, m_data + pos);
+  if (m_bigEndian)
+    return OFstatic_cast(Uint16, (p[0] << 8) | p[1]);
+  return OFstatic_cast(Uint16, (p[1] << 8) | p[0]);
+}
+
+
+Uint32 DcmMppsRawDataset::readUint32(const size_t pos) const
+{
+  const unsigned char *p = OFreinterpret_cast(const unsigned char *, m_data + pos);
+  if (m_bigEndian)
+    return (OFstatic_cast(Uint32, p[0]) << 24) | (OFstatic_cast(Uint32, p[1]) << 16) |
+           (OFstatic_cast(Uint32, p[2]) << 8) | OFstatic_cast(Uint32, p[3]);
+  return (OFstatic_cast(Uint32, p[3]) << 24) | (OFstatic_cast(Uint32, p[2]) << 16) |
+         (OFstatic_cast(Uint32, p[1]) << 8) | OFstatic_cast(Uint32, p[0]);
+}
+
+
+OFCondition DcmMppsRawDataset::readPart(const size_t offset,
+                                        const size_t length,
+                                        DcmDataset &target) const
+{
+  DcmInputBufferStream stream;
+  stream.setBuffer(m_data + offset, OFstatic_cast(offile_off_t, length));
+  stream.setEos();
+  target.transferInit();
+  OFCondition cond = target.read(stream, m_xfer, EGL_noChange);
+  target.transferEnd();
+  return cond;
+}
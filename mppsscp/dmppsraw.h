@@ -0,0 +1,262 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Received dataset kept in its encoded form with an index of top-level elements
+ *
+ */
+
+#ifndef DMPPSRAW_H
+#define DMPPSRAW_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofvector.h"
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+#include "dsvcspool.h"
+
+/** Maximum nesting depth of sequences accepted while indexing a raw dataset
+ */
+#define DCMMPPS_RAW_MAX_DEPTH 32
+
+/** Index entry of a top-level element of a raw dataset
+ */
+struct DcmMppsRawElement
+{
+  /// attribute tag, see DCMMPPS_TAG()
+  Uint32 tag;
+  /// offset of the element (i.e.\ of its tag) in the encoded dataset
+  size_t offset;
+  /// offset of the value
+  size_t valueOffset;
+  /// length of the value in bytes (for undefined length up to the delimitation item)
+  size_t valueLength;
+  /// total length of the element including its header and delimitation item
+  size_t totalLength;
+  /// OFTrue if the value does not contain anything, i.e.\ not even an item
+  OFBool empty;
+};
+
+/** A received dataset kept in the encoding in which it was received (i.e.\ the
+ *  concatenated PDV fragments), with an index of its top-level elements. Presence and
+ *  emptiness of attributes can be checked and short values read without decoding. An
+ *  element is only parsed into DcmElement objects by decodeElements(), sequences
+ *  including all their items. The buffer and index keep their capacity when cleared,
+ *  so that the object can be reused for each received message. If spooling is enabled,
+ *  a large dataset is written to disk while it is received and accessed through a
+ *  memory mapping (see DcmSvcSpoolBuffer).
+ *  Little Endian and Big Endian transfer syntaxes are indexed; for a deflated dataset,
+ *  isIndexed() returns OFFalse and the dataset can only be decoded as a whole.
+ */
+class DcmMppsRawDataset
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsRawDataset();
+
+  /** destructor
+   */
+  ~DcmMppsRawDataset();
+
+  /** Configure spooling of large datasets to disk
+   *  @param threshold [in] size in bytes above which a dataset is spooled, 0 to disable
+   *  @param directory [in] directory for the spool files
+   */
+  void setSpooling(const size_t threshold,
+                   const OFString &directory);
+
+  /** Returns the spool threshold
+   *  @return threshold in bytes, 0 if spooling is disabled
+   */
+  size_t getSpoolThreshold() const;
+
+  /** Remove the data and the index (the memory is kept for reuse, a spool file is
+   *  closed)
+   */
+  void clear();
+
+  /** Append a received fragment to the encoded dataset
+   *  @param data   [in] The fragment
+   *  @param length [in] Length of the fragment in bytes
+   *  @return EC_Normal if successful, an error code if the spool file cannot be written
+   */
+  OFCondition append(const void *data,
+                     const size_t length);
+
+  /** Complete the encoded dataset after the last fragment was appended, without
+   *  building the index. Only decodeAll() can be used afterwards.
+   *  @param xfer [in] Transfer syntax of the encoded dataset
+   *  @return EC_Normal if successful, an error code if the spool file cannot be mapped
+   */
+  OFCondition finish(const E_TransferSyntax xfer);
+
+  /** Complete the encoded dataset and build the index of the top-level elements after
+   *  the last fragment was appended
+   *  @param xfer [in] Transfer syntax of the encoded dataset
+   *  @return EC_Normal if the dataset is complete, whether or not it could be indexed
+   *    (see isIndexed(), e.g.\ not for a deflated, unsorted or unparsable dataset, which
+   *    has to be decoded with decodeAll()), an error code if the spool file cannot be mapped
+   */
+  OFCondition index(const E_TransferSyntax xfer);
+
+  /** Returns whether the encoded dataset has been spooled to disk
+   *  @return OFTrue if spooled, OFFalse if kept in memory
+   */
+  OFBool isSpooled() const;
+
+  /** Returns whether the index is available, i.e.\ the transfer syntax is supported
+   *  and the top-level elements are sorted by tag as required by the standard
+   *  @return OFTrue if the index can be used, OFFalse otherwise
+   */
+  OFBool isIndexed() const;
+
+  /** Returns the transfer syntax of the encoded dataset
+   *  @return the transfer syntax
+   */
+  E_TransferSyntax getTransferSyntax() const;
+
+  /** Returns the encoded dataset, e.g.\ for forwarding it without re-encoding
+   *  @return pointer to the encoded dataset, valid until the dataset is changed
+   */
+  const char *getData() const;
+
+  /** Returns the length of the encoded dataset
+   *  @return length in bytes
+   */
+  size_t getLength() const;
+
+  /** Returns the number of top-level elements
+   *  @return number of elements, 0 if not indexed
+   */
+  size_t getNumberOfElements() const;
+
+  /** Returns a top-level element
+   *  @param idx [in] Index of the element, must be less than getNumberOfElements()
+   *  @return the element
+   */
+  const DcmMppsRawElement &getElement(const size_t idx) const;
+
+  /** Find a top-level element by binary search
+   *  @param tag [in] The attribute tag, see DCMMPPS_TAG()
+   *  @return the element, NULL if not present
+   */
+  const DcmMppsRawElement *findElement(const Uint32 tag) const;
+
+  /** Returns a pointer to the (undecoded) value of an element. Only useful for string
+   *  values, which do not depend on the byte order.
+   *  @param element [in] The element
+   *  @return pointer to the first of element.valueLength bytes
+   */
+  const char *getValue(const DcmMppsRawElement &element) const;
+
+  /** Decode some top-level elements and insert them into an item. Elements that are
+   *  not present in the raw dataset are ignored.
+   *  @param tags   [in]    The attribute tags, see DCMMPPS_TAG()
+   *  @param count  [in]    Number of tags
+   *  @param target [inout] The item to insert the decoded elements into
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition decodeElements(const Uint32 *tags,
+                             const size_t count,
+                             DcmItem &target) const;
+
+  /** Decode the complete dataset
+   *  @param target [inout] The dataset to read into, should be empty
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition decodeAll(DcmDataset &target) const;
+
+  protected:
+
+  /** Read an element header
+   *  @param pos          [in]  Offset of the element
+   *  @param tag          [out] The tag, see DCMMPPS_TAG()
+   *  @param headerLength [out] Length of the element header
+   *  @param valueLength  [out] The value length as encoded (may be undefined)
+   *  @return OFTrue if successful, OFFalse if the data ends before the header does
+   */
+  OFBool readHeader(const size_t pos,
+                    Uint32 &tag,
+                    size_t &headerLength,
+                    Uint32 &valueLength) const;
+
+  /** Skip the items of a value with undefined length
+   *  @param pos   [inout] Offset of the first item, offset after the sequence
+   *                       delimitation item on return
+   *  @param depth [in]    Current nesting depth
+   *  @param empty [out]   OFTrue if the sequence delimitation item follows immediately
+   *  @return OFTrue if successful, OFFalse if the encoding is invalid
+   */
+  OFBool skipItems(size_t &pos,
+                   const unsigned int depth,
+                   OFBool &empty) const;
+
+  /** Skip the elements of an item with undefined length
+   *  @param pos   [inout] Offset of the first element, offset after the item
+   *                       delimitation item on return
+   *  @param depth [in]    Current nesting depth
+   *  @return OFTrue if successful, OFFalse if the encoding is invalid
+   */
+  OFBool skipElements(size_t &pos,
+                      const unsigned int depth) const;
+
+  /** Read a 16 bit value in the byte order of the dataset
+   *  @param pos [in] Offset of the value
+   *  @return the value
+   */
+  Uint16 readUint16(const size_t pos) const;
+
+  /** Read a 32 bit value in the byte order of the dataset
+   *  @param pos [in] Offset of the value
+   *  @return the value
+   */
+  Uint32 readUint32(const size_t pos) const;
+
+  /** Parse a part of the encoded dataset into a dataset
+   *  @param offset [in]    Offset of the first element
+   *  @param length [in]    Length of the part
+   *  @param target [inout] The dataset to read into
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition readPart(const size_t offset,
+                       const size_t length,
+                       DcmDataset &target) const;
+
+  private:
+
+  /// buffer (or spool file) receiving the encoded dataset
+  DcmSvcSpoolBuffer m_buffer;
+
+  /// the encoded dataset, available after finish() or index()
+  const char *m_data;
+
+  /// length of the encoded dataset
+  size_t m_length;
+
+  /// transfer syntax of the encoded dataset
+  E_TransferSyntax m_xfer;
+
+  /// OFTrue if the encoding uses explicit VR
+  OFBool m_explicitVR;
+
+  /// OFTrue if the encoding is big endian
+  OFBool m_bigEndian;
+
+  /// OFTrue if m_elements is valid
+  OFBool m_indexed;
+
+  /// the top-level elements, sorted by tag
+  OFVector<DcmMppsRawElement> m_elements;
+
+  // private undefined copy constructor
+  DcmMppsRawDataset(const DcmMppsRawDataset &);
+
+  // private undefined assignment operator
+  DcmMppsRawDataset &operator=(const DcmMppsRawDataset &);
+
+};
+
+#endif // DMPPSRAW_H
@@ -24,12 +24,154 @@
 
 #include "dmppsscp.h"
 #include "dcmtk/dcmnet/diutil.h"
+#include "dsvctrans.h"                 /* for DcmSvcTransportLayer */
+#include "dmppsprobe.h"                /* for DCMMPPS_PROBE1() et al. */
+
+#include <time.h>
+
+/* debug output of the SCP. For an association or request matching the debug filter it
+ * goes to the logger of the filter, otherwise it depends on the log level of dcmnet. */
+#define DCMMPPS_DEBUG(msg) \
+  do { \
+    if (m_debugLevel <= OFLogger::DEBUG_LOG_LEVEL) { \
+      OFLOG_DEBUG(m_debugFilter->getLogger(), msg); \
+    } else { \
+      DCMNET_DEBUG(msg); \
+    } \
+  } while (0)
+
+// Message ID of a request handled by this SCP, 0 for unsupported commands
+static Uint16 getMessageID(const T_DIMSE_Message &message)
+{
+  switch (message.CommandField)
+  {
+    case DIMSE_C_ECHO_RQ:   return message.msg.CEchoRQ.MessageID;
+    case DIMSE_N_CREATE_RQ: return message.msg.NCreateRQ.MessageID;
+    case DIMSE_N_SET_RQ:    return message.msg.NSetRQ.MessageID;
+    default:                return 0;
+  }
+}
+
+// Affected or requested SOP Instance UID of a request, NULL if none
+static const char *getInstanceUID(const T_DIMSE_Message &message)
+{
+  switch (message.CommandField)
+  {
+    case DIMSE_N_CREATE_RQ:
+      return (message.msg.NCreateRQ.opts & O_NCREATE_AFFECTEDSOPINSTANCEUID) ? message.msg.NCreateRQ.AffectedSOPInstanceUID : NULL;
+    case DIMSE_N_SET_RQ:
+      return message.msg.NSetRQ.RequestedSOPInstanceUID;
+    default:
+      return NULL;
+  }
+}
+
+// Name of a request on the timeline
+static const char *getCommandName(const Uint16 commandField)
+{
+  switch (commandField)
+  {
+    case DIMSE_C_ECHO_RQ:   return "C-ECHO";
+    case DIMSE_N_CREATE_RQ: return "N-CREATE";
+    case DIMSE_N_SET_RQ:    return "N-SET";
+    default:                return "unsupported command";
+  }
+}
+
+// Name of a phase on the timeline
+static const char *getPhaseName(const DcmMppsMetricsPhase phase)
+{
+  switch (phase)
+  {
+    case DCMMPPS_PHASE_ACCEPT:          return "accept";
+    case DCMMPPS_PHASE_NEGOTIATION:     return "negotiation";
+    case DCMMPPS_PHASE_COMMAND_RECEIVE: return "command receive";
+    case DCMMPPS_PHASE_DATASET_RECEIVE: return "dataset receive";
+    case DCMMPPS_PHASE_HANDLER:         return "handler";
+    default:                            return "response send";
+  }
+}
+
+// Count the sequence items below a dataset or item and their maximum nesting depth
+static void measureSequences(DcmItem &item,
+                             const Uint64 level,
+                             Uint64 &numItems,
+                             Uint64 &maxDepth)
+{
+  DcmObject *obj = NULL;
+  while ((obj = item.nextInContainer(obj)) != NULL)
+  {
+    if (obj->ident() != EVR_SQ)
+      continue;
+    if (level + 1 > maxDepth)
+      maxDepth = level + 1;
+    DcmSequenceOfItems *sequence = OFstatic_cast(DcmSequenceOfItems *, obj);
+    DcmObject *child = NULL;
+    while ((child = sequence->nextInContainer(child)) != NULL)
+    {
+      ++numItems;
+      measureSequences(*OFstatic_cast(DcmItem *, child), level + 1, numItems, maxDepth);
+    }
+  }
+}
+
+// Fill the dataset summary of a slow request from the index of a raw dataset, i.e.
+// without decoding it
+static void summarizeRawDataset(const DcmMppsRawDataset &dataset,
+                                DcmSvcSlowRecord &record)
+{
+  record.datasetSize = dataset.getLength();
+  record.numElements = dataset.getNumberOfElements();
+  record.numTags = 0;
+  while ((record.numTags < record.numElements) && (record.numTags < DCMSVC_SLOW_MAX_TAGS))
+  {
+    const DcmMppsRawElement &element = dataset.getElement(record.numTags);
+    record.tags[record.numTags] = element.tag;
+    record.lengths[record.numTags] = OFstatic_cast(Uint32, element.valueLength);
+    record.sequences[record.numTags] = OFFalse;
+    ++record.numTags;
+  }
+  record.datasetCaptured = OFTrue;
+}
 
 // implementation of the main interface class
 
 DcmMppsSCP::DcmMppsSCP():
   m_assoc(NULL),
-  m_cfg()
+  m_cfg(),
+  m_store(NULL),
+  m_exporter(NULL),
+  m_asyncLogger(NULL),
+  m_traceFile(NULL),
+  m_traceRecord(),
+  m_traceStart(0),
+  m_associationCounter(0),
+  m_messageID(0),
+  m_timeline(NULL),
+  m_associationStart(0),
+  m_slowLog(NULL),
+  m_slowRecord(),
+  m_debugFilter(NULL),
+  m_associationDebugLevel(OFLogger::OFF_LOG_LEVEL),
+  m_debugLevel(OFLogger::OFF_LOG_LEVEL),
+  m_metrics(NULL),
+  m_localCounters(DcmMppsMetrics::names),
+  m_counters(&m_localCounters),
+  m_transportLayer(NULL),
+  m_phaseStart(0),
+  m_datasetTime(0),
+  m_sendTime(0),
+  m_peer(NULL),
+  m_peerBytesReceived(0),
+  m_peerBytesSent(0),
+  m_datasetPool(),
+  m_lazyDecoding(OFFalse),
+  m_echoResponse(DIMSE_C_ECHO_RSP),
+  m_createResponse(DIMSE_N_CREATE_RSP),
+  m_setResponse(DIMSE_N_SET_RSP),
+  m_rawDataset(),
+  m_negotiationPolicy(),
+  m_negotiationCache()
 {
     // make sure that the SCP at least supports C-ECHO with default transfer syntax
     OFList<OFString> transferSyntaxes;
@@ -37,6 +179,11 @@ DcmMppsSCP::DcmMppsSCP():
     transferSyntaxes.push_back(UID_BigEndianExplicitTransferSyntax);
     transferSyntaxes.push_back(UID_LittleEndianImplicitTransferSyntax);
     addPresentationContext(UID_VerificationSOPClass, transferSyntaxes);
+#ifdef WITH_ZLIB
+    // also accept deflate for the service datasets, their UID sequences compress well; it
+    // is preferred unless a negotiation policy ranks it otherwise (e.g.\ last by decoding cost)
+    transferSyntaxes.push_front(UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+#endif
     // add MPPS (N-CREATE,N-SET) support
     addPresentationContext(UID_ModalityPerformedProcedureStepSOPClass, transferSyntaxes);
 
@@ -84,6 +231,25 @@ OFCondition DcmMppsSCP::listen()
   if( cond.bad() )
     return cond;
 
+  // Count in the counters of this thread, if the metrics have room for them
+  if (m_metrics != NULL)
+  {
+    m_counters = m_metrics->getThreadCounters();
+    if (m_counters == NULL)
+      m_counters = &m_localCounters;
+  }
+
+  // Use buffered reads and gathered writes on the connections (ownership passes to network)
+  m_transportLayer = new DcmSvcTransportLayer(&m_counters->transfer);
+  cond = ASC_setTransportLayer( network, m_transportLayer, 1 );
+  if( cond.bad() )
+  {
+    delete m_transportLayer;
+    m_transportLayer = NULL;
+    ASC_dropNetwork( &network );
+    return cond;
+  }
+
   // drop root privileges now and revert to the calling user id (if we are running as setuid root)
   cond = OFStandard::dropPrivileges();
   if (cond.bad())
@@ -107,6 +273,7 @@ OFCondition DcmMppsSCP::listen()
   // is the counterpart of ASC_initializeNetwork(...) which was called above.
   cond = ASC_dropNetwork( &network );
   network = NULL;
+  m_transportLayer = NULL;
 
   // return ok
   return cond;
@@ -118,36 +285,59 @@ void DcmMppsSCP::findPresentationContext(const T_ASC_PresentationContextID presI
                                      OFString &abstractSyntax,
                                      OFString &transferSyntax)
 {
-  transferSyntax.clear();
-  abstractSyntax.clear();
+  const DcmPresentationContextInfo &info = lookupPresentationContext(presID);
+  abstractSyntax = info.abstractSyntax;
+  transferSyntax = info.acceptedTransferSyntax;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::buildPresentationContextTable()
+{
+  clearPresentationContextTable();
   if (m_assoc == NULL)
     return;
 
-  DUL_PRESENTATIONCONTEXT *pc;
-  LST_HEAD **l;
-
-  /* we look for a presentation context matching
-   * both abstract and transfer syntax
-   */
-  l = &m_assoc->params->DULparams.acceptedPresentationContext;
-  pc = (DUL_PRESENTATIONCONTEXT*) LST_Head(l);
+  // walk the list once, instead of once per command
+  LST_HEAD **l = &m_assoc->params->DULparams.acceptedPresentationContext;
+  if (*l == NULL)
+    return;
+  DUL_PRESENTATIONCONTEXT *pc = (DUL_PRESENTATIONCONTEXT*) LST_Head(l);
   (void)LST_Position(l, (LST_NODE*)pc);
   while (pc)
   {
-     if (presID == pc->presentationContextID)
-     {
-       if (pc->result == ASC_P_ACCEPTANCE)
-       {
-         // found a match
-         transferSyntax = pc->acceptedTransferSyntax;
-         abstractSyntax = pc->abstractSyntax;
-       }
-       break;
-     }
-     pc = (DUL_PRESENTATIONCONTEXT*) LST_Next(l);
+    // presentation context IDs are odd numbers, i.e. entry 0 is never used
+    if ((pc->result == ASC_P_ACCEPTANCE) && (pc->presentationContextID != 0))
+    {
+      DcmPresentationContextInfo &info = m_presentationContexts[pc->presentationContextID];
+      info.presentationContextID = pc->presentationContextID;
+      info.abstractSyntax = pc->abstractSyntax;
+      info.proposedSCRole = pc->proposedSCRole;
+      info.acceptedSCRole = pc->acceptedSCRole;
+      info.acceptedTransferSyntax = pc->acceptedTransferSyntax;
+    }
+    pc = (DUL_PRESENTATIONCONTEXT*) LST_Next(l);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::clearPresentationContextTable()
+{
+  for (size_t i = 0; i < 256; i++)
+  {
+    if (m_presentationContexts[i].presentationContextID != 0)
+      m_presentationContexts[i] = DcmPresentationContextInfo();
   }
 }
 
+// ----------------------------------------------------------------------------
+
+const DcmPresentationContextInfo &DcmMppsSCP::lookupPresentationContext(const T_ASC_PresentationContextID presID) const
+{
+  return m_presentationContexts[presID];
+}
+
 DUL_PRESENTATIONCONTEXT* DcmMppsSCP::findPresentationContextID(LST_HEAD *head,
                                                            T_ASC_PresentationContextID presentationContextID)
 {
@@ -188,6 +378,12 @@ void DcmMppsSCP::refuseAssociation(const DcmRefuseReasonType reason)
     return;
   }
 
+  DCMMPPS_PROBE2(association__refused, m_associationCounter, OFstatic_cast(int, reason));
+  if (OFstatic_cast(size_t, reason) < DCMSVC_METRICS_REFUSE_REASONS)
+    ++m_counters->associationsRefused[reason];
+  if (m_peer != NULL)
+    ++m_peer->associationsRefused;
+
   T_ASC_RejectParameters rej;
 
   // dump some information if required
@@ -319,6 +515,10 @@ OFCondition DcmMppsSCP::waitForAssociationRQ(T_ASC_Network *network)
 
   Uint32 timeout = m_cfg->getConnectionTimeout();
 
+  // the bytes of the association are assigned to its peer when it ends (see dropAndDestroyAssociation())
+  m_peerBytesReceived = m_counters->transfer.bytesReceived;
+  m_peerBytesSent = m_counters->transfer.bytesSent;
+
   // Listen to a socket for timeout seconds and wait for an association request
   OFCondition cond = ASC_receiveAssociation( network, &m_assoc, m_cfg->getMaxReceivePDULength(), NULL, NULL, OFFalse,
                                              m_cfg->getConnectionBlockingMode(), OFstatic_cast(int, timeout) );
@@ -336,6 +536,26 @@ OFCondition DcmMppsSCP::waitForAssociationRQ(T_ASC_Network *network)
     return EC_Normal;
   }
 
+  // the transport layer notes when it creates the connection, i.e. right after accepting it
+  m_phaseStart = DcmSvcLatencyHistogram::getMonotonicTime();
+  m_associationStart = m_phaseStart;
+  if (m_transportLayer != NULL)
+  {
+    m_associationStart = m_transportLayer->getConnectionTime();
+    m_counters->phases[DCMMPPS_PHASE_ACCEPT].record(m_phaseStart - m_associationStart);
+  }
+
+  ++m_associationCounter;
+  m_messageID = 0;
+  if (m_timeline != NULL)
+    m_timeline->addSpan(getPhaseName(DCMMPPS_PHASE_ACCEPT), "phase", m_associationStart, m_phaseStart, m_associationCounter);
+  DCMMPPS_PROBE4(association__received, m_associationCounter, m_assoc->params->DULparams.callingAPTitle,
+    m_assoc->params->DULparams.callingPresentationAddress, m_assoc->params->theirMaxPDUReceiveSize);
+
+  m_peer = m_counters->getPeer(getPeerAETitle(), getPeerIP());
+  if (m_peer != NULL)
+    m_peer->lastSeen = OFstatic_cast(Uint64, time(NULL));
+
   return processAssociationRQ();
 }
 
@@ -423,7 +643,7 @@ OFCondition DcmMppsSCP::processAssociationRQ()
     if (m_cfg->getVerbosePCMode())
       DCMNET_INFO(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RJ));
     else
-      DCMNET_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RJ));
+      DCMMPPS_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RJ));
     refuseAssociation( DCMSCP_NO_PRESENTATION_CONTEXTS );
     dropAndDestroyAssociation();
     return EC_Normal;
@@ -436,6 +656,14 @@ OFCondition DcmMppsSCP::processAssociationRQ()
     dropAndDestroyAssociation();
     return EC_Normal;
   }
+  recordPhase(DCMMPPS_PHASE_NEGOTIATION, m_phaseStart);
+  DCMMPPS_PROBE3(association__acknowledged, m_associationCounter,
+    ASC_countAcceptedPresentationContexts(m_assoc->params), m_assoc->sendPDVLength);
+  ++m_counters->associationsAccepted;
+  if (m_peer != NULL)
+    ++m_peer->associationsAccepted;
+  buildPresentationContextTable();
+  m_negotiationPolicy.countAccepted(m_assoc->params, m_counters);
   notifyAssociationAcknowledge();
 
   // Dump some debug information
@@ -444,7 +672,7 @@ OFCondition DcmMppsSCP::processAssociationRQ()
   if (m_cfg->getVerbosePCMode())
     DCMNET_INFO(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_AC));
   else
-    DCMNET_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_AC));
+    DCMMPPS_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_AC));
 
    // Go ahead and handle the association (i.e. handle the callers requests) in this process
    handleAssociation();
@@ -459,6 +687,13 @@ OFCondition DcmMppsSCP::negotiateAssociation()
   if (m_assoc == NULL)
     return DIMSE_ILLEGALASSOCIATION;
 
+  // Replay the decisions for an identical earlier request, if any
+  if (m_negotiationCache.replay(m_assoc->params))
+  {
+    DCMMPPS_DEBUG("Presentation contexts negotiated as for an earlier identical request");
+    return EC_Normal;
+  }
+
   // Set presentation contexts as defined in association configuration
   OFCondition result = m_cfg->evaluateIncomingAssociation(*m_assoc);
   if (result.bad())
@@ -466,6 +701,12 @@ OFCondition DcmMppsSCP::negotiateAssociation()
     OFString tempStr;
     DCMNET_ERROR(DimseCondition::dump(tempStr, result));
   }
+  else
+  {
+    // rank the accepted transfer syntaxes as in the negotiation policy file, if any
+    m_negotiationPolicy.apply(m_assoc->params);
+    m_negotiationCache.store(m_assoc->params);
+  }
   return result;
 }
 
@@ -515,29 +756,86 @@ void DcmMppsSCP::handleAssociation()
   // start a loop to be able to receive more than one DIMSE command
   while( cond.good() )
   {
-    // receive a DIMSE command over the network
+    // receive a DIMSE command over the network, the time waiting for it is not counted
+    const Uint64 waitStart = DcmSvcLatencyHistogram::getMonotonicTime();
+    if (m_transportLayer != NULL)
+      m_transportLayer->resetDataArrivalTime();
     cond = DIMSE_receiveCommand( m_assoc, m_cfg->getDIMSEBlockingMode(), m_cfg->getDIMSETimeout(),
                                  &presID, &message, NULL );
     // check if peer did release or abort, or if we have a valid message
     if( cond.good() )
     {
-      DcmPresentationContextInfo presInfo;
-      getPresentationContextInfo(m_assoc, presID, presInfo);
-      cond = handleIncomingCommand(&message, presInfo);
+      const Uint64 arrival = (m_transportLayer != NULL) ? m_transportLayer->getDataArrivalTime() : 0;
+      m_messageID = getMessageID(message);
+      // a request for a selected instance is debugged even if its association is not
+      m_debugLevel = m_associationDebugLevel;
+      if (m_debugFilter != NULL)
+      {
+        const OFLogger::LogLevel instanceLevel = m_debugFilter->matchInstance(getInstanceUID(message));
+        if (instanceLevel < m_debugLevel)
+          m_debugLevel = instanceLevel;
+      }
+      DcmSvcSlowLog::resetRecord(m_slowRecord);
+      m_slowRecord.commandReceiveTime =
+        recordPhase(DCMMPPS_PHASE_COMMAND_RECEIVE, (arrival > waitStart) ? arrival : waitStart);
+      m_phaseStart = DcmSvcLatencyHistogram::getMonotonicTime();
+      m_datasetTime = 0;
+      m_sendTime = 0;
+      DCMMPPS_PROBE4(command__received, m_associationCounter, m_messageID, OFstatic_cast(int, message.CommandField), presID);
+      // the dataset size is only known if received by receiveRawDataset(), the size and
+      // the response status are also reported by the probes and the timeline
+      m_traceRecord.datasetSize = 0;
+      m_traceRecord.status = 0;
+      m_traceRecord.flags = 0;
+      if (m_traceFile != NULL)
+      {
+        // the rest of the record is filled while and after handling the command
+        DcmMppsTraceFile::setTimestamp(m_traceRecord);
+        m_traceStart = DcmMppsTraceFile::getMonotonicTime();
+      }
+      cond = handleIncomingCommand(&message, lookupPresentationContext(presID));
+      const Uint64 handled = DcmSvcLatencyHistogram::getMonotonicTime() - m_phaseStart;
+      m_counters->phases[DCMMPPS_PHASE_HANDLER].record(
+        (handled > m_datasetTime + m_sendTime) ? handled - m_datasetTime - m_sendTime : 0);
+      if (m_peer != NULL)
+        m_peer->requests.record(handled);
+      if (m_timeline != NULL)
+      {
+        m_timeline->addSpan(getCommandName(message.CommandField), "request", m_phaseStart, m_phaseStart + handled,
+          m_associationCounter, m_messageID,
+          (m_traceRecord.flags & DCMMPPS_TRACE_RESPONSE_SENT) ? OFstatic_cast(int, m_traceRecord.status) : -1);
+      }
+      if (m_traceFile != NULL)
+        writeTraceRecord(message, presID, cond);
+      if ((m_slowLog != NULL) && m_slowLog->isSlow(message.CommandField, handled))
+        writeSlowRecord(message, handled);
+      m_debugLevel = m_associationDebugLevel;
     }
   }
   // Clean up on association termination.
   if( cond == DUL_PEERREQUESTEDRELEASE )
   {
+    ++m_counters->associationsReleased;
+    if (m_peer != NULL)
+      ++m_peer->associationsReleased;
+    DCMMPPS_PROBE2(association__ended, m_associationCounter, 0);
     notifyReleaseRequest();
     ASC_acknowledgeRelease(m_assoc);
   }
   else if( cond == DUL_PEERABORTEDASSOCIATION )
   {
+    ++m_counters->associationsAborted;
+    if (m_peer != NULL)
+      ++m_peer->associationsAborted;
+    DCMMPPS_PROBE2(association__ended, m_associationCounter, 1);
     notifyAbortRequest();
   }
   else
   {
+    ++m_counters->associationsAborted;
+    if (m_peer != NULL)
+      ++m_peer->associationsFailed;
+    DCMMPPS_PROBE2(association__ended, m_associationCounter, 2);
     notifyDIMSEError(cond);
     ASC_abortAssociation( m_assoc );
   }
@@ -546,7 +844,7 @@ void DcmMppsSCP::handleAssociation()
   dropAndDestroyAssociation();
 
   // Output separator line.
-  DCMNET_DEBUG( "+++++++++++++++++++++++++++++" );
+  DCMMPPS_DEBUG( "+++++++++++++++++++++++++++++" );
 }
 
 
@@ -571,15 +869,60 @@ OFCondition DcmMppsSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
             T_DIMSE_N_CreateRQ &createReq = incomingMsg->msg.NCreateRQ;
             Uint16 rspStatusCode = STATUS_N_NoSuchAttribute;
 
-            DcmFileFormat fileformat;
-            DcmDataset *reqDataset = fileformat.getDataset();
+            // receive into a reused dataset rather than a new one per message
+            DcmDataset *pooledDataset = m_datasetPool.acquire();
+            DcmDataset *reqDataset = pooledDataset;
+
+            DcmMppsValidationResult validation;
+            DcmDataset *statusDetail = NULL;
 
             // receive dataset in memory
             status = receiveCREATERequest(createReq, presInfo.presentationContextID, reqDataset);
-            if (status.good())
+            const OFBool datasetReceived = status.good();
+            if (datasetReceived)
             {
-                // output debug message that dataset is not stored
-                rspStatusCode = STATUS_Success;
+                // check the received attributes against the N-CREATE requirements
+                if (isRawDatasetIndexed())
+                    rspStatusCode = DcmMppsValidator::validateCreateRequest(m_rawDataset, validation);
+                else
+                    rspStatusCode = DcmMppsValidator::validateCreateRequest(*reqDataset, validation);
+                if (rspStatusCode != STATUS_Success)
+                {
+                    DCMNET_WARN("N-CREATE dataset is not valid (" << DU_ncreateStatusString(rspStatusCode)
+                        << ", " << validation.numOffending << " offending element(s))");
+                    statusDetail = validation.createStatusDetail();
+                }
+                else if (((m_store != NULL) || (m_exporter != NULL)) && decodeInstanceAttributes(*reqDataset).bad())
+                {
+                    DCMNET_ERROR("cannot decode N-CREATE dataset");
+                    rspStatusCode = STATUS_N_ProcessingFailure;
+                }
+                else if ((m_store != NULL) || (m_exporter != NULL))
+                {
+                    // the SCP has to assign the SOP Instance UID if the SCU did not
+                    if (!(createReq.opts & O_NCREATE_AFFECTEDSOPINSTANCEUID) || (createReq.AffectedSOPInstanceUID[0] == '\0'))
+                    {
+                        dcmGenerateUniqueIdentifier(createReq.AffectedSOPInstanceUID, SITE_INSTANCE_UID_ROOT);
+                        createReq.opts |= O_NCREATE_AFFECTEDSOPINSTANCEUID;
+                    }
+                    DcmMppsInstance instance;
+                    if (m_store != NULL)
+                    {
+                        rspStatusCode = m_store->createInstance(createReq.AffectedSOPInstanceUID, *reqDataset,
+                            (m_exporter != NULL) ? &instance : NULL, &validation);
+                        DCMMPPS_PROBE4(instance__stored, m_associationCounter, m_messageID, DIMSE_N_CREATE_RQ, rspStatusCode);
+                    }
+                    else
+                    {
+                        instance.sopInstanceUID = createReq.AffectedSOPInstanceUID;
+                        instance.update(*reqDataset);
+                    }
+                    if ((rspStatusCode == STATUS_Success) && (m_exporter != NULL))
+                    {
+                        m_exporter->exportEvent(DCMMPPS_EVENT_CREATE, instance, DCMMPPS_STATUS_ABSENT, getPeerAETitle());
+                        DCMMPPS_PROBE3(event__exported, m_associationCounter, m_messageID, OFstatic_cast(int, DCMMPPS_EVENT_CREATE));
+                    }
+                }
             }
             else
             {
@@ -588,7 +931,20 @@ OFCondition DcmMppsSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
                 rspStatusCode = STATUS_N_AttributeListError;
             }
 
-            status = sendCREATEResponse(presInfo.presentationContextID, createReq, rspStatusCode);
+            status = sendCREATEResponse(presInfo.presentationContextID, createReq, rspStatusCode, statusDetail);
+            delete statusDetail;
+            // a slow request is summarized while its dataset is still available
+            if (m_slowLog != NULL)
+                captureSlowDataset(DIMSE_N_CREATE_RQ, *reqDataset);
+            // profiled after the response, i.e. without delaying it
+            if (datasetReceived)
+                recordPayload(DCMMPPS_PAYLOAD_N_CREATE, *reqDataset);
+            // the receive functions fill the given dataset, i.e. normally do not replace it
+            if (reqDataset != pooledDataset)
+                delete reqDataset;
+            m_datasetPool.release(pooledDataset);
+            // unmap and close a spool file now rather than with the next message
+            m_rawDataset.clear();
 
         }
         else if (incomingMsg->CommandField == DIMSE_N_SET_RQ)
@@ -597,15 +953,64 @@ OFCondition DcmMppsSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
             T_DIMSE_N_SetRQ &setReq = incomingMsg->msg.NSetRQ;
             Uint16 rspStatusCode = STATUS_N_NoSuchAttribute ;
 
-            DcmFileFormat fileformat;
-            DcmDataset *reqDataset = fileformat.getDataset();
+            // receive into a reused dataset rather than a new one per message
+            DcmDataset *pooledDataset = m_datasetPool.acquire();
+            DcmDataset *reqDataset = pooledDataset;
+
+            DcmMppsValidationResult validation;
+            DcmDataset *statusDetail = NULL;
 
             // receive dataset in memory
             status = receiveSETRequest(setReq, presInfo.presentationContextID, reqDataset);
-            if (status.good())
+            const OFBool datasetReceived = status.good();
+            if (datasetReceived)
             {
-                // output debug message that dataset is not stored
-                rspStatusCode = STATUS_Success;
+                // check the received attributes against the N-SET (and final state) requirements
+                if (isRawDatasetIndexed())
+                    rspStatusCode = DcmMppsValidator::validateSetRequest(m_rawDataset, validation);
+                else
+                    rspStatusCode = DcmMppsValidator::validateSetRequest(*reqDataset, validation);
+                if (rspStatusCode != STATUS_Success)
+                {
+                    DCMNET_WARN("N-SET dataset is not valid (" << DU_nsetStatusString(rspStatusCode)
+                        << ", " << validation.numOffending << " offending element(s))");
+                    statusDetail = validation.createStatusDetail();
+                }
+                else if (((m_store != NULL) || (m_exporter != NULL)) && decodeInstanceAttributes(*reqDataset).bad())
+                {
+                    DCMNET_ERROR("cannot decode N-SET dataset");
+                    rspStatusCode = STATUS_N_ProcessingFailure;
+                }
+                else if ((m_store != NULL) || (m_exporter != NULL))
+                {
+                    DcmMppsInstance instance;
+                    DcmMppsStepStatus previousStatus = DCMMPPS_STATUS_ABSENT;
+                    if (m_store != NULL)
+                    {
+                        // the final state is checked on the stored instance merged with the N-SET
+                        rspStatusCode = m_store->updateInstance(setReq.RequestedSOPInstanceUID, *reqDataset,
+                            (m_exporter != NULL) ? &instance : NULL, &previousStatus, &validation);
+                        DCMMPPS_PROBE4(instance__stored, m_associationCounter, m_messageID, DIMSE_N_SET_RQ, rspStatusCode);
+                        if ((rspStatusCode != STATUS_Success) && (validation.numOffending > 0))
+                        {
+                            DCMNET_WARN("N-SET does not complete the instance (" << DU_nsetStatusString(rspStatusCode)
+                                << ", " << validation.numOffending << " offending element(s))");
+                            statusDetail = validation.createStatusDetail();
+                        }
+                    }
+                    else
+                    {
+                        // without a store, only the attributes of the N-SET are known (i.e. the
+                        // final state cannot be checked, they may have been sent earlier)
+                        instance.sopInstanceUID = setReq.RequestedSOPInstanceUID;
+                        instance.update(*reqDataset);
+                    }
+                    if ((rspStatusCode == STATUS_Success) && (m_exporter != NULL))
+                    {
+                        m_exporter->exportEvent(DCMMPPS_EVENT_SET, instance, previousStatus, getPeerAETitle());
+                        DCMMPPS_PROBE3(event__exported, m_associationCounter, m_messageID, OFstatic_cast(int, DCMMPPS_EVENT_SET));
+                    }
+                }
             }
             else
             {
@@ -614,7 +1019,20 @@ OFCondition DcmMppsSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
                 rspStatusCode = STATUS_N_AttributeListError;
             }
 
-            status = sendSETResponse(presInfo.presentationContextID, setReq, rspStatusCode);
+            status = sendSETResponse(presInfo.presentationContextID, setReq, rspStatusCode, statusDetail);
+            delete statusDetail;
+            // a slow request is summarized while its dataset is still available
+            if (m_slowLog != NULL)
+                captureSlowDataset(DIMSE_N_SET_RQ, *reqDataset);
+            // profiled after the response, i.e. without delaying it
+            if (datasetReceived)
+                recordPayload(DCMMPPS_PAYLOAD_N_SET, *reqDataset);
+            // the receive functions fill the given dataset, i.e. normally do not replace it
+            if (reqDataset != pooledDataset)
+                delete reqDataset;
+            m_datasetPool.release(pooledDataset);
+            // unmap and close a spool file now rather than with the next message
+            m_rawDataset.clear();
 
         } else {
             // unsupported command
@@ -623,9 +1041,10 @@ OFCondition DcmMppsSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
                 << STD_NAMESPACE hex << STD_NAMESPACE setfill('0') << STD_NAMESPACE setw(4)
                 << OFstatic_cast(unsigned int, incomingMsg->CommandField)
                 << "), we are a Storage SCP only");
-            DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, *incomingMsg, DIMSE_INCOMING));
+            DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, *incomingMsg, DIMSE_INCOMING));
             // TODO: provide more information on this error?
             status = DIMSE_BADCOMMANDTYPE;
+            countCommand(incomingMsg->CommandField, DCMSVC_METRICS_FAILURE);
         }
     }
     return status;
@@ -642,10 +1061,10 @@ OFCondition DcmMppsSCP::handleECHORequest(T_DIMSE_C_EchoRQ &reqMessage,
   OFString tempStr;
 
   // Dump debug information
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
   {
     DCMNET_INFO("Received C-ECHO Request");
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_INFO("Sending C-ECHO Response");
   } else {
     DCMNET_INFO("Received C-ECHO Request (MsgID " << reqMessage.MessageID << ")");
@@ -653,11 +1072,21 @@ OFCondition DcmMppsSCP::handleECHORequest(T_DIMSE_C_EchoRQ &reqMessage,
   }
 
   // Send response message
-  cond = DIMSE_sendEchoResponse( m_assoc, presID, &reqMessage, STATUS_Success, NULL );
+  T_DIMSE_Message response;
+  // Make sure everything is zeroed (especially options)
+  bzero((char*)&response, sizeof(response));
+  T_DIMSE_C_EchoRSP &echoRsp = response.msg.CEchoRSP;
+  response.CommandField = DIMSE_C_ECHO_RSP;
+  echoRsp.MessageIDBeingRespondedTo = reqMessage.MessageID;
+  echoRsp.DimseStatus = STATUS_Success;
+  echoRsp.DataSetType = DIMSE_DATASET_NULL;
+  echoRsp.opts = O_ECHO_AFFECTEDSOPCLASSUID;
+  OFStandard::strlcpy(echoRsp.AffectedSOPClassUID, reqMessage.AffectedSOPClassUID, sizeof(echoRsp.AffectedSOPClassUID));
+  cond = sendDIMSEResponse(presID, &response, NULL /* statusDetail */);
   if( cond.bad() )
     DCMNET_ERROR("Cannot send C-ECHO Response: " << DimseCondition::dump(tempStr, cond));
   else
-    DCMNET_DEBUG("C-ECHO Response successfully sent");
+    DCMMPPS_DEBUG("C-ECHO Response successfully sent");
 
   return cond;
 }
@@ -677,7 +1106,7 @@ OFCondition DcmMppsSCP::receiveCREATERequest(T_DIMSE_N_CreateRQ &reqMessage,
   DcmDataset *dataset = reqDataset;
 
   // Dump debug information
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
     DCMNET_INFO("Received N-CREATE Request");
   else
     DCMNET_INFO("Received N-CREATE Request (MsgID " << reqMessage.MessageID << ")");
@@ -685,27 +1114,47 @@ OFCondition DcmMppsSCP::receiveCREATERequest(T_DIMSE_N_CreateRQ &reqMessage,
   // Check if dataset is announced correctly
   if (reqMessage.DataSetType == DIMSE_DATASET_NULL)
   {
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_ERROR("Received N-CREATE request but no dataset announced, aborting");
     return DIMSE_BADMESSAGE;
   }
 
-  // Receive dataset (in memory)
-  cond = receiveDIMSEDataset(&presIDdset, &dataset);
+  // Receive dataset (in memory or spooled), with lazy decoding only its top-level elements are indexed
+  const Uint64 datasetStart = DcmSvcLatencyHistogram::getMonotonicTime();
+  if (m_lazyDecoding || (m_rawDataset.getSpoolThreshold() > 0) || (m_traceFile != NULL))
+    cond = receiveRawDataset(&presIDdset, dataset);
+  else
+    cond = receiveDIMSEDataset(&presIDdset, &dataset);
+  m_datasetTime += recordPhase(DCMMPPS_PHASE_DATASET_RECEIVE, datasetStart);
+  DCMMPPS_PROBE4(dataset__received, m_associationCounter, reqMessage.MessageID, m_traceRecord.datasetSize, cond.good());
   if (cond.bad())
   {
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_ERROR("Unable to receive N-CREATE dataset on presentation context " << OFstatic_cast(unsigned int, presID));
     return cond;
   }
 
-  DCMNET_INFO(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dataset, presID));
-
-  // Output request message only if trace level is enabled
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::TRACE_LOG_LEVEL))
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dataset, presID));
+  // an undecoded dataset is not dumped, it would have to be decoded just for that
+  DcmDataset *dumpDataset = isRawDatasetIndexed() ? NULL : dataset;
+  // the messages of an association matching the debug filter are dumped synchronously
+  // to its logger, the asynchronous logger only writes to dcmnet
+  if ((m_asyncLogger != NULL) && (m_debugLevel == OFLogger::OFF_LOG_LEVEL))
+  {
+    // only encoded here, formatted by the writer thread of the logger
+    m_asyncLogger->dumpMessage(OFLogger::INFO_LOG_LEVEL, reqMessage, dumpDataset, presID);
+    m_asyncLogger->dumpMessage(OFLogger::DEBUG_LOG_LEVEL, reqMessage,
+      DCM_dcmnetLogger.isEnabledFor(OFLogger::TRACE_LOG_LEVEL) ? dumpDataset : NULL, presID);
+  }
   else
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+  {
+    DCMNET_INFO(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dumpDataset, presID));
+
+    // Output request message only if trace level is enabled
+    if (isLogEnabledFor(OFLogger::TRACE_LOG_LEVEL))
+      DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dumpDataset, presID));
+    else
+      DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+  }
 
   // Compare presentation context ID of command and data set
   if (presIDdset != presID)
@@ -729,7 +1178,8 @@ OFCondition DcmMppsSCP::receiveCREATERequest(T_DIMSE_N_CreateRQ &reqMessage,
 
 OFCondition DcmMppsSCP::sendCREATEResponse(T_ASC_PresentationContextID presID,
                                       const T_DIMSE_N_CreateRQ &reqMessage,
-                                      const Uint16 rspStatusCode)
+                                      const Uint16 rspStatusCode,
+                                      DcmDataset *statusDetail)
 {
   OFCondition cond;
   OFString tempStr;
@@ -744,20 +1194,20 @@ OFCondition DcmMppsSCP::sendCREATEResponse(T_ASC_PresentationContextID presID,
   createRsp.DimseStatus = rspStatusCode;
   createRsp.DataSetType = DIMSE_DATASET_NULL;
   // Always send the optional fields "Affected SOP Class UID" and "Affected SOP Instance UID"
-  createRsp.opts = O_STORE_AFFECTEDSOPCLASSUID | O_STORE_AFFECTEDSOPINSTANCEUID;
+  createRsp.opts = O_NCREATE_AFFECTEDSOPCLASSUID | O_NCREATE_AFFECTEDSOPINSTANCEUID;
   OFStandard::strlcpy(createRsp.AffectedSOPClassUID, reqMessage.AffectedSOPClassUID, sizeof(createRsp.AffectedSOPClassUID));
   OFStandard::strlcpy(createRsp.AffectedSOPInstanceUID, reqMessage.AffectedSOPInstanceUID, sizeof(createRsp.AffectedSOPInstanceUID));
 
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
   {
     DCMNET_INFO("Sending N-CREATE Response");
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_OUTGOING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_OUTGOING, NULL, presID));
   } else {
     DCMNET_INFO("Sending N-CREATE Response (" << DU_ncreateStatusString(rspStatusCode) << ")");
   }
 
   // Send response message
-  cond = sendDIMSEMessage(presID, &response, NULL /* dataObject */, NULL);
+  cond = sendDIMSEResponse(presID, &response, statusDetail);
   if (cond.bad())
   {
     DCMNET_ERROR("Failed sending N-CREATE response: " << DimseCondition::dump(tempStr, cond));
@@ -782,7 +1232,7 @@ OFCondition DcmMppsSCP::receiveSETRequest(T_DIMSE_N_SetRQ &reqMessage,
   DcmDataset *dataset = reqDataset;
 
   // Dump debug information
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
     DCMNET_INFO("Received N-SET Request");
   else
     DCMNET_INFO("Received N-SET Request (MsgID " << reqMessage.MessageID << ")");
@@ -790,27 +1240,47 @@ OFCondition DcmMppsSCP::receiveSETRequest(T_DIMSE_N_SetRQ &reqMessage,
   // Check if dataset is announced correctly
   if (reqMessage.DataSetType == DIMSE_DATASET_NULL)
   {
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_ERROR("Received N-SET request but no dataset announced, aborting");
     return DIMSE_BADMESSAGE;
   }
 
-  // Receive dataset (in memory)
-  cond = receiveDIMSEDataset(&presIDdset, &dataset);
+  // Receive dataset (in memory or spooled), with lazy decoding only its top-level elements are indexed
+  const Uint64 datasetStart = DcmSvcLatencyHistogram::getMonotonicTime();
+  if (m_lazyDecoding || (m_rawDataset.getSpoolThreshold() > 0) || (m_traceFile != NULL))
+    cond = receiveRawDataset(&presIDdset, dataset);
+  else
+    cond = receiveDIMSEDataset(&presIDdset, &dataset);
+  m_datasetTime += recordPhase(DCMMPPS_PHASE_DATASET_RECEIVE, datasetStart);
+  DCMMPPS_PROBE4(dataset__received, m_associationCounter, reqMessage.MessageID, m_traceRecord.datasetSize, cond.good());
   if (cond.bad())
   {
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_ERROR("Unable to receive N-SET dataset on presentation context " << OFstatic_cast(unsigned int, presID));
     return cond;
   }
 
-  DCMNET_INFO(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dataset, presID));
-
-  // Output request message only if trace level is enabled
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::TRACE_LOG_LEVEL))
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dataset, presID));
+  // an undecoded dataset is not dumped, it would have to be decoded just for that
+  DcmDataset *dumpDataset = isRawDatasetIndexed() ? NULL : dataset;
+  // the messages of an association matching the debug filter are dumped synchronously
+  // to its logger, the asynchronous logger only writes to dcmnet
+  if ((m_asyncLogger != NULL) && (m_debugLevel == OFLogger::OFF_LOG_LEVEL))
+  {
+    // only encoded here, formatted by the writer thread of the logger
+    m_asyncLogger->dumpMessage(OFLogger::INFO_LOG_LEVEL, reqMessage, dumpDataset, presID);
+    m_asyncLogger->dumpMessage(OFLogger::DEBUG_LOG_LEVEL, reqMessage,
+      DCM_dcmnetLogger.isEnabledFor(OFLogger::TRACE_LOG_LEVEL) ? dumpDataset : NULL, presID);
+  }
   else
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+  {
+    DCMNET_INFO(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dumpDataset, presID));
+
+    // Output request message only if trace level is enabled
+    if (isLogEnabledFor(OFLogger::TRACE_LOG_LEVEL))
+      DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dumpDataset, presID));
+    else
+      DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+  }
 
   // Compare presentation context ID of command and data set
   if (presIDdset != presID)
@@ -834,7 +1304,8 @@ OFCondition DcmMppsSCP::receiveSETRequest(T_DIMSE_N_SetRQ &reqMessage,
 
 OFCondition DcmMppsSCP::sendSETResponse(T_ASC_PresentationContextID presID,
                                       const T_DIMSE_N_SetRQ &reqMessage,
-                                      const Uint16 rspStatusCode)
+                                      const Uint16 rspStatusCode,
+                                      DcmDataset *statusDetail)
 {
   OFCondition cond;
   OFString tempStr;
@@ -849,20 +1320,20 @@ OFCondition DcmMppsSCP::sendSETResponse(T_ASC_PresentationContextID presID,
   setRsp.DimseStatus = rspStatusCode;
   setRsp.DataSetType = DIMSE_DATASET_NULL;
   // Always send the optional fields "Affected SOP Class UID" and "Affected SOP Instance UID"
-  setRsp.opts = O_STORE_AFFECTEDSOPCLASSUID | O_STORE_AFFECTEDSOPINSTANCEUID;
+  setRsp.opts = O_NSET_AFFECTEDSOPCLASSUID | O_NSET_AFFECTEDSOPINSTANCEUID;
   OFStandard::strlcpy(setRsp.AffectedSOPClassUID, reqMessage.RequestedSOPClassUID, sizeof(setRsp.AffectedSOPClassUID));
   OFStandard::strlcpy(setRsp.AffectedSOPInstanceUID, reqMessage.RequestedSOPInstanceUID, sizeof(setRsp.AffectedSOPInstanceUID));
 
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
   {
     DCMNET_INFO("Sending N-SET Response");
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_OUTGOING, NULL, presID));
+    DCMMPPS_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_OUTGOING, NULL, presID));
   } else {
     DCMNET_INFO("Sending N-SET Response (" << DU_nsetStatusString(rspStatusCode) << ")");
   }
 
   // Send response message
-  cond = sendDIMSEMessage(presID, &response, NULL /* dataObject */, NULL);
+  cond = sendDIMSEResponse(presID, &response, statusDetail);
   if (cond.bad())
   {
     DCMNET_ERROR("Failed sending N-SET response: " << DimseCondition::dump(tempStr, cond));
@@ -896,6 +1367,98 @@ OFCondition DcmMppsSCP::sendDIMSEMessage(const T_ASC_PresentationContextID presI
 
 // ----------------------------------------------------------------------------
 
+// Sends a response, if possible from a pre-encoded command template
+OFCondition DcmMppsSCP::sendDIMSEResponse(const T_ASC_PresentationContextID presID,
+                                          T_DIMSE_Message *message,
+                                          DcmDataset *statusDetail)
+{
+  if (m_assoc == NULL)
+    return DIMSE_ILLEGALASSOCIATION;
+  if (message == NULL)
+    return DIMSE_NULLKEY;
+
+  // the templates cover the responses of this SCP, which always include the Affected SOP Class UID
+  DcmSvcResponseTemplate *command = NULL;
+  OFBool encoded = OFFalse;
+  Uint16 status = STATUS_Success;
+  switch (message->CommandField)
+  {
+    case DIMSE_C_ECHO_RSP:
+    {
+      const T_DIMSE_C_EchoRSP &rsp = message->msg.CEchoRSP;
+      command = &m_echoResponse;
+      status = rsp.DimseStatus;
+      if ((rsp.DataSetType == DIMSE_DATASET_NULL) && (rsp.opts & O_ECHO_AFFECTEDSOPCLASSUID))
+        encoded = command->encode(rsp.AffectedSOPClassUID, rsp.MessageIDBeingRespondedTo, rsp.DimseStatus, NULL);
+      break;
+    }
+    case DIMSE_N_CREATE_RSP:
+    {
+      const T_DIMSE_N_CreateRSP &rsp = message->msg.NCreateRSP;
+      command = &m_createResponse;
+      status = rsp.DimseStatus;
+      if ((rsp.DataSetType == DIMSE_DATASET_NULL) && (rsp.opts & O_NCREATE_AFFECTEDSOPCLASSUID))
+      {
+        encoded = command->encode(rsp.AffectedSOPClassUID, rsp.MessageIDBeingRespondedTo, rsp.DimseStatus,
+          (rsp.opts & O_NCREATE_AFFECTEDSOPINSTANCEUID) ? rsp.AffectedSOPInstanceUID : NULL);
+      }
+      break;
+    }
+    case DIMSE_N_SET_RSP:
+    {
+      const T_DIMSE_N_SetRSP &rsp = message->msg.NSetRSP;
+      command = &m_setResponse;
+      status = rsp.DimseStatus;
+      if ((rsp.DataSetType == DIMSE_DATASET_NULL) && (rsp.opts & O_NSET_AFFECTEDSOPCLASSUID))
+      {
+        encoded = command->encode(rsp.AffectedSOPClassUID, rsp.MessageIDBeingRespondedTo, rsp.DimseStatus,
+          (rsp.opts & O_NSET_AFFECTEDSOPINSTANCEUID) ? rsp.AffectedSOPInstanceUID : NULL);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  m_traceRecord.status = status;
+
+  // the status detail is encoded between Status and Affected SOP Instance UID, i.e. not covered
+  const Uint64 sendStart = DcmSvcLatencyHistogram::getMonotonicTime();
+  OFCondition cond;
+  if (encoded && (statusDetail == NULL) && (command->getLength() <= m_assoc->sendPDVLength))
+    cond = sendEncodedCommand(presID, *command);
+  else
+    cond = sendDIMSEMessage(presID, message, NULL /* dataObject */, statusDetail);
+  m_sendTime += recordPhase(DCMMPPS_PHASE_RESPONSE_SEND, sendStart);
+  DCMMPPS_PROBE5(response__sent, m_associationCounter, m_messageID, OFstatic_cast(int, message->CommandField),
+    status, cond.good());
+  if (cond.good())
+    m_traceRecord.flags |= DCMMPPS_TRACE_RESPONSE_SENT;
+  // a response that cannot be sent counts as failure, whatever its status
+  countCommand(message->CommandField, cond.good()
+    ? DcmSvcMetricsCounters::classifyStatus(status) : DCMSVC_METRICS_FAILURE);
+  return cond;
+}
+
+// ----------------------------------------------------------------------------
+
+// Sends an encoded command set as the only (and last) command PDV
+OFCondition DcmMppsSCP::sendEncodedCommand(const T_ASC_PresentationContextID presID,
+                                           const DcmSvcResponseTemplate &command)
+{
+  DUL_PDV pdv;
+  pdv.fragmentLength = OFstatic_cast(unsigned long, command.getLength());
+  pdv.presentationContextID = presID;
+  pdv.pdvType = DUL_COMMANDPDV;
+  pdv.lastPDV = OFTrue;
+  pdv.data = OFconst_cast(Uint8 *, command.getData());
+  DUL_PDVLIST pdvList;
+  pdvList.count = 1;
+  pdvList.pdv = &pdv;
+  return DUL_WritePDVs(&m_assoc->DULassociation, &pdvList);
+}
+
+// ----------------------------------------------------------------------------
+
 // Receive DIMSE command (excluding dataset!) over the currently open association
 OFCondition DcmMppsSCP::receiveDIMSECommand(T_ASC_PresentationContextID *presID,
                                         T_DIMSE_Message *message,
@@ -935,8 +1498,82 @@ OFCondition DcmMppsSCP::receiveDIMSEDataset(T_ASC_PresentationContextID *presID,
 
   if (cond.good())
   {
-    DCMNET_DEBUG("Received dataset on presentation context " << OFstatic_cast(unsigned int, *presID));
+    DCMMPPS_DEBUG("Received dataset on presentation context " << OFstatic_cast(unsigned int, *presID));
+  } else {
+    OFString tempStr;
+    DCMNET_ERROR("Unable to receive dataset on presentation context "
+      << OFstatic_cast(unsigned int, *presID) << ": " << DimseCondition::dump(tempStr, cond));
+  }
+  return cond;
+}
+
+// ----------------------------------------------------------------------------
+
+OFCondition DcmMppsSCP::receiveRawDataset(T_ASC_PresentationContextID *presID,
+                                          DcmDataset *dataset)
+{
+  if (m_assoc == NULL)
+    return DIMSE_ILLEGALASSOCIATION;
+
+  // collect the PDV fragments like DIMSE_receiveDataSetInMemory() does, but do not parse them.
+  // Above the spool threshold, they are written to a spool file as they arrive.
+  m_rawDataset.clear();
+  const DUL_BLOCKOPTIONS blocking = (m_cfg->getDIMSEBlockingMode() == DIMSE_BLOCKING) ? DUL_BLOCK : DUL_NOBLOCK;
+  OFCondition cond = EC_Normal;
+  OFBool last = OFFalse;
+  *presID = 0;
+  while (cond.good() && !last)
+  {
+    DUL_PDV pdv;
+    cond = DUL_NextPDV(&m_assoc->DULassociation, &pdv);
+    if (cond == DUL_NOPDVS)
+    {
+      cond = DUL_ReadPDVs(&m_assoc->DULassociation, NULL, blocking, OFstatic_cast(int, m_cfg->getDIMSETimeout()));
+      if (cond.good())
+        cond = DUL_NextPDV(&m_assoc->DULassociation, &pdv);
+    }
+    if (cond.bad())
+      break;
+    if (pdv.pdvType != DUL_DATASETPDV)
+      cond = DIMSE_UNEXPECTEDPDVTYPE;
+    else if ((*presID != 0) && (*presID != pdv.presentationContextID))
+      cond = makeDcmnetCondition(DIMSEC_INVALIDPRESENTATIONCONTEXTID, OF_error,
+        "DIMSE: Different Presentation IDs inside Data Set");
+    else
+    {
+      *presID = pdv.presentationContextID;
+      cond = m_rawDataset.append(pdv.data, pdv.fragmentLength);
+      last = pdv.lastPDV;
+    }
+  }
+
+  // index the dataset in the accepted transfer syntax of the presentation context
+  const DcmPresentationContextInfo &presInfo = lookupPresentationContext(*presID);
+  if (cond.good() && presInfo.acceptedTransferSyntax.empty())
+    cond = DIMSE_NOVALIDPRESENTATIONCONTEXTID;
+  if (cond.good())
+  {
+    const E_TransferSyntax xfer = DcmXfer(presInfo.acceptedTransferSyntax.c_str()).getXfer();
+    cond = m_lazyDecoding ? m_rawDataset.index(xfer) : m_rawDataset.finish(xfer);
+  }
+  const size_t length = m_rawDataset.getLength();
+  const OFBool spooled = m_rawDataset.isSpooled();
+  m_traceRecord.datasetSize = OFstatic_cast(Uint32, length);
+  if (cond.good() && !isRawDatasetIndexed())
+  {
+    // e.g. deflated, unsorted, not indexable or only spooled, so the dataset has to be
+    // decoded as a whole
+    cond = m_rawDataset.decodeAll(*dataset);
+    m_rawDataset.clear();
+  }
+
+  if (cond.good())
+  {
+    DCMMPPS_DEBUG("Received dataset on presentation context " << OFstatic_cast(unsigned int, *presID)
+      << " (" << length << " bytes" << (spooled ? " spooled to disk, " : ", ")
+      << m_rawDataset.getNumberOfElements() << " top-level elements indexed)");
   } else {
+    m_rawDataset.clear();
     OFString tempStr;
     DCMNET_ERROR("Unable to receive dataset on presentation context "
       << OFstatic_cast(unsigned int, *presID) << ": " << DimseCondition::dump(tempStr, cond));
@@ -946,6 +1583,159 @@ OFCondition DcmMppsSCP::receiveDIMSEDataset(T_ASC_PresentationContextID *presID,
 
 // ----------------------------------------------------------------------------
 
+OFBool DcmMppsSCP::isRawDatasetIndexed() const
+{
+  return m_lazyDecoding && m_rawDataset.isIndexed();
+}
+
+// ----------------------------------------------------------------------------
+
+OFCondition DcmMppsSCP::decodeInstanceAttributes(DcmDataset &dataset)
+{
+  if (!isRawDatasetIndexed())
+    return EC_Normal;
+  size_t count = 0;
+  const Uint32 *tags = DcmMppsInstance::getUpdateAttributes(count);
+  return m_rawDataset.decodeElements(tags, count, dataset);
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::writeTraceRecord(const T_DIMSE_Message &message,
+                                  const T_ASC_PresentationContextID presID,
+                                  const OFCondition &cond)
+{
+  m_traceRecord.latency = OFstatic_cast(Uint32, DcmMppsTraceFile::getMonotonicTime() - m_traceStart);
+  m_traceRecord.associationID = m_associationCounter;
+  m_traceRecord.commandField = OFstatic_cast(Uint16, message.CommandField);
+  m_traceRecord.presentationContextID = presID;
+  if (cond.bad())
+    m_traceRecord.flags |= DCMMPPS_TRACE_HANDLER_FAILED;
+
+  const char *sopClassUID = "";
+  const char *sopInstanceUID = "";
+  switch (message.CommandField)
+  {
+    case DIMSE_C_ECHO_RQ:
+      m_traceRecord.messageID = message.msg.CEchoRQ.MessageID;
+      sopClassUID = message.msg.CEchoRQ.AffectedSOPClassUID;
+      break;
+    case DIMSE_N_CREATE_RQ:
+      m_traceRecord.messageID = message.msg.NCreateRQ.MessageID;
+      sopClassUID = message.msg.NCreateRQ.AffectedSOPClassUID;
+      if (message.msg.NCreateRQ.opts & O_NCREATE_AFFECTEDSOPINSTANCEUID)
+        sopInstanceUID = message.msg.NCreateRQ.AffectedSOPInstanceUID;
+      break;
+    case DIMSE_N_SET_RQ:
+      m_traceRecord.messageID = message.msg.NSetRQ.MessageID;
+      sopClassUID = message.msg.NSetRQ.RequestedSOPClassUID;
+      sopInstanceUID = message.msg.NSetRQ.RequestedSOPInstanceUID;
+      break;
+    default:
+      // the message ID of unsupported commands is not looked up
+      m_traceRecord.messageID = 0;
+      break;
+  }
+  // fixed-size fields, i.e. padded with NUL bytes but not necessarily terminated
+  strncpy(m_traceRecord.callingAETitle, m_assoc->params->DULparams.callingAPTitle, sizeof(m_traceRecord.callingAETitle));
+  strncpy(m_traceRecord.sopClassUID, sopClassUID, sizeof(m_traceRecord.sopClassUID));
+  strncpy(m_traceRecord.sopInstanceUID, sopInstanceUID, sizeof(m_traceRecord.sopInstanceUID));
+  m_traceFile->write(m_traceRecord);
+}
+
+// ----------------------------------------------------------------------------
+
+Uint64 DcmMppsSCP::recordPhase(const DcmMppsMetricsPhase phase,
+                               const Uint64 start)
+{
+  const Uint64 end = DcmSvcLatencyHistogram::getMonotonicTime();
+  m_counters->phases[phase].record(end - start);
+  if (m_timeline != NULL)
+    m_timeline->addSpan(getPhaseName(phase), "phase", start, end, m_associationCounter, m_messageID);
+  return end - start;
+}
+
+
+void DcmMppsSCP::captureSlowDataset(const Uint16 commandField,
+                                    DcmDataset &dataset)
+{
+  if (!m_slowLog->isSlow(commandField, DcmSvcLatencyHistogram::getMonotonicTime() - m_phaseStart))
+    return;
+  // the size is known if the dataset was received in encoded form, and the index of a
+  // raw dataset is summarized as received, i.e. without decoding it
+  m_slowRecord.datasetSize = m_traceRecord.datasetSize;
+  if (isRawDatasetIndexed())
+    summarizeRawDataset(m_rawDataset, m_slowRecord);
+  else
+    DcmSvcSlowLog::summarizeDataset(dataset, m_slowRecord);
+}
+
+
+void DcmMppsSCP::recordPayload(const DcmMppsMetricsPayload payload,
+                               DcmDataset &dataset)
+{
+  // the size is known if the dataset was received in encoded form, an indexed raw
+  // dataset is profiled from its index only, i.e. without decoding its sequences
+  Uint64 numBytes = m_traceRecord.datasetSize;
+  Uint64 numElements = 0;
+  Uint64 numItems = 0;
+  Uint64 maxDepth = 0;
+  const OFBool decoded = !isRawDatasetIndexed();
+  if (decoded)
+  {
+    if (numBytes == 0)
+      numBytes = dataset.getLength(EXS_LittleEndianExplicit);
+    numElements = dataset.card();
+    measureSequences(dataset, 0, numItems, maxDepth);
+  }
+  else
+    numElements = m_rawDataset.getNumberOfElements();
+  m_counters->payloads[payload].record(numBytes, numElements);
+  if (decoded)
+    m_counters->payloads[payload].recordSequences(numItems, maxDepth);
+  if (m_peer != NULL)
+  {
+    m_peer->payloads[payload].record(numBytes, numElements);
+    if (decoded)
+      m_peer->payloads[payload].recordSequences(numItems, maxDepth);
+  }
+}
+
+
+void DcmMppsSCP::writeSlowRecord(const T_DIMSE_Message &message,
+                                 const Uint64 latency)
+{
+  m_slowRecord.associationID = m_associationCounter;
+  m_slowRecord.messageID = m_messageID;
+  m_slowRecord.commandField = OFstatic_cast(Uint16, message.CommandField);
+  if (m_traceRecord.flags & DCMMPPS_TRACE_RESPONSE_SENT)
+    m_slowRecord.status = m_traceRecord.status;
+  m_slowRecord.latency = latency;
+  m_slowRecord.datasetReceiveTime = m_datasetTime;
+  m_slowRecord.responseSendTime = m_sendTime;
+  m_slowRecord.handlerTime = (latency > m_datasetTime + m_sendTime) ? latency - m_datasetTime - m_sendTime : 0;
+  if (!m_slowRecord.datasetCaptured)
+    m_slowRecord.datasetSize = m_traceRecord.datasetSize;
+  m_slowLog->write(m_slowRecord, getPeerAETitle(), getPeerIP());
+}
+
+
+OFBool DcmMppsSCP::isLogEnabledFor(const OFLogger::LogLevel level) const
+{
+  return (level >= m_debugLevel) || DCM_dcmnetLogger.isEnabledFor(level);
+}
+
+
+void DcmMppsSCP::countCommand(const Uint16 commandField,
+                              const DcmSvcMetricsStatus status)
+{
+  m_counters->countCommand(commandField, status);
+  if (m_peer != NULL)
+    m_peer->countCommand(commandField, status);
+}
+
+// ----------------------------------------------------------------------------
+
 void DcmMppsSCP::setMaxReceivePDULength(const Uint32 maxRecPDU)
 {
   m_cfg->setMaxReceivePDULength(maxRecPDU);
@@ -958,7 +1748,12 @@ OFCondition DcmMppsSCP::addPresentationContext(const OFString &abstractSyntax,
                                            const T_ASC_SC_ROLE role,
                                            const OFString &profile)
 {
-  return m_cfg->addPresentationContext(abstractSyntax, xferSyntaxes, role, profile);
+  OFCondition result = m_cfg->addPresentationContext(abstractSyntax, xferSyntaxes, role, profile);
+  if (result.good())
+    m_negotiationPolicy.addSupportedTransferSyntaxes(abstractSyntax, xferSyntaxes);
+  // cached negotiation results may not reflect the new configuration
+  m_negotiationCache.clear();
+  return result;
 }
 
 // ----------------------------------------------------------------------------
@@ -1034,6 +1829,85 @@ void DcmMppsSCP::setHostLookupEnabled(const OFBool mode)
 
 // ----------------------------------------------------------------------------
 
+void DcmMppsSCP::setInstanceStore(DcmMppsStore *store)
+{
+  m_store = store;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setEventExporter(DcmMppsEventExporter *exporter)
+{
+  m_exporter = exporter;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setAsyncLogger(DcmMppsAsyncLogger *logger)
+{
+  m_asyncLogger = logger;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setTraceFile(DcmMppsTraceFile *traceFile)
+{
+  m_traceFile = traceFile;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setMetrics(DcmMppsMetrics *metrics)
+{
+  m_metrics = metrics;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setTimeline(DcmSvcTimeline *timeline)
+{
+  m_timeline = timeline;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setSlowLog(DcmSvcSlowLog *slowLog)
+{
+  m_slowLog = slowLog;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setDebugFilter(DcmSvcDebugFilter *debugFilter)
+{
+  m_debugFilter = debugFilter;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setLazyDecoding(const OFBool enabled)
+{
+  m_lazyDecoding = enabled;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsSCP::setSpooling(const size_t threshold,
+                             const OFString &directory)
+{
+  m_rawDataset.setSpooling(threshold, directory);
+}
+
+// ----------------------------------------------------------------------------
+
+OFCondition DcmMppsSCP::loadNegotiationPolicy(const OFString &filename)
+{
+  m_negotiationCache.clear();
+  return m_negotiationPolicy.loadFile(filename);
+}
+
+// ----------------------------------------------------------------------------
+
 Uint32 DcmMppsSCP::getMaxReceivePDULength() const
 {
   return m_cfg->getMaxReceivePDULength();
@@ -1111,6 +1985,13 @@ OFBool DcmMppsSCP::getHostLookupEnabled() const
 
 // ----------------------------------------------------------------------------
 
+const DcmSvcNegotiationPolicy &DcmMppsSCP::getNegotiationPolicy() const
+{
+  return m_negotiationPolicy;
+}
+
+// ----------------------------------------------------------------------------
+
 OFBool DcmMppsSCP::isConnected() const
 {
   return (m_assoc != NULL) && (m_assoc->DULassociation != NULL);
@@ -1159,9 +2040,25 @@ void DcmMppsSCP::dropAndDestroyAssociation()
   if (m_assoc)
   {
     notifyAssociationTermination();
+    if ((m_timeline != NULL) && (m_associationStart != 0))
+    {
+      m_timeline->addSpan("association", "association", m_associationStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+        m_associationCounter, 0, -1, m_assoc->params->DULparams.callingAPTitle);
+    }
     ASC_dropSCPAssociation( m_assoc );
     ASC_destroyAssociation( &m_assoc );
   }
+  m_associationStart = 0;
+  m_associationDebugLevel = OFLogger::OFF_LOG_LEVEL;
+  m_debugLevel = OFLogger::OFF_LOG_LEVEL;
+  if (m_peer != NULL)
+  {
+    m_peer->bytesReceived += m_counters->transfer.bytesReceived - m_peerBytesReceived;
+    m_peer->bytesSent += m_counters->transfer.bytesSent - m_peerBytesSent;
+    m_peer->lastSeen = OFstatic_cast(Uint64, time(NULL));
+    m_peer = NULL;
+  }
+  clearPresentationContextTable();
 }
 
 
@@ -1173,6 +2070,13 @@ void DcmMppsSCP::dropAndDestroyAssociation()
 void DcmMppsSCP::notifyAssociationRequest(const T_ASC_Parameters &params,
                                       DcmSCPActionType & /* desiredAction */)
 {
+  // decide once whether the debug output of this association is written regardless of
+  // the log level, so that other associations do not pay for the filter
+  m_associationDebugLevel = (m_debugFilter != NULL)
+    ? m_debugFilter->matchAssociation(params.DULparams.callingAPTitle, params.DULparams.callingPresentationAddress)
+    : OFLogger::OFF_LOG_LEVEL;
+  m_debugLevel = m_associationDebugLevel;
+
   // Dump some information if required
   DCMNET_INFO("Association Received " << params.DULparams.callingPresentationAddress << ": "
                                       << params.DULparams.callingAPTitle << " -> "
@@ -1183,7 +2087,7 @@ void DcmMppsSCP::notifyAssociationRequest(const T_ASC_Parameters &params,
   if (m_cfg->getVerbosePCMode())
     DCMNET_INFO("Incoming Association Request:" << OFendl << ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RQ));
   else
-    DCMNET_DEBUG("Incoming Association Request:" << OFendl << ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RQ));
+    DCMMPPS_DEBUG("Incoming Association Request:" << OFendl << ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RQ));
 }
 
 // ----------------------------------------------------------------------------
@@ -1212,7 +2116,7 @@ OFBool DcmMppsSCP::checkCallingHostAccepted(const OFString& /*hostOrIP*/)
 
 void DcmMppsSCP::notifyAssociationAcknowledge()
 {
-  DCMNET_DEBUG("DcmSCP: Association Acknowledged");
+  DCMMPPS_DEBUG("DcmSCP: Association Acknowledged");
 }
 
 // ----------------------------------------------------------------------------
@@ -1233,7 +2137,13 @@ void DcmMppsSCP::notifyAbortRequest()
 
 void DcmMppsSCP::notifyAssociationTermination()
 {
-  DCMNET_DEBUG("DcmSCP: Association Terminated");
+  DCMMPPS_DEBUG("DcmSCP: Association Terminated");
+  DCMMPPS_DEBUG("Dataset pool: " << m_datasetPool.getNumberOfAcquisitions() << " datasets used, "
+    << m_datasetPool.getNumberOfContainerAllocations() << " container allocations");
+  OFString counters;
+  DCMMPPS_DEBUG("Accepted transfer syntaxes:" << OFendl << m_negotiationPolicy.dumpCounters(counters));
+  DCMMPPS_DEBUG("Negotiation cache: " << m_negotiationCache.getHits() << " hits, "
+    << m_negotiationCache.getMisses() << " misses");
 }
 
 // ----------------------------------------------------------------------------
@@ -1241,7 +2151,7 @@ void DcmMppsSCP::notifyAssociationTermination()
 void DcmMppsSCP::notifyDIMSEError(const OFCondition &cond)
 {
   OFString tempStr;
-  DCMNET_DEBUG("DIMSE Error, detail (if available): " << DimseCondition::dump(tempStr, cond));
+  DCMMPPS_DEBUG("DIMSE Error, detail (if available): " << DimseCondition::dump(tempStr, cond));
 }
 
 // ----------------------------------------------------------------------------
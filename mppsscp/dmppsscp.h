@@ -31,6 +31,21 @@
 #include "dcmtk/dcmnet/scpcfg.h"
 #include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_WARN() */
 
+#include "dmppsval.h"               /* for DcmMppsValidator */
+#include "dmppsstor.h"              /* for DcmMppsStore */
+#include "dmppsexp.h"               /* for DcmMppsEventExporter */
+#include "dmppslog.h"               /* for DcmMppsAsyncLogger */
+#include "dmppstrace.h"             /* for DcmMppsTraceFile */
+#include "dmppsmetr.h"              /* for DcmMppsMetrics */
+#include "dsvctime.h"               /* for DcmSvcTimeline */
+#include "dsvcslow.h"               /* for DcmSvcSlowLog */
+#include "dsvcdbg.h"                /* for DcmSvcDebugFilter */
+#include "dmppspool.h"              /* for DcmDatasetPool */
+#include "dsvcrsp.h"                /* for DcmSvcResponseTemplate */
+#include "dsvcneg.h"                /* for DcmSvcNegotiationPolicy */
+
+class DcmSvcTransportLayer;
+
 /** Action codes that can be given to DcmSCP to control behavior during SCP's operation.
  *  Different hooks permit jumping into different phases of SCP operation.
  */
@@ -227,6 +242,94 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
   */
   void setCommitWaitTimeout(const Uint32 timeout);
 
+  /** Set the store that keeps track of the received MPPS instances. If a store is set,
+   *  N-CREATE requests for existing instances and N-SET requests for unknown or already
+   *  completed instances are rejected.
+   *  @param store [in] The store to be used, NULL for none. The store is not owned by
+   *                    the SCP and must exist as long as the SCP is running.
+   */
+  void setInstanceStore(DcmMppsStore *store);
+
+  /** Set the exporter that receives an event for each accepted N-CREATE and N-SET
+   *  @param exporter [in] The exporter to be used, NULL for none. The exporter is not
+   *                       owned by the SCP and must exist as long as the SCP is running.
+   */
+  void setEventExporter(DcmMppsEventExporter *exporter);
+
+  /** Set the logger that dumps received N-CREATE and N-SET requests (with their
+   *  datasets) in its writer thread instead of the network thread
+   *  @param logger [in] The logger to be used, NULL to dump synchronously. The logger is
+   *                     not owned by the SCP and must exist as long as the SCP is running.
+   */
+  void setAsyncLogger(DcmMppsAsyncLogger *logger);
+
+  /** Set the file that receives a binary trace record (see DcmMppsTraceRecord) for each
+   *  handled request. While tracing, datasets are always received in encoded form first
+   *  (see receiveRawDataset()), so that their size is known.
+   *  @param traceFile [in] The opened trace file, NULL for no trace. The file is not
+   *                        owned by the SCP and must exist as long as the SCP is running.
+   */
+  void setTraceFile(DcmMppsTraceFile *traceFile);
+
+  /** Set the metrics that count associations, handled requests and network traffic.
+   *  The SCP counts in the counters of the thread calling listen().
+   *  @param metrics [in] The metrics, NULL for no metrics. The metrics are not owned
+   *                      by the SCP and must exist as long as the SCP is running.
+   */
+  void setMetrics(DcmMppsMetrics *metrics);
+
+  /** Set the timeline that receives a span for each association, each handled request
+   *  and each of their phases (see DcmMppsMetricsPhase), on the track of the thread
+   *  calling listen()
+   *  @param timeline [in] The opened timeline, NULL for no timeline. The timeline is not
+   *                       owned by the SCP and must exist as long as the SCP is running.
+   */
+  void setTimeline(DcmSvcTimeline *timeline);
+
+  /** Set the log that receives a diagnostic record (see DcmSvcSlowRecord) for each
+   *  request exceeding the threshold of its DIMSE operation. The top-level elements of
+   *  the dataset are only summarized once the request is known to be slow.
+   *  @param slowLog [in] The opened log, NULL for no log. The log is not owned by the
+   *                      SCP and must exist as long as the SCP is running.
+   */
+  void setSlowLog(DcmSvcSlowLog *slowLog);
+
+  /** Set the filter selecting the associations and requests whose debug output is
+   *  written regardless of the log level of dcmnet (see DcmSvcDebugFilter). The peer
+   *  rules are evaluated once per association, the instance rules once per request.
+   *  @param debugFilter [in] The filter, NULL for none. The filter is not owned by the
+   *                          SCP and must exist as long as the SCP is running.
+   */
+  void setDebugFilter(DcmSvcDebugFilter *debugFilter);
+
+  /** Enable or disable lazy decoding of received datasets. If enabled, N-CREATE and
+   *  N-SET datasets are kept in their encoded form with an index of their top-level
+   *  elements. They are validated on the index, and only the attributes needed by the
+   *  store and the exporter are decoded. Datasets that cannot be indexed (deflated or
+   *  not sorted by tag) are decoded completely as before.
+   *  @param enabled [in] OFTrue to enable lazy decoding, OFFalse to decode completely
+   */
+  void setLazyDecoding(const OFBool enabled);
+
+  /** Enable or disable spooling of large received datasets. A N-CREATE or N-SET dataset
+   *  larger than the threshold is written to a spool file in the given directory while
+   *  its PDVs arrive, and parsed (or indexed, see setLazyDecoding()) from a memory-mapped
+   *  view of the file. This bounds the memory used for receiving a dataset by the
+   *  threshold, since the pages of the mapping can be reclaimed by the kernel.
+   *  @param threshold [in] size in bytes above which a dataset is spooled, 0 to receive
+   *                        all datasets in memory
+   *  @param directory [in] directory for the spool files (which are unlinked immediately)
+   */
+  void setSpooling(const size_t threshold,
+                   const OFString &directory);
+
+  /** Load transfer syntax rankings (in general and per calling AE title) that replace
+   *  the configuration order, see DcmSvcNegotiationPolicy::loadFile()
+   *  @param filename [in] The negotiation policy file
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition loadNegotiationPolicy(const OFString &filename);
+
   /* Get methods for SCP settings */
 
   /** Returns TCP/IP port number SCP listens for new connection requests
@@ -289,6 +392,12 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
    */
   OFBool getHostLookupEnabled() const;
 
+  /** Returns the transfer syntax negotiation policy, e.g.\ for its counters of
+   *  accepted transfer syntaxes
+   *  @return The negotiation policy
+   */
+  const DcmSvcNegotiationPolicy &getNegotiationPolicy() const;
+
   /* ************************************************************* */
   /*  Methods for receiving runtime (i.e. connection time) infos   */
   /* ************************************************************* */
@@ -345,6 +454,22 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
                                OFString &abstractSyntax,
                                OFString &transferSyntax);
 
+  /** Fill the table of accepted presentation contexts of the current association,
+   *  called once after the association has been acknowledged
+   */
+  void buildPresentationContextTable();
+
+  /** Remove all entries from the table of accepted presentation contexts
+   */
+  void clearPresentationContextTable();
+
+  /** Look up an accepted presentation context of the current association in the table
+   *  @param presID [in] The presentation context ID to look for
+   *  @return The presentation context, an entry with ID 0 (and empty syntaxes) if no
+   *    presentation context with this ID has been accepted
+   */
+  const DcmPresentationContextInfo &lookupPresentationContext(const T_ASC_PresentationContextID presID) const;
+
   /** Aborts the current association by sending an A-ABORT request to the SCU.
    *  This method allows derived classes to abort an association in case of severe errors.
    *  @return status, EC_Normal if successful, an error code otherwise
@@ -464,11 +589,14 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
    *  @param reqMessage    [in] The N-CREATE request that should be responded to
    *  @param rspStatusCode [in] The response status code. 0 means success,
    *                            others can found in the DICOM standard.
+   *  @param statusDetail  [in] The status detail of the response (if desired),
+   *                            e.g.\ the list of offending elements.
    *  @return EC_Normal, if responding was successful, an error code otherwise
    */
   virtual OFCondition sendCREATEResponse(const T_ASC_PresentationContextID presID,
                                         const T_DIMSE_N_CreateRQ &reqMessage,
-                                        const Uint16 rspStatusCode);
+                                        const Uint16 rspStatusCode,
+                                        DcmDataset *statusDetail = NULL);
 
   // -- N-SET --
 
@@ -490,11 +618,14 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
    *  @param reqMessage    [in] The N-SET request that should be responded to
    *  @param rspStatusCode [in] The response status code. 0 means success,
    *                            others can found in the DICOM standard.
+   *  @param statusDetail  [in] The status detail of the response (if desired),
+   *                            e.g.\ the list of offending elements.
    *  @return EC_Normal, if responding was successful, an error code otherwise
    */
   virtual OFCondition sendSETResponse(const T_ASC_PresentationContextID presID,
                                         const T_DIMSE_N_SetRQ &reqMessage,
-                                        const Uint16 rspStatusCode);
+                                        const Uint16 rspStatusCode,
+                                        DcmDataset *statusDetail = NULL);
 
   /* ********************************************************************* */
   /*  Further functions and member variables                               */
@@ -574,6 +705,26 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
                                DcmDataset *statusDetail = NULL,
                                DcmDataset **commandSet = NULL);
 
+  /** Send a C-ECHO, N-CREATE or N-SET response. A response without status detail is
+   *  sent from a pre-encoded command template (see DcmSvcResponseTemplate), all other
+   *  messages via sendDIMSEMessage().
+   *  @param presID       [in] Presentation context ID to be used for message
+   *  @param message      [in] The response message, without dataset
+   *  @param statusDetail [in] The status detail of the response, NULL if none
+   *  @return Returns EC_Normal if sending response was successful, an error code otherwise
+   */
+  OFCondition sendDIMSEResponse(const T_ASC_PresentationContextID presID,
+                                T_DIMSE_Message *message,
+                                DcmDataset *statusDetail);
+
+  /** Send an encoded command set in a single PDV
+   *  @param presID  [in] Presentation context ID to be used for message
+   *  @param command [in] The encoded command set
+   *  @return Returns EC_Normal if sending was successful, an error code otherwise
+   */
+  OFCondition sendEncodedCommand(const T_ASC_PresentationContextID presID,
+                                 const DcmSvcResponseTemplate &command);
+
   /** Receive DIMSE command (excluding dataset!) over the currently open association
    *  @param presID       [out] Contains in the end the ID of the presentation context
    *                            which was specified in the DIMSE command received
@@ -615,6 +766,92 @@ class DCMTK_DCMNET_EXPORT DcmMppsSCP
   OFCondition receiveDIMSEDataset(T_ASC_PresentationContextID *presID,
                                   DcmDataset **dataObject);
 
+  /** Receive one dataset without decoding it (lazy decoding, see setLazyDecoding()).
+   *  The received PDV fragments are collected in the raw dataset of the SCP (spooled to
+   *  disk above the spool threshold, see setSpooling()) and indexed. Without lazy
+   *  decoding, the dataset is decoded completely and the raw dataset is cleared.
+   *  @param presID  [out]   Contains in the end the ID of the presentation context
+   *                         which was used in the PDVs that were received
+   *  @param dataset [inout] The dataset to decode into if the raw dataset cannot be
+   *                         indexed, left unchanged otherwise
+   *  @return EC_Normal if dataset could be received successfully, an error code otherwise
+   */
+  OFCondition receiveRawDataset(T_ASC_PresentationContextID *presID,
+                                DcmDataset *dataset);
+
+  /** Check whether the last received dataset is kept undecoded
+   *  @return OFTrue if lazy decoding is enabled and the raw dataset is indexed
+   */
+  OFBool isRawDatasetIndexed() const;
+
+  /** Decode the attributes needed for the store and the exporter (see
+   *  DcmMppsInstance::getUpdateAttributes()) from the raw dataset, if the last received
+   *  dataset is kept undecoded
+   *  @param dataset [inout] The dataset to insert the decoded attributes into
+   *  @return EC_Normal if successful or not needed, an error code otherwise
+   */
+  OFCondition decodeInstanceAttributes(DcmDataset &dataset);
+
+  /** Complete the trace record of a handled request and write it to the trace file
+   *  @param message [in] The request, after handling (i.e.\ with the SOP Instance UID
+   *                      assigned by the SCP, if any)
+   *  @param presID  [in] The presentation context ID of the request
+   *  @param cond    [in] The result of handling the request
+   */
+  void writeTraceRecord(const T_DIMSE_Message &message,
+                        const T_ASC_PresentationContextID presID,
+                        const OFCondition &cond);
+
+  /** Record the duration of a phase (up to now) in the counters of the SCP thread and
+   *  on the timeline, if any
+   *  @param phase [in] The phase
+   *  @param start [in] Start of the phase, see DcmSvcLatencyHistogram::getMonotonicTime()
+   *  @return the duration in microseconds
+   */
+  Uint64 recordPhase(const DcmMppsMetricsPhase phase,
+                     const Uint64 start);
+
+  /** Summarize the dataset of the request being handled in the slow operation record,
+   *  if the request has already exceeded its threshold. Must be called before the
+   *  dataset and the raw dataset are released.
+   *  @param commandField [in] Command field of the request
+   *  @param dataset      [in] The received dataset, used if the raw dataset is not indexed
+   */
+  void captureSlowDataset(const Uint16 commandField,
+                          DcmDataset &dataset);
+
+  /** Record the size and shape of the dataset of the request being handled in the
+   *  counters of the SCP thread and of the peer. Must be called before the dataset and
+   *  the raw dataset are released.
+   *  @param payload [in] The kind of request
+   *  @param dataset [in] The received dataset, used if the raw dataset is not indexed
+   */
+  void recordPayload(const DcmMppsMetricsPayload payload,
+                     DcmDataset &dataset);
+
+  /** Complete the slow operation record of a handled request and write it to the log
+   *  @param message [in] The request
+   *  @param latency [in] Time from receiving the command to the end of the handling,
+   *                      microseconds
+   */
+  void writeSlowRecord(const T_DIMSE_Message &message,
+                       const Uint64 latency);
+
+  /** Check whether debug output of the given level is written for the association or
+   *  request being handled, i.e.\ whether it matches the debug filter with that level
+   *  or the level is enabled for dcmnet anyway
+   *  @param level [in] The log level, debug or trace
+   *  @return OFTrue if enabled, OFFalse otherwise
+   */
+  OFBool isLogEnabledFor(const OFLogger::LogLevel level) const;
+
+  /** Count a handled request in the counters of the SCP thread and of the peer
+   *  @param commandField [in] Command field of the request or of its response
+   *  @param status       [in] Class of the response status
+   */
+  void countCommand(const Uint16 commandField,
+                    const DcmSvcMetricsStatus status);
+
 private:
 
   /// Current association run by this SCP
@@ -625,6 +862,110 @@ private:
   /// it, e.g. in the context of the DcmSCPPool class.
   DcmSharedSCPConfig m_cfg;
 
+  /// Accepted presentation contexts of the current association, indexed by their ID,
+  /// i.e.\ entries that are not used (including entry 0) have ID 0
+  DcmPresentationContextInfo m_presentationContexts[256];
+
+  /// Store of MPPS instances (not owned), NULL if not used
+  DcmMppsStore *m_store;
+
+  /// Exporter for accepted MPPS events (not owned), NULL if not used
+  DcmMppsEventExporter *m_exporter;
+
+  /// Logger for deferred message dumps (not owned), NULL if dumped synchronously
+  DcmMppsAsyncLogger *m_asyncLogger;
+
+  /// Trace file for handled requests (not owned), NULL if not traced
+  DcmMppsTraceFile *m_traceFile;
+
+  /// Trace record of the request being handled
+  DcmMppsTraceRecord m_traceRecord;
+
+  /// Monotonic time (in microseconds) the request being handled was received
+  Uint64 m_traceStart;
+
+  /// Number of association requests received so far, identifies the current association
+  /// in the trace, the probes and the timeline
+  Uint32 m_associationCounter;
+
+  /// Message ID of the request being handled (0 if not looked up), for the probes and the timeline
+  Uint16 m_messageID;
+
+  /// Timeline (not owned), NULL if not used
+  DcmSvcTimeline *m_timeline;
+
+  /// Monotonic time (in microseconds) the connection of the current association was accepted, 0 if none
+  Uint64 m_associationStart;
+
+  /// Log of slow operations (not owned), NULL if not used
+  DcmSvcSlowLog *m_slowLog;
+
+  /// Slow operation record of the request being handled
+  DcmSvcSlowRecord m_slowRecord;
+
+  /// Filter for targeted debug output (not owned), NULL if not used
+  DcmSvcDebugFilter *m_debugFilter;
+
+  /// Debug level of the current association as matched by the filter, OFF_LOG_LEVEL if none
+  OFLogger::LogLevel m_associationDebugLevel;
+
+  /// Debug level of the association or request being handled, OFF_LOG_LEVEL if none
+  OFLogger::LogLevel m_debugLevel;
+
+  /// Metrics (not owned), NULL if not used
+  DcmMppsMetrics *m_metrics;
+
+  /// Counters used if no metrics are set (or the metrics have no room for this thread)
+  DcmSvcMetricsCounters m_localCounters;
+
+  /// Counters of the SCP thread, never NULL
+  DcmSvcMetricsCounters *m_counters;
+
+  /// Transport layer of the network while listening (owned by the network), else NULL
+  DcmSvcTransportLayer *m_transportLayer;
+
+  /// Monotonic time (in microseconds) the association request or command being handled was received
+  Uint64 m_phaseStart;
+
+  /// Time (in microseconds) spent receiving the dataset of the request being handled
+  Uint64 m_datasetTime;
+
+  /// Time (in microseconds) spent sending the response to the request being handled
+  Uint64 m_sendTime;
+
+  /// Counters of the peer of the current association (owned by m_counters), NULL if none
+  DcmSvcPeerCounters *m_peer;
+
+  /// Bytes received by the SCP thread before the current association
+  Uint64 m_peerBytesReceived;
+
+  /// Bytes sent by the SCP thread before the current association
+  Uint64 m_peerBytesSent;
+
+  /// Reusable datasets for received N-CREATE and N-SET requests
+  DcmDatasetPool m_datasetPool;
+
+  /// OFTrue if received datasets are decoded lazily
+  OFBool m_lazyDecoding;
+
+  /// Pre-encoded C-ECHO response
+  DcmSvcResponseTemplate m_echoResponse;
+
+  /// Pre-encoded N-CREATE response
+  DcmSvcResponseTemplate m_createResponse;
+
+  /// Pre-encoded N-SET response
+  DcmSvcResponseTemplate m_setResponse;
+
+  /// Last received dataset in encoded form (lazy decoding or spooling), reused for each message
+  DcmMppsRawDataset m_rawDataset;
+
+  /// Selects the transfer syntax of each accepted presentation context
+  DcmSvcNegotiationPolicy m_negotiationPolicy;
+
+  /// Negotiation results of earlier association requests
+  DcmSvcNegotiationCache m_negotiationCache;
+
   /** Drops association and clears internal structures to free memory
    */
   void dropAndDestroyAssociation();
@@ -0,0 +1,854 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: In-memory store and secondary indexes for MPPS instances
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppsstor.h"
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_WARN() */
+
+#include <time.h>                   /* for clock_gettime() */
+
+/* top-level attributes used by DcmMppsInstance::update(), sorted by tag */
+static const Uint32 updateAttributes[] =
+{
+  DCMMPPS_TAG(0x0008, 0x0060),  // Modality
+  DCMMPPS_TAG(0x0010, 0x0010),  // Patient's Name
+  DCMMPPS_TAG(0x0010, 0x0020),  // Patient ID
+  DCMMPPS_TAG(0x0040, 0x0241),  // Performed Station AE Title
+  DCMMPPS_TAG(0x0040, 0x0244),  // Performed Procedure Step Start Date
+  DCMMPPS_TAG(0x0040, 0x0245),  // Performed Procedure Step Start Time
+  DCMMPPS_TAG(0x0040, 0x0250),  // Performed Procedure Step End Date
+  DCMMPPS_TAG(0x0040, 0x0251),  // Performed Procedure Step End Time
+  DCMMPPS_TAG(0x0040, 0x0252),  // Performed Procedure Step Status
+  DCMMPPS_TAG(0x0040, 0x0253),  // Performed Procedure Step ID
+  DCMMPPS_TAG(0x0040, 0x0270)   // Scheduled Step Attributes Sequence
+};
+
+/* copy the value of an attribute, if present in the dataset */
+static void copyValue(DcmItem &dataset,
+                      const DcmTagKey &tagKey,
+                      OFString &value)
+{
+  OFString newValue;
+  if (dataset.findAndGetOFStringArray(tagKey, newValue).good())
+    value = newValue;
+}
+
+
+void DcmMppsInstance::update(DcmItem &dataset)
+{
+  DcmElement *element = NULL;
+  if (dataset.findAndGetElement(DCM_PerformedProcedureStepStatus, element).good() && (element->getLength() > 0))
+    status = DcmMppsValidator::classifyStepStatus(*element);
+
+  copyValue(dataset, DCM_PatientID, patientID);
+  copyValue(dataset, DCM_PatientName, patientName);
+  copyValue(dataset, DCM_PerformedStationAETitle, stationAETitle);
+  copyValue(dataset, DCM_Modality, modality);
+  copyValue(dataset, DCM_PerformedProcedureStepID, procedureStepID);
+  copyValue(dataset, DCM_PerformedProcedureStepStartDate, startDate);
+  copyValue(dataset, DCM_PerformedProcedureStepStartTime, startTime);
+  copyValue(dataset, DCM_PerformedProcedureStepEndDate, endDate);
+  copyValue(dataset, DCM_PerformedProcedureStepEndTime, endTime);
+
+  // collect the (distinct) accession numbers of all scheduled steps
+  DcmSequenceOfItems *sequence = NULL;
+  if (dataset.findAndGetSequence(DCM_ScheduledStepAttributesSequence, sequence).good() && (sequence != NULL))
+  {
+    accessionNumbers.clear();
+    const unsigned long count = sequence->card();
+    for (unsigned long i = 0; i < count; i++)
+    {
+      OFString accessionNumber;
+      if (sequence->getItem(i)->findAndGetOFString(DCM_AccessionNumber, accessionNumber).good() && !accessionNumber.empty())
+      {
+        OFBool found = OFFalse;
+        for (size_t j = 0; (j < accessionNumbers.size()) && !found; j++)
+          found = (accessionNumbers[j] == accessionNumber);
+        if (!found)
+          accessionNumbers.push_back(accessionNumber);
+      }
+    }
+  }
+}
+
+
+const Uint32 *DcmMppsInstance::getUpdateAttributes(size_t &count)
+{
+  count = sizeof(updateAttributes) / sizeof(updateAttributes[0]);
+  return updateAttributes;
+}
+
+
+const char *DcmMppsInstance::statusName(const DcmMppsStepStatus status)
+{
+  switch (status)
+  {
+    case DCMMPPS_STATUS_IN_PROGRESS:
+      return "IN PROGRESS";
+    case DCMMPPS_STATUS_COMPLETED:
+      return "COMPLETED";
+    case DCMMPPS_STATUS_DISCONTINUED:
+      return "DISCONTINUED";
+    case DCMMPPS_STATUS_INVALID:
+      return "INVALID";
+    default:
+      return "";
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmMppsRecordList::append(DcmMppsRecord *record)
+{
+  record->agePrev = tail;
+  record->ageNext = NULL;
+  if (tail != NULL)
+    tail->ageNext = record;
+  else
+    head = record;
+  tail = record;
+}
+
+
+void DcmMppsRecordList::remove(DcmMppsRecord *record)
+{
+  if (record->agePrev != NULL)
+    record->agePrev->ageNext = record->ageNext;
+  else
+    head = record->ageNext;
+  if (record->ageNext != NULL)
+    record->ageNext->agePrev = record->agePrev;
+  else
+    tail = record->agePrev;
+  record->agePrev = NULL;
+  record->ageNext = NULL;
+}
+
+// ----------------------------------------------------------------------------
+
+#define WHEEL_SLOTS (1 << DCMMPPS_WHEEL_BITS)
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+
+DcmMppsTimerWheel::DcmMppsTimerWheel()
+  : m_current(0)
+{
+  for (int level = 0; level < DCMMPPS_WHEEL_LEVELS; level++)
+    for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+      m_slots[level][slot] = NULL;
+}
+
+
+void DcmMppsTimerWheel::schedule(DcmMppsRecord *record,
+                                 const Uint32 expiry)
+{
+  cancel(record);
+  // the slot of the current tick has already been processed
+  record->expiry = (expiry > m_current) ? expiry : m_current + 1;
+  insert(record);
+}
+
+
+void DcmMppsTimerWheel::cancel(DcmMppsRecord *record)
+{
+  if (record->timerSlot == NULL)
+    return;
+  if (record->timerPrev != NULL)
+    record->timerPrev->timerNext = record->timerNext;
+  else
+    *record->timerSlot = record->timerNext;
+  if (record->timerNext != NULL)
+    record->timerNext->timerPrev = record->timerPrev;
+  record->timerNext = NULL;
+  record->timerPrev = NULL;
+  record->timerSlot = NULL;
+}
+
+
+void DcmMppsTimerWheel::insert(DcmMppsRecord *record)
+{
+  // the level is determined by the remaining time, the slot by the expiry itself.
+  // Records that are due (only while cascading) go to the slot of the current tick,
+  // which is processed right after the cascade.
+  Uint32 delta = (record->expiry > m_current) ? record->expiry - m_current : 0;
+  Uint32 expiry = m_current + delta;
+  int level = 0;
+  while ((level < DCMMPPS_WHEEL_LEVELS - 1) && (delta >> (DCMMPPS_WHEEL_BITS * (level + 1))) != 0)
+    ++level;
+  if ((delta >> (DCMMPPS_WHEEL_BITS * (level + 1))) != 0)
+  {
+    // beyond the range of the wheel: park in the farthest slot, the record is
+    // cascaded (and parked again) until its expiry is in range
+    expiry = m_current + (1UL << (DCMMPPS_WHEEL_BITS * DCMMPPS_WHEEL_LEVELS)) - 1;
+  }
+  DcmMppsRecord **slot = &m_slots[level][(expiry >> (DCMMPPS_WHEEL_BITS * level)) & WHEEL_MASK];
+  record->timerSlot = slot;
+  record->timerPrev = NULL;
+  record->timerNext = *slot;
+  if (*slot != NULL)
+    (*slot)->timerPrev = record;
+  *slot = record;
+}
+
+
+void DcmMppsTimerWheel::advance(const Uint32 now,
+                                OFVector<DcmMppsRecord *> &expired)
+{
+  while (m_current != now)
+  {
+    ++m_current;
+    // whenever a level wraps around, move the records of the next slot of the
+    // coarser level down to the finer levels
+    for (int level = 1; level < DCMMPPS_WHEEL_LEVELS; level++)
+    {
+      if ((m_current & ((1UL << (DCMMPPS_WHEEL_BITS * level)) - 1)) != 0)
+        break;
+      DcmMppsRecord **slot = &m_slots[level][(m_current >> (DCMMPPS_WHEEL_BITS * level)) & WHEEL_MASK];
+      DcmMppsRecord *record = *slot;
+      *slot = NULL;
+      while (record != NULL)
+      {
+        DcmMppsRecord *next = record->timerNext;
+        insert(record);
+        record = next;
+      }
+    }
+    // collect the records that are due now
+    DcmMppsRecord **slot = &m_slots[0][m_current & WHEEL_MASK];
+    DcmMppsRecord *record = *slot;
+    *slot = NULL;
+    while (record != NULL)
+    {
+      DcmMppsRecord *next = record->timerNext;
+      record->timerNext = NULL;
+      record->timerPrev = NULL;
+      record->timerSlot = NULL;
+      if (record->expiry > m_current)
+        insert(record);
+      else
+        expired.push_back(record);
+      record = next;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+DcmMppsRecordArena::DcmMppsRecordArena()
+  : m_blocks()
+  , m_freeList(NULL)
+  , m_numFree(0)
+{
+}
+
+
+DcmMppsRecordArena::~DcmMppsRecordArena()
+{
+  for (size_t i = 0; i < m_blocks.size(); i++)
+    delete[] m_blocks[i];
+}
+
+
+DcmMppsRecord *DcmMppsRecordArena::allocate()
+{
+  if (m_freeList == NULL)
+  {
+    // allocate a new block and put all its records on the free list
+    DcmMppsRecord *block = new DcmMppsRecord[DCMMPPS_ARENA_BLOCK_SIZE];
+    m_blocks.push_back(block);
+    for (size_t i = 0; i < DCMMPPS_ARENA_BLOCK_SIZE; i++)
+    {
+      block[i].ageNext = m_freeList;
+      m_freeList = &block[i];
+    }
+    m_numFree += DCMMPPS_ARENA_BLOCK_SIZE;
+  }
+  DcmMppsRecord *record = m_freeList;
+  m_freeList = record->ageNext;
+  --m_numFree;
+  record->ageNext = NULL;
+  return record;
+}
+
+
+void DcmMppsRecordArena::release(DcmMppsRecord *record)
+{
+  // reset the record, so that it does not keep any of the old values
+  *record = DcmMppsRecord();
+  record->ageNext = m_freeList;
+  m_freeList = record;
+  ++m_numFree;
+}
+
+
+size_t DcmMppsRecordArena::getNumberOfFreeRecords() const
+{
+  return m_numFree;
+}
+
+
+size_t DcmMppsRecordArena::getNumberOfBlocks() const
+{
+  return m_blocks.size();
+}
+
+// ----------------------------------------------------------------------------
+
+DcmMppsStoreShard::DcmMppsStoreShard()
+  : m_lock()
+  , m_readLocks(0)
+  , m_readContentions(0)
+  , m_writeLocks(0)
+  , m_writeContentions(0)
+  , m_arena()
+  , m_instances()
+  , m_patientIndex()
+  , m_accessionIndex()
+  , m_stationIndex()
+  , m_statusIndex()
+  , m_startDateIndex()
+  , m_wheel()
+  , m_activeRecords()
+  , m_finalRecords()
+  , m_finalTimeout(0)
+  , m_staleTimeout(0)
+  , m_maxMemory(0)
+  , m_memoryUsage(0)
+  , m_startTime(0)
+{
+  m_startTime = OFstatic_cast(long, currentTick());
+}
+
+
+DcmMppsStoreShard::~DcmMppsStoreShard()
+{
+  // the records are freed by the arena
+}
+
+
+void DcmMppsStoreShard::setRetention(const Uint32 finalTimeout,
+                                     const Uint32 staleTimeout)
+{
+  m_lock.wrlock();
+  m_finalTimeout = finalTimeout;
+  m_staleTimeout = staleTimeout;
+  m_lock.wrunlock();
+}
+
+
+void DcmMppsStoreShard::setMemoryLimit(const size_t maxMemory)
+{
+  m_lock.wrlock();
+  m_maxMemory = maxMemory;
+  m_lock.wrunlock();
+}
+
+
+void DcmMppsStoreShard::expireInstances()
+{
+  const Uint32 now = currentTick();
+  lockWrite();
+  applyRetention(now);
+  m_lock.wrunlock();
+}
+
+
+Uint16 DcmMppsStoreShard::createInstance(const OFString &sopInstanceUID,
+                                         DcmItem &dataset,
+                                         DcmMppsInstance *snapshot,
+                                         const DcmMppsValidationResult *validation)
+{
+  // extract the attributes before acquiring the lock
+  DcmMppsInstance instance;
+  instance.sopInstanceUID = sopInstanceUID;
+  instance.update(dataset);
+
+  Uint16 result = STATUS_Success;
+  const Uint32 now = currentTick();
+  lockWrite();
+  if (m_instances.find(sopInstanceUID) != m_instances.end())
+    result = STATUS_N_DuplicateSOPInstance;
+  else
+  {
+    DcmMppsRecord *record = m_arena.allocate();
+    record->instance = instance;
+    if (validation != NULL)
+      DcmMppsValidator::mergeAttributes(record->presentAttributes, record->valuedAttributes, *validation);
+    record->memoryUsage = estimateMemoryUsage(*record);
+    // expire old records and make room for the new one before it is inserted, so that
+    // it can never be evicted itself
+    if (!applyRetention(now, record->memoryUsage))
+    {
+      m_arena.release(record);
+      result = STATUS_N_ProcessingFailure;
+    }
+    else
+    {
+      m_instances.insert(InstanceMap::value_type(sopInstanceUID, record));
+      addToIndexes(record);
+      m_activeRecords.append(record);
+      if (m_staleTimeout > 0)
+        m_wheel.schedule(record, now + m_staleTimeout);
+      m_memoryUsage += record->memoryUsage;
+      if (snapshot != NULL)
+        *snapshot = record->instance;
+    }
+  }
+  m_lock.wrunlock();
+
+  if (result == STATUS_N_DuplicateSOPInstance)
+    DCMNET_WARN("MPPS instance " << sopInstanceUID << " already exists");
+  else if (result == STATUS_N_ProcessingFailure)
+    DCMNET_WARN("MPPS store memory limit exceeded, instance " << sopInstanceUID << " not stored");
+  return result;
+}
+
+
+Uint16 DcmMppsStoreShard::updateInstance(const OFString &sopInstanceUID,
+                                         DcmItem &dataset,
+                                         DcmMppsInstance *snapshot,
+                                         DcmMppsStepStatus *previousStatus,
+                                         DcmMppsValidationResult *validation)
+{
+  // extract the attributes before acquiring the lock
+  DcmMppsInstance changes;
+  changes.update(dataset);
+
+  Uint16 result = STATUS_Success;
+  const Uint32 now = currentTick();
+  lockWrite();
+  applyRetention(now);
+  InstanceMap::iterator it = m_instances.find(sopInstanceUID);
+  if (it == m_instances.end())
+    result = STATUS_N_NoSuchObjectInstance;
+  else if (it->second->instance.isFinal())
+    result = STATUS_N_ProcessingFailure;
+  else if ((validation != NULL) &&
+           (DcmMppsValidator::checkFinalState(it->second->presentAttributes, it->second->valuedAttributes, *validation) != STATUS_Success))
+  {
+    // the final state requirements apply to the instance, not only to this request
+    result = validation->status;
+  }
+  else
+  {
+    DcmMppsRecord *record = it->second;
+    if (validation != NULL)
+      DcmMppsValidator::mergeAttributes(record->presentAttributes, record->valuedAttributes, *validation);
+    DcmMppsInstance &instance = record->instance;
+    if (previousStatus != NULL)
+      *previousStatus = instance.status;
+    // only attributes that are allowed in an N-SET are taken over, so the status
+    // index is the only one that may have to be updated
+    if ((changes.status != DCMMPPS_STATUS_ABSENT) && (changes.status != instance.status))
+    {
+      m_statusIndex.erase(IndexEntry(DcmMppsInstance::statusName(instance.status), record));
+      instance.status = changes.status;
+      m_statusIndex.insert(IndexEntry(DcmMppsInstance::statusName(instance.status), record));
+    }
+    if (!changes.endDate.empty())
+      instance.endDate = changes.endDate;
+    if (!changes.endTime.empty())
+      instance.endTime = changes.endTime;
+    instance.numberOfUpdates++;
+    if (snapshot != NULL)
+      *snapshot = instance;
+
+    // restart the retention timer
+    if (instance.isFinal())
+    {
+      m_activeRecords.remove(record);
+      m_finalRecords.append(record);
+      if (m_finalTimeout > 0)
+        m_wheel.schedule(record, now + m_finalTimeout);
+      else
+        m_wheel.cancel(record);
+    }
+    else if (m_staleTimeout > 0)
+      m_wheel.schedule(record, now + m_staleTimeout);
+    m_memoryUsage -= record->memoryUsage;
+    record->memoryUsage = estimateMemoryUsage(*record);
+    m_memoryUsage += record->memoryUsage;
+  }
+  m_lock.wrunlock();
+
+  if (result == STATUS_N_NoSuchObjectInstance)
+    DCMNET_WARN("MPPS instance " << sopInstanceUID << " does not exist");
+  else if (result == STATUS_N_ProcessingFailure)
+    DCMNET_WARN("MPPS instance " << sopInstanceUID << " is no longer IN PROGRESS and may not be updated");
+  return result;
+}
+
+
+OFBool DcmMppsStoreShard::findInstances(const DcmMppsQuery &query,
+                                        OFVector<DcmMppsInstance> &results)
+{
+  OFBool complete = OFTrue;
+  // exact matches on an empty value never match anything
+  if ((query.key != DCMMPPS_QUERY_START_DATE) && query.value.empty())
+    return complete;
+
+  // only collect the UIDs while holding the read lock, copying the instances
+  // themselves (with all their strings) would block the writers much longer
+  const size_t maxUIDs = (results.size() < query.maxResults) ? query.maxResults - results.size() : 0;
+  OFVector<OFString> uids;
+  lockRead();
+  switch (query.key)
+  {
+    case DCMMPPS_QUERY_INSTANCE_UID:
+      if (m_instances.find(query.value) != m_instances.end())
+      {
+        if (maxUIDs > 0)
+          uids.push_back(query.value);
+        else
+          complete = OFFalse;
+      }
+      break;
+    case DCMMPPS_QUERY_PATIENT_ID:
+      complete = collectRange(m_patientIndex, query.value, query.value, maxUIDs, uids);
+      break;
+    case DCMMPPS_QUERY_ACCESSION_NUMBER:
+      complete = collectRange(m_accessionIndex, query.value, query.value, maxUIDs, uids);
+      break;
+    case DCMMPPS_QUERY_STATION_AETITLE:
+      complete = collectRange(m_stationIndex, query.value, query.value, maxUIDs, uids);
+      break;
+    case DCMMPPS_QUERY_STATUS:
+      complete = collectRange(m_statusIndex, query.value, query.value, maxUIDs, uids);
+      break;
+    case DCMMPPS_QUERY_START_DATE:
+      complete = collectRange(m_startDateIndex, query.value, query.upperValue, maxUIDs, uids);
+      break;
+  }
+  m_lock.rdunlock();
+
+  // copy the instances one at a time, skipping those removed in the meantime
+  results.reserve(results.size() + uids.size());
+  for (size_t i = 0; i < uids.size(); i++)
+  {
+    lockRead();
+    InstanceMap::const_iterator it = m_instances.find(uids[i]);
+    if (it != m_instances.end())
+      results.push_back(it->second->instance);
+    m_lock.rdunlock();
+  }
+  return complete;
+}
+
+
+size_t DcmMppsStoreShard::getNumberOfInstances()
+{
+  lockRead();
+  const size_t count = m_instances.size();
+  m_lock.rdunlock();
+  return count;
+}
+
+
+size_t DcmMppsStoreShard::getMemoryUsage()
+{
+  lockRead();
+  const size_t usage = m_memoryUsage;
+  m_lock.rdunlock();
+  return usage;
+}
+
+
+void DcmMppsStoreShard::getStatistics(DcmMppsShardStatistics &statistics)
+{
+  lockRead();
+  statistics.numberOfInstances = m_instances.size();
+  statistics.memoryUsage = m_memoryUsage;
+  statistics.arenaBlocks = m_arena.getNumberOfBlocks();
+  statistics.writeLocks = m_writeLocks;
+  statistics.writeContentions = m_writeContentions;
+  m_lock.rdunlock();
+  statistics.readLocks = m_readLocks;
+  statistics.readContentions = m_readContentions;
+}
+
+
+void DcmMppsStoreShard::lockRead()
+{
+  // readers may run concurrently, so the counters are updated atomically
+  if (m_lock.tryrdlock() != 0)
+  {
+    __sync_fetch_and_add(&m_readContentions, 1UL);
+    m_lock.rdlock();
+  }
+  __sync_fetch_and_add(&m_readLocks, 1UL);
+}
+
+
+void DcmMppsStoreShard::lockWrite()
+{
+  if (m_lock.trywrlock() != 0)
+  {
+    m_lock.wrlock();
+    ++m_writeContentions;
+  }
+  ++m_writeLocks;
+}
+
+
+void DcmMppsStoreShard::addToIndexes(DcmMppsRecord *record)
+{
+  const DcmMppsInstance &instance = record->instance;
+  // empty (type 2) values are not indexed
+  if (!instance.patientID.empty())
+    m_patientIndex.insert(IndexEntry(instance.patientID, record));
+  for (size_t i = 0; i < instance.accessionNumbers.size(); i++)
+    m_accessionIndex.insert(IndexEntry(instance.accessionNumbers[i], record));
+  if (!instance.stationAETitle.empty())
+    m_stationIndex.insert(IndexEntry(instance.stationAETitle, record));
+  m_statusIndex.insert(IndexEntry(DcmMppsInstance::statusName(instance.status), record));
+  if (!instance.startDate.empty())
+    m_startDateIndex.insert(IndexEntry(instance.startDate, record));
+}
+
+
+void DcmMppsStoreShard::removeFromIndexes(DcmMppsRecord *record)
+{
+  const DcmMppsInstance &instance = record->instance;
+  m_patientIndex.erase(IndexEntry(instance.patientID, record));
+  for (size_t i = 0; i < instance.accessionNumbers.size(); i++)
+    m_accessionIndex.erase(IndexEntry(instance.accessionNumbers[i], record));
+  m_stationIndex.erase(IndexEntry(instance.stationAETitle, record));
+  m_statusIndex.erase(IndexEntry(DcmMppsInstance::statusName(instance.status), record));
+  m_startDateIndex.erase(IndexEntry(instance.startDate, record));
+}
+
+
+void DcmMppsStoreShard::removeRecord(DcmMppsRecord *record)
+{
+  m_instances.erase(record->instance.sopInstanceUID);
+  removeFromIndexes(record);
+  m_wheel.cancel(record);
+  if (record->instance.isFinal())
+    m_finalRecords.remove(record);
+  else
+    m_activeRecords.remove(record);
+  m_memoryUsage -= record->memoryUsage;
+  m_arena.release(record);
+}
+
+
+OFBool DcmMppsStoreShard::applyRetention(const Uint32 now,
+                                         const size_t reserve)
+{
+  // remove the records whose timer has expired
+  OFVector<DcmMppsRecord *> expired;
+  m_wheel.advance(now, expired);
+  for (size_t i = 0; i < expired.size(); i++)
+  {
+    DCMNET_DEBUG("MPPS instance " << expired[i]->instance.sopInstanceUID << " ("
+      << DcmMppsInstance::statusName(expired[i]->instance.status) << ") expired");
+    removeRecord(expired[i]);
+  }
+
+  // evict the oldest records if the memory limit is exceeded, final ones first
+  if (m_maxMemory == 0)
+    return OFTrue;
+  if (reserve > m_maxMemory)
+    return OFFalse;
+  while (m_memoryUsage > m_maxMemory - reserve)
+  {
+    DcmMppsRecord *victim = m_finalRecords.head;
+    if (victim == NULL)
+    {
+      victim = m_activeRecords.head;
+      if (victim == NULL)
+        return OFFalse;
+      DCMNET_WARN("MPPS store memory limit exceeded, evicting instance "
+        << victim->instance.sopInstanceUID << " which is still IN PROGRESS");
+    }
+    removeRecord(victim);
+  }
+  return OFTrue;
+}
+
+
+Uint32 DcmMppsStoreShard::currentTick() const
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return OFstatic_cast(Uint32, now.tv_sec - m_startTime);
+}
+
+
+size_t DcmMppsStoreShard::estimateMemoryUsage(const DcmMppsRecord &record)
+{
+  // approximate size of a node of the map and of the index sets (tree node header)
+  const size_t nodeSize = 4 * sizeof(void *) + sizeof(IndexEntry);
+  const DcmMppsInstance &instance = record.instance;
+  size_t usage = sizeof(DcmMppsRecord) + nodeSize + instance.sopInstanceUID.capacity()
+    + instance.patientID.capacity() + instance.patientName.capacity()
+    + instance.stationAETitle.capacity() + instance.modality.capacity()
+    + instance.procedureStepID.capacity() + instance.startDate.capacity()
+    + instance.startTime.capacity() + instance.endDate.capacity()
+    + instance.endTime.capacity();
+  // key strings are stored once more in the indexes
+  usage += 3 * nodeSize + instance.sopInstanceUID.capacity() + instance.patientID.capacity()
+    + instance.stationAETitle.capacity() + instance.startDate.capacity();
+  for (size_t i = 0; i < instance.accessionNumbers.size(); i++)
+    usage += sizeof(OFString) + nodeSize + 2 * instance.accessionNumbers[i].capacity();
+  return usage;
+}
+
+
+OFBool DcmMppsStoreShard::collectRange(const Index &index,
+                                       const OFString &lower,
+                                       const OFString &upper,
+                                       const size_t maxResults,
+                                       OFVector<OFString> &uids)
+{
+  // NULL is the smallest pointer value, i.e. this is the first entry for "lower"
+  Index::const_iterator it = index.lower_bound(IndexEntry(lower, NULL));
+  while ((it != index.end()) && (upper.empty() || (it->first <= upper)))
+  {
+    if (uids.size() >= maxResults)
+      return OFFalse;
+    uids.push_back(it->second->instance.sopInstanceUID);
+    ++it;
+  }
+  return OFTrue;
+}
+
+// ----------------------------------------------------------------------------
+
+DcmMppsStore::DcmMppsStore(const size_t numShards)
+  : m_shards(NULL)
+  , m_numShards((numShards > 0) ? numShards : 1)
+  , m_lastExpiry(0)
+{
+  m_shards = new DcmMppsStoreShard[m_numShards];
+}
+
+
+DcmMppsStore::~DcmMppsStore()
+{
+  delete[] m_shards;
+}
+
+
+Uint16 DcmMppsStore::createInstance(const OFString &sopInstanceUID,
+                                    DcmItem &dataset,
+                                    DcmMppsInstance *snapshot,
+                                    const DcmMppsValidationResult *validation)
+{
+  expireInstances();
+  return getShard(sopInstanceUID).createInstance(sopInstanceUID, dataset, snapshot, validation);
+}
+
+
+Uint16 DcmMppsStore::updateInstance(const OFString &sopInstanceUID,
+                                    DcmItem &dataset,
+                                    DcmMppsInstance *snapshot,
+                                    DcmMppsStepStatus *previousStatus,
+                                    DcmMppsValidationResult *validation)
+{
+  expireInstances();
+  return getShard(sopInstanceUID).updateInstance(sopInstanceUID, dataset, snapshot, previousStatus, validation);
+}
+
+
+OFBool DcmMppsStore::findInstances(const DcmMppsQuery &query,
+                                   OFVector<DcmMppsInstance> &results)
+{
+  results.clear();
+  expireInstances();
+  // the primary key determines the shard
+  if (query.key == DCMMPPS_QUERY_INSTANCE_UID)
+    return getShard(query.value).findInstances(query, results);
+
+  // secondary indexes are local to each shard, the read lock of a shard is only
+  // held while the UIDs of its matches are collected and while each match is copied
+  OFBool complete = OFTrue;
+  for (size_t i = 0; (i < m_numShards) && complete; i++)
+    complete = m_shards[i].findInstances(query, results);
+  return complete;
+}
+
+
+void DcmMppsStore::expireInstances()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const long last = m_lastExpiry;
+  // only one of the threads calling in the same second does the work
+  if ((now.tv_sec == last) ||
+      !__sync_bool_compare_and_swap(&m_lastExpiry, last, OFstatic_cast(long, now.tv_sec)))
+    return;
+  for (size_t i = 0; i < m_numShards; i++)
+    m_shards[i].expireInstances();
+}
+
+
+void DcmMppsStore::setRetention(const Uint32 finalTimeout,
+                                const Uint32 staleTimeout)
+{
+  for (size_t i = 0; i < m_numShards; i++)
+    m_shards[i].setRetention(finalTimeout, staleTimeout);
+}
+
+
+void DcmMppsStore::setMemoryLimit(const size_t maxMemory)
+{
+  // make sure that a limit does not become "no limit" for many shards
+  size_t shardLimit = maxMemory / m_numShards;
+  if ((maxMemory > 0) && (shardLimit == 0))
+    shardLimit = 1;
+  for (size_t i = 0; i < m_numShards; i++)
+    m_shards[i].setMemoryLimit(shardLimit);
+}
+
+
+size_t DcmMppsStore::getNumberOfInstances()
+{
+  size_t count = 0;
+  for (size_t i = 0; i < m_numShards; i++)
+    count += m_shards[i].getNumberOfInstances();
+  return count;
+}
+
+
+size_t DcmMppsStore::getMemoryUsage()
+{
+  size_t usage = 0;
+  for (size_t i = 0; i < m_numShards; i++)
+    usage += m_shards[i].getMemoryUsage();
+  return usage;
+}
+
+
+size_t DcmMppsStore::getNumberOfShards() const
+{
+  return m_numShards;
+}
+
+
+void DcmMppsStore::getShardStatistics(OFVector<DcmMppsShardStatistics> &statistics)
+{
+  statistics.clear();
+  statistics.resize(m_numShards);
+  for (size_t i = 0; i < m_numShards; i++)
+    m_shards[i].getStatistics(statistics[i]);
+}
+
+
+DcmMppsStoreShard &DcmMppsStore::getShard(const OFString &sopInstanceUID)
+{
+  // FNV-1a, UIDs only differ in their last components, so all characters are used
+  Uint32 hash = 2166136261U;
+  for (size_t i = 0; i < sopInstanceUID.length(); i++)
+  {
+    hash ^= OFstatic_cast(unsigned char, sopInstanceUID[i]);
+    hash *= 16777619U;
+  }
+  return m_shards[hash % m_numShards];
+}
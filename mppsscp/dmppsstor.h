@@ -0,0 +1,757 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: In-memory store and secondary indexes for MPPS instances
+ *
+ */
+
+#ifndef DMPPSSTOR_H
+#define DMPPSSTOR_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/ofvector.h"
+#include "dcmtk/ofstd/ofthread.h"   /* for OFReadWriteLock */
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+
+#include "dmppsval.h"               /* for DcmMppsStepStatus */
+
+#include <map>
+#include <set>
+
+/** Key attributes of a single Modality Performed Procedure Step instance as kept
+ *  in the store. The received datasets themselves are not kept.
+ */
+struct DcmMppsInstance
+{
+  DcmMppsInstance()
+    : sopInstanceUID()
+    , status(DCMMPPS_STATUS_ABSENT)
+    , patientID()
+    , patientName()
+    , accessionNumbers()
+    , stationAETitle()
+    , modality()
+    , procedureStepID()
+    , startDate()
+    , startTime()
+    , endDate()
+    , endTime()
+    , numberOfUpdates(0)
+  {
+  }
+
+  /** Copy the key attributes from the dataset of an N-CREATE or N-SET request.
+   *  Attributes that are not present in the dataset are left unchanged.
+   *  @param dataset [in] The request dataset
+   */
+  void update(DcmItem &dataset);
+
+  /** Get the top-level attributes used by update(), e.g.\ to decode only these
+   *  attributes of a received dataset
+   *  @param count [out] Number of attributes
+   *  @return the attribute tags (see DCMMPPS_TAG()), sorted
+   */
+  static const Uint32 *getUpdateAttributes(size_t &count);
+
+  /** Check whether the instance has reached a final state, i.e.\ whether it may no
+   *  longer be updated
+   *  @return OFTrue if the status is COMPLETED or DISCONTINUED, OFFalse otherwise
+   */
+  OFBool isFinal() const
+  {
+    return (status == DCMMPPS_STATUS_COMPLETED) || (status == DCMMPPS_STATUS_DISCONTINUED);
+  }
+
+  /** Get the defined term for the status of the instance
+   *  @param status [in] The status to convert
+   *  @return the defined term, e.g.\ "IN PROGRESS"
+   */
+  static const char *statusName(const DcmMppsStepStatus status);
+
+  /// SOP Instance UID, the primary key
+  OFString sopInstanceUID;
+  /// Performed Procedure Step Status
+  DcmMppsStepStatus status;
+  /// Patient ID (0010,0020)
+  OFString patientID;
+  /// Patient's Name (0010,0010)
+  OFString patientName;
+  /// Accession Numbers of all items of the Scheduled Step Attributes Sequence
+  OFVector<OFString> accessionNumbers;
+  /// Performed Station AE Title (0040,0241)
+  OFString stationAETitle;
+  /// Modality (0008,0060)
+  OFString modality;
+  /// Performed Procedure Step ID (0040,0253)
+  OFString procedureStepID;
+  /// Performed Procedure Step Start Date (0040,0244)
+  OFString startDate;
+  /// Performed Procedure Step Start Time (0040,0245)
+  OFString startTime;
+  /// Performed Procedure Step End Date (0040,0250)
+  OFString endDate;
+  /// Performed Procedure Step End Time (0040,0251)
+  OFString endTime;
+  /// number of N-SET requests applied to this instance
+  Uint32 numberOfUpdates;
+};
+
+/** Attribute a query on the MPPS store is based on
+ */
+enum DcmMppsQueryKey
+{
+  /// SOP Instance UID (exact match)
+  DCMMPPS_QUERY_INSTANCE_UID,
+  /// Patient ID (exact match)
+  DCMMPPS_QUERY_PATIENT_ID,
+  /// Accession Number (exact match)
+  DCMMPPS_QUERY_ACCESSION_NUMBER,
+  /// Performed Station AE Title (exact match)
+  DCMMPPS_QUERY_STATION_AETITLE,
+  /// Performed Procedure Step Status (exact match)
+  DCMMPPS_QUERY_STATUS,
+  /// Performed Procedure Step Start Date (inclusive range)
+  DCMMPPS_QUERY_START_DATE
+};
+
+/** Query on the MPPS store. Each query is answered from a single index.
+ */
+struct DcmMppsQuery
+{
+  DcmMppsQuery()
+    : key(DCMMPPS_QUERY_INSTANCE_UID)
+    , value()
+    , upperValue()
+    , maxResults(100)
+  {
+  }
+
+  /// the index to be used
+  DcmMppsQueryKey key;
+  /// the value to match; lower bound of the date range (YYYYMMDD, empty = open)
+  OFString value;
+  /// upper bound of the date range (YYYYMMDD, empty = open), only used for start date
+  OFString upperValue;
+  /// maximum number of results to be returned
+  size_t maxResults;
+};
+
+/** Number of levels of the retention timer wheel
+ */
+#define DCMMPPS_WHEEL_LEVELS 4
+
+/** Number of bits per level of the retention timer wheel, i.e.\ each level has
+ *  2^DCMMPPS_WHEEL_BITS slots. With one tick per second, four levels of 64 slots
+ *  cover about 194 days; longer timeouts are cascaded repeatedly.
+ */
+#define DCMMPPS_WHEEL_BITS 6
+
+/** A stored MPPS instance together with the bookkeeping of the retention policy
+ */
+struct DcmMppsRecord
+{
+  DcmMppsRecord()
+    : instance()
+    , presentAttributes(0)
+    , valuedAttributes(0)
+    , memoryUsage(0)
+    , expiry(0)
+    , timerNext(NULL)
+    , timerPrev(NULL)
+    , timerSlot(NULL)
+    , ageNext(NULL)
+    , agePrev(NULL)
+  {
+  }
+
+  /// the instance
+  DcmMppsInstance instance;
+  /// attributes sent with any request of the instance, see DcmMppsValidationResult
+  Uint32 presentAttributes;
+  /// attributes with a value after the last request of the instance
+  Uint32 valuedAttributes;
+  /// estimated memory usage of the record including its index entries (bytes)
+  size_t memoryUsage;
+  /// tick at which the record expires (only valid if scheduled, i.e.\ timerSlot != NULL)
+  Uint32 expiry;
+  /// next record in the same timer wheel slot
+  DcmMppsRecord *timerNext;
+  /// previous record in the same timer wheel slot
+  DcmMppsRecord *timerPrev;
+  /// head of the timer wheel slot the record is in, NULL if not scheduled
+  DcmMppsRecord **timerSlot;
+  /// next (younger) record in the age list
+  DcmMppsRecord *ageNext;
+  /// previous (older) record in the age list
+  DcmMppsRecord *agePrev;
+};
+
+/** Doubly-linked list of records, oldest first. Used to evict the oldest records
+ *  in constant time.
+ */
+struct DcmMppsRecordList
+{
+  DcmMppsRecordList()
+    : head(NULL)
+    , tail(NULL)
+  {
+  }
+
+  /** Append a record at the end (youngest position)
+   *  @param record [in] The record, must not be in any list
+   */
+  void append(DcmMppsRecord *record);
+
+  /** Remove a record from the list
+   *  @param record [in] The record, must be in this list
+   */
+  void remove(DcmMppsRecord *record);
+
+  /// oldest record
+  DcmMppsRecord *head;
+  /// youngest record
+  DcmMppsRecord *tail;
+};
+
+/** Hierarchical timer wheel for the expiry of records. Scheduling and cancelling a
+ *  timer takes constant time; advancing the wheel only visits the records that are
+ *  due or that have to be moved to a finer level, i.e.\ the store is never scanned.
+ */
+class DcmMppsTimerWheel
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsTimerWheel();
+
+  /** Schedule the expiry of a record. If the record is already scheduled, it is
+   *  rescheduled.
+   *  @param record [in] The record
+   *  @param expiry [in] The tick at which the record expires
+   */
+  void schedule(DcmMppsRecord *record,
+                const Uint32 expiry);
+
+  /** Cancel the expiry of a record (if scheduled)
+   *  @param record [in] The record
+   */
+  void cancel(DcmMppsRecord *record);
+
+  /** Advance the wheel to the given tick and collect all records that have expired
+   *  @param now     [in]    The current tick
+   *  @param expired [inout] Expired records are appended, they are no longer scheduled
+   */
+  void advance(const Uint32 now,
+               OFVector<DcmMppsRecord *> &expired);
+
+  protected:
+
+  /** Put a record into the slot matching its expiry
+   *  @param record [in] The record, must not be scheduled
+   */
+  void insert(DcmMppsRecord *record);
+
+  private:
+
+  /// slots of all levels, each slot is a doubly-linked list of records
+  DcmMppsRecord *m_slots[DCMMPPS_WHEEL_LEVELS][1 << DCMMPPS_WHEEL_BITS];
+
+  /// the current tick
+  Uint32 m_current;
+};
+
+/** Number of records allocated at once by DcmMppsRecordArena
+ */
+#define DCMMPPS_ARENA_BLOCK_SIZE 256
+
+/** Allocator for the records of a single shard. Records are allocated in blocks and
+ *  released records are kept on a free list for reuse, so that the shards do not
+ *  compete for the global heap on each N-CREATE. Not thread-safe, i.e.\ only used
+ *  with the write lock of the shard held.
+ */
+class DcmMppsRecordArena
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsRecordArena();
+
+  /** destructor. Frees all blocks, i.e.\ all records allocated from this arena.
+   */
+  ~DcmMppsRecordArena();
+
+  /** Allocate a (default initialized) record
+   *  @return the record
+   */
+  DcmMppsRecord *allocate();
+
+  /** Return a record to the arena
+   *  @param record [in] The record, must have been allocated from this arena
+   */
+  void release(DcmMppsRecord *record);
+
+  /** Returns the number of records that can be allocated without a new block
+   *  @return number of free records
+   */
+  size_t getNumberOfFreeRecords() const;
+
+  /** Returns the number of blocks allocated so far
+   *  @return number of blocks
+   */
+  size_t getNumberOfBlocks() const;
+
+  private:
+
+  /// all blocks of DCMMPPS_ARENA_BLOCK_SIZE records
+  OFVector<DcmMppsRecord *> m_blocks;
+
+  /// free records, linked via DcmMppsRecord::ageNext
+  DcmMppsRecord *m_freeList;
+
+  /// number of records on the free list
+  size_t m_numFree;
+
+  // private undefined copy constructor
+  DcmMppsRecordArena(const DcmMppsRecordArena &);
+
+  // private undefined assignment operator
+  DcmMppsRecordArena &operator=(const DcmMppsRecordArena &);
+
+};
+
+/** Statistics of a single shard of the MPPS store
+ */
+struct DcmMppsShardStatistics
+{
+  DcmMppsShardStatistics()
+    : numberOfInstances(0)
+    , memoryUsage(0)
+    , arenaBlocks(0)
+    , readLocks(0)
+    , readContentions(0)
+    , writeLocks(0)
+    , writeContentions(0)
+  {
+  }
+
+  /// number of instances in the shard
+  size_t numberOfInstances;
+  /// estimated memory usage of the instances in bytes
+  size_t memoryUsage;
+  /// number of blocks allocated by the arena of the shard
+  size_t arenaBlocks;
+  /// number of times the read lock was acquired
+  unsigned long readLocks;
+  /// number of times the read lock was not immediately available
+  unsigned long readContentions;
+  /// number of times the write lock was acquired
+  unsigned long writeLocks;
+  /// number of times the write lock was not immediately available
+  unsigned long writeContentions;
+};
+
+/** A single shard of the MPPS store, holding all instances whose SOP Instance UID
+ *  hashes to this shard, with secondary indexes on Patient ID, Accession Number,
+ *  Performed Station AE Title, status and start date. The indexes are updated
+ *  incrementally with each N-CREATE and N-SET, so that queries never scan the shard.
+ *  Each shard has its own lock, record arena, timer wheel and memory accounting, so
+ *  that shards can be accessed by different threads without contention.
+ *  Queries only hold a read lock while copying a bounded number of results, so that
+ *  writers are never blocked for longer than that.
+ *  Optionally, COMPLETED/DISCONTINUED instances and instances that are IN PROGRESS but
+ *  have not been updated for some time expire. Expiry is driven by a timer wheel that
+ *  is advanced with each N-CREATE/N-SET of the shard. If a memory limit is set, the
+ *  oldest COMPLETED/DISCONTINUED instances are evicted first when it is exceeded.
+ */
+class DcmMppsStoreShard
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsStoreShard();
+
+  /** destructor
+   */
+  virtual ~DcmMppsStoreShard();
+
+  /** Add a new instance (N-CREATE)
+   *  @param sopInstanceUID [in] The Affected SOP Instance UID of the request
+   *  @param dataset        [in] The (validated) request dataset
+   *  @param snapshot       [out] If not NULL, receives a copy of the new instance
+   *  @param validation     [in]  If not NULL, the validation result of the dataset,
+   *                              whose attributes are kept for the final state check
+   *  @return STATUS_Success if the instance was added, STATUS_N_DuplicateSOPInstance
+   *          if an instance with the same UID already exists, STATUS_N_ProcessingFailure
+   *          if the instance does not fit into the memory limit
+   */
+  Uint16 createInstance(const OFString &sopInstanceUID,
+                        DcmItem &dataset,
+                        DcmMppsInstance *snapshot = NULL,
+                        const DcmMppsValidationResult *validation = NULL);
+
+  /** Update an existing instance (N-SET)
+   *  @param sopInstanceUID [in] The Requested SOP Instance UID of the request
+   *  @param dataset        [in] The (validated) request dataset
+   *  @param snapshot       [out] If not NULL, receives a copy of the updated instance
+   *  @param previousStatus [out] If not NULL, receives the status before the update
+   *  @param validation     [inout] If not NULL, the validation result of the dataset.
+   *                                If the request sets a final state, its requirements
+   *                                are checked on the instance merged with the request
+   *                                (see DcmMppsValidator::checkFinalState()) and the
+   *                                offending elements are added to the result.
+   *  @return STATUS_Success if the instance was updated, STATUS_N_NoSuchObjectInstance
+   *          if there is no such instance, STATUS_N_ProcessingFailure if the instance
+   *          is already COMPLETED or DISCONTINUED, the status of the final state check
+   *          if it fails (the instance is not changed then)
+   */
+  Uint16 updateInstance(const OFString &sopInstanceUID,
+                        DcmItem &dataset,
+                        DcmMppsInstance *snapshot = NULL,
+                        DcmMppsStepStatus *previousStatus = NULL,
+                        DcmMppsValidationResult *validation = NULL);
+
+  /** Find instances using one of the indexes. Only the SOP Instance UIDs of the
+   *  matching instances are collected while the read lock is held, the instances are
+   *  then copied one by one, so that a large result does not block the writers.
+   *  Instances removed in the meantime are skipped, instances updated in the meantime
+   *  are returned as they are then.
+   *  @param query   [in]    The query
+   *  @param results [inout] Copies of the matching instances are appended, until
+   *                         there are query.maxResults results
+   *  @return OFTrue if all matching instances were returned, OFFalse if the results
+   *          were truncated to query.maxResults
+   */
+  OFBool findInstances(const DcmMppsQuery &query,
+                       OFVector<DcmMppsInstance> &results);
+
+  /** Set the retention policy. Should be called before the store is used.
+   *  @param finalTimeout [in] Number of seconds after which COMPLETED/DISCONTINUED
+   *                           instances are removed, 0 to keep them
+   *  @param staleTimeout [in] Number of seconds after which IN PROGRESS instances
+   *                           without any update are removed, 0 to keep them
+   */
+  void setRetention(const Uint32 finalTimeout,
+                    const Uint32 staleTimeout);
+
+  /** Set the maximum (estimated) memory used by the stored instances. If exceeded,
+   *  the oldest COMPLETED/DISCONTINUED instances are evicted first, then the oldest
+   *  instances IN PROGRESS.
+   *  @param maxMemory [in] Maximum memory usage in bytes, 0 for no limit
+   */
+  void setMemoryLimit(const size_t maxMemory);
+
+  /** Remove the expired records and enforce the memory limit, even if the shard
+   *  receives no requests
+   */
+  void expireInstances();
+
+  /** Returns the number of instances in the store
+   *  @return number of instances
+   */
+  size_t getNumberOfInstances();
+
+  /** Returns the estimated memory used by the stored instances
+   *  @return memory usage in bytes
+   */
+  size_t getMemoryUsage();
+
+  /** Returns the statistics of the shard
+   *  @param statistics [out] The statistics
+   */
+  void getStatistics(DcmMppsShardStatistics &statistics);
+
+  protected:
+
+  /// index entry: indexed value and record
+  typedef STD_NAMESPACE pair<OFString, DcmMppsRecord *> IndexEntry;
+  /// ordered index, allows for exact and range lookups in logarithmic time
+  typedef STD_NAMESPACE set<IndexEntry> Index;
+  /// primary map from SOP Instance UID to record
+  typedef STD_NAMESPACE map<OFString, DcmMppsRecord *> InstanceMap;
+
+  /** Acquire the read lock and count whether it had to be waited for
+   */
+  void lockRead();
+
+  /** Acquire the write lock and count whether it had to be waited for
+   */
+  void lockWrite();
+
+  /** Add a record to all secondary indexes
+   *  @param record [in] The record to add
+   */
+  void addToIndexes(DcmMppsRecord *record);
+
+  /** Remove a record from all secondary indexes. Must be called with the old
+   *  attribute values before the instance is changed.
+   *  @param record [in] The record to remove
+   */
+  void removeFromIndexes(DcmMppsRecord *record);
+
+  /** Remove a record from the store and delete it. The write lock must be held.
+   *  @param record [in] The record to remove
+   */
+  void removeRecord(DcmMppsRecord *record);
+
+  /** Remove expired records and enforce the memory limit. The write lock must be held.
+   *  @param now     [in] The current tick
+   *  @param reserve [in] Memory (in bytes) to be kept free below the limit, e.g.\ for
+   *                      a record that is about to be inserted
+   *  @return OFTrue if the memory usage plus the reserve is within the limit, OFFalse
+   *          if it could not be reached by evicting all records
+   */
+  OFBool applyRetention(const Uint32 now,
+                        const size_t reserve = 0);
+
+  /** Returns the current tick of the retention timer (seconds since creation of the
+   *  store, from a monotonic clock)
+   *  @return the current tick
+   */
+  Uint32 currentTick() const;
+
+  /** Estimate the memory used by a record including its index entries
+   *  @param record [in] The record
+   *  @return estimated memory usage in bytes
+   */
+  static size_t estimateMemoryUsage(const DcmMppsRecord &record);
+
+  /** Collect the SOP Instance UIDs of the instances of an index in the range
+   *  [lower, upper]
+   *  @param index      [in]    The index to search
+   *  @param lower      [in]    Lower bound, empty for an open range
+   *  @param upper      [in]    Upper bound, empty for an open range
+   *  @param maxResults [in]    Maximum number of UIDs to be collected
+   *  @param uids       [inout] The SOP Instance UIDs
+   *  @return OFTrue if all matching UIDs were collected, OFFalse otherwise
+   */
+  static OFBool collectRange(const Index &index,
+                             const OFString &lower,
+                             const OFString &upper,
+                             const size_t maxResults,
+                             OFVector<OFString> &uids);
+
+  private:
+
+  /// lock protecting all data of the shard
+  OFReadWriteLock m_lock;
+
+  /// number of read lock acquisitions (updated atomically)
+  volatile unsigned long m_readLocks;
+
+  /// number of read lock acquisitions that had to wait (updated atomically)
+  volatile unsigned long m_readContentions;
+
+  /// number of write lock acquisitions (only updated with the write lock held)
+  unsigned long m_writeLocks;
+
+  /// number of write lock acquisitions that had to wait
+  unsigned long m_writeContentions;
+
+  /// allocator for the records of this shard
+  DcmMppsRecordArena m_arena;
+
+  /// all instances by SOP Instance UID
+  InstanceMap m_instances;
+
+  /// index on Patient ID
+  Index m_patientIndex;
+
+  /// index on Accession Number (an instance may be listed more than once)
+  Index m_accessionIndex;
+
+  /// index on Performed Station AE Title
+  Index m_stationIndex;
+
+  /// index on status (defined term)
+  Index m_statusIndex;
+
+  /// index on start date (YYYYMMDD)
+  Index m_startDateIndex;
+
+  /// timer wheel for the expiry of records
+  DcmMppsTimerWheel m_wheel;
+
+  /// records IN PROGRESS, in order of creation
+  DcmMppsRecordList m_activeRecords;
+
+  /// COMPLETED/DISCONTINUED records, in order of completion
+  DcmMppsRecordList m_finalRecords;
+
+  /// seconds after which COMPLETED/DISCONTINUED records expire, 0 for never
+  Uint32 m_finalTimeout;
+
+  /// seconds after which IN PROGRESS records without update expire, 0 for never
+  Uint32 m_staleTimeout;
+
+  /// maximum estimated memory usage, 0 for no limit
+  size_t m_maxMemory;
+
+  /// current estimated memory usage
+  size_t m_memoryUsage;
+
+  /// monotonic clock value (seconds) at which the store was created
+  long m_startTime;
+
+  // private undefined copy constructor
+  DcmMppsStoreShard(const DcmMppsStoreShard &);
+
+  // private undefined assignment operator
+  DcmMppsStoreShard &operator=(const DcmMppsStoreShard &);
+
+};
+
+/** Default number of shards of the MPPS store
+ */
+#define DCMMPPS_DEFAULT_SHARDS 16
+
+/** Default number of seconds after which mppsrecv removes completed/discontinued
+ *  instances from the store (24 hours)
+ */
+#define DCMMPPS_DEFAULT_FINAL_RETENTION 86400
+
+/** Default number of seconds after which mppsrecv removes instances in progress
+ *  without any update from the store (48 hours)
+ */
+#define DCMMPPS_DEFAULT_STALE_TIMEOUT 172800
+
+/** Default maximum memory of the store of mppsrecv in MB
+ */
+#define DCMMPPS_DEFAULT_MAX_MEMORY 256
+
+/** In-memory store of MPPS instances. The store is partitioned into a number of shards
+ *  by a hash of the SOP Instance UID (see DcmMppsStoreShard), so that N-CREATE and
+ *  N-SET requests on different instances rarely compete for the same lock. Requests
+ *  on a single instance only access one shard, queries on the secondary indexes are
+ *  answered by each shard in turn.
+ */
+class DcmMppsStore
+{
+
+  public:
+
+  /** constructor
+   *  @param numShards [in] Number of shards, should be a few times the number of
+   *                        threads accessing the store
+   */
+  DcmMppsStore(const size_t numShards = DCMMPPS_DEFAULT_SHARDS);
+
+  /** destructor
+   */
+  virtual ~DcmMppsStore();
+
+  /** Add a new instance (N-CREATE), see DcmMppsStoreShard::createInstance()
+   *  @param sopInstanceUID [in] The Affected SOP Instance UID of the request
+   *  @param dataset        [in] The (validated) request dataset
+   *  @param snapshot       [out] If not NULL, receives a copy of the new instance
+   *  @param validation     [in]  If not NULL, the validation result of the dataset
+   *  @return STATUS_Success if the instance was added, an error status otherwise
+   */
+  Uint16 createInstance(const OFString &sopInstanceUID,
+                        DcmItem &dataset,
+                        DcmMppsInstance *snapshot = NULL,
+                        const DcmMppsValidationResult *validation = NULL);
+
+  /** Update an existing instance (N-SET), see DcmMppsStoreShard::updateInstance()
+   *  @param sopInstanceUID [in] The Requested SOP Instance UID of the request
+   *  @param dataset        [in] The (validated) request dataset
+   *  @param snapshot       [out] If not NULL, receives a copy of the updated instance
+   *  @param previousStatus [out] If not NULL, receives the status before the update
+   *  @param validation     [inout] If not NULL, the validation result of the dataset
+   *  @return STATUS_Success if the instance was updated, an error status otherwise
+   */
+  Uint16 updateInstance(const OFString &sopInstanceUID,
+                        DcmItem &dataset,
+                        DcmMppsInstance *snapshot = NULL,
+                        DcmMppsStepStatus *previousStatus = NULL,
+                        DcmMppsValidationResult *validation = NULL);
+
+  /** Find instances using one of the indexes. The results are collected shard by
+   *  shard, i.e.\ they are not sorted.
+   *  @param query   [in]  The query
+   *  @param results [out] Copies of the matching instances (at most query.maxResults)
+   *  @return OFTrue if all matching instances were returned, OFFalse if the results
+   *          were truncated to query.maxResults
+   */
+  OFBool findInstances(const DcmMppsQuery &query,
+                       OFVector<DcmMppsInstance> &results);
+
+  /** Set the retention policy, see DcmMppsStoreShard::setRetention()
+   *  @param finalTimeout [in] Number of seconds after which COMPLETED/DISCONTINUED
+   *                           instances are removed, 0 to keep them
+   *  @param staleTimeout [in] Number of seconds after which IN PROGRESS instances
+   *                           without any update are removed, 0 to keep them
+   */
+  void setRetention(const Uint32 finalTimeout,
+                    const Uint32 staleTimeout);
+
+  /** Set the maximum (estimated) memory used by the stored instances. The limit is
+   *  divided evenly among the shards.
+   *  @param maxMemory [in] Maximum memory usage in bytes, 0 for no limit
+   */
+  void setMemoryLimit(const size_t maxMemory);
+
+  /** Remove the expired instances of all shards, see DcmMppsStoreShard::expireInstances().
+   *  Called by every request on the store and periodically by the query server, but does
+   *  the work at most once per second, so that the timers of shards that receive no
+   *  requests still advance.
+   */
+  void expireInstances();
+
+  /** Returns the number of instances in the store
+   *  @return number of instances
+   */
+  size_t getNumberOfInstances();
+
+  /** Returns the estimated memory used by the stored instances
+   *  @return memory usage in bytes
+   */
+  size_t getMemoryUsage();
+
+  /** Returns the number of shards
+   *  @return number of shards
+   */
+  size_t getNumberOfShards() const;
+
+  /** Returns the statistics of all shards, e.g.\ to check whether the number of
+   *  shards is appropriate (lock contentions)
+   *  @param statistics [out] The statistics, one entry per shard
+   */
+  void getShardStatistics(OFVector<DcmMppsShardStatistics> &statistics);
+
+  protected:
+
+  /** Determine the shard of an instance
+   *  @param sopInstanceUID [in] The SOP Instance UID
+   *  @return the shard
+   */
+  DcmMppsStoreShard &getShard(const OFString &sopInstanceUID);
+
+  private:
+
+  /// the shards
+  DcmMppsStoreShard *m_shards;
+
+  /// number of shards
+  size_t m_numShards;
+
+  /// monotonic clock value (seconds) of the last call of expireInstances() that did the work
+  volatile long m_lastExpiry;
+
+  // private undefined copy constructor
+  DcmMppsStore(const DcmMppsStore &);
+
+  // private undefined assignment operator
+  DcmMppsStore &operator=(const DcmMppsStore &);
+
+};
+
+#endif // DMPPSSTOR_H
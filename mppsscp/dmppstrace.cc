@@ -0,0 +1,179 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Compact binary trace of DIMSE messages in memory-mapped rotating files
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppstrace.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_ERROR() */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+/* makes a record visible before the count that covers it */
+#define MEMORY_BARRIER() __sync_synchronize()
+
+DcmMppsTraceFile::DcmMppsTraceFile()
+  : m_filename()
+  , m_maxRecords(DCMMPPS_TRACE_DEFAULT_RECORDS)
+  , m_maxFiles(5)
+  , m_fd(-1)
+  , m_header(NULL)
+  , m_records(NULL)
+{
+}
+
+
+DcmMppsTraceFile::~DcmMppsTraceFile()
+{
+  close();
+}
+
+
+void DcmMppsTraceFile::setRotation(const Uint32 maxRecords,
+                                   const unsigned int maxFiles)
+{
+  m_maxRecords = maxRecords;
+  m_maxFiles = maxFiles;
+}
+
+
+OFCondition DcmMppsTraceFile::open(const OFString &filename)
+{
+  if (m_header != NULL)
+    return EC_IllegalCall;
+
+  m_filename = filename;
+  // the trace of an earlier run is kept like a full file
+  rotateFiles();
+  if (!mapFile())
+  {
+    DCMNET_ERROR("Cannot create DIMSE trace file " << filename << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot create DIMSE trace file");
+  }
+  DCMNET_INFO("Tracing DIMSE messages to file " << filename);
+  return EC_Normal;
+}
+
+
+void DcmMppsTraceFile::close()
+{
+  unmapFile();
+}
+
+
+void DcmMppsTraceFile::write(const DcmMppsTraceRecord &record)
+{
+  if (m_header == NULL)
+    return;
+  if (m_header->count == m_header->capacity)
+  {
+    unmapFile();
+    rotateFiles();
+    if (!mapFile())
+    {
+      DCMNET_ERROR("Cannot create DIMSE trace file " << m_filename << ", tracing stopped: "
+        << OFStandard::getLastSystemErrorCode().message());
+      return;
+    }
+  }
+  m_records[m_header->count] = record;
+  // a reader of the running trace only sees complete records
+  MEMORY_BARRIER();
+  ++m_header->count;
+}
+
+
+void DcmMppsTraceFile::setTimestamp(DcmMppsTraceRecord &record)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  record.seconds = OFstatic_cast(Uint32, now.tv_sec);
+  record.nanoseconds = OFstatic_cast(Uint32, now.tv_nsec);
+}
+
+
+Uint64 DcmMppsTraceFile::getMonotonicTime()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return OFstatic_cast(Uint64, now.tv_sec) * 1000000 + OFstatic_cast(Uint64, now.tv_nsec / 1000);
+}
+
+
+OFBool DcmMppsTraceFile::mapFile()
+{
+  const size_t size = sizeof(DcmMppsTraceHeader) + OFstatic_cast(size_t, m_maxRecords) * sizeof(DcmMppsTraceRecord);
+  m_fd = ::open(m_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0)
+    return OFFalse;
+  // the file is sparse, the pages are only allocated as records are written
+  void *map = MAP_FAILED;
+  if (ftruncate(m_fd, OFstatic_cast(off_t, size)) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+  if (map == MAP_FAILED)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+    return OFFalse;
+  }
+  m_header = OFstatic_cast(DcmMppsTraceHeader *, map);
+  m_records = OFreinterpret_cast(DcmMppsTraceRecord *, m_header + 1);
+  memcpy(m_header->magic, DCMMPPS_TRACE_MAGIC, sizeof(m_header->magic));
+  m_header->version = DCMMPPS_TRACE_VERSION;
+  m_header->recordSize = sizeof(DcmMppsTraceRecord);
+  m_header->capacity = m_maxRecords;
+  m_header->count = 0;
+  return OFTrue;
+}
+
+
+void DcmMppsTraceFile::unmapFile()
+{
+  if (m_header == NULL)
+    return;
+  const size_t used = sizeof(DcmMppsTraceHeader) + OFstatic_cast(size_t, m_header->count) * sizeof(DcmMppsTraceRecord);
+  munmap(m_header, sizeof(DcmMppsTraceHeader) + OFstatic_cast(size_t, m_header->capacity) * sizeof(DcmMppsTraceRecord));
+  m_header = NULL;
+  m_records = NULL;
+  // the decoder relies on the count in the header, truncating only saves space
+  if (ftruncate(m_fd, OFstatic_cast(off_t, used)) != 0)
+    DCMNET_WARN("Cannot truncate DIMSE trace file " << m_filename);
+  ::close(m_fd);
+  m_fd = -1;
+}
+
+
+void DcmMppsTraceFile::rotateFiles()
+{
+  // shift the older files, i.e. "name.1" becomes "name.2" and so on
+  char from[1024];
+  char to[1024];
+  for (unsigned int i = m_maxFiles; i > 1; i--)
+  {
+    OFStandard::snprintf(from, sizeof(from), "%s.%u", m_filename.c_str(), i - 1);
+    OFStandard::snprintf(to, sizeof(to), "%s.%u", m_filename.c_str(), i);
+    rename(from, to);
+  }
+  if (m_maxFiles > 0)
+  {
+    OFStandard::snprintf(to, sizeof(to), "%s.1", m_filename.c_str());
+    rename(m_filename.c_str(), to);
+  }
+  else
+    unlink(m_filename.c_str());
+}
@@ -0,0 +1,205 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Compact binary trace of DIMSE messages in memory-mapped rotating files
+ *
+ */
+
+#ifndef DMPPSTRACE_H
+#define DMPPSTRACE_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/ofcond.h"
+#include "dcmtk/ofstd/oftypes.h"    /* for Uint32 et al. */
+
+/** Identification at the start of each trace file
+ */
+#define DCMMPPS_TRACE_MAGIC "DMPSTRC1"
+
+/** Version of the record layout
+ */
+#define DCMMPPS_TRACE_VERSION 1
+
+/** Default number of records of a trace file
+ */
+#define DCMMPPS_TRACE_DEFAULT_RECORDS 65536
+
+/** Record flag: a response has been sent, i.e.\ the status is valid
+ */
+#define DCMMPPS_TRACE_RESPONSE_SENT 0x01
+
+/** Record flag: handling the message failed, e.g.\ the association was aborted
+ */
+#define DCMMPPS_TRACE_HANDLER_FAILED 0x02
+
+/** Header of a trace file. All numbers are in the byte order of the host that wrote
+ *  the file.
+ */
+struct DcmMppsTraceHeader
+{
+  /// DCMMPPS_TRACE_MAGIC (not NUL terminated)
+  char magic[8];
+
+  /// DCMMPPS_TRACE_VERSION
+  Uint32 version;
+
+  /// size of a record in bytes
+  Uint32 recordSize;
+
+  /// number of records the file has room for
+  Uint32 capacity;
+
+  /// number of records written, updated after each record
+  Uint32 count;
+
+  /// reserved, zero
+  Uint32 reserved[2];
+};
+
+/** Trace record of one received DIMSE request and its handling. String fields are
+ *  padded with NUL bytes, but not terminated if they fill the field completely.
+ */
+struct DcmMppsTraceRecord
+{
+  /// time the request was received, seconds since the epoch
+  Uint32 seconds;
+
+  /// time the request was received, nanoseconds
+  Uint32 nanoseconds;
+
+  /// number of the association (counted from program start)
+  Uint32 associationID;
+
+  /// size of the encoded dataset of the request, 0 if none
+  Uint32 datasetSize;
+
+  /// time from receiving the command to sending the response, microseconds
+  Uint32 latency;
+
+  /// command field of the request
+  Uint16 commandField;
+
+  /// message ID of the request
+  Uint16 messageID;
+
+  /// DIMSE status of the response, see flags
+  Uint16 status;
+
+  /// presentation context ID of the request
+  Uint8 presentationContextID;
+
+  /// DCMMPPS_TRACE_RESPONSE_SENT and DCMMPPS_TRACE_HANDLER_FAILED
+  Uint8 flags;
+
+  /// calling AE title
+  char callingAETitle[16];
+
+  /// affected or requested SOP class UID
+  char sopClassUID[64];
+
+  /// affected or requested SOP instance UID
+  char sopInstanceUID[64];
+};
+
+/** Writer of DIMSE trace records, meant to stay enabled in production. The records
+ *  have a fixed size and are copied into a memory-mapped file of fixed capacity, i.e.\
+ *  writing one costs a copy of a few cache lines and neither a system call nor any
+ *  formatting; the kernel writes the pages back in the background (and also if the
+ *  process crashes). When the file is full, it is rotated like the event export, i.e.\
+ *  "name" becomes "name.1" and so on, and a new file is created. The files are decoded
+ *  offline with the dimsetrace tool. The writer is not thread safe.
+ */
+class DcmMppsTraceFile
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmMppsTraceFile();
+
+  /** destructor. Closes the file.
+   */
+  ~DcmMppsTraceFile();
+
+  /** Set the size of the trace files and the number of rotated files to keep.
+   *  Must be called before open().
+   *  @param maxRecords [in] Number of records of each file
+   *  @param maxFiles   [in] Number of rotated files to keep, 0 to remove full files
+   */
+  void setRotation(const Uint32 maxRecords,
+                   const unsigned int maxFiles);
+
+  /** Create the trace file. An existing file is rotated first.
+   *  @param filename [in] The trace file
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition open(const OFString &filename);
+
+  /** Truncate the trace file to the records written and close it
+   */
+  void close();
+
+  /** Append a record, rotating the file if it is full. If a new file cannot be
+   *  created, tracing stops.
+   *  @param record [in] The record
+   */
+  void write(const DcmMppsTraceRecord &record);
+
+  /** Set the timestamp of a record to the current time
+   *  @param record [out] The record
+   */
+  static void setTimestamp(DcmMppsTraceRecord &record);
+
+  /** Returns a monotonic time, for measuring latencies
+   *  @return time in microseconds since an unspecified point
+   */
+  static Uint64 getMonotonicTime();
+
+  protected:
+
+  /** Create, size and map a new trace file
+   *  @return OFTrue if successful, OFFalse otherwise
+   */
+  OFBool mapFile();
+
+  /** Unmap the trace file and truncate it to the records written
+   */
+  void unmapFile();
+
+  /** Rename the trace file and the older ones, see setRotation()
+   */
+  void rotateFiles();
+
+  private:
+
+  /// name of the trace file
+  OFString m_filename;
+
+  /// number of records of each file
+  Uint32 m_maxRecords;
+
+  /// number of rotated files to keep
+  unsigned int m_maxFiles;
+
+  /// file descriptor of the trace file, -1 if closed
+  int m_fd;
+
+  /// the mapped header, NULL if not mapped
+  DcmMppsTraceHeader *m_header;
+
+  /// the mapped records
+  DcmMppsTraceRecord *m_records;
+
+  // private undefined copy constructor
+  DcmMppsTraceFile(const DcmMppsTraceFile &);
+
+  // private undefined assignment operator
+  DcmMppsTraceFile &operator=(const DcmMppsTraceFile &);
+
+};
+
+#endif // DMPPSTRACE_H
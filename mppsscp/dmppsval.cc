@@ -0,0 +1,372 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Attribute requirement tables and validator for MPPS N-CREATE and N-SET
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dmppsval.h"
+
+/* maximum number of entries of a requirement table */
+#define MAX_REQUIREMENTS 32
+
+/* presence of a table entry in the dataset, as recorded by checkRequirements() */
+#define PRESENCE_ABSENT  0
+#define PRESENCE_EMPTY   1
+#define PRESENCE_VALUE   2
+
+#define TYPE_1  DCMMPPS_TYPE_1
+#define TYPE_2  DCMMPPS_TYPE_2
+#define TYPE_3  DCMMPPS_TYPE_3
+#define TYPE_NA DCMMPPS_TYPE_NOT_ALLOWED
+
+/* Requirements for the N-CREATE dataset (DICOM PS3.4, Table F.7.2-1).
+ * Columns: tag, N-CREATE type, (unused) final state types. Sorted by tag!
+ */
+static const DcmMppsAttributeRequirement ncreateRequirements[] =
+{
+  { DCMMPPS_TAG(0x0008, 0x0060), TYPE_1, TYPE_1, TYPE_1 },  // Modality
+  { DCMMPPS_TAG(0x0008, 0x1032), TYPE_2, TYPE_2, TYPE_2 },  // Procedure Code Sequence
+  { DCMMPPS_TAG(0x0008, 0x1120), TYPE_2, TYPE_2, TYPE_2 },  // Referenced Patient Sequence
+  { DCMMPPS_TAG(0x0010, 0x0010), TYPE_2, TYPE_2, TYPE_2 },  // Patient's Name
+  { DCMMPPS_TAG(0x0010, 0x0020), TYPE_2, TYPE_2, TYPE_2 },  // Patient ID
+  { DCMMPPS_TAG(0x0010, 0x0030), TYPE_2, TYPE_2, TYPE_2 },  // Patient's Birth Date
+  { DCMMPPS_TAG(0x0010, 0x0040), TYPE_2, TYPE_2, TYPE_2 },  // Patient's Sex
+  { DCMMPPS_TAG(0x0020, 0x0010), TYPE_2, TYPE_2, TYPE_2 },  // Study ID
+  { DCMMPPS_TAG(0x0040, 0x0241), TYPE_1, TYPE_1, TYPE_1 },  // Performed Station AE Title
+  { DCMMPPS_TAG(0x0040, 0x0242), TYPE_2, TYPE_2, TYPE_2 },  // Performed Station Name
+  { DCMMPPS_TAG(0x0040, 0x0243), TYPE_2, TYPE_2, TYPE_2 },  // Performed Location
+  { DCMMPPS_TAG(0x0040, 0x0244), TYPE_1, TYPE_1, TYPE_1 },  // Performed Procedure Step Start Date
+  { DCMMPPS_TAG(0x0040, 0x0245), TYPE_1, TYPE_1, TYPE_1 },  // Performed Procedure Step Start Time
+  { DCMMPPS_TAG(0x0040, 0x0250), TYPE_2, TYPE_2, TYPE_2 },  // Performed Procedure Step End Date
+  { DCMMPPS_TAG(0x0040, 0x0251), TYPE_2, TYPE_2, TYPE_2 },  // Performed Procedure Step End Time
+  { DCMMPPS_TAG(0x0040, 0x0252), TYPE_1, TYPE_1, TYPE_1 },  // Performed Procedure Step Status
+  { DCMMPPS_TAG(0x0040, 0x0253), TYPE_1, TYPE_1, TYPE_1 },  // Performed Procedure Step ID
+  { DCMMPPS_TAG(0x0040, 0x0254), TYPE_2, TYPE_2, TYPE_2 },  // Performed Procedure Step Description
+  { DCMMPPS_TAG(0x0040, 0x0255), TYPE_2, TYPE_2, TYPE_2 },  // Performed Procedure Type Description
+  { DCMMPPS_TAG(0x0040, 0x0260), TYPE_2, TYPE_2, TYPE_2 },  // Performed Protocol Code Sequence
+  { DCMMPPS_TAG(0x0040, 0x0270), TYPE_1, TYPE_1, TYPE_1 },  // Scheduled Step Attributes Sequence
+  { DCMMPPS_TAG(0x0040, 0x0280), TYPE_3, TYPE_3, TYPE_3 },  // Comments on the Performed Procedure Step
+  { DCMMPPS_TAG(0x0040, 0x0281), TYPE_3, TYPE_3, TYPE_3 },  // PPS Discontinuation Reason Code Sequence
+  { DCMMPPS_TAG(0x0040, 0x0340), TYPE_2, TYPE_2, TYPE_2 }   // Performed Series Sequence
+};
+
+/* Requirements for the N-SET dataset (DICOM PS3.4, Table F.7.2-1) including the
+ * final state requirements (Section F.7.2.2). Columns: tag, N-SET type, type if
+ * set to COMPLETED, type if set to DISCONTINUED. Same attributes in the same order
+ * as for N-CREATE, so that the attribute bits of both requests can be merged!
+ */
+static const DcmMppsAttributeRequirement nsetRequirements[] =
+{
+  { DCMMPPS_TAG(0x0008, 0x0060), TYPE_NA, TYPE_NA, TYPE_NA },  // Modality
+  { DCMMPPS_TAG(0x0008, 0x1032), TYPE_3,  TYPE_3,  TYPE_3  },  // Procedure Code Sequence
+  { DCMMPPS_TAG(0x0008, 0x1120), TYPE_NA, TYPE_NA, TYPE_NA },  // Referenced Patient Sequence
+  { DCMMPPS_TAG(0x0010, 0x0010), TYPE_NA, TYPE_NA, TYPE_NA },  // Patient's Name
+  { DCMMPPS_TAG(0x0010, 0x0020), TYPE_NA, TYPE_NA, TYPE_NA },  // Patient ID
+  { DCMMPPS_TAG(0x0010, 0x0030), TYPE_NA, TYPE_NA, TYPE_NA },  // Patient's Birth Date
+  { DCMMPPS_TAG(0x0010, 0x0040), TYPE_NA, TYPE_NA, TYPE_NA },  // Patient's Sex
+  { DCMMPPS_TAG(0x0020, 0x0010), TYPE_NA, TYPE_NA, TYPE_NA },  // Study ID
+  { DCMMPPS_TAG(0x0040, 0x0241), TYPE_NA, TYPE_NA, TYPE_NA },  // Performed Station AE Title
+  { DCMMPPS_TAG(0x0040, 0x0242), TYPE_NA, TYPE_NA, TYPE_NA },  // Performed Station Name
+  { DCMMPPS_TAG(0x0040, 0x0243), TYPE_NA, TYPE_NA, TYPE_NA },  // Performed Location
+  { DCMMPPS_TAG(0x0040, 0x0244), TYPE_NA, TYPE_NA, TYPE_NA },  // Performed Procedure Step Start Date
+  { DCMMPPS_TAG(0x0040, 0x0245), TYPE_NA, TYPE_NA, TYPE_NA },  // Performed Procedure Step Start Time
+  { DCMMPPS_TAG(0x0040, 0x0250), TYPE_3,  TYPE_1,  TYPE_1  },  // Performed Procedure Step End Date
+  { DCMMPPS_TAG(0x0040, 0x0251), TYPE_3,  TYPE_1,  TYPE_1  },  // Performed Procedure Step End Time
+  { DCMMPPS_TAG(0x0040, 0x0252), TYPE_3,  TYPE_1,  TYPE_1  },  // Performed Procedure Step Status
+  { DCMMPPS_TAG(0x0040, 0x0253), TYPE_NA, TYPE_NA, TYPE_NA },  // Performed Procedure Step ID
+  { DCMMPPS_TAG(0x0040, 0x0254), TYPE_3,  TYPE_3,  TYPE_3  },  // Performed Procedure Step Description
+  { DCMMPPS_TAG(0x0040, 0x0255), TYPE_3,  TYPE_3,  TYPE_3  },  // Performed Procedure Type Description
+  { DCMMPPS_TAG(0x0040, 0x0260), TYPE_3,  TYPE_3,  TYPE_3  },  // Performed Protocol Code Sequence
+  { DCMMPPS_TAG(0x0040, 0x0270), TYPE_NA, TYPE_NA, TYPE_NA },  // Scheduled Step Attributes Sequence
+  { DCMMPPS_TAG(0x0040, 0x0280), TYPE_3,  TYPE_3,  TYPE_3  },  // Comments on the Performed Procedure Step
+  { DCMMPPS_TAG(0x0040, 0x0281), TYPE_3,  TYPE_3,  TYPE_3  },  // PPS Discontinuation Reason Code Sequence
+  { DCMMPPS_TAG(0x0040, 0x0340), TYPE_3,  TYPE_1,  TYPE_2  }   // Performed Series Sequence
+};
+
+#define NUMBER_OF(table) (sizeof(table) / sizeof(table[0]))
+
+/* make sure that the presence array of checkRequirements() is large enough */
+typedef char ncreateRequirementsSizeCheck[(NUMBER_OF(ncreateRequirements) <= MAX_REQUIREMENTS) ? 1 : -1];
+typedef char nsetRequirementsSizeCheck[(NUMBER_OF(nsetRequirements) <= MAX_REQUIREMENTS) ? 1 : -1];
+typedef char requirementsMatchCheck[(NUMBER_OF(ncreateRequirements) == NUMBER_OF(nsetRequirements)) ? 1 : -1];
+
+// ----------------------------------------------------------------------------
+
+/* ranks status codes so that the most significant failure is reported */
+static int statusRank(const Uint16 statusCode)
+{
+  switch (statusCode)
+  {
+    case STATUS_N_MissingAttribute:
+      return 3;
+    case STATUS_N_MissingAttributeValue:
+      return 2;
+    case STATUS_N_InvalidAttributeValue:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+void DcmMppsValidationResult::addOffendingElement(const Uint32 tag,
+                                                  const Uint16 statusCode)
+{
+  if (statusRank(statusCode) > statusRank(status))
+    status = statusCode;
+  // further offending elements are silently dropped, the status code is still correct
+  if (numOffending < DCMMPPS_MAX_OFFENDING_ELEMENTS)
+    offending[numOffending++] = tag;
+}
+
+
+DcmDataset *DcmMppsValidationResult::createStatusDetail() const
+{
+  if (numOffending == 0)
+    return NULL;
+
+  DcmDataset *detail = new DcmDataset();
+  // specify the VR explicitly, so that no dictionary lookup is needed
+  DcmAttributeTag *element = new DcmAttributeTag(DcmTag(DCM_OffendingElement, EVR_AT));
+  for (size_t i = 0; i < numOffending; i++)
+  {
+    element->putTagVal(DcmTagKey(OFstatic_cast(Uint16, offending[i] >> 16),
+                                 OFstatic_cast(Uint16, offending[i] & 0xffff)),
+                       OFstatic_cast(unsigned long, i));
+  }
+  if (detail->insert(element).bad())
+    delete element;
+  return detail;
+}
+
+// ----------------------------------------------------------------------------
+
+Uint16 DcmMppsValidator::validateCreateRequest(DcmItem &dataset,
+                                               DcmMppsValidationResult &result)
+{
+  result.clear();
+  checkRequirements(dataset, ncreateRequirements, NUMBER_OF(ncreateRequirements), result);
+  // a new Performed Procedure Step must be created in state IN PROGRESS
+  if ((result.stepStatus != DCMMPPS_STATUS_IN_PROGRESS) && (result.stepStatus != DCMMPPS_STATUS_ABSENT))
+    result.addOffendingElement(DCMMPPS_TAG(0x0040, 0x0252), STATUS_N_InvalidAttributeValue);
+  return result.status;
+}
+
+
+Uint16 DcmMppsValidator::validateSetRequest(DcmItem &dataset,
+                                            DcmMppsValidationResult &result)
+{
+  result.clear();
+  checkRequirements(dataset, nsetRequirements, NUMBER_OF(nsetRequirements), result);
+  return result.status;
+}
+
+
+Uint16 DcmMppsValidator::validateCreateRequest(const DcmMppsRawDataset &dataset,
+                                               DcmMppsValidationResult &result)
+{
+  result.clear();
+  checkRequirements(dataset, ncreateRequirements, NUMBER_OF(ncreateRequirements), result);
+  // a new Performed Procedure Step must be created in state IN PROGRESS
+  if ((result.stepStatus != DCMMPPS_STATUS_IN_PROGRESS) && (result.stepStatus != DCMMPPS_STATUS_ABSENT))
+    result.addOffendingElement(DCMMPPS_TAG(0x0040, 0x0252), STATUS_N_InvalidAttributeValue);
+  return result.status;
+}
+
+
+Uint16 DcmMppsValidator::validateSetRequest(const DcmMppsRawDataset &dataset,
+                                            DcmMppsValidationResult &result)
+{
+  result.clear();
+  checkRequirements(dataset, nsetRequirements, NUMBER_OF(nsetRequirements), result);
+  return result.status;
+}
+
+
+Uint16 DcmMppsValidator::checkFinalState(const Uint32 presentAttributes,
+                                         const Uint32 valuedAttributes,
+                                         DcmMppsValidationResult &result)
+{
+  if ((result.stepStatus != DCMMPPS_STATUS_COMPLETED) && (result.stepStatus != DCMMPPS_STATUS_DISCONTINUED))
+    return result.status;
+  Uint32 present = presentAttributes;
+  Uint32 valued = valuedAttributes;
+  mergeAttributes(present, valued, result);
+  for (size_t pos = 0; pos < NUMBER_OF(nsetRequirements); pos++)
+  {
+    const DcmMppsAttributeRequirement &requirement = nsetRequirements[pos];
+    const DcmMppsAttributeType type = (result.stepStatus == DCMMPPS_STATUS_COMPLETED)
+      ? requirement.completedType : requirement.discontinuedType;
+    const Uint32 bit = OFstatic_cast(Uint32, 1) << pos;
+    if (!(present & bit))
+    {
+      if ((type == DCMMPPS_TYPE_1) || (type == DCMMPPS_TYPE_2))
+        result.addOffendingElement(requirement.tag, STATUS_N_MissingAttribute);
+    }
+    else if (!(valued & bit) && (type == DCMMPPS_TYPE_1))
+      result.addOffendingElement(requirement.tag, STATUS_N_MissingAttributeValue);
+  }
+  return result.status;
+}
+
+
+void DcmMppsValidator::mergeAttributes(Uint32 &presentAttributes,
+                                       Uint32 &valuedAttributes,
+                                       const DcmMppsValidationResult &result)
+{
+  presentAttributes |= result.presentAttributes;
+  valuedAttributes = (valuedAttributes & ~result.presentAttributes) | result.valuedAttributes;
+}
+
+
+DcmMppsStepStatus DcmMppsValidator::classifyStepStatus(DcmElement &element)
+{
+  char *value = NULL;
+  if (element.getString(value).bad() || (value == NULL))
+    return DCMMPPS_STATUS_INVALID;
+  return classifyStepStatus(value, element.getLength());
+}
+
+
+DcmMppsStepStatus DcmMppsValidator::classifyStepStatus(const char *value,
+                                                       size_t length)
+{
+  // ignore trailing padding
+  while ((length > 0) && (value[length - 1] == ' '))
+    --length;
+
+  // the defined terms differ in length, so at most one comparison is needed
+  switch (length)
+  {
+    case 11:
+      if (memcmp(value, "IN PROGRESS", 11) == 0)
+        return DCMMPPS_STATUS_IN_PROGRESS;
+      break;
+    case 9:
+      if (memcmp(value, "COMPLETED", 9) == 0)
+        return DCMMPPS_STATUS_COMPLETED;
+      break;
+    case 12:
+      if (memcmp(value, "DISCONTINUED", 12) == 0)
+        return DCMMPPS_STATUS_DISCONTINUED;
+      break;
+    default:
+      break;
+  }
+  return DCMMPPS_STATUS_INVALID;
+}
+
+
+void DcmMppsValidator::checkRequirements(DcmItem &dataset,
+                                         const DcmMppsAttributeRequirement *table,
+                                         const size_t count,
+                                         DcmMppsValidationResult &result)
+{
+  Uint8 presence[MAX_REQUIREMENTS];
+  size_t pos = 0;
+
+  // walk the dataset and the table in parallel, both are sorted by tag
+  DcmObject *obj = NULL;
+  while ((obj = dataset.nextInContainer(obj)) != NULL)
+  {
+    const Uint32 tag = DCMMPPS_TAG(obj->getGTag(), obj->getETag());
+    while ((pos < count) && (table[pos].tag < tag))
+      presence[pos++] = PRESENCE_ABSENT;
+    if ((pos == count) || (table[pos].tag != tag))
+      continue;
+
+    // determine whether the element has a value
+    OFBool empty;
+    if (obj->ident() == EVR_SQ)
+      empty = (OFstatic_cast(DcmSequenceOfItems *, obj)->card() == 0);
+    else
+      empty = (obj->getLength() == 0);
+    presence[pos] = empty ? PRESENCE_EMPTY : PRESENCE_VALUE;
+    checkElement(table[pos], empty, result);
+
+    // the status decides which final state requirements apply
+    if ((tag == DCMMPPS_TAG(0x0040, 0x0252)) && !empty)
+    {
+      result.stepStatus = classifyStepStatus(*OFstatic_cast(DcmElement *, obj));
+      if (result.stepStatus == DCMMPPS_STATUS_INVALID)
+        result.addOffendingElement(tag, STATUS_N_InvalidAttributeValue);
+    }
+    pos++;
+  }
+  while (pos < count)
+    presence[pos++] = PRESENCE_ABSENT;
+
+  checkPresence(table, count, presence, result);
+}
+
+
+void DcmMppsValidator::checkRequirements(const DcmMppsRawDataset &dataset,
+                                         const DcmMppsAttributeRequirement *table,
+                                         const size_t count,
+                                         DcmMppsValidationResult &result)
+{
+  Uint8 presence[MAX_REQUIREMENTS];
+  size_t pos = 0;
+
+  // same as above, but walking the index of the undecoded dataset
+  const size_t numElements = dataset.getNumberOfElements();
+  for (size_t i = 0; i < numElements; i++)
+  {
+    const DcmMppsRawElement &element = dataset.getElement(i);
+    const Uint32 tag = element.tag;
+    while ((pos < count) && (table[pos].tag < tag))
+      presence[pos++] = PRESENCE_ABSENT;
+    if ((pos == count) || (table[pos].tag != tag))
+      continue;
+
+    presence[pos] = element.empty ? PRESENCE_EMPTY : PRESENCE_VALUE;
+    checkElement(table[pos], element.empty, result);
+
+    // a CS value is the same in any byte order, so it can be classified in place
+    if ((tag == DCMMPPS_TAG(0x0040, 0x0252)) && !element.empty)
+    {
+      result.stepStatus = classifyStepStatus(dataset.getValue(element), element.valueLength);
+      if (result.stepStatus == DCMMPPS_STATUS_INVALID)
+        result.addOffendingElement(tag, STATUS_N_InvalidAttributeValue);
+    }
+    pos++;
+  }
+  while (pos < count)
+    presence[pos++] = PRESENCE_ABSENT;
+
+  checkPresence(table, count, presence, result);
+}
+
+
+void DcmMppsValidator::checkElement(const DcmMppsAttributeRequirement &requirement,
+                                    const OFBool empty,
+                                    DcmMppsValidationResult &result)
+{
+  if (requirement.type == DCMMPPS_TYPE_NOT_ALLOWED)
+    result.addOffendingElement(requirement.tag, STATUS_N_InvalidAttributeValue);
+  else if (empty && (requirement.type == DCMMPPS_TYPE_1))
+    result.addOffendingElement(requirement.tag, STATUS_N_MissingAttributeValue);
+}
+
+
+void DcmMppsValidator::checkPresence(const DcmMppsAttributeRequirement *table,
+                                     const size_t count,
+                                     const Uint8 *presence,
+                                     DcmMppsValidationResult &result)
+{
+  // check the requirements using the recorded presence, the dataset is not visited again
+  for (size_t pos = 0; pos < count; pos++)
+  {
+    if (presence[pos] != PRESENCE_ABSENT)
+      result.presentAttributes |= (OFstatic_cast(Uint32, 1) << pos);
+    if (presence[pos] == PRESENCE_VALUE)
+      result.valuedAttributes |= (OFstatic_cast(Uint32, 1) << pos);
+    // empty type 1 values have already been reported by checkElement()
+    if ((presence[pos] == PRESENCE_ABSENT) && ((table[pos].type == DCMMPPS_TYPE_1) || (table[pos].type == DCMMPPS_TYPE_2)))
+      result.addOffendingElement(table[pos].tag, STATUS_N_MissingAttribute);
+  }
+}
@@ -0,0 +1,262 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Attribute requirement tables and validator for MPPS N-CREATE and N-SET
+ *
+ */
+
+#ifndef DMPPSVAL_H
+#define DMPPSVAL_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+#include "dcmtk/dcmnet/dimse.h"     /* for STATUS_N_xxx codes */
+
+#include "dmppsraw.h"               /* for DcmMppsRawDataset */
+
+/** Build the numeric representation of an attribute tag as used in the requirement
+ *  tables, i.e.\ group number in the upper and element number in the lower 16 bits.
+ *  The tables are sorted by this value, which is also the order of elements in a
+ *  DcmItem.
+ */
+#define DCMMPPS_TAG(group, element) ((OFstatic_cast(Uint32, group) << 16) | OFstatic_cast(Uint32, element))
+
+/** Maximum number of offending elements reported in a single response
+ */
+#define DCMMPPS_MAX_OFFENDING_ELEMENTS 16
+
+/** Requirement type of an attribute in an MPPS request
+ */
+enum DcmMppsAttributeType
+{
+  /// Type 1: attribute must be present and must have a value
+  DCMMPPS_TYPE_1,
+  /// Type 2: attribute must be present but may be empty
+  DCMMPPS_TYPE_2,
+  /// Type 3: attribute is optional
+  DCMMPPS_TYPE_3,
+  /// Attribute must not be sent in this request (N-SET only)
+  DCMMPPS_TYPE_NOT_ALLOWED
+};
+
+/** Performed Procedure Step Status (0040,0252) as classified by the validator
+ */
+enum DcmMppsStepStatus
+{
+  /// attribute not present in the dataset
+  DCMMPPS_STATUS_ABSENT,
+  /// "IN PROGRESS"
+  DCMMPPS_STATUS_IN_PROGRESS,
+  /// "COMPLETED"
+  DCMMPPS_STATUS_COMPLETED,
+  /// "DISCONTINUED"
+  DCMMPPS_STATUS_DISCONTINUED,
+  /// any other (invalid) value
+  DCMMPPS_STATUS_INVALID
+};
+
+/** A single entry of an attribute requirement table. The tables are plain arrays of
+ *  this structure that are constant-initialized at compile time.
+ */
+struct DcmMppsAttributeRequirement
+{
+  /// attribute tag, see DCMMPPS_TAG()
+  Uint32 tag;
+  /// requirement type of the attribute in the request itself
+  DcmMppsAttributeType type;
+  /// requirement type if the request sets the status to COMPLETED
+  DcmMppsAttributeType completedType;
+  /// requirement type if the request sets the status to DISCONTINUED
+  DcmMppsAttributeType discontinuedType;
+};
+
+/** Result of validating an MPPS request dataset
+ */
+struct DcmMppsValidationResult
+{
+  DcmMppsValidationResult()
+    : status(STATUS_Success)
+    , stepStatus(DCMMPPS_STATUS_ABSENT)
+    , presentAttributes(0)
+    , valuedAttributes(0)
+    , numOffending(0)
+  {
+  }
+
+  /** Reset the result so that it can be reused for another message
+   */
+  void clear()
+  {
+    status = STATUS_Success;
+    stepStatus = DCMMPPS_STATUS_ABSENT;
+    presentAttributes = 0;
+    valuedAttributes = 0;
+    numOffending = 0;
+  }
+
+  /** Add an offending element and update the status code. Missing attributes take
+   *  precedence over missing values, which take precedence over invalid values.
+   *  @param tag        [in] The offending attribute, see DCMMPPS_TAG()
+   *  @param statusCode [in] The status code caused by this attribute
+   */
+  void addOffendingElement(const Uint32 tag,
+                           const Uint16 statusCode);
+
+  /** Create a status detail dataset containing the Offending Element (0000,0901) list.
+   *  @return new dataset to be deleted by the caller, NULL if there is no offending element
+   */
+  DcmDataset *createStatusDetail() const;
+
+  /// response status code, STATUS_Success if the dataset is valid
+  Uint16 status;
+  /// Performed Procedure Step Status found in the dataset
+  DcmMppsStepStatus stepStatus;
+  /// attributes present in the dataset, one bit per entry of the requirement table
+  Uint32 presentAttributes;
+  /// attributes with a value in the dataset, one bit per entry of the requirement table
+  Uint32 valuedAttributes;
+  /// number of valid entries in offending[]
+  size_t numOffending;
+  /// offending attributes, see DCMMPPS_TAG()
+  Uint32 offending[DCMMPPS_MAX_OFFENDING_ELEMENTS];
+};
+
+/** Validator for the datasets of MPPS N-CREATE and N-SET requests. The requirement
+ *  tables are sorted by tag, so that each dataset is checked in a single linear pass
+ *  over its top-level elements. Tags are compared numerically, i.e.\ neither the data
+ *  dictionary nor any string comparison is needed.
+ */
+class DcmMppsValidator
+{
+
+  public:
+
+  /** Validate the dataset of an N-CREATE request.
+   *  @param dataset [in]  The received dataset
+   *  @param result  [out] The validation result including offending elements
+   *  @return response status code, STATUS_Success if the dataset is valid
+   */
+  static Uint16 validateCreateRequest(DcmItem &dataset,
+                                      DcmMppsValidationResult &result);
+
+  /** Validate the undecoded dataset of an N-CREATE request, see above
+   *  @param dataset [in]  The received dataset, must be indexed
+   *  @param result  [out] The validation result including offending elements
+   *  @return response status code, STATUS_Success if the dataset is valid
+   */
+  static Uint16 validateCreateRequest(const DcmMppsRawDataset &dataset,
+                                      DcmMppsValidationResult &result);
+
+  /** Validate the dataset of an N-SET request. The requirements of the final state
+   *  apply to the instance rather than to the request, so they are checked separately
+   *  with checkFinalState().
+   *  @param dataset [in]  The received dataset
+   *  @param result  [out] The validation result including offending elements
+   *  @return response status code, STATUS_Success if the dataset is valid
+   */
+  static Uint16 validateSetRequest(DcmItem &dataset,
+                                   DcmMppsValidationResult &result);
+
+  /** Validate the undecoded dataset of an N-SET request, see above
+   *  @param dataset [in]  The received dataset, must be indexed
+   *  @param result  [out] The validation result including offending elements
+   *  @return response status code, STATUS_Success if the dataset is valid
+   */
+  static Uint16 validateSetRequest(const DcmMppsRawDataset &dataset,
+                                   DcmMppsValidationResult &result);
+
+  /** Check the requirements of the final state (DICOM PS3.4, Section F.7.2.2) if an
+   *  N-SET request sets the Performed Procedure Step Status to COMPLETED or
+   *  DISCONTINUED. The attributes may have been sent with the N-CREATE or any N-SET
+   *  of the instance, so they are checked on the attributes of the instance merged
+   *  with those of the request, see mergeAttributes().
+   *  @param presentAttributes [in]    Attributes present in the instance before the
+   *                                   request, see DcmMppsValidationResult
+   *  @param valuedAttributes  [in]    Attributes with a value in the instance before
+   *                                   the request
+   *  @param result            [inout] The validation result of the N-SET request
+   *  @return response status code, STATUS_Success if the final state is valid
+   */
+  static Uint16 checkFinalState(const Uint32 presentAttributes,
+                                const Uint32 valuedAttributes,
+                                DcmMppsValidationResult &result);
+
+  /** Merge the attributes of a validated request into those of the instance. An
+   *  attribute sent with the request replaces the one of the instance, i.e.\ an empty
+   *  value replaces a non-empty one.
+   *  @param presentAttributes [inout] Attributes present in the instance
+   *  @param valuedAttributes  [inout] Attributes with a value in the instance
+   *  @param result            [in]    The validation result of the request
+   */
+  static void mergeAttributes(Uint32 &presentAttributes,
+                              Uint32 &valuedAttributes,
+                              const DcmMppsValidationResult &result);
+
+  /** Classify the value of a Performed Procedure Step Status element, see below
+   *  @param element [in] The Performed Procedure Step Status element
+   *  @return the classified status
+   */
+  static DcmMppsStepStatus classifyStepStatus(DcmElement &element);
+
+  /** Classify a Performed Procedure Step Status value. The defined terms differ in
+   *  length, so the value is compared with at most one of them.
+   *  @param value  [in] The value (not necessarily null-terminated)
+   *  @param length [in] Length of the value including any trailing padding
+   *  @return the classified status
+   */
+  static DcmMppsStepStatus classifyStepStatus(const char *value,
+                                              size_t length);
+
+  protected:
+
+  /** Check a dataset against a requirement table in one pass over its top-level
+   *  elements. The presence of each table entry is recorded, so that the final state
+   *  requirements can be checked afterwards without visiting the dataset again.
+   *  @param dataset [in]    The dataset to check
+   *  @param table   [in]    The requirement table, sorted by tag
+   *  @param count   [in]    Number of entries in the table
+   *  @param result  [inout] The validation result
+   */
+  static void checkRequirements(DcmItem &dataset,
+                                const DcmMppsAttributeRequirement *table,
+                                const size_t count,
+                                DcmMppsValidationResult &result);
+
+  /** Check an undecoded dataset against a requirement table in one pass over its
+   *  index, see above
+   *  @param dataset [in]    The dataset to check, must be indexed
+   *  @param table   [in]    The requirement table, sorted by tag
+   *  @param count   [in]    Number of entries in the table
+   *  @param result  [inout] The validation result
+   */
+  static void checkRequirements(const DcmMppsRawDataset &dataset,
+                                const DcmMppsAttributeRequirement *table,
+                                const size_t count,
+                                DcmMppsValidationResult &result);
+
+  /** Check a single element present in the dataset against its table entry
+   *  @param requirement [in]    The table entry of the element
+   *  @param empty       [in]    OFTrue if the element has no value
+   *  @param result      [inout] The validation result
+   */
+  static void checkElement(const DcmMppsAttributeRequirement &requirement,
+                           const OFBool empty,
+                           DcmMppsValidationResult &result);
+
+  /** Check the recorded presence of all table entries against the requirements of
+   *  the request itself
+   *  @param table    [in]    The requirement table, sorted by tag
+   *  @param count    [in]    Number of entries in the table
+   *  @param presence [in]    Presence of each table entry in the dataset
+   *  @param result   [inout] The validation result
+   */
+  static void checkPresence(const DcmMppsAttributeRequirement *table,
+                            const size_t count,
+                            const Uint8 *presence,
+                            DcmMppsValidationResult &result);
+
+};
+
+#endif // DMPPSVAL_H
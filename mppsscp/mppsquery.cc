@@ -0,0 +1,227 @@
+/*
+ *
+ *  Module:  mppsscp
+ *
+ *  Purpose: Query the MPPS store of a running mppsrecv via its local query socket
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"   /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstd.h"       /* for OFStandard functions */
+#include "dcmtk/ofstd/ofconapp.h"    /* for OFConsoleApplication */
+#include "dcmtk/ofstd/ofstream.h"    /* for OFStringStream et al. */
+#include "dcmtk/dcmdata/dcuid.h"     /* for dcmtk version name */
+#include "dcmtk/dcmdata/cmdlnarg.h"  /* for prepareCmdLineArgs */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/* general definitions */
+
+#define OFFIS_CONSOLE_APPLICATION "mppsquery"
+
+static OFLogger mppsqueryLogger = OFLog::getLogger("dcmtk.apps." OFFIS_CONSOLE_APPLICATION);
+
+static char rcsid[] = "$dcmtk: " OFFIS_CONSOLE_APPLICATION " v"
+  OFFIS_DCMTK_VERSION " " OFFIS_DCMTK_RELEASEDATE " $";
+
+
+/* exit codes for this command line tool */
+/* (EXIT_SUCCESS and EXIT_FAILURE are standard codes) */
+
+// general
+#define EXITCODE_NO_ERROR                         0
+#define EXITCODE_COMMANDLINE_SYNTAX_ERROR         1
+
+// network errors
+#define EXITCODE_CANNOT_CONNECT                  64
+#define EXITCODE_QUERY_FAILED                    65
+
+
+/* helper macro for converting stream output to a string */
+#define CONVERT_TO_STRING(output, string) \
+    optStream.str(""); \
+    optStream.clear(); \
+    optStream << output << OFStringStream_ends; \
+    OFSTRINGSTREAM_GETOFSTRING(optStream, string)
+
+
+/* main program */
+
+#define SHORTCOL 4
+#define LONGCOL 21
+
+int main(int argc, char *argv[])
+{
+    OFOStringStream optStream;
+
+    const char *opt_socketPath = NULL;
+    const char *opt_key = NULL;
+    const char *opt_value = NULL;
+    OFCmdUnsignedInt opt_maxResults = 100;
+
+    OFConsoleApplication app(OFFIS_CONSOLE_APPLICATION , "Query the MPPS store of a running mppsrecv", rcsid);
+    OFCommandLine cmd;
+
+    cmd.setParamColumn(LONGCOL + SHORTCOL + 4);
+    cmd.addParam("socket", "file name of the query socket (see mppsrecv --query-socket)");
+
+    cmd.setOptionColumns(LONGCOL, SHORTCOL);
+    cmd.addGroup("general options:", LONGCOL, SHORTCOL + 2);
+      cmd.addOption("--help",                  "-h",      "print this help text and exit", OFCommandLine::AF_Exclusive);
+      cmd.addOption("--version",                          "print version information and exit", OFCommandLine::AF_Exclusive);
+      OFLog::addOptions(cmd);
+
+    cmd.addGroup("query keys (exactly one required):");
+      cmd.addOption("--instance-uid",          "-uid", 1, "[u]id: string",
+                                                          "find by SOP Instance UID");
+      cmd.addOption("--patient-id",            "-pid", 1, "[i]d: string",
+                                                          "find by Patient ID");
+      cmd.addOption("--accession",             "-acc", 1, "[n]umber: string",
+                                                          "find by Accession Number");
+      cmd.addOption("--station",               "-sta", 1, "[a]etitle: string",
+                                                          "find by Performed Station AE Title");
+      cmd.addOption("--status",                "-st",  1, "[s]tatus: string",
+                                                          "find by status (IN PROGRESS, COMPLETED\nor DISCONTINUED)");
+      cmd.addOption("--start-date",            "-sd",  1, "[r]ange: YYYYMMDD-YYYYMMDD",
+                                                          "find by start date (either bound optional)");
+      cmd.addOption("--stats",                 "-sts",    "print statistics of each shard of the store\n"
+                                                          "(shard, instances, memory, arena blocks, read\n"
+                                                          "locks, contentions, write locks, contentions)");
+    cmd.addGroup("output options:");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_maxResults << ")", optString1);
+      cmd.addOption("--max-results",           "-max", 1, optString1.c_str(),
+                                                          "return at most n instances");
+
+    /* evaluate command line */
+    prepareCmdLineArgs(argc, argv, OFFIS_CONSOLE_APPLICATION);
+    if (app.parseCommandLine(cmd, argc, argv))
+    {
+        /* check exclusive options first */
+        if (cmd.hasExclusiveOption())
+        {
+            if (cmd.findOption("--version"))
+            {
+                app.printHeader(OFTrue /*print host identifier*/);
+                COUT << OFendl << "External libraries used: none" << OFendl;
+                return EXITCODE_NO_ERROR;
+            }
+        }
+
+        /* general options */
+        OFLog::configureFromCommandLine(cmd, app);
+
+        cmd.beginOptionBlock();
+        if (cmd.findOption("--instance-uid"))
+        {
+            app.checkValue(cmd.getValue(opt_value));
+            opt_key = "UID";
+        }
+        if (cmd.findOption("--patient-id"))
+        {
+            app.checkValue(cmd.getValue(opt_value));
+            opt_key = "PATIENT";
+        }
+        if (cmd.findOption("--accession"))
+        {
+            app.checkValue(cmd.getValue(opt_value));
+            opt_key = "ACCESSION";
+        }
+        if (cmd.findOption("--station"))
+        {
+            app.checkValue(cmd.getValue(opt_value));
+            opt_key = "STATION";
+        }
+        if (cmd.findOption("--status"))
+        {
+            app.checkValue(cmd.getValue(opt_value));
+            opt_key = "STATUS";
+        }
+        if (cmd.findOption("--start-date"))
+        {
+            app.checkValue(cmd.getValue(opt_value));
+            opt_key = "DATE";
+        }
+        if (cmd.findOption("--stats"))
+            opt_key = "STATS";
+        cmd.endOptionBlock();
+
+        if (cmd.findOption("--max-results"))
+        {
+            app.checkConflict("--max-results", "--stats", (opt_key != NULL) && (opt_value == NULL));
+            app.checkValue(cmd.getValueAndCheckMin(opt_maxResults, 1));
+        }
+
+        /* command line parameters */
+        cmd.getParam(1, opt_socketPath);
+    }
+
+    /* print resource identifier */
+    OFLOG_DEBUG(mppsqueryLogger, rcsid << OFendl);
+
+    if (opt_key == NULL)
+    {
+        OFLOG_FATAL(mppsqueryLogger, "no query key specified");
+        return EXITCODE_COMMANDLINE_SYNTAX_ERROR;
+    }
+
+    /* connect to the query socket */
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    if (strlen(opt_socketPath) >= sizeof(address.sun_path))
+    {
+        OFLOG_FATAL(mppsqueryLogger, "socket file name too long: " << opt_socketPath);
+        return EXITCODE_COMMANDLINE_SYNTAX_ERROR;
+    }
+    address.sun_family = AF_UNIX;
+    OFStandard::strlcpy(address.sun_path, opt_socketPath, sizeof(address.sun_path));
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((sock < 0) || (connect(sock, OFreinterpret_cast(struct sockaddr *, &address), sizeof(address)) < 0))
+    {
+        OFLOG_FATAL(mppsqueryLogger, "cannot connect to " << opt_socketPath << ": "
+            << OFStandard::getLastSystemErrorCode().message());
+        if (sock >= 0)
+            close(sock);
+        return EXITCODE_CANNOT_CONNECT;
+    }
+
+    /* send the request line */
+    OFString request;
+    if (opt_value == NULL)
+        request = opt_key;
+    else
+    {
+        CONVERT_TO_STRING(opt_key << " " << opt_maxResults << " " << opt_value, request);
+    }
+    OFLOG_DEBUG(mppsqueryLogger, "sending request: " << request);
+    request += "\n";
+    if (send(sock, request.c_str(), request.length(), MSG_NOSIGNAL) != OFstatic_cast(ssize_t, request.length()))
+    {
+        OFLOG_FATAL(mppsqueryLogger, "cannot send query request");
+        close(sock);
+        return EXITCODE_QUERY_FAILED;
+    }
+
+    /* copy the response to standard output */
+    OFString response;
+    char buffer[4096];
+    ssize_t bytes;
+    while ((bytes = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        response.append(buffer, OFstatic_cast(size_t, bytes));
+    close(sock);
+
+    COUT << response;
+    if ((response.compare(0, 6, "ERROR ") == 0) || (response.find("END ") == OFString_npos))
+    {
+        OFLOG_ERROR(mppsqueryLogger, "query failed");
+        return EXITCODE_QUERY_FAILED;
+    }
+
+    return EXITCODE_NO_ERROR;
+}
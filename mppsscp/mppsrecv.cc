@@ -29,6 +29,19 @@
 #include "dcmtk/dcmdata/dcuid.h"     /* for dcmtk version name */
 #include "dcmtk/dcmdata/cmdlnarg.h"  /* for prepareCmdLineArgs */
 #include "dmppsscp.h"   /* for DcmMppsSCP */
+#include "dmppsqry.h"   /* for DcmMppsQueryServer */
+#include "dmppsexp.h"   /* for DcmMppsEventExporter */
+#include "dmppstrace.h" /* for DcmMppsTraceFile */
+#include "dmppsmetr.h"  /* for DcmMppsMetrics, DcmSvcMetricsServer */
+#include "dsvctime.h"   /* for DcmSvcTimeline */
+#include "dsvcslow.h"   /* for DcmSvcSlowLog */
+#include "dsvcdbg.h"    /* for DcmSvcDebugFilter */
+
+#ifdef WITH_ZLIB
+#include <zlib.h>                     /* for zlibVersion() */
+#endif
+
+#include <signal.h>                   /* for SIGUSR1 */
 
 
 /* general definitions */
@@ -49,9 +62,20 @@ static char rcsid[] = "$dcmtk: " OFFIS_CONSOLE_APPLICATION " v"
 
 // general
 #define EXITCODE_NO_ERROR                         0
+#define EXITCODE_COMMANDLINE_SYNTAX_ERROR         1
+
+// input file errors
+#define EXITCODE_CANNOT_LOAD_NEGOTIATION_POLICY  20
 
 // network errors
 #define EXITCODE_CANNOT_START_SCP_AND_LISTEN     64
+#define EXITCODE_CANNOT_START_QUERY_SERVER       65
+#define EXITCODE_CANNOT_START_EXPORT             66
+#define EXITCODE_CANNOT_START_LOGGING            67
+#define EXITCODE_CANNOT_START_TRACE              68
+#define EXITCODE_CANNOT_START_METRICS            69
+#define EXITCODE_CANNOT_START_TIMELINE           70
+#define EXITCODE_CANNOT_START_SLOW_LOG           71
 
 
 /* helper macro for converting stream output to a string */
@@ -80,8 +104,38 @@ int main(int argc, char *argv[])
     T_DIMSE_BlockingMode opt_blockingMode = DIMSE_BLOCKING;
 
     OFBool opt_showPresentationContexts = OFFalse;  // default: do not show presentation contexts in verbose mode
+    OFBool opt_asyncLogging = OFFalse;              // default: dump messages in the network thread
+    OFList<OFString> opt_debugRules;                // default: debug output as by log level only
     OFBool opt_useCalledAETitle = OFFalse;          // default: respond with specified application entity title
     OFBool opt_HostnameLookup = OFTrue;             // default: perform hostname lookup (for log output)
+    OFBool opt_lazyDecoding = OFFalse;              // default: decode received datasets completely
+    OFCmdUnsignedInt opt_spoolThreshold = 0;        // default: receive datasets in memory
+    const char *opt_spoolDirectory = "/tmp";
+    const char *opt_negotiationPolicy = NULL;       // default: keep configuration order (deflated first)
+    OFBool opt_useStore = OFFalse;                  // default: accept any N-CREATE and N-SET
+    const char *opt_querySocket = NULL;             // default: no query interface
+    OFCmdUnsignedInt opt_finalRetention = DCMMPPS_DEFAULT_FINAL_RETENTION;
+    OFCmdUnsignedInt opt_staleTimeout = DCMMPPS_DEFAULT_STALE_TIMEOUT;
+    OFCmdUnsignedInt opt_maxStoreMemory = DCMMPPS_DEFAULT_MAX_MEMORY;
+    OFCmdUnsignedInt opt_storeShards = DCMMPPS_DEFAULT_SHARDS;
+    const char *opt_exportFile = NULL;              // default: no event export
+    OFCmdUnsignedInt opt_exportMaxSize = 0;         // default: no rotation
+    OFCmdUnsignedInt opt_exportMaxFiles = 5;
+    const char *opt_traceFile = NULL;               // default: no DIMSE trace
+    OFCmdUnsignedInt opt_traceMaxRecords = DCMMPPS_TRACE_DEFAULT_RECORDS;
+    OFCmdUnsignedInt opt_traceMaxFiles = 5;
+    const char *opt_timelineFile = NULL;            // default: no timeline
+    const char *opt_slowLogFile = NULL;             // default: no slow operation log
+    OFCmdUnsignedInt opt_slowThreshold = DCMSVC_SLOW_DEFAULT_THRESHOLD;
+    OFCmdUnsignedInt opt_slowEchoThreshold = 0;     // default: as for all operations
+    OFCmdUnsignedInt opt_slowCreateThreshold = 0;
+    OFCmdUnsignedInt opt_slowSetThreshold = 0;
+    OFBool opt_slowEcho = OFFalse;
+    OFBool opt_slowCreate = OFFalse;
+    OFBool opt_slowSet = OFFalse;
+    OFCmdUnsignedInt opt_slowRateLimit = DCMSVC_SLOW_DEFAULT_RATE;
+    OFCmdUnsignedInt opt_metricsPort = 0;           // default: no metrics endpoint
+    const char *opt_metricsAddress = "127.0.0.1";   // default: local scrapers only
 
     OFConsoleApplication app(OFFIS_CONSOLE_APPLICATION , "Simple DICOM MPPS SCP (receiver)", rcsid);
     OFCommandLine cmd;
@@ -95,6 +149,13 @@ int main(int argc, char *argv[])
       cmd.addOption("--version",                          "print version information and exit", OFCommandLine::AF_Exclusive);
       OFLog::addOptions(cmd);
       cmd.addOption("--verbose-pc",            "+v",      "show presentation contexts in verbose mode");
+      cmd.addOption("--async-logging",         "-al",     "dump received messages in a separate thread\n"
+                                                          "(dropped if it cannot keep up)");
+      cmd.addOption("--debug-peer",            "-dp",  1, "[r]ule: string",
+                                                          "write debug output of matching associations\n"
+                                                          "regardless of the log level; r = ae=TITLE,\n"
+                                                          "ip=ADDRESS or uid=UID, optionally followed\n"
+                                                          "by ,trace to include datasets (repeatable)");
 
     cmd.addGroup("network options:");
       cmd.addSubGroup("application entity title:");
@@ -112,6 +173,95 @@ int main(int argc, char *argv[])
         cmd.addOption("--max-pdu",             "-pdu", 1, optString3.c_str(),
                                                           optString4.c_str());
         cmd.addOption("--disable-host-lookup", "-dhl",    "disable hostname lookup");
+        cmd.addOption("--lazy-decoding",       "-ld",     "keep received datasets encoded and decode\n"
+                                                          "only the attributes needed");
+        cmd.addOption("--spool-threshold",     "-spt", 1, "[k]B: integer (default: never)",
+                                                          "spool received datasets larger than k kB\n"
+                                                          "to disk while receiving them");
+        CONVERT_TO_STRING("[d]irectory: string (default: " << opt_spoolDirectory << ")", optString7);
+        cmd.addOption("--spool-directory",     "-spd", 1, optString7.c_str(),
+                                                          "create spool files in directory d");
+        cmd.addOption("--negotiation-policy",  "-np",  1, "[f]ilename: string",
+                                                          "rank transfer syntaxes (per calling AE) as\n"
+                                                          "in file f (default: configuration order,\n"
+                                                          "i.e. deflated first)");
+
+    cmd.addGroup("mpps store options:");
+      cmd.addOption("--store",                 "+ms",     "keep track of MPPS instances, i.e. refuse\n"
+                                                          "duplicate N-CREATE and N-SET of unknown or\n"
+                                                          "completed instances (default: accept all)");
+      cmd.addOption("--query-socket",          "-qs",  1, "[f]ilename: string",
+                                                          "answer queries (see mppsquery) on Unix\n"
+                                                          "domain socket f");
+      CONVERT_TO_STRING("[s]econds: integer (default: " << opt_finalRetention << ")", optString13);
+      cmd.addOption("--final-retention",       "-fr",  1, optString13.c_str(),
+                                                          "remove completed/discontinued instances\n"
+                                                          "after s seconds (0 = never)");
+      CONVERT_TO_STRING("[s]econds: integer (default: " << opt_staleTimeout << ")", optString14);
+      cmd.addOption("--stale-timeout",         "-st",  1, optString14.c_str(),
+                                                          "remove instances in progress after s seconds\n"
+                                                          "without update (0 = never)");
+      CONVERT_TO_STRING("[n]umber of MB: integer (default: " << opt_maxStoreMemory << ")", optString15);
+      cmd.addOption("--max-store-memory",      "-msm", 1, optString15.c_str(),
+                                                          "evict oldest instances if the store exceeds\n"
+                                                          "n MB (completed/discontinued ones first,\n"
+                                                          "0 = unlimited)");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_storeShards << ")", optString5);
+      cmd.addOption("--store-shards",          "-ss",  1, optString5.c_str(),
+                                                          "partition the store into n independently\n"
+                                                          "locked shards");
+
+    cmd.addGroup("export options:");
+      cmd.addOption("--export-file",           "-ef",  1, "[f]ilename: string",
+                                                          "write accepted N-CREATE/N-SET as JSON lines\n"
+                                                          "to file or named pipe f");
+      cmd.addOption("--export-max-size",       "-ems", 1, "[n]umber of MB: integer",
+                                                          "rotate export file after n MB (default: never)");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_exportMaxFiles << ")", optString6);
+      cmd.addOption("--export-max-files",      "-emf", 1, optString6.c_str(),
+                                                          "keep n rotated export files");
+
+    cmd.addGroup("trace options:");
+      cmd.addOption("--trace-file",            "-tf",  1, "[f]ilename: string",
+                                                          "write a binary record of each handled request\n"
+                                                          "to file f (decode with dimsetrace)");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_traceMaxRecords << ")", optString8);
+      cmd.addOption("--trace-max-records",     "-tmr", 1, optString8.c_str(),
+                                                          "rotate trace file after n records");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_traceMaxFiles << ")", optString9);
+      cmd.addOption("--trace-max-files",       "-tmf", 1, optString9.c_str(),
+                                                          "keep n rotated trace files");
+      cmd.addOption("--timeline-file",         "-tlf", 1, "[f]ilename: string",
+                                                          "write associations and requests as Chrome\n"
+                                                          "trace events to file f (for Perfetto)");
+      cmd.addOption("--slow-log-file",         "-slf", 1, "[f]ilename: string",
+                                                          "append a diagnostic record of each request\n"
+                                                          "exceeding its threshold to file f");
+      CONVERT_TO_STRING("[m]s: integer (default: " << opt_slowThreshold << ")", optString11);
+      cmd.addOption("--slow-threshold",        "-sth", 1, optString11.c_str(),
+                                                          "threshold of all operations");
+      cmd.addOption("--slow-echo",             "-sle", 1, "[m]s: integer",
+                                                          "threshold of C-ECHO requests");
+      cmd.addOption("--slow-create",           "-slc", 1, "[m]s: integer",
+                                                          "threshold of N-CREATE requests");
+      cmd.addOption("--slow-set",              "-sls", 1, "[m]s: integer",
+                                                          "threshold of N-SET requests");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_slowRateLimit << ")", optString12);
+      cmd.addOption("--slow-rate-limit",       "-slr", 1, optString12.c_str(),
+                                                          "log at most n slow requests per minute\n"
+                                                          "(0 = unlimited)");
+
+    cmd.addGroup("metrics options:");
+      cmd.addOption("--metrics-port",          "-mp",  1, "[p]ort: integer (1..65535)",
+                                                          "serve Prometheus metrics via HTTP on port p\n"
+                                                          "(path /metrics) and peer statistics in JSON\n"
+                                                          "(path /peers, also printed on SIGUSR1); if\n"
+                                                          "bound to a loopback address, the debug rules\n"
+                                                          "are listed on path /debug and changed by POST\n"
+                                                          "/debug?add=r, /debug?remove=r or /debug?clear");
+      CONVERT_TO_STRING("[a]ddress: string (default: " << opt_metricsAddress << ")", optString10);
+      cmd.addOption("--metrics-address",       "-ma",  1, optString10.c_str(),
+                                                          "serve metrics on IPv4 address a only");
 
     /* evaluate command line */
     prepareCmdLineArgs(argc, argv, OFFIS_CONSOLE_APPLICATION);
@@ -123,7 +273,12 @@ int main(int argc, char *argv[])
             if (cmd.findOption("--version"))
             {
                 app.printHeader(OFTrue /*print host identifier*/);
+#if !defined(WITH_ZLIB)
                 COUT << OFendl << "External libraries used: none" << OFendl;
+#else
+                COUT << OFendl << "External libraries used:" << OFendl;
+                COUT << "- ZLIB, Version " << zlibVersion() << OFendl;
+#endif
                 return EXITCODE_NO_ERROR;
             }
         }
@@ -135,6 +290,17 @@ int main(int argc, char *argv[])
             app.checkDependence("--verbose-pc", "verbose mode", dcmrecvLogger.isEnabledFor(OFLogger::INFO_LOG_LEVEL));
             opt_showPresentationContexts = OFTrue;
         }
+        if (cmd.findOption("--async-logging"))
+            opt_asyncLogging = OFTrue;
+        if (cmd.findOption("--debug-peer", 0, OFCommandLine::FOM_FirstFromLeft))
+        {
+            const char *rule = NULL;
+            do
+            {
+                app.checkValue(cmd.getValue(rule));
+                opt_debugRules.push_back(rule);
+            } while (cmd.findOption("--debug-peer", 0, OFCommandLine::FOM_NextFromLeft));
+        }
 
         cmd.beginOptionBlock();
         if (cmd.findOption("--aetitle"))
@@ -157,6 +323,111 @@ int main(int argc, char *argv[])
             app.checkValue(cmd.getValueAndCheckMinMax(opt_maxPDULength, ASC_MINIMUMPDUSIZE, ASC_MAXIMUMPDUSIZE));
         if (cmd.findOption("--disable-host-lookup"))
             opt_HostnameLookup = OFFalse;
+        if (cmd.findOption("--lazy-decoding"))
+            opt_lazyDecoding = OFTrue;
+        if (cmd.findOption("--spool-threshold"))
+            app.checkValue(cmd.getValueAndCheckMin(opt_spoolThreshold, 1));
+        if (cmd.findOption("--spool-directory"))
+        {
+            app.checkDependence("--spool-directory", "--spool-threshold", opt_spoolThreshold > 0);
+            app.checkValue(cmd.getValue(opt_spoolDirectory));
+        }
+        if (cmd.findOption("--negotiation-policy"))
+            app.checkValue(cmd.getValue(opt_negotiationPolicy));
+
+        if (cmd.findOption("--store"))
+            opt_useStore = OFTrue;
+        if (cmd.findOption("--query-socket"))
+        {
+            app.checkDependence("--query-socket", "--store", opt_useStore);
+            app.checkValue(cmd.getValue(opt_querySocket));
+        }
+        if (cmd.findOption("--final-retention"))
+        {
+            app.checkDependence("--final-retention", "--store", opt_useStore);
+            app.checkValue(cmd.getValue(opt_finalRetention));
+        }
+        if (cmd.findOption("--stale-timeout"))
+        {
+            app.checkDependence("--stale-timeout", "--store", opt_useStore);
+            app.checkValue(cmd.getValue(opt_staleTimeout));
+        }
+        if (cmd.findOption("--max-store-memory"))
+        {
+            app.checkDependence("--max-store-memory", "--store", opt_useStore);
+            app.checkValue(cmd.getValue(opt_maxStoreMemory));
+        }
+        if (cmd.findOption("--store-shards"))
+        {
+            app.checkDependence("--store-shards", "--store", opt_useStore);
+            app.checkValue(cmd.getValueAndCheckMinMax(opt_storeShards, 1, 4096));
+        }
+
+        if (cmd.findOption("--export-file"))
+            app.checkValue(cmd.getValue(opt_exportFile));
+        if (cmd.findOption("--export-max-size"))
+        {
+            app.checkDependence("--export-max-size", "--export-file", opt_exportFile != NULL);
+            app.checkValue(cmd.getValueAndCheckMin(opt_exportMaxSize, 1));
+        }
+        if (cmd.findOption("--export-max-files"))
+        {
+            app.checkDependence("--export-max-files", "--export-max-size", opt_exportMaxSize > 0);
+            app.checkValue(cmd.getValueAndCheckMin(opt_exportMaxFiles, 1));
+        }
+
+        if (cmd.findOption("--trace-file"))
+            app.checkValue(cmd.getValue(opt_traceFile));
+        if (cmd.findOption("--trace-max-records"))
+        {
+            app.checkDependence("--trace-max-records", "--trace-file", opt_traceFile != NULL);
+            app.checkValue(cmd.getValueAndCheckMinMax(opt_traceMaxRecords, 1, 16777216));
+        }
+        if (cmd.findOption("--trace-max-files"))
+        {
+            app.checkDependence("--trace-max-files", "--trace-file", opt_traceFile != NULL);
+            app.checkValue(cmd.getValueAndCheckMin(opt_traceMaxFiles, 0));
+        }
+        if (cmd.findOption("--timeline-file"))
+            app.checkValue(cmd.getValue(opt_timelineFile));
+        if (cmd.findOption("--slow-log-file"))
+            app.checkValue(cmd.getValue(opt_slowLogFile));
+        if (cmd.findOption("--slow-threshold"))
+        {
+            app.checkDependence("--slow-threshold", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowThreshold));
+        }
+        if (cmd.findOption("--slow-echo"))
+        {
+            app.checkDependence("--slow-echo", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowEchoThreshold));
+            opt_slowEcho = OFTrue;
+        }
+        if (cmd.findOption("--slow-create"))
+        {
+            app.checkDependence("--slow-create", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowCreateThreshold));
+            opt_slowCreate = OFTrue;
+        }
+        if (cmd.findOption("--slow-set"))
+        {
+            app.checkDependence("--slow-set", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowSetThreshold));
+            opt_slowSet = OFTrue;
+        }
+        if (cmd.findOption("--slow-rate-limit"))
+        {
+            app.checkDependence("--slow-rate-limit", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowRateLimit));
+        }
+
+        if (cmd.findOption("--metrics-port"))
+            app.checkValue(cmd.getValueAndCheckMinMax(opt_metricsPort, 1, 65535));
+        if (cmd.findOption("--metrics-address"))
+        {
+            app.checkDependence("--metrics-address", "--metrics-port", opt_metricsPort > 0);
+            app.checkValue(cmd.getValue(opt_metricsAddress));
+        }
 
       /* command line parameters */
       app.checkParam(cmd.getParamAndCheckMinMax(1, opt_port, 1, 65535));
@@ -174,6 +445,16 @@ int main(int argc, char *argv[])
 
     /* start with the real work */
     DcmMppsSCP mppsSCP;
+    DcmMppsStore mppsStore(OFstatic_cast(size_t, opt_storeShards));
+    DcmMppsQueryServer queryServer(mppsStore);
+    DcmMppsEventExporter eventExporter;
+    DcmMppsAsyncLogger asyncLogger;
+    DcmMppsTraceFile traceFile;
+    DcmSvcTimeline timeline("mppsscp");
+    DcmSvcSlowLog slowLog;
+    DcmSvcDebugFilter debugFilter("dcmtk.mppsscp.peer");
+    DcmMppsMetrics metrics;
+    DcmSvcMetricsServer metricsServer(metrics);
     OFCondition status;
 
     OFLOG_INFO(dcmrecvLogger, "configuring service class provider ...");
@@ -188,6 +469,142 @@ int main(int argc, char *argv[])
     mppsSCP.setVerbosePCMode(opt_showPresentationContexts);
     mppsSCP.setRespondWithCalledAETitle(opt_useCalledAETitle);
     mppsSCP.setHostLookupEnabled(opt_HostnameLookup);
+    mppsSCP.setLazyDecoding(opt_lazyDecoding);
+    mppsSCP.setSpooling(OFstatic_cast(size_t, opt_spoolThreshold) * 1024, opt_spoolDirectory);
+    if (opt_negotiationPolicy != NULL)
+    {
+        status = mppsSCP.loadNegotiationPolicy(opt_negotiationPolicy);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot load negotiation policy " << opt_negotiationPolicy << ": " << status.text());
+            return EXITCODE_CANNOT_LOAD_NEGOTIATION_POLICY;
+        }
+    }
+    if (opt_useStore)
+    {
+        mppsStore.setRetention(OFstatic_cast(Uint32, opt_finalRetention), OFstatic_cast(Uint32, opt_staleTimeout));
+        mppsStore.setMemoryLimit(OFstatic_cast(size_t, opt_maxStoreMemory) * 1024 * 1024);
+        mppsSCP.setInstanceStore(&mppsStore);
+    }
+
+    /* write debug output of the selected peers and instances regardless of the log level */
+    for (OFListIterator(OFString) rule = opt_debugRules.begin(); rule != opt_debugRules.end(); ++rule)
+    {
+        status = debugFilter.addRule(*rule);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "invalid debug rule: " << *rule);
+            return EXITCODE_COMMANDLINE_SYNTAX_ERROR;
+        }
+    }
+    mppsSCP.setDebugFilter(&debugFilter);
+
+    /* take SIGUSR1 in the metrics thread, i.e. block it before any thread is started */
+    if (opt_metricsPort > 0)
+    {
+        metricsServer.setDebugFilter(&debugFilter);
+        status = metricsServer.setDumpSignal(SIGUSR1);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot serve metrics on port " << opt_metricsPort << ": " << status.text());
+            return EXITCODE_CANNOT_START_METRICS;
+        }
+    }
+
+    /* start answering queries on the MPPS store */
+    if (opt_querySocket != NULL)
+    {
+        status = queryServer.listen(opt_querySocket);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot start query server on " << opt_querySocket << ": " << status.text());
+            return EXITCODE_CANNOT_START_QUERY_SERVER;
+        }
+    }
+
+    /* start exporting MPPS events */
+    if (opt_exportFile != NULL)
+    {
+        eventExporter.setRotation(OFstatic_cast(size_t, opt_exportMaxSize) * 1024 * 1024,
+                                  OFstatic_cast(unsigned int, opt_exportMaxFiles));
+        status = eventExporter.open(opt_exportFile);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot export MPPS events to " << opt_exportFile << ": " << status.text());
+            return EXITCODE_CANNOT_START_EXPORT;
+        }
+        mppsSCP.setEventExporter(&eventExporter);
+    }
+
+    /* start dumping messages asynchronously */
+    if (opt_asyncLogging)
+    {
+        status = asyncLogger.startLogging();
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot start asynchronous logging: " << status.text());
+            return EXITCODE_CANNOT_START_LOGGING;
+        }
+        mppsSCP.setAsyncLogger(&asyncLogger);
+    }
+
+    /* start tracing DIMSE messages */
+    if (opt_traceFile != NULL)
+    {
+        traceFile.setRotation(OFstatic_cast(Uint32, opt_traceMaxRecords),
+                              OFstatic_cast(unsigned int, opt_traceMaxFiles));
+        status = traceFile.open(opt_traceFile);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot trace DIMSE messages to " << opt_traceFile << ": " << status.text());
+            return EXITCODE_CANNOT_START_TRACE;
+        }
+        mppsSCP.setTraceFile(&traceFile);
+    }
+
+    /* start writing the timeline */
+    if (opt_timelineFile != NULL)
+    {
+        status = timeline.open(opt_timelineFile);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot write timeline to " << opt_timelineFile << ": " << status.text());
+            return EXITCODE_CANNOT_START_TIMELINE;
+        }
+        mppsSCP.setTimeline(&timeline);
+    }
+
+    /* start logging slow operations */
+    if (opt_slowLogFile != NULL)
+    {
+        slowLog.setThresholds(OFstatic_cast(Uint32, opt_slowThreshold));
+        if (opt_slowEcho)
+            slowLog.setThreshold(DIMSE_C_ECHO_RQ, OFstatic_cast(Uint32, opt_slowEchoThreshold));
+        if (opt_slowCreate)
+            slowLog.setThreshold(DIMSE_N_CREATE_RQ, OFstatic_cast(Uint32, opt_slowCreateThreshold));
+        if (opt_slowSet)
+            slowLog.setThreshold(DIMSE_N_SET_RQ, OFstatic_cast(Uint32, opt_slowSetThreshold));
+        slowLog.setRateLimit(OFstatic_cast(unsigned int, opt_slowRateLimit));
+        status = slowLog.open(opt_slowLogFile);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot log slow operations to " << opt_slowLogFile << ": " << status.text());
+            return EXITCODE_CANNOT_START_SLOW_LOG;
+        }
+        mppsSCP.setSlowLog(&slowLog);
+    }
+
+    /* start serving metrics */
+    if (opt_metricsPort > 0)
+    {
+        status = metricsServer.listen(OFstatic_cast(Uint16, opt_metricsPort), opt_metricsAddress);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot serve metrics on port " << opt_metricsPort << ": " << status.text());
+            return EXITCODE_CANNOT_START_METRICS;
+        }
+        mppsSCP.setMetrics(&metrics);
+    }
 
     OFLOG_INFO(dcmrecvLogger, "starting service class provider and listening ...");
 
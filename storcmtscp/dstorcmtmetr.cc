@@ -0,0 +1,108 @@
+/*
+ *
+ *  Module:  storcmtscp
+ *
+ *  Purpose: Runtime counters of the SCP and their export in the Prometheus text format
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dstorcmtmetr.h"
+#include "dcmtk/dcmnet/dimse.h"     /* for DIMSE_C_ECHO_RQ et al. */
+
+// ----------------------------------------------------------------------------
+
+/* request command fields, in the order of DcmStorCmtMetricsCommand (without "other") */
+static const Uint16 commandFields[] =
+{
+  DIMSE_C_ECHO_RQ,
+  DIMSE_N_ACTION_RQ,
+  DIMSE_N_EVENT_REPORT_RQ
+};
+
+static const char *const commandNames[DCMSTORCMT_METRICS_COMMANDS] =
+{
+  "C-ECHO",
+  "N-ACTION",
+  "N-EVENT-REPORT",
+  "other"
+};
+
+static const char *const phaseNames[DCMSTORCMT_PHASES] =
+{
+  "accept",
+  "negotiation",
+  "command_receive",
+  "dataset_receive",
+  "handler",
+  "response_send",
+  "commitment"
+};
+
+static const char *const payloadNames[DCMSTORCMT_PAYLOADS] =
+{
+  "N-ACTION"
+};
+
+const DcmSvcMetricsNames DcmStorCmtMetrics::names =
+{
+  "storcmtscp_",
+  commandFields,
+  commandNames,
+  DCMSTORCMT_METRICS_COMMANDS,
+  phaseNames,
+  DCMSTORCMT_PHASES,
+  payloadNames,
+  DCMSTORCMT_PAYLOADS
+};
+
+// ----------------------------------------------------------------------------
+
+DcmStorCmtMetricsCounters::DcmStorCmtMetricsCounters()
+  : DcmSvcMetricsCounters(DcmStorCmtMetrics::names)
+  , commitmentsQueued(0)
+  , commitmentsDequeued(0)
+{
+}
+
+
+void DcmStorCmtMetricsCounters::add(const DcmSvcMetricsCounters &other)
+{
+  DcmSvcMetricsCounters::add(other);
+  const DcmStorCmtMetricsCounters &counters = OFstatic_cast(const DcmStorCmtMetricsCounters &, other);
+  commitmentsQueued += counters.commitmentsQueued;
+  commitmentsDequeued += counters.commitmentsDequeued;
+}
+
+// ----------------------------------------------------------------------------
+
+DcmStorCmtMetrics::DcmStorCmtMetrics()
+  : DcmSvcMetrics(names)
+{
+}
+
+
+DcmStorCmtMetricsCounters *DcmStorCmtMetrics::getThreadCounters()
+{
+  // all counters are created by createCounters()
+  return OFstatic_cast(DcmStorCmtMetricsCounters *, DcmSvcMetrics::getThreadCounters());
+}
+
+
+DcmSvcMetricsCounters *DcmStorCmtMetrics::createCounters()
+{
+  return new DcmStorCmtMetricsCounters();
+}
+
+
+void DcmStorCmtMetrics::formatGauges(const DcmSvcMetricsCounters &total,
+                                     DcmSvcMetricsFormatter &formatter)
+{
+  const DcmStorCmtMetricsCounters &counters = OFstatic_cast(const DcmStorCmtMetricsCounters &, total);
+  // requests whose N-EVENT-REPORT has not been sent yet
+  formatter.appendHeader("pending_commitments", "gauge", "Storage commitment requests waiting for their N-EVENT-REPORT.");
+  formatter.appendSample("pending_commitments", "",
+    (counters.commitmentsQueued > counters.commitmentsDequeued) ? counters.commitmentsQueued - counters.commitmentsDequeued : 0);
+}
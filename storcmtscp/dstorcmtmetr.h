@@ -0,0 +1,129 @@
+/*
+ *
+ *  Module:  storcmtscp
+ *
+ *  Purpose: Runtime counters of the SCP and their export in the Prometheus text format
+ *
+ */
+
+#ifndef DSTORCMTMETR_H
+#define DSTORCMTMETR_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dsvcmetr.h"               /* for DcmSvcMetrics */
+
+/** Commands counted separately. Received requests are counted with their responses,
+ *  the N-EVENT-REPORT requests sent by the SCP with the responses of the peer.
+ */
+enum DcmStorCmtMetricsCommand
+{
+  /// C-ECHO
+  DCMSTORCMT_METRICS_C_ECHO,
+  /// N-ACTION
+  DCMSTORCMT_METRICS_N_ACTION,
+  /// N-EVENT-REPORT
+  DCMSTORCMT_METRICS_N_EVENT_REPORT,
+  /// any other (unsupported) command
+  DCMSTORCMT_METRICS_OTHER_COMMAND,
+  /// number of counted commands
+  DCMSTORCMT_METRICS_COMMANDS
+};
+
+/** Phases of an association and of its requests, whose durations are recorded
+ */
+enum DcmStorCmtMetricsPhase
+{
+  /// from accepting the TCP connection to the received A-ASSOCIATE-RQ
+  DCMSTORCMT_PHASE_ACCEPT,
+  /// from the received A-ASSOCIATE-RQ to the sent A-ASSOCIATE-AC
+  DCMSTORCMT_PHASE_NEGOTIATION,
+  /// from the first data of a command to the received command
+  DCMSTORCMT_PHASE_COMMAND_RECEIVE,
+  /// receiving the dataset of a request
+  DCMSTORCMT_PHASE_DATASET_RECEIVE,
+  /// handling a request, excluding receiving its dataset, sending the response and
+  /// waiting for the N-EVENT-REPORT to be acknowledged
+  DCMSTORCMT_PHASE_HANDLER,
+  /// sending the response to a request (or handing it to the transport layer)
+  DCMSTORCMT_PHASE_RESPONSE_SEND,
+  /// from the received N-ACTION request to the acknowledged N-EVENT-REPORT, on the
+  /// same or on a separate association
+  DCMSTORCMT_PHASE_COMMITMENT,
+  /// number of phases
+  DCMSTORCMT_PHASES
+};
+
+/** Requests whose datasets are profiled, see DcmSvcPayloadHistograms. The datasets of
+ *  N-ACTION requests mainly consist of their Referenced SOP Sequence.
+ */
+enum DcmStorCmtMetricsPayload
+{
+  /// dataset of N-ACTION requests
+  DCMSTORCMT_PAYLOAD_N_ACTION,
+  /// number of profiled requests
+  DCMSTORCMT_PAYLOADS
+};
+
+/** Counters of one thread, i.e.\ the common counters plus those of the storage
+ *  commitment requests waiting for their N-EVENT-REPORT
+ */
+struct DcmStorCmtMetricsCounters : public DcmSvcMetricsCounters
+{
+  /** default constructor. Sets all counters to 0.
+   */
+  DcmStorCmtMetricsCounters();
+
+  /** Add the counters of another thread
+   *  @param other [in] The counters to add, must be DcmStorCmtMetricsCounters
+   */
+  virtual void add(const DcmSvcMetricsCounters &other);
+
+  /// storage commitment requests accepted for sending an N-EVENT-REPORT
+  volatile Uint64 commitmentsQueued;
+
+  /// storage commitment requests answered by an N-EVENT-REPORT or given up
+  volatile Uint64 commitmentsDequeued;
+
+  /// padding against false sharing with the following allocation
+  char paddingCommitments[DCMSVC_CACHE_LINE_SIZE];
+};
+
+/** Runtime metrics of the storage commitment SCP, i.e.\ the common metrics (see
+ *  DcmSvcMetrics) of the commands, phases and datasets above plus the number of
+ *  pending commitments
+ */
+class DcmStorCmtMetrics : public DcmSvcMetrics
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmStorCmtMetrics();
+
+  /** Get the counters of the calling thread, create and register them if needed
+   *  @return the counters, NULL if too many threads are counting
+   */
+  DcmStorCmtMetricsCounters *getThreadCounters();
+
+  /// commands, phases and profiled datasets, indexed by the enums above
+  static const DcmSvcMetricsNames names;
+
+  protected:
+
+  /** Create the counters of a thread
+   *  @return new DcmStorCmtMetricsCounters
+   */
+  virtual DcmSvcMetricsCounters *createCounters();
+
+  /** Append the number of pending commitments
+   *  @param total     [in] The counters of all threads
+   *  @param formatter [in] The formatter to append to
+   */
+  virtual void formatGauges(const DcmSvcMetricsCounters &total,
+                            DcmSvcMetricsFormatter &formatter);
+
+};
+
+#endif // DSTORCMTMETR_H
@@ -0,0 +1,71 @@
+/*
+ *
+ *  Module:  storcmtscp
+ *
+ *  Purpose: Static tracepoints (USDT probes) of the SCP
+ *
+ */
+
+#ifndef DSTORCMTPROBE_H
+#define DSTORCMTPROBE_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+/*
+ *  The probes are compiled in if <sys/sdt.h> of SystemTap is available, or if WITH_SDT
+ *  is defined for a compiler without __has_include. They can be disabled by defining
+ *  WITHOUT_SDT (e.g. "make LOCALDEFS=-DWITHOUT_SDT"). A probe is a single NOP until a
+ *  tracer attaches to it, e.g.
+ *
+ *    bpftrace -e 'usdt:./storcmtrecv:storcmtscp:command__received { @[arg2] = count(); }'
+ *
+ *  The arguments are kept to integers and existing strings, so that they are cheap to
+ *  provide while no tracer is attached. All probes of the provider "storcmtscp" start
+ *  with the association ID (counted from 1 per SCP thread, 0 for the separate association
+ *  on which a storage commitment result is reported by the SCU):
+ *
+ *    association__received       (assocID, calling AE title, peer address, peer max PDU)
+ *    association__acknowledged   (assocID, accepted presentation contexts, max send PDV)
+ *    association__refused        (assocID, refuse reason, see DcmRefuseReasonType)
+ *    association__ended          (assocID, 0 = released, 1 = aborted by peer, 2 = error)
+ *    command__received           (assocID, message ID, command field, presentation context ID)
+ *    dataset__received           (assocID, message ID, dataset bytes or 0 if not known, 0 = error)
+ *    response__sent              (assocID, message ID, command field, status, 0 = error)
+ *    commitment__queued          (assocID, message ID of the N-ACTION request)
+ *    commitment__dequeued        (assocID, 0 = reported, 1 = handed to the SCU, 2 = replaced
+ *                                 by a newer request, 3 = dropped with the SCP)
+ *    event__report__sent         (assocID, message ID, 0 = error)
+ *    event__report__acknowledged (assocID, message ID, status)
+ */
+
+#if !defined(WITH_SDT) && !defined(WITHOUT_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define WITH_SDT
+#endif
+#endif
+
+#if defined(WITH_SDT) && !defined(WITHOUT_SDT)
+#include <sys/sdt.h>
+
+#define DCMSTORCMT_PROBE1(name, a1) \
+  DTRACE_PROBE1(storcmtscp, name, a1)
+#define DCMSTORCMT_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2(storcmtscp, name, a1, a2)
+#define DCMSTORCMT_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(storcmtscp, name, a1, a2, a3)
+#define DCMSTORCMT_PROBE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4(storcmtscp, name, a1, a2, a3, a4)
+#define DCMSTORCMT_PROBE5(name, a1, a2, a3, a4, a5) \
+  DTRACE_PROBE5(storcmtscp, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define DCMSTORCMT_PROBE1(name, a1)
+#define DCMSTORCMT_PROBE2(name, a1, a2)
+#define DCMSTORCMT_PROBE3(name, a1, a2, a3)
+#define DCMSTORCMT_PROBE4(name, a1, a2, a3, a4)
+#define DCMSTORCMT_PROBE5(name, a1, a2, a3, a4, a5)
+
+#endif
+
+#endif // DSTORCMTPROBE_H
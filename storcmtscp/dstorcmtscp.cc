@@ -24,6 +24,82 @@
 
 #include "dstorcmtscp.h"
 #include "dcmtk/dcmnet/diutil.h"
+#include "dcmtk/dcmdata/dcistrmb.h"   /* for DcmInputBufferStream */
+#include "dsvctrans.h"                 /* for DcmSvcTransportLayer */
+#include "dstorcmtprobe.h"             /* for DCMSTORCMT_PROBE1() et al. */
+
+#include <time.h>
+
+/* debug output of the SCP. For an association or request matching the debug filter it
+ * goes to the logger of the filter, otherwise it depends on the log level of dcmnet. */
+#define DCMSTORCMT_DEBUG(msg) \
+  do { \
+    if (m_debugLevel <= OFLogger::DEBUG_LOG_LEVEL) { \
+      OFLOG_DEBUG(m_debugFilter->getLogger(), msg); \
+    } else { \
+      DCMNET_DEBUG(msg); \
+    } \
+  } while (0)
+
+// Message ID of a request handled by this SCP, 0 for unsupported commands
+static Uint16 getMessageID(const T_DIMSE_Message &message)
+{
+  switch (message.CommandField)
+  {
+    case DIMSE_C_ECHO_RQ:   return message.msg.CEchoRQ.MessageID;
+    case DIMSE_N_ACTION_RQ: return message.msg.NActionRQ.MessageID;
+    default:                return 0;
+  }
+}
+
+// Name of a request on the timeline
+static const char *getCommandName(const Uint16 commandField)
+{
+  switch (commandField)
+  {
+    case DIMSE_C_ECHO_RQ:   return "C-ECHO";
+    case DIMSE_N_ACTION_RQ: return "N-ACTION";
+    default:                return "unsupported command";
+  }
+}
+
+// Name of a phase on the timeline
+static const char *getPhaseName(const DcmStorCmtMetricsPhase phase)
+{
+  switch (phase)
+  {
+    case DCMSTORCMT_PHASE_ACCEPT:          return "accept";
+    case DCMSTORCMT_PHASE_NEGOTIATION:     return "negotiation";
+    case DCMSTORCMT_PHASE_COMMAND_RECEIVE: return "command receive";
+    case DCMSTORCMT_PHASE_DATASET_RECEIVE: return "dataset receive";
+    case DCMSTORCMT_PHASE_HANDLER:         return "handler";
+    case DCMSTORCMT_PHASE_RESPONSE_SEND:   return "response send";
+    default:                               return "commitment";
+  }
+}
+
+// Count the sequence items below a dataset or item and their maximum nesting depth
+static void measureSequences(DcmItem &item,
+                             const Uint64 level,
+                             Uint64 &numItems,
+                             Uint64 &maxDepth)
+{
+  DcmObject *obj = NULL;
+  while ((obj = item.nextInContainer(obj)) != NULL)
+  {
+    if (obj->ident() != EVR_SQ)
+      continue;
+    if (level + 1 > maxDepth)
+      maxDepth = level + 1;
+    DcmSequenceOfItems *sequence = OFstatic_cast(DcmSequenceOfItems *, obj);
+    DcmObject *child = NULL;
+    while ((child = sequence->nextInContainer(child)) != NULL)
+    {
+      ++numItems;
+      measureSequences(*OFstatic_cast(DcmItem *, child), level + 1, numItems, maxDepth);
+    }
+  }
+}
 
 // implementation of the main interface class
 
@@ -31,7 +107,33 @@ DcmStorCmtSCP::DcmStorCmtSCP():
   m_assoc(NULL),
   m_cfg(),
   m_commit_wait_timeout(5),
-  m_peerPort(115)
+  m_peerPort(115),
+  m_spoolBuffer("storcmtspool"),
+  m_echoResponse(DIMSE_C_ECHO_RSP),
+  m_actionResponse(DIMSE_N_ACTION_RSP),
+  m_negotiationPolicy(),
+  m_negotiationCache(),
+  m_metrics(NULL),
+  m_localCounters(),
+  m_counters(&m_localCounters),
+  m_transportLayer(NULL),
+  m_phaseStart(0),
+  m_datasetTime(0),
+  m_sendTime(0),
+  m_reportTime(0),
+  m_peer(NULL),
+  m_peerBytesReceived(0),
+  m_peerBytesSent(0),
+  m_associationCounter(0),
+  m_messageID(0),
+  m_timeline(NULL),
+  m_associationStart(0),
+  m_responseStatus(-1),
+  m_slowLog(NULL),
+  m_slowRecord(),
+  m_debugFilter(NULL),
+  m_associationDebugLevel(OFLogger::OFF_LOG_LEVEL),
+  m_debugLevel(OFLogger::OFF_LOG_LEVEL)
 {
     // make sure that the SCP at least supports C-ECHO with default transfer syntax
     OFList<OFString> transferSyntaxes;
@@ -39,6 +141,11 @@ DcmStorCmtSCP::DcmStorCmtSCP():
     transferSyntaxes.push_back(UID_BigEndianExplicitTransferSyntax);
     transferSyntaxes.push_back(UID_LittleEndianImplicitTransferSyntax);
     addPresentationContext(UID_VerificationSOPClass, transferSyntaxes);
+#ifdef WITH_ZLIB
+    // also accept deflate for the service datasets, their UID sequences compress well; it
+    // is preferred unless a negotiation policy ranks it otherwise (e.g.\ last by decoding cost)
+    transferSyntaxes.push_front(UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+#endif
     // add Storage Commitment support
     addPresentationContext(UID_StorageCommitmentPushModelSOPClass, transferSyntaxes);
 
@@ -48,14 +155,14 @@ DcmStorCmtSCP::DcmStorCmtSCP():
 
 DcmStorCmtSCP::~DcmStorCmtSCP()
 {
-    if (storageCommitCommand != NULL )
+    // also deletes the request dataset
+    if (storageCommitCommand != NULL)
     {
-        if (storageCommitCommand->reqDataset != NULL) {
-            delete storageCommitCommand->reqDataset;
-        }
-        delete storageCommitCommand;
-        storageCommitCommand = NULL;
+        ++m_counters->commitmentsDequeued;
+        DCMSTORCMT_PROBE2(commitment__dequeued, m_associationCounter, 3);
     }
+    delete storageCommitCommand;
+    storageCommitCommand = NULL;
 
   // If there is an open association, drop it and free memory (just to be sure...)
   if (m_assoc)
@@ -96,6 +203,25 @@ OFCondition DcmStorCmtSCP::listen()
   if( cond.bad() )
     return cond;
 
+  // Count in the counters of this thread, if the metrics have room for them
+  if (m_metrics != NULL)
+  {
+    m_counters = m_metrics->getThreadCounters();
+    if (m_counters == NULL)
+      m_counters = &m_localCounters;
+  }
+
+  // Use buffered reads and gathered writes on the connections (ownership passes to network)
+  m_transportLayer = new DcmSvcTransportLayer(&m_counters->transfer);
+  cond = ASC_setTransportLayer( network, m_transportLayer, 1 );
+  if( cond.bad() )
+  {
+    delete m_transportLayer;
+    m_transportLayer = NULL;
+    ASC_dropNetwork( &network );
+    return cond;
+  }
+
   // drop root privileges now and revert to the calling user id (if we are running as setuid root)
   cond = OFStandard::dropPrivileges();
   if (cond.bad())
@@ -119,6 +245,7 @@ OFCondition DcmStorCmtSCP::listen()
   // is the counterpart of ASC_initializeNetwork(...) which was called above.
   cond = ASC_dropNetwork( &network );
   network = NULL;
+  m_transportLayer = NULL;
 
   // return ok
   return cond;
@@ -130,36 +257,59 @@ void DcmStorCmtSCP::findPresentationContext(const T_ASC_PresentationContextID pr
                                      OFString &abstractSyntax,
                                      OFString &transferSyntax)
 {
-  transferSyntax.clear();
-  abstractSyntax.clear();
+  const DcmPresentationContextInfo &info = lookupPresentationContext(presID);
+  abstractSyntax = info.abstractSyntax;
+  transferSyntax = info.acceptedTransferSyntax;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmStorCmtSCP::buildPresentationContextTable()
+{
+  clearPresentationContextTable();
   if (m_assoc == NULL)
     return;
 
-  DUL_PRESENTATIONCONTEXT *pc;
-  LST_HEAD **l;
-
-  /* we look for a presentation context matching
-   * both abstract and transfer syntax
-   */
-  l = &m_assoc->params->DULparams.acceptedPresentationContext;
-  pc = (DUL_PRESENTATIONCONTEXT*) LST_Head(l);
+  // walk the list once, instead of once per command
+  LST_HEAD **l = &m_assoc->params->DULparams.acceptedPresentationContext;
+  if (*l == NULL)
+    return;
+  DUL_PRESENTATIONCONTEXT *pc = (DUL_PRESENTATIONCONTEXT*) LST_Head(l);
   (void)LST_Position(l, (LST_NODE*)pc);
   while (pc)
   {
-     if (presID == pc->presentationContextID)
-     {
-       if (pc->result == ASC_P_ACCEPTANCE)
-       {
-         // found a match
-         transferSyntax = pc->acceptedTransferSyntax;
-         abstractSyntax = pc->abstractSyntax;
-       }
-       break;
-     }
-     pc = (DUL_PRESENTATIONCONTEXT*) LST_Next(l);
+    // presentation context IDs are odd numbers, i.e. entry 0 is never used
+    if ((pc->result == ASC_P_ACCEPTANCE) && (pc->presentationContextID != 0))
+    {
+      DcmPresentationContextInfo &info = m_presentationContexts[pc->presentationContextID];
+      info.presentationContextID = pc->presentationContextID;
+      info.abstractSyntax = pc->abstractSyntax;
+      info.proposedSCRole = pc->proposedSCRole;
+      info.acceptedSCRole = pc->acceptedSCRole;
+      info.acceptedTransferSyntax = pc->acceptedTransferSyntax;
+    }
+    pc = (DUL_PRESENTATIONCONTEXT*) LST_Next(l);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmStorCmtSCP::clearPresentationContextTable()
+{
+  for (size_t i = 0; i < 256; i++)
+  {
+    if (m_presentationContexts[i].presentationContextID != 0)
+      m_presentationContexts[i] = DcmPresentationContextInfo();
   }
 }
 
+// ----------------------------------------------------------------------------
+
+const DcmPresentationContextInfo &DcmStorCmtSCP::lookupPresentationContext(const T_ASC_PresentationContextID presID) const
+{
+  return m_presentationContexts[presID];
+}
+
 DUL_PRESENTATIONCONTEXT* DcmStorCmtSCP::findPresentationContextID(LST_HEAD *head,
                                                            T_ASC_PresentationContextID presentationContextID)
 {
@@ -200,6 +350,12 @@ void DcmStorCmtSCP::refuseAssociation(const DcmRefuseReasonType reason)
     return;
   }
 
+  DCMSTORCMT_PROBE2(association__refused, m_associationCounter, OFstatic_cast(int, reason));
+  if (OFstatic_cast(size_t, reason) < DCMSVC_METRICS_REFUSE_REASONS)
+    ++m_counters->associationsRefused[reason];
+  if (m_peer != NULL)
+    ++m_peer->associationsRefused;
+
   T_ASC_RejectParameters rej;
 
   // dump some information if required
@@ -331,6 +487,10 @@ OFCondition DcmStorCmtSCP::waitForAssociationRQ(T_ASC_Network *network)
 
   Uint32 timeout = m_cfg->getConnectionTimeout();
 
+  // the bytes of the association are assigned to its peer when it ends (see dropAndDestroyAssociation())
+  m_peerBytesReceived = m_counters->transfer.bytesReceived;
+  m_peerBytesSent = m_counters->transfer.bytesSent;
+
   // Listen to a socket for timeout seconds and wait for an association request
   OFCondition cond = ASC_receiveAssociation( network, &m_assoc, m_cfg->getMaxReceivePDULength(), NULL, NULL, OFFalse,
                                              m_cfg->getConnectionBlockingMode(), OFstatic_cast(int, timeout) );
@@ -348,6 +508,26 @@ OFCondition DcmStorCmtSCP::waitForAssociationRQ(T_ASC_Network *network)
     return EC_Normal;
   }
 
+  // the transport layer notes when it creates the connection, i.e. right after accepting it
+  m_phaseStart = DcmSvcLatencyHistogram::getMonotonicTime();
+  m_associationStart = m_phaseStart;
+  if (m_transportLayer != NULL)
+  {
+    m_associationStart = m_transportLayer->getConnectionTime();
+    m_counters->phases[DCMSTORCMT_PHASE_ACCEPT].record(m_phaseStart - m_associationStart);
+  }
+
+  ++m_associationCounter;
+  m_messageID = 0;
+  if (m_timeline != NULL)
+    m_timeline->addSpan(getPhaseName(DCMSTORCMT_PHASE_ACCEPT), "phase", m_associationStart, m_phaseStart, m_associationCounter);
+  DCMSTORCMT_PROBE4(association__received, m_associationCounter, m_assoc->params->DULparams.callingAPTitle,
+    m_assoc->params->DULparams.callingPresentationAddress, m_assoc->params->theirMaxPDUReceiveSize);
+
+  m_peer = m_counters->getPeer(getPeerAETitle(), getPeerIP());
+  if (m_peer != NULL)
+    m_peer->lastSeen = OFstatic_cast(Uint64, time(NULL));
+
   return processAssociationRQ();
 }
 
@@ -435,7 +615,7 @@ OFCondition DcmStorCmtSCP::processAssociationRQ()
     if (m_cfg->getVerbosePCMode())
       DCMNET_INFO(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RJ));
     else
-      DCMNET_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RJ));
+      DCMSTORCMT_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RJ));
     refuseAssociation( DCMSCP_NO_PRESENTATION_CONTEXTS );
     dropAndDestroyAssociation();
     return EC_Normal;
@@ -448,6 +628,14 @@ OFCondition DcmStorCmtSCP::processAssociationRQ()
     dropAndDestroyAssociation();
     return EC_Normal;
   }
+  recordPhase(DCMSTORCMT_PHASE_NEGOTIATION, m_phaseStart);
+  DCMSTORCMT_PROBE3(association__acknowledged, m_associationCounter,
+    ASC_countAcceptedPresentationContexts(m_assoc->params), m_assoc->sendPDVLength);
+  ++m_counters->associationsAccepted;
+  if (m_peer != NULL)
+    ++m_peer->associationsAccepted;
+  buildPresentationContextTable();
+  m_negotiationPolicy.countAccepted(m_assoc->params, m_counters);
   notifyAssociationAcknowledge();
 
   // Dump some debug information
@@ -456,7 +644,7 @@ OFCondition DcmStorCmtSCP::processAssociationRQ()
   if (m_cfg->getVerbosePCMode())
     DCMNET_INFO(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_AC));
   else
-    DCMNET_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_AC));
+    DCMSTORCMT_DEBUG(ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_AC));
 
    // Go ahead and handle the association (i.e. handle the callers requests) in this process
    handleAssociation();
@@ -471,6 +659,13 @@ OFCondition DcmStorCmtSCP::negotiateAssociation()
   if (m_assoc == NULL)
     return DIMSE_ILLEGALASSOCIATION;
 
+  // Replay the decisions for an identical earlier request, if any
+  if (m_negotiationCache.replay(m_assoc->params))
+  {
+    DCMSTORCMT_DEBUG("Presentation contexts negotiated as for an earlier identical request");
+    return EC_Normal;
+  }
+
   // Set presentation contexts as defined in association configuration
   OFCondition result = m_cfg->evaluateIncomingAssociation(*m_assoc);
   if (result.bad())
@@ -478,6 +673,12 @@ OFCondition DcmStorCmtSCP::negotiateAssociation()
     OFString tempStr;
     DCMNET_ERROR(DimseCondition::dump(tempStr, result));
   }
+  else
+  {
+    // rank the accepted transfer syntaxes as in the negotiation policy file, if any
+    m_negotiationPolicy.apply(m_assoc->params);
+    m_negotiationCache.store(m_assoc->params);
+  }
   return result;
 }
 
@@ -527,29 +728,71 @@ void DcmStorCmtSCP::handleAssociation()
   // start a loop to be able to receive more than one DIMSE command
   while( cond.good() )
   {
-    // receive a DIMSE command over the network
+    // receive a DIMSE command over the network, the time waiting for it is not counted
+    const Uint64 waitStart = DcmSvcLatencyHistogram::getMonotonicTime();
+    if (m_transportLayer != NULL)
+      m_transportLayer->resetDataArrivalTime();
     cond = DIMSE_receiveCommand( m_assoc, m_cfg->getDIMSEBlockingMode(), m_cfg->getDIMSETimeout(),
                                  &presID, &message, NULL );
     // check if peer did release or abort, or if we have a valid message
     if( cond.good() )
     {
-      DcmPresentationContextInfo presInfo;
-      getPresentationContextInfo(m_assoc, presID, presInfo);
-      cond = handleIncomingCommand(&message, presInfo);
+      const Uint64 arrival = (m_transportLayer != NULL) ? m_transportLayer->getDataArrivalTime() : 0;
+      m_messageID = getMessageID(message);
+      // raised by receiveACTIONRequest() for a selected transaction
+      m_debugLevel = m_associationDebugLevel;
+      DcmSvcSlowLog::resetRecord(m_slowRecord);
+      m_slowRecord.commandReceiveTime =
+        recordPhase(DCMSTORCMT_PHASE_COMMAND_RECEIVE, (arrival > waitStart) ? arrival : waitStart);
+      m_phaseStart = DcmSvcLatencyHistogram::getMonotonicTime();
+      m_datasetTime = 0;
+      m_sendTime = 0;
+      m_reportTime = 0;
+      m_responseStatus = -1;
+      DCMSTORCMT_PROBE4(command__received, m_associationCounter, m_messageID, OFstatic_cast(int, message.CommandField), presID);
+      cond = handleIncomingCommand(&message, lookupPresentationContext(presID));
+      const Uint64 handled = DcmSvcLatencyHistogram::getMonotonicTime() - m_phaseStart;
+      const Uint64 excluded = m_datasetTime + m_sendTime + m_reportTime;
+      m_counters->phases[DCMSTORCMT_PHASE_HANDLER].record((handled > excluded) ? handled - excluded : 0);
+      // the N-EVENT-REPORT on the same association is not part of the request
+      const Uint64 requestTime = (handled > m_reportTime) ? handled - m_reportTime : 0;
+      if (m_peer != NULL)
+        m_peer->requests.record(requestTime);
+      // including the N-EVENT-REPORT on the same association, which is shown nested
+      if (m_timeline != NULL)
+      {
+        m_timeline->addSpan(getCommandName(message.CommandField), "request", m_phaseStart, m_phaseStart + handled,
+          m_associationCounter, m_messageID, m_responseStatus);
+      }
+      if ((m_slowLog != NULL) && m_slowLog->isSlow(message.CommandField, requestTime))
+        writeSlowRecord(message, requestTime);
+      m_debugLevel = m_associationDebugLevel;
     }
   }
   // Clean up on association termination.
   if( cond == DUL_PEERREQUESTEDRELEASE )
   {
+    ++m_counters->associationsReleased;
+    if (m_peer != NULL)
+      ++m_peer->associationsReleased;
+    DCMSTORCMT_PROBE2(association__ended, m_associationCounter, 0);
     notifyReleaseRequest();
     ASC_acknowledgeRelease(m_assoc);
   }
   else if( cond == DUL_PEERABORTEDASSOCIATION )
   {
+    ++m_counters->associationsAborted;
+    if (m_peer != NULL)
+      ++m_peer->associationsAborted;
+    DCMSTORCMT_PROBE2(association__ended, m_associationCounter, 1);
     notifyAbortRequest();
   }
   else
   {
+    ++m_counters->associationsAborted;
+    if (m_peer != NULL)
+      ++m_peer->associationsFailed;
+    DCMSTORCMT_PROBE2(association__ended, m_associationCounter, 2);
     notifyDIMSEError(cond);
     ASC_abortAssociation( m_assoc );
   }
@@ -558,7 +801,7 @@ void DcmStorCmtSCP::handleAssociation()
   dropAndDestroyAssociation();
 
   // Output separator line.
-  DCMNET_DEBUG( "+++++++++++++++++++++++++++++" );
+  DCMSTORCMT_DEBUG( "+++++++++++++++++++++++++++++" );
 }
 
 
@@ -583,10 +826,8 @@ OFCondition DcmStorCmtSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
             T_DIMSE_N_ActionRQ &actionReq = incomingMsg->msg.NActionRQ;
             Uint16 rspStatusCode = STATUS_N_NoSuchAttribute;
 
-            DcmFileFormat fileformat;
-            DcmDataset *reqDataset = fileformat.getDataset();
-
-            // receive dataset in memory
+            // receive dataset in memory (allocated by receiveACTIONRequest(), owned by us)
+            DcmDataset *reqDataset = NULL;
             Uint16 actionTypeID = 0;
             status = handleACTIONRequest(actionReq, presInfo.presentationContextID, reqDataset,actionTypeID);
             if (status.good())
@@ -606,39 +847,75 @@ OFCondition DcmStorCmtSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
 
             status = sendACTIONResponse(presInfo.presentationContextID, messageID, 
                                        sopClassUID, sopInstanceUID,rspStatusCode);
-            if (status.good()) {
+            // a slow request is summarized before its dataset is handed over
+            if ((m_slowLog != NULL) && (reqDataset != NULL))
+                captureSlowDataset(DIMSE_N_ACTION_RQ, *reqDataset);
+            // profiled after the response, i.e. without delaying it
+            if (reqDataset != NULL)
+                recordPayload(*reqDataset);
+            if (status.good() && (reqDataset != NULL)) {
+                // a command that could not be reported before is replaced
+                if (storageCommitCommand != NULL)
+                {
+                    ++m_counters->commitmentsDequeued;
+                    DCMSTORCMT_PROBE2(commitment__dequeued, m_associationCounter, 2);
+                }
+                delete storageCommitCommand;
                 storageCommitCommand = new DcmStorageCommitmentCommand();
+                ++m_counters->commitmentsQueued;
+                DCMSTORCMT_PROBE2(commitment__queued, m_associationCounter, messageID);
+                storageCommitCommand->actionTime = m_phaseStart;
+                storageCommitCommand->actionMessageID = messageID;
                 storageCommitCommand->scuinf.localAETitle = getCalledAETitle();
                 storageCommitCommand->scuinf.remoteAETitle = getPeerAETitle();
                 storageCommitCommand->scuinf.remoteHostName = getPeerAETitle();
                 storageCommitCommand->scuinf.remoteIP = getPeerIP();
                 storageCommitCommand->scuinf.remotePort = getPeerPort();
-                storageCommitCommand->reqDataset = (DcmDataset *)reqDataset->clone();
+                // hand over the received dataset, the command deletes it
+                storageCommitCommand->reqDataset = reqDataset;
+                reqDataset = NULL;
             }
+            // not handed over, e.g. because the response could not be sent
+            delete reqDataset;
+            reqDataset = NULL;
 
             T_DIMSE_Message response;
             bzero((char*)&response, sizeof(response));
             T_ASC_PresentationContextID tempID;
             OFString tempStr;
-            status = receiveDIMSECommand(&tempID, &response, NULL, NULL /* commandSet */, m_commit_wait_timeout);
+            const Uint64 reportStart = DcmSvcLatencyHistogram::getMonotonicTime();
+            if (m_commit_wait_timeout > 0)
+                status = receiveDIMSECommand(&tempID, &response, NULL, NULL /* commandSet */, m_commit_wait_timeout);
             if( status == DUL_PEERREQUESTEDRELEASE )
             {
-                DCMNET_DEBUG("Aassociation Release Request received");
+                DCMSTORCMT_DEBUG("Aassociation Release Request received");
             }
-            else //if ( status == DUL_NOASSOCIATIONREQUEST )
+            else if (storageCommitCommand != NULL) //if ( status == DUL_NOASSOCIATIONREQUEST )
             {
-                DCMNET_DEBUG("No Association Request. Go to send N-EVENT-REPORT request");
+                DCMSTORCMT_DEBUG("No Association Request. Go to send N-EVENT-REPORT request");
                 Uint16 eventTypeID = 1;
                 status = sendEVENTREPORTRequest(presInfo.presentationContextID,
                                    sopInstanceUID, messageID, eventTypeID,
                                    storageCommitCommand->reqDataset,rspStatusCode);
+                countCommand(DIMSE_N_EVENT_REPORT_RQ, status.good()
+                    ? DcmSvcMetricsCounters::classifyStatus(rspStatusCode) : DCMSVC_METRICS_FAILURE);
 
                 if (status.good()) {
-                    delete storageCommitCommand->reqDataset ;
+                    const Uint64 actionTime = storageCommitCommand->actionTime;
+                    const Uint64 duration = recordPhase(DCMSTORCMT_PHASE_COMMITMENT, actionTime);
+                    if (m_timeline != NULL)
+                    {
+                        m_timeline->addAsyncSpan("commitment", "commitment", actionTime, actionTime + duration,
+                            m_associationCounter, storageCommitCommand->actionMessageID, rspStatusCode);
+                    }
+                    // also deletes the request dataset
                     delete storageCommitCommand;
                     storageCommitCommand = NULL;
+                    ++m_counters->commitmentsDequeued;
+                    DCMSTORCMT_PROBE2(commitment__dequeued, m_associationCounter, 0);
                 }
             }
+            m_reportTime += DcmSvcLatencyHistogram::getMonotonicTime() - reportStart;
         } else {
             // unsupported command
             OFString tempStr;
@@ -646,9 +923,10 @@ OFCondition DcmStorCmtSCP::handleIncomingCommand(T_DIMSE_Message *incomingMsg,
                 << STD_NAMESPACE hex << STD_NAMESPACE setfill('0') << STD_NAMESPACE setw(4)
                 << OFstatic_cast(unsigned int, incomingMsg->CommandField)
                 << "), we are a Storage SCP only");
-            DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, *incomingMsg, DIMSE_INCOMING));
+            DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, *incomingMsg, DIMSE_INCOMING));
             // TODO: provide more information on this error?
             status = DIMSE_BADCOMMANDTYPE;
+            countCommand(incomingMsg->CommandField, DCMSVC_METRICS_FAILURE);
         }
     }
     return status;
@@ -665,10 +943,10 @@ OFCondition DcmStorCmtSCP::handleECHORequest(T_DIMSE_C_EchoRQ &reqMessage,
   OFString tempStr;
 
   // Dump debug information
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
   {
     DCMNET_INFO("Received C-ECHO Request");
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_INFO("Sending C-ECHO Response");
   } else {
     DCMNET_INFO("Received C-ECHO Request (MsgID " << reqMessage.MessageID << ")");
@@ -676,11 +954,21 @@ OFCondition DcmStorCmtSCP::handleECHORequest(T_DIMSE_C_EchoRQ &reqMessage,
   }
 
   // Send response message
-  cond = DIMSE_sendEchoResponse( m_assoc, presID, &reqMessage, STATUS_Success, NULL );
+  T_DIMSE_Message response;
+  // Make sure everything is zeroed (especially options)
+  bzero((char*)&response, sizeof(response));
+  T_DIMSE_C_EchoRSP &echoRsp = response.msg.CEchoRSP;
+  response.CommandField = DIMSE_C_ECHO_RSP;
+  echoRsp.MessageIDBeingRespondedTo = reqMessage.MessageID;
+  echoRsp.DimseStatus = STATUS_Success;
+  echoRsp.DataSetType = DIMSE_DATASET_NULL;
+  echoRsp.opts = O_ECHO_AFFECTEDSOPCLASSUID;
+  OFStandard::strlcpy(echoRsp.AffectedSOPClassUID, reqMessage.AffectedSOPClassUID, sizeof(echoRsp.AffectedSOPClassUID));
+  cond = sendDIMSEResponse(presID, &response);
   if( cond.bad() )
     DCMNET_ERROR("Cannot send C-ECHO Response: " << DimseCondition::dump(tempStr, cond));
   else
-    DCMNET_DEBUG("C-ECHO Response successfully sent");
+    DCMSTORCMT_DEBUG("C-ECHO Response successfully sent");
 
   return cond;
 }
@@ -704,7 +992,7 @@ OFCondition DcmStorCmtSCP::receiveACTIONRequest(T_DIMSE_N_ActionRQ &reqMessage,
   DcmDataset *dataset = NULL;
 
   // Dump debug information
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
     DCMNET_INFO("Received N-ACTION Request");
   else
     DCMNET_INFO("Received N-ACTION Request (MsgID " << reqMessage.MessageID << ")");
@@ -712,25 +1000,39 @@ OFCondition DcmStorCmtSCP::receiveACTIONRequest(T_DIMSE_N_ActionRQ &reqMessage,
   // Check if dataset is announced correctly
   if (reqMessage.DataSetType == DIMSE_DATASET_NULL)
   {
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_ERROR("Received N-ACTION request but no dataset announced, aborting");
     return DIMSE_BADMESSAGE;
   }
 
   // Receive dataset
+  const Uint64 datasetStart = DcmSvcLatencyHistogram::getMonotonicTime();
   cond = receiveDIMSEDataset(&presIDdset, &dataset);
+  m_datasetTime += recordPhase(DCMSTORCMT_PHASE_DATASET_RECEIVE, datasetStart);
+  DCMSTORCMT_PROBE4(dataset__received, m_associationCounter, reqMessage.MessageID,
+    (m_spoolBuffer.getSpoolThreshold() > 0) ? m_spoolBuffer.getLength() : 0, cond.good());
   if (cond.bad())
   {
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
     DCMNET_ERROR("Unable to receive N-ACTION dataset on presentation context " << OFstatic_cast(unsigned int, presID));
     return DIMSE_BADDATA;
   }
 
+  // a request of a selected transaction is debugged even if its association is not
+  if ((m_debugFilter != NULL) && m_debugFilter->hasInstanceRules())
+  {
+    const char *transactionUID = NULL;
+    dataset->findAndGetString(DCM_TransactionUID, transactionUID);
+    const OFLogger::LogLevel level = m_debugFilter->matchInstance(transactionUID);
+    if (level < m_debugLevel)
+      m_debugLevel = level;
+  }
+
   // Output request message only if trace level is enabled
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::TRACE_LOG_LEVEL))
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dataset, presID));
+  if (isLogEnabledFor(OFLogger::TRACE_LOG_LEVEL))
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, dataset, presID));
   else
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, reqMessage, DIMSE_INCOMING, NULL, presID));
 
   // Compare presentation context ID of command and data set
   if (presIDdset != presID)
@@ -773,16 +1075,16 @@ OFCondition DcmStorCmtSCP::sendACTIONResponse(const T_ASC_PresentationContextID
   OFStandard::strlcpy(actionRsp.AffectedSOPInstanceUID, sopInstanceUID.c_str(), sizeof(actionRsp.AffectedSOPInstanceUID));
   // Do not send any other optional fields, e.g. "Action Type ID"
 
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
   {
     DCMNET_INFO("Sending N-ACTION Response");
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_OUTGOING, NULL, presID));
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_OUTGOING, NULL, presID));
   } else {
     DCMNET_INFO("Sending N-ACTION Response (" << DU_nactionStatusString(rspStatusCode) << ")");
   }
 
   // Send response message
-  cond = sendDIMSEMessage(presID, &response, NULL /* dataObject */);
+  cond = sendDIMSEResponse(presID, &response);
   if (cond.bad())
   {
     DCMNET_ERROR("Failed sending N-ACTION response: " << DimseCondition::dump(tempStr, cond));
@@ -828,29 +1130,35 @@ OFCondition DcmStorCmtSCP::sendEVENTREPORTRequest(const T_ASC_PresentationContex
   eventReportReq.EventTypeID = eventTypeID;
 
   // Determine SOP Class from presentation context
-  OFString abstractSyntax, transferSyntax;
-  findPresentationContext(pcid, abstractSyntax, transferSyntax);
-  if (abstractSyntax.empty() || transferSyntax.empty())
+  const DcmPresentationContextInfo &presInfo = lookupPresentationContext(pcid);
+  if (presInfo.abstractSyntax.empty() || presInfo.acceptedTransferSyntax.empty())
     return DIMSE_NOVALIDPRESENTATIONCONTEXTID;
-  OFStandard::strlcpy(eventReportReq.AffectedSOPClassUID, abstractSyntax.c_str(), sizeof(eventReportReq.AffectedSOPClassUID));
+  OFStandard::strlcpy(eventReportReq.AffectedSOPClassUID, presInfo.abstractSyntax.c_str(), sizeof(eventReportReq.AffectedSOPClassUID));
   OFStandard::strlcpy(eventReportReq.AffectedSOPInstanceUID, sopInstanceUID.c_str(), sizeof(eventReportReq.AffectedSOPInstanceUID));
 
   // Send request
-  if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+  if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
   {
     DCMNET_INFO("Sending N-EVENT-REPORT Request");
     // Output dataset only if trace level is enabled
-    if (DCM_dcmnetLogger.isEnabledFor(OFLogger::TRACE_LOG_LEVEL))
-      DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, request, DIMSE_OUTGOING, reqDataset, pcid));
+    if (isLogEnabledFor(OFLogger::TRACE_LOG_LEVEL))
+      DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, request, DIMSE_OUTGOING, reqDataset, pcid));
     else
-      DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, request, DIMSE_OUTGOING, NULL, pcid));
+      DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, request, DIMSE_OUTGOING, NULL, pcid));
   } else {
     DCMNET_INFO("Sending N-EVENT-REPORT Request (MsgID " << eventReportReq.MessageID << ")");
   }
+  const Uint64 sendStart = DcmSvcLatencyHistogram::getMonotonicTime();
   cond = sendDIMSEMessage(pcid, &request, reqDataset);
+  DCMSTORCMT_PROBE3(event__report__sent, m_associationCounter, eventReportReq.MessageID, cond.good());
   if (cond.bad())
   {
     DCMNET_ERROR("Failed sending N-EVENT-REPORT request: " << DimseCondition::dump(tempStr, cond));
+    if (m_timeline != NULL)
+    {
+      m_timeline->addSpan("N-EVENT-REPORT", "report", sendStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+        m_associationCounter, eventReportReq.MessageID);
+    }
     return cond;
   }
   // Receive response
@@ -862,16 +1170,21 @@ OFCondition DcmStorCmtSCP::sendEVENTREPORTRequest(const T_ASC_PresentationContex
   if (cond.bad())
   {
       DCMNET_ERROR("Failed receiving DIMSE response: " << DimseCondition::dump(tempStr, cond));
+      if (m_timeline != NULL)
+      {
+        m_timeline->addSpan("N-EVENT-REPORT", "report", sendStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+          m_associationCounter, eventReportReq.MessageID);
+      }
       return cond;
   }
 
   // Check command set
   if (response.CommandField == DIMSE_N_EVENT_REPORT_RSP)
   {
-    if (DCM_dcmnetLogger.isEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
+    if (isLogEnabledFor(OFLogger::DEBUG_LOG_LEVEL))
     {
       DCMNET_INFO("Received N-EVENT-REPORT Response");
-      DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_INCOMING, NULL, pcid));
+      DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_INCOMING, NULL, pcid));
     } else {
       DCMNET_INFO("Received N-EVENT-REPORT Response (" << DU_neventReportStatusString(response.msg.NEventReportRSP.DimseStatus) << ")");
     }
@@ -879,18 +1192,24 @@ OFCondition DcmStorCmtSCP::sendEVENTREPORTRequest(const T_ASC_PresentationContex
     DCMNET_ERROR("Expected N-EVENT-REPORT response but received DIMSE command 0x"
       << STD_NAMESPACE hex << STD_NAMESPACE setfill('0') << STD_NAMESPACE setw(4)
       << OFstatic_cast(unsigned int, response.CommandField));
-    DCMNET_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_INCOMING, NULL, pcid));
+    DCMSTORCMT_DEBUG(DIMSE_dumpMessage(tempStr, response, DIMSE_INCOMING, NULL, pcid));
     delete statusDetail;
     return DIMSE_BADCOMMANDTYPE;
   }
   if (statusDetail != NULL)
   {
-    DCMNET_DEBUG("Response has status detail:" << OFendl << DcmObject::PrintHelper(*statusDetail));
+    DCMSTORCMT_DEBUG("Response has status detail:" << OFendl << DcmObject::PrintHelper(*statusDetail));
     delete statusDetail;
   }
   // Set return value
   T_DIMSE_N_EventReportRSP &eventReportRsp = response.msg.NEventReportRSP;
   rspStatusCode = eventReportRsp.DimseStatus;
+  DCMSTORCMT_PROBE3(event__report__acknowledged, m_associationCounter, eventReportReq.MessageID, rspStatusCode);
+  if (m_timeline != NULL)
+  {
+    m_timeline->addSpan("N-EVENT-REPORT", "report", sendStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+      m_associationCounter, eventReportReq.MessageID, rspStatusCode);
+  }
 
   // Check whether there is a dataset to be received
   if (eventReportRsp.DataSetType == DIMSE_DATASET_PRESENT)
@@ -937,6 +1256,85 @@ OFCondition DcmStorCmtSCP::sendDIMSEMessage(const T_ASC_PresentationContextID pr
 
 // ----------------------------------------------------------------------------
 
+// Sends a response, if possible from a pre-encoded command template
+OFCondition DcmStorCmtSCP::sendDIMSEResponse(const T_ASC_PresentationContextID presID,
+                                             T_DIMSE_Message *message)
+{
+  if (m_assoc == NULL)
+    return DIMSE_ILLEGALASSOCIATION;
+  if (message == NULL)
+    return DIMSE_NULLKEY;
+
+  // the templates cover the responses of this SCP, which always include the Affected SOP Class UID
+  DcmSvcResponseTemplate *command = NULL;
+  OFBool encoded = OFFalse;
+  Uint16 status = STATUS_Success;
+  switch (message->CommandField)
+  {
+    case DIMSE_C_ECHO_RSP:
+    {
+      const T_DIMSE_C_EchoRSP &rsp = message->msg.CEchoRSP;
+      command = &m_echoResponse;
+      status = rsp.DimseStatus;
+      if ((rsp.DataSetType == DIMSE_DATASET_NULL) && (rsp.opts & O_ECHO_AFFECTEDSOPCLASSUID))
+        encoded = command->encode(rsp.AffectedSOPClassUID, rsp.MessageIDBeingRespondedTo, rsp.DimseStatus, NULL);
+      break;
+    }
+    case DIMSE_N_ACTION_RSP:
+    {
+      const T_DIMSE_N_ActionRSP &rsp = message->msg.NActionRSP;
+      command = &m_actionResponse;
+      status = rsp.DimseStatus;
+      // Action Type ID would follow Affected SOP Instance UID, i.e. is not covered
+      if ((rsp.DataSetType == DIMSE_DATASET_NULL) && (rsp.opts & O_NACTION_AFFECTEDSOPCLASSUID) &&
+          !(rsp.opts & O_NACTION_ACTIONTYPEID))
+      {
+        encoded = command->encode(rsp.AffectedSOPClassUID, rsp.MessageIDBeingRespondedTo, rsp.DimseStatus,
+          (rsp.opts & O_NACTION_AFFECTEDSOPINSTANCEUID) ? rsp.AffectedSOPInstanceUID : NULL);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  const Uint64 sendStart = DcmSvcLatencyHistogram::getMonotonicTime();
+  OFCondition cond;
+  if (encoded && (command->getLength() <= m_assoc->sendPDVLength))
+    cond = sendEncodedCommand(presID, *command);
+  else
+    cond = sendDIMSEMessage(presID, message, NULL /* dataObject */);
+  m_sendTime += recordPhase(DCMSTORCMT_PHASE_RESPONSE_SEND, sendStart);
+  DCMSTORCMT_PROBE5(response__sent, m_associationCounter, m_messageID, OFstatic_cast(int, message->CommandField),
+    status, cond.good());
+  if (cond.good())
+    m_responseStatus = status;
+  // a response that cannot be sent counts as failure, whatever its status
+  countCommand(message->CommandField, cond.good()
+    ? DcmSvcMetricsCounters::classifyStatus(status) : DCMSVC_METRICS_FAILURE);
+  return cond;
+}
+
+// ----------------------------------------------------------------------------
+
+// Sends an encoded command set as the only (and last) command PDV
+OFCondition DcmStorCmtSCP::sendEncodedCommand(const T_ASC_PresentationContextID presID,
+                                              const DcmSvcResponseTemplate &command)
+{
+  DUL_PDV pdv;
+  pdv.fragmentLength = OFstatic_cast(unsigned long, command.getLength());
+  pdv.presentationContextID = presID;
+  pdv.pdvType = DUL_COMMANDPDV;
+  pdv.lastPDV = OFTrue;
+  pdv.data = OFconst_cast(Uint8 *, command.getData());
+  DUL_PDVLIST pdvList;
+  pdvList.count = 1;
+  pdvList.pdv = &pdv;
+  return DUL_WritePDVs(&m_assoc->DULassociation, &pdvList);
+}
+
+// ----------------------------------------------------------------------------
+
 // Receive DIMSE command (excluding dataset!) over the currently open association
 OFCondition DcmStorCmtSCP::receiveDIMSECommand(T_ASC_PresentationContextID *presID,
                                         T_DIMSE_Message *message,
@@ -971,12 +1369,17 @@ OFCondition DcmStorCmtSCP::receiveDIMSEDataset(T_ASC_PresentationContextID *pres
     return DIMSE_ILLEGALASSOCIATION;
 
   OFCondition cond;
-  cond = DIMSE_receiveDataSetInMemory(m_assoc, m_cfg->getDIMSEBlockingMode(), m_cfg->getDIMSETimeout(),
-                                        presID, dataObject, NULL /*callback*/, NULL /*callbackData*/);
+  if (m_spoolBuffer.getSpoolThreshold() == 0)
+  {
+    cond = DIMSE_receiveDataSetInMemory(m_assoc, m_cfg->getDIMSEBlockingMode(), m_cfg->getDIMSETimeout(),
+                                          presID, dataObject, NULL /*callback*/, NULL /*callbackData*/);
+  } else {
+    cond = receiveSpooledDataset(presID, dataObject);
+  }
 
   if (cond.good())
   {
-    DCMNET_DEBUG("Received dataset on presentation context " << OFstatic_cast(unsigned int, *presID));
+    DCMSTORCMT_DEBUG("Received dataset on presentation context " << OFstatic_cast(unsigned int, *presID));
   } else {
     OFString tempStr;
     DCMNET_ERROR("Unable to receive dataset on presentation context "
@@ -987,6 +1390,145 @@ OFCondition DcmStorCmtSCP::receiveDIMSEDataset(T_ASC_PresentationContextID *pres
 
 // ----------------------------------------------------------------------------
 
+// Receives one dataset via the spool buffer, i.e. on disk above the spool threshold
+OFCondition DcmStorCmtSCP::receiveSpooledDataset(T_ASC_PresentationContextID *presID,
+                                                 DcmDataset **dataObject)
+{
+  // collect the PDV fragments like DIMSE_receiveDataSetInMemory() does, but parse them at the end
+  m_spoolBuffer.clear();
+  const DUL_BLOCKOPTIONS blocking = (m_cfg->getDIMSEBlockingMode() == DIMSE_BLOCKING) ? DUL_BLOCK : DUL_NOBLOCK;
+  OFCondition cond = EC_Normal;
+  OFBool last = OFFalse;
+  *presID = 0;
+  while (cond.good() && !last)
+  {
+    DUL_PDV pdv;
+    cond = DUL_NextPDV(&m_assoc->DULassociation, &pdv);
+    if (cond == DUL_NOPDVS)
+    {
+      cond = DUL_ReadPDVs(&m_assoc->DULassociation, NULL, blocking, OFstatic_cast(int, m_cfg->getDIMSETimeout()));
+      if (cond.good())
+        cond = DUL_NextPDV(&m_assoc->DULassociation, &pdv);
+    }
+    if (cond.bad())
+      break;
+    if (pdv.pdvType != DUL_DATASETPDV)
+      cond = DIMSE_UNEXPECTEDPDVTYPE;
+    else if ((*presID != 0) && (*presID != pdv.presentationContextID))
+      cond = makeDcmnetCondition(DIMSEC_INVALIDPRESENTATIONCONTEXTID, OF_error,
+        "DIMSE: Different Presentation IDs inside Data Set");
+    else
+    {
+      *presID = pdv.presentationContextID;
+      cond = m_spoolBuffer.append(pdv.data, pdv.fragmentLength);
+      last = pdv.lastPDV;
+    }
+  }
+
+  // parse the dataset in the accepted transfer syntax of the presentation context
+  const DcmPresentationContextInfo &presInfo = lookupPresentationContext(*presID);
+  if (cond.good() && presInfo.acceptedTransferSyntax.empty())
+    cond = DIMSE_NOVALIDPRESENTATIONCONTEXTID;
+  if (cond.good())
+    cond = m_spoolBuffer.finish();
+  if (cond.good())
+  {
+    const OFBool created = (*dataObject == NULL);
+    if (created)
+      *dataObject = new DcmDataset();
+    DcmInputBufferStream stream;
+    stream.setBuffer(m_spoolBuffer.getData(), OFstatic_cast(offile_off_t, m_spoolBuffer.getLength()));
+    stream.setEos();
+    (*dataObject)->transferInit();
+    cond = (*dataObject)->read(stream, DcmXfer(presInfo.acceptedTransferSyntax.c_str()).getXfer(), EGL_noChange);
+    (*dataObject)->transferEnd();
+    if (cond.bad() && created)
+    {
+      delete *dataObject;
+      *dataObject = NULL;
+    }
+    else if (m_spoolBuffer.isSpooled())
+      DCMSTORCMT_DEBUG("Parsed spooled dataset of " << m_spoolBuffer.getLength() << " bytes");
+  }
+  // unmap and close a spool file
+  m_spoolBuffer.clear();
+  return cond;
+}
+
+// ----------------------------------------------------------------------------
+
+Uint64 DcmStorCmtSCP::recordPhase(const DcmStorCmtMetricsPhase phase,
+                                  const Uint64 start)
+{
+  const Uint64 end = DcmSvcLatencyHistogram::getMonotonicTime();
+  m_counters->phases[phase].record(end - start);
+  // a commitment outlasts its request, the caller adds it as an asynchronous span
+  if ((m_timeline != NULL) && (phase != DCMSTORCMT_PHASE_COMMITMENT))
+    m_timeline->addSpan(getPhaseName(phase), "phase", start, end, m_associationCounter, m_messageID);
+  return end - start;
+}
+
+
+void DcmStorCmtSCP::captureSlowDataset(const Uint16 commandField,
+                                       DcmDataset &dataset)
+{
+  if (m_slowLog->isSlow(commandField, DcmSvcLatencyHistogram::getMonotonicTime() - m_phaseStart))
+    DcmSvcSlowLog::summarizeDataset(dataset, m_slowRecord);
+}
+
+
+void DcmStorCmtSCP::recordPayload(DcmDataset &dataset)
+{
+  // the encoded size is not kept after receiving, so the size in Explicit VR Little
+  // Endian is used (as for the slow operation log)
+  const Uint64 numBytes = dataset.getLength(EXS_LittleEndianExplicit);
+  const Uint64 numElements = dataset.card();
+  Uint64 numItems = 0;
+  Uint64 maxDepth = 0;
+  measureSequences(dataset, 0, numItems, maxDepth);
+  DcmSvcPayloadHistograms &payload = m_counters->payloads[DCMSTORCMT_PAYLOAD_N_ACTION];
+  payload.record(numBytes, numElements);
+  payload.recordSequences(numItems, maxDepth);
+  if (m_peer != NULL)
+  {
+    m_peer->payloads[DCMSTORCMT_PAYLOAD_N_ACTION].record(numBytes, numElements);
+    m_peer->payloads[DCMSTORCMT_PAYLOAD_N_ACTION].recordSequences(numItems, maxDepth);
+  }
+}
+
+
+void DcmStorCmtSCP::writeSlowRecord(const T_DIMSE_Message &message,
+                                    const Uint64 latency)
+{
+  m_slowRecord.associationID = m_associationCounter;
+  m_slowRecord.messageID = m_messageID;
+  m_slowRecord.commandField = OFstatic_cast(Uint16, message.CommandField);
+  m_slowRecord.status = m_responseStatus;
+  m_slowRecord.latency = latency;
+  m_slowRecord.datasetReceiveTime = m_datasetTime;
+  m_slowRecord.responseSendTime = m_sendTime;
+  m_slowRecord.reportTime = m_reportTime;
+  m_slowRecord.handlerTime = (latency > m_datasetTime + m_sendTime) ? latency - m_datasetTime - m_sendTime : 0;
+  m_slowLog->write(m_slowRecord, getPeerAETitle(), getPeerIP());
+}
+
+
+OFBool DcmStorCmtSCP::isLogEnabledFor(const OFLogger::LogLevel level) const
+{
+  return (level >= m_debugLevel) || DCM_dcmnetLogger.isEnabledFor(level);
+}
+
+
+void DcmStorCmtSCP::countCommand(const Uint16 commandField,
+                                 const DcmSvcMetricsStatus status)
+{
+  m_counters->countCommand(commandField, status);
+  if (m_peer != NULL)
+    m_peer->countCommand(commandField, status);
+}
+
+// ----------------------------------------------------------------------------
+
 void DcmStorCmtSCP::setMaxReceivePDULength(const Uint32 maxRecPDU)
 {
   m_cfg->setMaxReceivePDULength(maxRecPDU);
@@ -999,7 +1541,12 @@ OFCondition DcmStorCmtSCP::addPresentationContext(const OFString &abstractSyntax
                                            const T_ASC_SC_ROLE role,
                                            const OFString &profile)
 {
-  return m_cfg->addPresentationContext(abstractSyntax, xferSyntaxes, role, profile);
+  OFCondition result = m_cfg->addPresentationContext(abstractSyntax, xferSyntaxes, role, profile);
+  if (result.good())
+    m_negotiationPolicy.addSupportedTransferSyntaxes(abstractSyntax, xferSyntaxes);
+  // cached negotiation results may not reflect the new configuration
+  m_negotiationCache.clear();
+  return result;
 }
 
 // ----------------------------------------------------------------------------
@@ -1089,6 +1636,50 @@ void DcmStorCmtSCP::setCommitWaitTimeout(const Uint32 timeout)
 
 // ----------------------------------------------------------------------------
 
+void DcmStorCmtSCP::setSpooling(const size_t threshold,
+                                const OFString &directory)
+{
+  m_spoolBuffer.setSpooling(threshold, directory);
+}
+
+// ----------------------------------------------------------------------------
+
+OFCondition DcmStorCmtSCP::loadNegotiationPolicy(const OFString &filename)
+{
+  m_negotiationCache.clear();
+  return m_negotiationPolicy.loadFile(filename);
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmStorCmtSCP::setMetrics(DcmStorCmtMetrics *metrics)
+{
+  m_metrics = metrics;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmStorCmtSCP::setTimeline(DcmSvcTimeline *timeline)
+{
+  m_timeline = timeline;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmStorCmtSCP::setSlowLog(DcmSvcSlowLog *slowLog)
+{
+  m_slowLog = slowLog;
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmStorCmtSCP::setDebugFilter(DcmSvcDebugFilter *debugFilter)
+{
+  m_debugFilter = debugFilter;
+}
+
+// ----------------------------------------------------------------------------
+
 Uint32 DcmStorCmtSCP::getMaxReceivePDULength() const
 {
   return m_cfg->getMaxReceivePDULength();
@@ -1166,6 +1757,13 @@ OFBool DcmStorCmtSCP::getHostLookupEnabled() const
 
 // ----------------------------------------------------------------------------
 
+const DcmSvcNegotiationPolicy &DcmStorCmtSCP::getNegotiationPolicy() const
+{
+  return m_negotiationPolicy;
+}
+
+// ----------------------------------------------------------------------------
+
 Uint32 DcmStorCmtSCP::getCommitWaitTimeout() const
 {
   return m_commit_wait_timeout;
@@ -1228,9 +1826,26 @@ void DcmStorCmtSCP::dropAndDestroyAssociation()
   if (m_assoc)
   {
     notifyAssociationTermination();
+    if ((m_timeline != NULL) && (m_associationStart != 0))
+    {
+      m_timeline->addSpan("association", "association", m_associationStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+        m_associationCounter, 0, -1, m_assoc->params->DULparams.callingAPTitle);
+    }
     ASC_dropSCPAssociation( m_assoc );
     ASC_destroyAssociation( &m_assoc );
   }
+  m_associationStart = 0;
+  m_associationDebugLevel = OFLogger::OFF_LOG_LEVEL;
+  m_debugLevel = OFLogger::OFF_LOG_LEVEL;
+  // including a storage commitment report sent on a separate association
+  if (m_peer != NULL)
+  {
+    m_peer->bytesReceived += m_counters->transfer.bytesReceived - m_peerBytesReceived;
+    m_peer->bytesSent += m_counters->transfer.bytesSent - m_peerBytesSent;
+    m_peer->lastSeen = OFstatic_cast(Uint64, time(NULL));
+    m_peer = NULL;
+  }
+  clearPresentationContextTable();
 }
 
 
@@ -1242,6 +1857,13 @@ void DcmStorCmtSCP::dropAndDestroyAssociation()
 void DcmStorCmtSCP::notifyAssociationRequest(const T_ASC_Parameters &params,
                                       DcmSCPActionType & /* desiredAction */)
 {
+  // decide once whether the debug output of this association is written regardless of
+  // the log level, so that other associations do not pay for the filter
+  m_associationDebugLevel = (m_debugFilter != NULL)
+    ? m_debugFilter->matchAssociation(params.DULparams.callingAPTitle, params.DULparams.callingPresentationAddress)
+    : OFLogger::OFF_LOG_LEVEL;
+  m_debugLevel = m_associationDebugLevel;
+
   // Dump some information if required
   DCMNET_INFO("Association Received " << params.DULparams.callingPresentationAddress << ": "
                                       << params.DULparams.callingAPTitle << " -> "
@@ -1252,7 +1874,7 @@ void DcmStorCmtSCP::notifyAssociationRequest(const T_ASC_Parameters &params,
   if (m_cfg->getVerbosePCMode())
     DCMNET_INFO("Incoming Association Request:" << OFendl << ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RQ));
   else
-    DCMNET_DEBUG("Incoming Association Request:" << OFendl << ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RQ));
+    DCMSTORCMT_DEBUG("Incoming Association Request:" << OFendl << ASC_dumpParameters(tempStr, m_assoc->params, ASC_ASSOC_RQ));
 }
 
 // ----------------------------------------------------------------------------
@@ -1281,7 +1903,7 @@ OFBool DcmStorCmtSCP::checkCallingHostAccepted(const OFString& /*hostOrIP*/)
 
 void DcmStorCmtSCP::notifyAssociationAcknowledge()
 {
-  DCMNET_DEBUG("DcmSCP: Association Acknowledged");
+  DCMSTORCMT_DEBUG("DcmSCP: Association Acknowledged");
 }
 
 // ----------------------------------------------------------------------------
@@ -1302,20 +1924,35 @@ void DcmStorCmtSCP::notifyAbortRequest()
 
 void DcmStorCmtSCP::notifyAssociationTermination()
 {
-  DCMNET_DEBUG("DcmSCP: Association Terminated");
+  DCMSTORCMT_DEBUG("DcmSCP: Association Terminated");
+  OFString counters;
+  DCMSTORCMT_DEBUG("Accepted transfer syntaxes:" << OFendl << m_negotiationPolicy.dumpCounters(counters));
+  DCMSTORCMT_DEBUG("Negotiation cache: " << m_negotiationCache.getHits() << " hits, "
+    << m_negotiationCache.getMisses() << " misses");
 
     if ( storageCommitCommand != NULL)
     {
         OFCondition cond = EC_Normal;
 
+        // the SCU takes over the command (and its dataset) and deletes it when done
+        DcmDataset *reqDataset = storageCommitCommand->reqDataset;
+        const Uint64 actionTime = storageCommitCommand->actionTime;
+        const Uint16 actionMessageID = storageCommitCommand->actionMessageID;
         DcmStorCmtSCU *scu = new DcmStorCmtSCU();
         scu->setVerbosePCMode(OFTrue);
+        scu->setMetricsCounters(m_counters);
+        scu->setTimeline(m_timeline);
         scu->setStorageCommitCommand(storageCommitCommand) ;
+        storageCommitCommand = NULL;
+        // pending no longer, the report is either sent now or given up
+        ++m_counters->commitmentsDequeued;
+        DCMSTORCMT_PROBE2(commitment__dequeued, m_associationCounter, 1);
 
         cond = scu->initNetwork();
         if (cond.bad()) {
             OFString tempStr;
             DCMNET_ERROR(DimseCondition::dump(tempStr, cond));
+            delete scu;
             return;
         }
 
@@ -1323,10 +1960,15 @@ void DcmStorCmtSCP::notifyAssociationTermination()
         if (cond.bad()) {
             OFString tempStr;
             DCMNET_ERROR(DimseCondition::dump(tempStr, cond));
+            delete scu;
             return;
         }
 
         T_ASC_PresentationContextID presID = 0;
+#ifdef WITH_ZLIB
+        if (presID == 0)
+            presID = scu->findPresentationContextID(UID_StorageCommitmentPushModelSOPClass, UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+#endif
         if (presID == 0)
             presID = scu->findPresentationContextID(UID_StorageCommitmentPushModelSOPClass, UID_LittleEndianExplicitTransferSyntax);
         if (presID == 0)
@@ -1336,25 +1978,32 @@ void DcmStorCmtSCP::notifyAssociationTermination()
         if (presID == 0)
         {
             DCMNET_ERROR("No presentation context found for sending N-EVENT-REPORT with SOP Class / Transfer Syntax");
+            delete scu;
             return;
         }
 
         OFString sopInstanceUID = UID_StorageCommitmentPushModelSOPInstance;
         Uint16 eventTypeID = 1;
         Uint16 rspStatusCode = 0; 
-        cond = scu->sendEVENTREPORTRequest(presID,sopInstanceUID,eventTypeID,storageCommitCommand->reqDataset,rspStatusCode);
+        cond = scu->sendEVENTREPORTRequest(presID,sopInstanceUID,eventTypeID,reqDataset,rspStatusCode);
+        countCommand(DIMSE_N_EVENT_REPORT_RQ, cond.good()
+            ? DcmSvcMetricsCounters::classifyStatus(rspStatusCode) : DCMSVC_METRICS_FAILURE);
         if (cond.bad()) {
             OFString tempStr;
             DCMNET_ERROR(DimseCondition::dump(tempStr, cond));
+            delete scu;
             return;
         }
+        const Uint64 duration = recordPhase(DCMSTORCMT_PHASE_COMMITMENT, actionTime);
+        if (m_timeline != NULL)
+        {
+            m_timeline->addAsyncSpan("commitment", "commitment", actionTime, actionTime + duration,
+                m_associationCounter, actionMessageID, rspStatusCode);
+        }
 
         scu->closeAssociation(DCMSCU_RELEASE_ASSOCIATION);
+        // also deletes the command and its dataset
         delete scu;
-
-        delete storageCommitCommand->reqDataset ;
-        delete storageCommitCommand;
-        storageCommitCommand = NULL;
     }
 }
 
@@ -1363,7 +2012,7 @@ void DcmStorCmtSCP::notifyAssociationTermination()
 void DcmStorCmtSCP::notifyDIMSEError(const OFCondition &cond)
 {
   OFString tempStr;
-  DCMNET_DEBUG("DIMSE Error, detail (if available): " << DimseCondition::dump(tempStr, cond));
+  DCMSTORCMT_DEBUG("DIMSE Error, detail (if available): " << DimseCondition::dump(tempStr, cond));
 }
 
 // ----------------------------------------------------------------------------
@@ -33,7 +33,15 @@
 
 //#include "dcmtk/dcmnet/scp.h"       /* for base class DcmSCP */
 #include "dstorcmtscu.h"
+#include "dsvcspool.h"
+#include "dsvcrsp.h"
+#include "dsvcneg.h"
+#include "dstorcmtmetr.h"
+#include "dsvctime.h"
+#include "dsvcslow.h"
+#include "dsvcdbg.h"
 
+class DcmSvcTransportLayer;
 
 
 /** Action codes that can be given to DcmSCP to control behavior during SCP's operation.
@@ -234,10 +242,66 @@ class DCMTK_DCMNET_EXPORT DcmStorCmtSCP
 
   /** Set maximum commitment event wait delay time in second 
    *  Note: SCP wait for association release request from SCU after ACTION response is sent
+   *  If 0, the event is sent right after the ACTION response, without waiting, so that
+   *  both messages are sent together (see DcmSvcTransportConnection).
    *  @param delay [in]  maximum event delay time in sec
   */
   void setCommitWaitTimeout(const Uint32 timeout);
 
+  /** Enable or disable spooling of large received datasets. A dataset larger than the
+   *  threshold is written to a spool file in the given directory while its PDVs arrive,
+   *  and parsed from a memory-mapped view of the file. This bounds the memory used for
+   *  the encoded dataset by the threshold, since the pages of the mapping can be
+   *  reclaimed by the kernel (the parsed dataset is still kept in memory).
+   *  @param threshold [in] size in bytes above which a dataset is spooled, 0 to receive
+   *                        all datasets with DIMSE_receiveDataSetInMemory()
+   *  @param directory [in] directory for the spool files (which are unlinked immediately)
+   */
+  void setSpooling(const size_t threshold,
+                   const OFString &directory);
+
+  /** Load transfer syntax rankings (in general and per calling AE title) that replace
+   *  the configuration order, see DcmSvcNegotiationPolicy::loadFile()
+   *  @param filename [in] The negotiation policy file
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition loadNegotiationPolicy(const OFString &filename);
+
+  /** Set the metrics that count associations, handled requests, sent event reports,
+   *  pending storage commitment requests and network traffic. The SCP counts in the
+   *  counters of the thread calling listen().
+   *  @param metrics [in] The metrics, NULL for no metrics. The metrics are not owned
+   *                      by the SCP and must exist as long as the SCP is running.
+   */
+  void setMetrics(DcmStorCmtMetrics *metrics);
+
+  /** Set the timeline that receives a span for each association, each handled request,
+   *  each of their phases (see DcmStorCmtMetricsPhase) and each N-EVENT-REPORT, on the
+   *  track of the thread calling listen(). The time from an N-ACTION request to its
+   *  acknowledged report is added as an asynchronous span.
+   *  @param timeline [in] The opened timeline, NULL for no timeline. The timeline is not
+   *                       owned by the SCP and must exist as long as the SCP is running.
+   */
+  void setTimeline(DcmSvcTimeline *timeline);
+
+  /** Set the log that receives a diagnostic record (see DcmSvcSlowRecord) for each
+   *  request exceeding the threshold of its DIMSE operation. The N-EVENT-REPORT on the
+   *  same association is not counted. The top-level elements of the dataset are only
+   *  summarized once the request is known to be slow.
+   *  @param slowLog [in] The opened log, NULL for no log. The log is not owned by the
+   *                      SCP and must exist as long as the SCP is running.
+   */
+  void setSlowLog(DcmSvcSlowLog *slowLog);
+
+  /** Set the filter selecting the associations and requests whose debug output is
+   *  written regardless of the log level of dcmnet (see DcmSvcDebugFilter). The
+   *  peer rules are evaluated once per association, the instance rules once per
+   *  N-ACTION request (on its Transaction UID).
+   *  @param debugFilter [in] The filter, NULL for none. The filter is not owned by the
+   *                          SCP and must exist as long as the SCP is running.
+   */
+  void setDebugFilter(DcmSvcDebugFilter *debugFilter);
+
   /* Get methods for SCP settings */
 
   /** Returns TCP/IP port number SCP listens for new connection requests
@@ -300,6 +364,12 @@ class DCMTK_DCMNET_EXPORT DcmStorCmtSCP
    */
   OFBool getHostLookupEnabled() const;
 
+  /** Returns the transfer syntax negotiation policy, e.g.\ for its counters of
+   *  accepted transfer syntaxes
+   *  @return The negotiation policy
+   */
+  const DcmSvcNegotiationPolicy &getNegotiationPolicy() const;
+
   /* ************************************************************* */
   /*  Methods for receiving runtime (i.e. connection time) infos   */
   /* ************************************************************* */
@@ -362,6 +432,22 @@ class DCMTK_DCMNET_EXPORT DcmStorCmtSCP
                                OFString &abstractSyntax,
                                OFString &transferSyntax);
 
+  /** Fill the table of accepted presentation contexts of the current association,
+   *  called once after the association has been acknowledged
+   */
+  void buildPresentationContextTable();
+
+  /** Remove all entries from the table of accepted presentation contexts
+   */
+  void clearPresentationContextTable();
+
+  /** Look up an accepted presentation context of the current association in the table
+   *  @param presID [in] The presentation context ID to look for
+   *  @return The presentation context, an entry with ID 0 (and empty syntaxes) if no
+   *    presentation context with this ID has been accepted
+   */
+  const DcmPresentationContextInfo &lookupPresentationContext(const T_ASC_PresentationContextID presID) const;
+
   /** Aborts the current association by sending an A-ABORT request to the SCU.
    *  This method allows derived classes to abort an association in case of severe errors.
    *  @return status, EC_Normal if successful, an error code otherwise
@@ -607,6 +693,24 @@ class DCMTK_DCMNET_EXPORT DcmStorCmtSCP
                                DcmDataset *statusDetail = NULL,
                                DcmDataset **commandSet = NULL);
 
+  /** Send a C-ECHO or N-ACTION response without dataset and status detail from a
+   *  pre-encoded command template (see DcmSvcResponseTemplate). Other messages are
+   *  sent via sendDIMSEMessage().
+   *  @param presID  [in] Presentation context ID to be used for message
+   *  @param message [in] The response message
+   *  @return Returns EC_Normal if sending response was successful, an error code otherwise
+   */
+  OFCondition sendDIMSEResponse(const T_ASC_PresentationContextID presID,
+                                T_DIMSE_Message *message);
+
+  /** Send an encoded command set in a single PDV
+   *  @param presID  [in] Presentation context ID to be used for message
+   *  @param command [in] The encoded command set
+   *  @return Returns EC_Normal if sending was successful, an error code otherwise
+   */
+  OFCondition sendEncodedCommand(const T_ASC_PresentationContextID presID,
+                                 const DcmSvcResponseTemplate &command);
+
   /** Receive DIMSE command (excluding dataset!) over the currently open association
    *  @param presID       [out] Contains in the end the ID of the presentation context
    *                            which was specified in the DIMSE command received
@@ -634,7 +738,9 @@ class DCMTK_DCMNET_EXPORT DcmStorCmtSCP
                                   DcmDataset **commandSet = NULL,
                                   const Uint32 timeout = 0);
 
-  /** Receive one dataset (of instance data) via network from another DICOM application
+  /** Receive one dataset (of instance data) via network from another DICOM application.
+   *  If spooling is enabled (see setSpooling()), the PDVs are collected in the spool
+   *  buffer and the dataset is parsed from there.
    *  @param presID     [out]   Contains in the end the ID of the presentation context
    *                            which was used in the PDVs that were received on the
    *                            network. If the PDVs show different presentation context
@@ -648,6 +754,66 @@ class DCMTK_DCMNET_EXPORT DcmStorCmtSCP
   OFCondition receiveDIMSEDataset(T_ASC_PresentationContextID *presID,
                                   DcmDataset **dataObject);
 
+  /** Receive one dataset into the spool buffer (on disk above the spool threshold) and
+   *  parse it from there, used by receiveDIMSEDataset() if spooling is enabled
+   *  @param presID     [out]   Contains in the end the ID of the presentation context
+   *                            which was used in the PDVs that were received
+   *  @param dataObject [inout] The dataset to read into. If this parameter points to
+   *                            NULL, a new dataset is created, which has to be deleted
+   *                            by the caller.
+   *  @return EC_Normal if dataset could be received successfully, an error code otherwise
+   */
+  OFCondition receiveSpooledDataset(T_ASC_PresentationContextID *presID,
+                                    DcmDataset **dataObject);
+
+  /** Record the duration of a phase (up to now) in the counters of the SCP thread and,
+   *  except for DCMSTORCMT_PHASE_COMMITMENT, on the timeline
+   *  @param phase [in] The phase
+   *  @param start [in] Start of the phase, see DcmSvcLatencyHistogram::getMonotonicTime()
+   *  @return the duration in microseconds
+   */
+  Uint64 recordPhase(const DcmStorCmtMetricsPhase phase,
+                     const Uint64 start);
+
+  /** Summarize the dataset of the request being handled in the slow operation record,
+   *  if the request has already exceeded its threshold. Must be called before the
+   *  dataset is handed over to the storage commitment command.
+   *  @param commandField [in] Command field of the request
+   *  @param dataset      [in] The received dataset
+   */
+  void captureSlowDataset(const Uint16 commandField,
+                          DcmDataset &dataset);
+
+  /** Record the size and shape of the dataset of the N-ACTION request being handled in
+   *  the counters of the SCP thread and of the peer. Must be called before the dataset
+   *  is handed over to the storage commitment command.
+   *  @param dataset [in] The received dataset
+   */
+  void recordPayload(DcmDataset &dataset);
+
+  /** Complete the slow operation record of a handled request and write it to the log
+   *  @param message [in] The request
+   *  @param latency [in] Time from receiving the command to the end of the handling,
+   *                      without the N-EVENT-REPORT on the same association, microseconds
+   */
+  void writeSlowRecord(const T_DIMSE_Message &message,
+                       const Uint64 latency);
+
+  /** Check whether debug output of the given level is written for the association or
+   *  request being handled, i.e.\ whether it matches the debug filter with that level
+   *  or the level is enabled for dcmnet anyway
+   *  @param level [in] The log level, debug or trace
+   *  @return OFTrue if enabled, OFFalse otherwise
+   */
+  OFBool isLogEnabledFor(const OFLogger::LogLevel level) const;
+
+  /** Count a handled request in the counters of the SCP thread and of the peer
+   *  @param commandField [in] Command field of the request or of its response
+   *  @param status       [in] Class of the response status
+   */
+  void countCommand(const Uint16 commandField,
+                    const DcmSvcMetricsStatus status);
+
 private:
 
   /// Current association run by this SCP
@@ -658,6 +824,10 @@ private:
   /// it, e.g. in the context of the DcmSCPPool class.
   DcmSharedSCPConfig m_cfg;
 
+  /// Accepted presentation contexts of the current association, indexed by their ID,
+  /// i.e.\ entries that are not used (including entry 0) have ID 0
+  DcmPresentationContextInfo m_presentationContexts[256];
+
   /** Drops association and clears internal structures to free memory
    */
   void dropAndDestroyAssociation();
@@ -676,6 +846,84 @@ private:
 
     // peer port of SCU
     Uint16 m_peerPort;
+
+    // buffer (or spool file) for received datasets, reused for each message
+    DcmSvcSpoolBuffer m_spoolBuffer;
+
+    // pre-encoded C-ECHO response
+    DcmSvcResponseTemplate m_echoResponse;
+
+    // pre-encoded N-ACTION response
+    DcmSvcResponseTemplate m_actionResponse;
+
+    // selects the transfer syntax of each accepted presentation context
+    DcmSvcNegotiationPolicy m_negotiationPolicy;
+
+    // negotiation results of earlier association requests
+    DcmSvcNegotiationCache m_negotiationCache;
+
+    // metrics (not owned), NULL if not used
+    DcmStorCmtMetrics *m_metrics;
+
+    // counters used if no metrics are set (or the metrics have no room for this thread)
+    DcmStorCmtMetricsCounters m_localCounters;
+
+    // counters of the SCP thread, never NULL
+    DcmStorCmtMetricsCounters *m_counters;
+
+    // transport layer of the network while listening (owned by the network), else NULL
+    DcmSvcTransportLayer *m_transportLayer;
+
+    // monotonic time (in microseconds) the association request or command being handled was received
+    Uint64 m_phaseStart;
+
+    // time (in microseconds) spent receiving the dataset of the request being handled
+    Uint64 m_datasetTime;
+
+    // time (in microseconds) spent sending the response to the request being handled
+    Uint64 m_sendTime;
+
+    // time (in microseconds) spent waiting for and sending the N-EVENT-REPORT of the request being handled
+    Uint64 m_reportTime;
+
+    // counters of the peer of the current association (owned by m_counters), NULL if none
+    DcmSvcPeerCounters *m_peer;
+
+    // bytes received by the SCP thread before the current association
+    Uint64 m_peerBytesReceived;
+
+    // bytes sent by the SCP thread before the current association
+    Uint64 m_peerBytesSent;
+
+    // number of association requests received so far, identifies the current association in the probes and the timeline
+    Uint32 m_associationCounter;
+
+    // message ID of the request being handled (0 if not looked up), for the probes and the timeline
+    Uint16 m_messageID;
+
+    // timeline (not owned), NULL if not used
+    DcmSvcTimeline *m_timeline;
+
+    // monotonic time (in microseconds) the connection of the current association was accepted, 0 if none
+    Uint64 m_associationStart;
+
+    // status of the response sent to the request being handled, -1 if none (yet)
+    int m_responseStatus;
+
+    // log of slow operations (not owned), NULL if not used
+    DcmSvcSlowLog *m_slowLog;
+
+    // slow operation record of the request being handled
+    DcmSvcSlowRecord m_slowRecord;
+
+    // filter for targeted debug output (not owned), NULL if not used
+    DcmSvcDebugFilter *m_debugFilter;
+
+    // debug level of the current association as matched by the filter, OFF_LOG_LEVEL if none
+    OFLogger::LogLevel m_associationDebugLevel;
+
+    // debug level of the association or request being handled, OFF_LOG_LEVEL if none
+    OFLogger::LogLevel m_debugLevel;
 };
 
 #endif // DSTORCMTSCP_H
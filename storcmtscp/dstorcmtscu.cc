@@ -21,6 +21,8 @@
 
 #include "dstorcmtscu.h"
 #include "dcmtk/dcmnet/diutil.h"
+#include "dsvctrans.h"
+#include "dstorcmtprobe.h"             /* for DCMSTORCMT_PROBE3() */
 
 #include "dcmtk/ofstd/ofstd.h"
 
@@ -38,9 +40,16 @@ DcmStorCmtSCU::DcmStorCmtSCU():
   m_peerAETitle("ANY-SCP"),
   m_peerPort(104),
   m_dimseTimeout(0),
-  m_acseTimeout(30)
+  m_acseTimeout(30),
+  m_counters(NULL),
+  m_timeline(NULL),
+  m_networkStart(0)
 {
     OFList<OFString> transferSyntaxes;
+#ifdef WITH_ZLIB
+    // propose deflate first, the event report datasets compress well
+    transferSyntaxes.push_back(UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+#endif
     transferSyntaxes.push_back(UID_LittleEndianExplicitTransferSyntax);
     transferSyntaxes.push_back(UID_BigEndianExplicitTransferSyntax);
     transferSyntaxes.push_back(UID_LittleEndianImplicitTransferSyntax);
@@ -76,14 +85,9 @@ void DcmStorCmtSCU::freeNetwork()
 
 DcmStorCmtSCU::~DcmStorCmtSCU()
 {
-    if (storageCommitCommand != NULL )
-    {
-        if (storageCommitCommand->reqDataset != NULL) {
-            delete storageCommitCommand->reqDataset;
-        }
-        delete storageCommitCommand;
-        storageCommitCommand = NULL;
-    }
+    // also deletes the request dataset
+    delete storageCommitCommand;
+    storageCommitCommand = NULL;
 
   // abort association (if any) and destroy dcmnet data structures
   if (isConnected())
@@ -93,6 +97,13 @@ DcmStorCmtSCU::~DcmStorCmtSCU()
     freeNetwork();
   }
 
+  // the report association, from connecting to releasing (or giving up)
+  if ((m_timeline != NULL) && (m_networkStart != 0))
+  {
+    m_timeline->addSpan("report association", "report", m_networkStart,
+      DcmSvcLatencyHistogram::getMonotonicTime(), 0, 0, -1, m_peerAETitle.c_str());
+  }
+
 }
 
 OFCondition DcmStorCmtSCU::initNetwork()
@@ -103,6 +114,7 @@ OFCondition DcmStorCmtSCU::initNetwork()
 
   /* Be sure internal network structures are clean (delete old) */
   freeNetwork();
+  m_networkStart = DcmSvcLatencyHistogram::getMonotonicTime();
 
   OFString tempStr;
   /* initialize network, i.e. create an instance of T_ASC_Network*. */
@@ -114,6 +126,14 @@ OFCondition DcmStorCmtSCU::initNetwork()
     return cond;
   }
 
+  /* use buffered reads and gathered writes on the connection (ownership passes to m_net) */
+  cond = ASC_setTransportLayer(m_net, new DcmSvcTransportLayer((m_counters != NULL) ? &m_counters->transfer : NULL), 1);
+  if (cond.bad())
+  {
+    DCMNET_ERROR(DimseCondition::dump(tempStr, cond));
+    return cond;
+  }
+
   /* initialize association parameters, i.e. create an instance of T_ASC_Parameters*. */
   cond = ASC_createAssociationParameters(&m_params, m_maxReceivePDULength);
   if (cond.bad())
@@ -232,7 +252,13 @@ OFCondition DcmStorCmtSCU::negotiateAssociation()
   /* create association, i.e. try to establish a network connection to another */
   /* DICOM application. This call creates an instance of T_ASC_Association*. */
   DCMNET_INFO("Requesting Association");
+  const Uint64 requestStart = DcmSvcLatencyHistogram::getMonotonicTime();
   OFCondition cond = ASC_requestAssociation(m_net, m_params, &m_assoc);
+  if (m_timeline != NULL)
+  {
+    m_timeline->addSpan("negotiation", "report", requestStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+      0, 0, -1, m_peerAETitle.c_str());
+  }
   if (cond.bad())
   {
     if (cond == DUL_ASSOCIATIONREJECTED)
@@ -451,13 +477,10 @@ OFCondition DcmStorCmtSCU::abortAssociation()
 
 void DcmStorCmtSCU::setStorageCommitCommand( DcmStorageCommitmentCommand *command )
 {
-    storageCommitCommand = new DcmStorageCommitmentCommand();
-    storageCommitCommand->scuinf.localAETitle = command->scuinf.localAETitle;
-    storageCommitCommand->scuinf.remoteAETitle = command->scuinf.remoteAETitle;
-    storageCommitCommand->scuinf.remoteHostName = command->scuinf.remoteIP;
-    storageCommitCommand->scuinf.remoteIP = command->scuinf.remoteIP;
-    storageCommitCommand->scuinf.remotePort = command->scuinf.remotePort;
-    storageCommitCommand->reqDataset = (DcmDataset *)command->reqDataset->clone();
+    // take over the command, no need to copy the (possibly large) dataset
+    if (storageCommitCommand != command)
+        delete storageCommitCommand;
+    storageCommitCommand = command;
 
     setAETitle(storageCommitCommand->scuinf.localAETitle);
     setPeerHostName(storageCommitCommand->scuinf.remoteIP);
@@ -466,6 +489,16 @@ void DcmStorCmtSCU::setStorageCommitCommand( DcmStorageCommitmentCommand *comman
 
 }
 
+void DcmStorCmtSCU::setMetricsCounters(DcmStorCmtMetricsCounters *counters)
+{
+  m_counters = counters;
+}
+
+void DcmStorCmtSCU::setTimeline(DcmSvcTimeline *timeline)
+{
+  m_timeline = timeline;
+}
+
 /* ************************************************************************* */
 /*                         N-EVENT REPORT functionality                      */
 /* ************************************************************************* */
@@ -521,10 +554,14 @@ OFCondition DcmStorCmtSCU::sendEVENTREPORTRequest(const T_ASC_PresentationContex
   } else {
     DCMNET_INFO("Sending N-EVENT-REPORT Request (MsgID " << eventReportReq.MessageID << ")");
   }
+  const Uint64 sendStart = DcmSvcLatencyHistogram::getMonotonicTime();
   cond = sendDIMSEMessage(pcid, &request, reqDataset);
+  DCMSTORCMT_PROBE3(event__report__sent, 0, eventReportReq.MessageID, cond.good());
   if (cond.bad())
   {
     DCMNET_ERROR("Failed sending N-EVENT-REPORT request: " << DimseCondition::dump(tempStr, cond));
+    if (m_timeline != NULL)
+      m_timeline->addSpan("N-EVENT-REPORT", "report", sendStart, DcmSvcLatencyHistogram::getMonotonicTime(), 0, eventReportReq.MessageID);
     return cond;
   }
   // Receive response
@@ -536,6 +573,8 @@ OFCondition DcmStorCmtSCU::sendEVENTREPORTRequest(const T_ASC_PresentationContex
   if (cond.bad())
   {
     DCMNET_ERROR("Failed receiving DIMSE response: " << DimseCondition::dump(tempStr, cond));
+    if (m_timeline != NULL)
+      m_timeline->addSpan("N-EVENT-REPORT", "report", sendStart, DcmSvcLatencyHistogram::getMonotonicTime(), 0, eventReportReq.MessageID);
     return cond;
   }
 
@@ -566,6 +605,12 @@ OFCondition DcmStorCmtSCU::sendEVENTREPORTRequest(const T_ASC_PresentationContex
   // Set return value
   T_DIMSE_N_EventReportRSP &eventReportRsp = response.msg.NEventReportRSP;
   rspStatusCode = eventReportRsp.DimseStatus;
+  DCMSTORCMT_PROBE3(event__report__acknowledged, 0, eventReportReq.MessageID, rspStatusCode);
+  if (m_timeline != NULL)
+  {
+    m_timeline->addSpan("N-EVENT-REPORT", "report", sendStart, DcmSvcLatencyHistogram::getMonotonicTime(),
+      0, eventReportReq.MessageID, rspStatusCode);
+  }
 
   // Check whether there is a dataset to be received
   if (eventReportRsp.DataSetType == DIMSE_DATASET_PRESENT)
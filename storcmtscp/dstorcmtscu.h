@@ -31,6 +31,9 @@
 
 #include <dcmtk/ofstd/ofthread.h>
 
+#include "dstorcmtmetr.h"           /* for DcmStorCmtMetricsCounters */
+#include "dsvctime.h"               /* for DcmSvcTimeline */
+
 // include this file in doxygen documentation
 
 /** @file dstorcmtscu.h
@@ -80,19 +83,44 @@ struct DcmStorCmtSCUInf {
 
 }; 
 
+/** Pending storage commitment request. The command owns the request dataset, i.e.
+ *  the dataset received with the N-ACTION is handed over (not copied) and deleted
+ *  together with the command once the N-EVENT-REPORT has been sent.
+ */
 struct DcmStorageCommitmentCommand {
 
   DcmStorageCommitmentCommand() :
-    reqDataset(NULL)
+    reqDataset(NULL),
+    actionTime(0),
+    actionMessageID(0)
+  {
+  }
+
+  ~DcmStorageCommitmentCommand()
   {
+    delete reqDataset;
   }
 
   /// SCU (called) info
   DcmStorCmtSCUInf scuinf; 
 
-  // Dataset to send to SCU
+  // Dataset to send to SCU (owned by the command)
   DcmDataset *reqDataset ;
 
+  // monotonic time (in microseconds) the N-ACTION request was received
+  Uint64 actionTime;
+
+  // message ID of the N-ACTION request
+  Uint16 actionMessageID;
+
+private:
+
+  // private undefined copy constructor
+  DcmStorageCommitmentCommand(const DcmStorageCommitmentCommand &);
+
+  // private undefined assignment operator
+  DcmStorageCommitmentCommand &operator=(const DcmStorageCommitmentCommand &);
+
 } ;
 
 class DcmStorCmtSCU {
@@ -232,9 +260,27 @@ public:
   /** Deletes internal networking structures from memory */
   void freeNetwork();
 
-  // set storage commitment command
+  /** Set the storage commitment command to be sent. The SCU takes over ownership of
+   *  the command (including its dataset) and deletes it when destroyed.
+   *  @param command [in] The command, must have been created with new
+   */
     void setStorageCommitCommand( DcmStorageCommitmentCommand *command );
 
+  /** Set the counters of the bytes received and sent by this SCU. Must be called before
+   *  initNetwork().
+   *  @param counters [in] The counters, NULL if not counted. Not owned, must exist as
+   *                       long as the SCU.
+   */
+  void setMetricsCounters(DcmStorCmtMetricsCounters *counters);
+
+  /** Set the timeline that receives a span for the association and for each
+   *  N-EVENT-REPORT of this SCU, on the track of the calling thread. Must be called
+   *  before initNetwork().
+   *  @param timeline [in] The timeline, NULL for no timeline. Not owned, must exist as
+   *                       long as the SCU.
+   */
+  void setTimeline(DcmSvcTimeline *timeline);
+
 protected:
 
   /** Sends a DIMSE command and possibly also a dataset from a data object via network to
@@ -378,6 +424,15 @@ private:
   /// Verbose PC mode (default: disabled)
   OFBool m_verbosePCMode;
 
+  /// Counters of received and sent bytes (not owned), NULL if not counted
+  DcmStorCmtMetricsCounters *m_counters;
+
+  /// Timeline (not owned), NULL if not used
+  DcmSvcTimeline *m_timeline;
+
+  /// Monotonic time (in microseconds) the network was initialized, 0 if not yet
+  Uint64 m_networkStart;
+
   /** Returns next available message ID free to be used by SCU
    *  @return Next free message ID
    */
@@ -29,6 +29,16 @@
 #include "dcmtk/dcmdata/dcuid.h"     /* for dcmtk version name */
 #include "dcmtk/dcmdata/cmdlnarg.h"  /* for prepareCmdLineArgs */
 #include "dstorcmtscp.h"   /* for DcmStorCmtSCP */
+#include "dstorcmtmetr.h"  /* for DcmStorCmtMetrics, DcmSvcMetricsServer */
+#include "dsvctime.h"      /* for DcmSvcTimeline */
+#include "dsvcslow.h"      /* for DcmSvcSlowLog */
+#include "dsvcdbg.h"       /* for DcmSvcDebugFilter */
+
+#ifdef WITH_ZLIB
+#include <zlib.h>                     /* for zlibVersion() */
+#endif
+
+#include <signal.h>                   /* for SIGUSR1 */
 
 
 /* general definitions */
@@ -49,9 +59,16 @@ static char rcsid[] = "$dcmtk: " OFFIS_CONSOLE_APPLICATION " v"
 
 // general
 #define EXITCODE_NO_ERROR                         0
+#define EXITCODE_COMMANDLINE_SYNTAX_ERROR         1
+
+// input file errors
+#define EXITCODE_CANNOT_LOAD_NEGOTIATION_POLICY  20
 
 // network errors
 #define EXITCODE_CANNOT_START_SCP_AND_LISTEN     64
+#define EXITCODE_CANNOT_START_METRICS            65
+#define EXITCODE_CANNOT_START_TIMELINE           66
+#define EXITCODE_CANNOT_START_SLOW_LOG           67
 
 
 /* helper macro for converting stream output to a string */
@@ -82,8 +99,22 @@ int main(int argc, char *argv[])
     OFCmdUnsignedInt opt_commitWaitTimeout = 5;
 
     OFBool opt_showPresentationContexts = OFFalse;  // default: do not show presentation contexts in verbose mode
+    OFList<OFString> opt_debugRules;                // default: debug output as by log level only
     OFBool opt_useCalledAETitle = OFFalse;          // default: respond with specified application entity title
     OFBool opt_HostnameLookup = OFTrue;             // default: perform hostname lookup (for log output)
+    OFCmdUnsignedInt opt_spoolThreshold = 0;        // default: receive datasets in memory
+    const char *opt_spoolDirectory = "/tmp";
+    const char *opt_negotiationPolicy = NULL;       // default: keep configuration order (deflated first)
+    OFCmdUnsignedInt opt_metricsPort = 0;           // default: no metrics endpoint
+    const char *opt_metricsAddress = "127.0.0.1";   // default: local scrapers only
+    const char *opt_timelineFile = NULL;            // default: no timeline
+    const char *opt_slowLogFile = NULL;             // default: no slow operation log
+    OFCmdUnsignedInt opt_slowThreshold = DCMSVC_SLOW_DEFAULT_THRESHOLD;
+    OFCmdUnsignedInt opt_slowEchoThreshold = 0;     // default: as for all operations
+    OFCmdUnsignedInt opt_slowActionThreshold = 0;
+    OFBool opt_slowEcho = OFFalse;
+    OFBool opt_slowAction = OFFalse;
+    OFCmdUnsignedInt opt_slowRateLimit = DCMSVC_SLOW_DEFAULT_RATE;
 
     OFConsoleApplication app(OFFIS_CONSOLE_APPLICATION , "Simple DICOM MPPS SCP (receiver)", rcsid);
     OFCommandLine cmd;
@@ -97,6 +128,12 @@ int main(int argc, char *argv[])
       cmd.addOption("--version",                          "print version information and exit", OFCommandLine::AF_Exclusive);
       OFLog::addOptions(cmd);
       cmd.addOption("--verbose-pc",            "+v",      "show presentation contexts in verbose mode");
+      cmd.addOption("--debug-peer",            "-dp",  1, "[r]ule: string",
+                                                          "write debug output of matching associations\n"
+                                                          "regardless of the log level; r = ae=TITLE,\n"
+                                                          "ip=ADDRESS or uid=UID (Transaction UID),\n"
+                                                          "optionally followed by ,trace to include\n"
+                                                          "datasets (repeatable)");
 
     cmd.addGroup("network options:");
       cmd.addSubGroup("application entity title:");
@@ -105,7 +142,7 @@ int main(int argc, char *argv[])
         cmd.addOption("--use-called-aetitle",  "-uca",    "always respond with called AE title");
       cmd.addSubGroup("storage commitment options:");
         CONVERT_TO_STRING("[s]econds: integer (default: " << opt_commitWaitTimeout << ")", optString2);
-        cmd.addOption("--commit-wait-timeout", "-cwt", 1, optString2.c_str(), "timeout for storage commitment event");
+        cmd.addOption("--commit-wait-timeout", "-cwt", 1, optString2.c_str(), "timeout for storage commitment event,\n0 = send event without waiting for release");
         CONVERT_TO_STRING("port number: integer (default: " << opt_peerPort << ")", optString3);
         cmd.addOption("--peer-port", "-p", 1,  optString3.c_str(), "peer port number");
       cmd.addSubGroup("other network options:");
@@ -119,6 +156,49 @@ int main(int argc, char *argv[])
         cmd.addOption("--max-pdu",             "-pdu", 1, optString5.c_str(),
                                                           optString6.c_str());
         cmd.addOption("--disable-host-lookup", "-dhl",    "disable hostname lookup");
+        cmd.addOption("--spool-threshold",     "-spt", 1, "[k]B: integer (default: never)",
+                                                          "spool received datasets larger than k kB\n"
+                                                          "to disk while receiving them");
+        CONVERT_TO_STRING("[d]irectory: string (default: " << opt_spoolDirectory << ")", optString7);
+        cmd.addOption("--spool-directory",     "-spd", 1, optString7.c_str(),
+                                                          "create spool files in directory d");
+        cmd.addOption("--negotiation-policy",  "-np",  1, "[f]ilename: string",
+                                                          "rank transfer syntaxes (per calling AE) as\n"
+                                                          "in file f (default: configuration order,\n"
+                                                          "i.e. deflated first)");
+
+    cmd.addGroup("metrics options:");
+      cmd.addOption("--metrics-port",          "-mp",  1, "[p]ort: integer (1..65535)",
+                                                          "serve Prometheus metrics via HTTP on port p\n"
+                                                          "(path /metrics) and peer statistics in JSON\n"
+                                                          "(path /peers, also printed on SIGUSR1); if\n"
+                                                          "bound to a loopback address, the debug rules\n"
+                                                          "are listed on path /debug and changed by POST\n"
+                                                          "/debug?add=r, /debug?remove=r or /debug?clear");
+      CONVERT_TO_STRING("[a]ddress: string (default: " << opt_metricsAddress << ")", optString8);
+      cmd.addOption("--metrics-address",       "-ma",  1, optString8.c_str(),
+                                                          "serve metrics on IPv4 address a only");
+
+    cmd.addGroup("trace options:");
+      cmd.addOption("--timeline-file",         "-tlf", 1, "[f]ilename: string",
+                                                          "write associations, requests and event\n"
+                                                          "reports as Chrome trace events to file f\n"
+                                                          "(for Perfetto)");
+      cmd.addOption("--slow-log-file",         "-slf", 1, "[f]ilename: string",
+                                                          "append a diagnostic record of each request\n"
+                                                          "exceeding its threshold to file f");
+      CONVERT_TO_STRING("[m]s: integer (default: " << opt_slowThreshold << ")", optString9);
+      cmd.addOption("--slow-threshold",        "-sth", 1, optString9.c_str(),
+                                                          "threshold of all operations");
+      cmd.addOption("--slow-echo",             "-sle", 1, "[m]s: integer",
+                                                          "threshold of C-ECHO requests");
+      cmd.addOption("--slow-action",           "-sla", 1, "[m]s: integer",
+                                                          "threshold of N-ACTION requests (without\n"
+                                                          "the event report on the same association)");
+      CONVERT_TO_STRING("[n]umber: integer (default: " << opt_slowRateLimit << ")", optString10);
+      cmd.addOption("--slow-rate-limit",       "-slr", 1, optString10.c_str(),
+                                                          "log at most n slow requests per minute\n"
+                                                          "(0 = unlimited)");
 
     /* evaluate command line */
     prepareCmdLineArgs(argc, argv, OFFIS_CONSOLE_APPLICATION);
@@ -130,7 +210,12 @@ int main(int argc, char *argv[])
             if (cmd.findOption("--version"))
             {
                 app.printHeader(OFTrue /*print host identifier*/);
+#if !defined(WITH_ZLIB)
                 COUT << OFendl << "External libraries used: none" << OFendl;
+#else
+                COUT << OFendl << "External libraries used:" << OFendl;
+                COUT << "- ZLIB, Version " << zlibVersion() << OFendl;
+#endif
                 return EXITCODE_NO_ERROR;
             }
         }
@@ -142,6 +227,15 @@ int main(int argc, char *argv[])
             app.checkDependence("--verbose-pc", "verbose mode", dcmrecvLogger.isEnabledFor(OFLogger::INFO_LOG_LEVEL));
             opt_showPresentationContexts = OFTrue;
         }
+        if (cmd.findOption("--debug-peer", 0, OFCommandLine::FOM_FirstFromLeft))
+        {
+            const char *rule = NULL;
+            do
+            {
+                app.checkValue(cmd.getValue(rule));
+                opt_debugRules.push_back(rule);
+            } while (cmd.findOption("--debug-peer", 0, OFCommandLine::FOM_NextFromLeft));
+        }
 
         cmd.beginOptionBlock();
         if (cmd.findOption("--aetitle"))
@@ -153,7 +247,7 @@ int main(int argc, char *argv[])
             opt_useCalledAETitle = OFTrue;
 
         if (cmd.findOption("--commit-wait-timeout"))
-            app.checkValue(cmd.getValueAndCheckMin(opt_commitWaitTimeout, 1));
+            app.checkValue(cmd.getValueAndCheckMin(opt_commitWaitTimeout, 0));
         if (cmd.findOption("--peer-port")) 
             app.checkValue(cmd.getValueAndCheckMin(opt_peerPort, 104));
  
@@ -170,6 +264,51 @@ int main(int argc, char *argv[])
             opt_HostnameLookup = OFFalse;
         cmd.endOptionBlock();
 
+        if (cmd.findOption("--spool-threshold"))
+            app.checkValue(cmd.getValueAndCheckMin(opt_spoolThreshold, 1));
+        if (cmd.findOption("--spool-directory"))
+        {
+            app.checkDependence("--spool-directory", "--spool-threshold", opt_spoolThreshold > 0);
+            app.checkValue(cmd.getValue(opt_spoolDirectory));
+        }
+        if (cmd.findOption("--negotiation-policy"))
+            app.checkValue(cmd.getValue(opt_negotiationPolicy));
+
+        if (cmd.findOption("--metrics-port"))
+            app.checkValue(cmd.getValueAndCheckMinMax(opt_metricsPort, 1, 65535));
+        if (cmd.findOption("--metrics-address"))
+        {
+            app.checkDependence("--metrics-address", "--metrics-port", opt_metricsPort > 0);
+            app.checkValue(cmd.getValue(opt_metricsAddress));
+        }
+
+        if (cmd.findOption("--timeline-file"))
+            app.checkValue(cmd.getValue(opt_timelineFile));
+        if (cmd.findOption("--slow-log-file"))
+            app.checkValue(cmd.getValue(opt_slowLogFile));
+        if (cmd.findOption("--slow-threshold"))
+        {
+            app.checkDependence("--slow-threshold", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowThreshold));
+        }
+        if (cmd.findOption("--slow-echo"))
+        {
+            app.checkDependence("--slow-echo", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowEchoThreshold));
+            opt_slowEcho = OFTrue;
+        }
+        if (cmd.findOption("--slow-action"))
+        {
+            app.checkDependence("--slow-action", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowActionThreshold));
+            opt_slowAction = OFTrue;
+        }
+        if (cmd.findOption("--slow-rate-limit"))
+        {
+            app.checkDependence("--slow-rate-limit", "--slow-log-file", opt_slowLogFile != NULL);
+            app.checkValue(cmd.getValue(opt_slowRateLimit));
+        }
+
       /* command line parameters */
       app.checkParam(cmd.getParamAndCheckMinMax(1, opt_port, 1, 65535));
 
@@ -187,6 +326,11 @@ int main(int argc, char *argv[])
 
     /* start with the real work */
     DcmStorCmtSCP storcmtSCP;
+    DcmStorCmtMetrics metrics;
+    DcmSvcMetricsServer metricsServer(metrics);
+    DcmSvcTimeline timeline("storcmtscp");
+    DcmSvcSlowLog slowLog;
+    DcmSvcDebugFilter debugFilter("dcmtk.storcmtscp.peer");
     OFCondition status;
 
     OFLOG_INFO(dcmrecvLogger, "configuring service class provider ...");
@@ -203,6 +347,74 @@ int main(int argc, char *argv[])
     storcmtSCP.setRespondWithCalledAETitle(opt_useCalledAETitle);
     storcmtSCP.setHostLookupEnabled(opt_HostnameLookup);
     storcmtSCP.setCommitWaitTimeout(opt_commitWaitTimeout);
+    storcmtSCP.setSpooling(OFstatic_cast(size_t, opt_spoolThreshold) * 1024, opt_spoolDirectory);
+    if (opt_negotiationPolicy != NULL)
+    {
+        status = storcmtSCP.loadNegotiationPolicy(opt_negotiationPolicy);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot load negotiation policy " << opt_negotiationPolicy << ": " << status.text());
+            return EXITCODE_CANNOT_LOAD_NEGOTIATION_POLICY;
+        }
+    }
+
+    /* write debug output of the selected peers and transactions regardless of the log level */
+    for (OFListIterator(OFString) rule = opt_debugRules.begin(); rule != opt_debugRules.end(); ++rule)
+    {
+        status = debugFilter.addRule(*rule);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "invalid debug rule: " << *rule);
+            return EXITCODE_COMMANDLINE_SYNTAX_ERROR;
+        }
+    }
+    storcmtSCP.setDebugFilter(&debugFilter);
+
+    /* start serving metrics */
+    if (opt_metricsPort > 0)
+    {
+        metricsServer.setDebugFilter(&debugFilter);
+        /* no other thread has been started yet, i.e. the signal is blocked in all threads */
+        status = metricsServer.setDumpSignal(SIGUSR1);
+        if (status.good())
+            status = metricsServer.listen(OFstatic_cast(Uint16, opt_metricsPort), opt_metricsAddress);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot serve metrics on port " << opt_metricsPort << ": " << status.text());
+            return EXITCODE_CANNOT_START_METRICS;
+        }
+        storcmtSCP.setMetrics(&metrics);
+    }
+
+    /* start writing the timeline */
+    if (opt_timelineFile != NULL)
+    {
+        status = timeline.open(opt_timelineFile);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot write timeline to " << opt_timelineFile << ": " << status.text());
+            return EXITCODE_CANNOT_START_TIMELINE;
+        }
+        storcmtSCP.setTimeline(&timeline);
+    }
+
+    /* start logging slow operations */
+    if (opt_slowLogFile != NULL)
+    {
+        slowLog.setThresholds(OFstatic_cast(Uint32, opt_slowThreshold));
+        if (opt_slowEcho)
+            slowLog.setThreshold(DIMSE_C_ECHO_RQ, OFstatic_cast(Uint32, opt_slowEchoThreshold));
+        if (opt_slowAction)
+            slowLog.setThreshold(DIMSE_N_ACTION_RQ, OFstatic_cast(Uint32, opt_slowActionThreshold));
+        slowLog.setRateLimit(OFstatic_cast(unsigned int, opt_slowRateLimit));
+        status = slowLog.open(opt_slowLogFile);
+        if (status.bad())
+        {
+            OFLOG_FATAL(dcmrecvLogger, "cannot log slow operations to " << opt_slowLogFile << ": " << status.text());
+            return EXITCODE_CANNOT_START_SLOW_LOG;
+        }
+        storcmtSCP.setSlowLog(&slowLog);
+    }
 
     OFLOG_INFO(dcmrecvLogger, "starting service class provider and listening ...");
 
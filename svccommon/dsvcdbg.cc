@@ -0,0 +1,288 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Filter raising the log level for selected peers and instances only
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvcdbg.h"
+#include "dcmtk/dcmdata/dcerror.h"    /* for EC_IllegalParameter */
+#include "dcmtk/dcmnet/diutil.h"      /* for DCMNET_INFO() */
+
+// Name of the kind of a rule, as written in the rule
+static const char *getRuleTypeName(const DcmSvcDebugRuleType type)
+{
+  switch (type)
+  {
+    case DCMSVC_DEBUG_AETITLE: return "ae";
+    case DCMSVC_DEBUG_ADDRESS: return "ip";
+    default:                   return "uid";
+  }
+}
+
+// Value of a hexadecimal digit, -1 if none
+static int getHexValue(const char c)
+{
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Decode a URL encoded query parameter, i.e. "%XX" escapes and "+" for space
+static OFString decodeQueryValue(const OFString &value)
+{
+  OFString decoded;
+  for (size_t i = 0; i < value.length(); i++)
+  {
+    if ((value[i] == '%') && (i + 2 < value.length()) && (getHexValue(value[i + 1]) >= 0) && (getHexValue(value[i + 2]) >= 0))
+    {
+      decoded += OFstatic_cast(char, getHexValue(value[i + 1]) * 16 + getHexValue(value[i + 2]));
+      i += 2;
+    }
+    else if (value[i] == '+')
+      decoded += ' ';
+    else
+      decoded += value[i];
+  }
+  return decoded;
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcDebugFilter::DcmSvcDebugFilter(const char *loggerName)
+  : m_logger(OFLog::getLogger(loggerName))
+  , m_rules()
+  , m_numPeerRules(0)
+  , m_numInstanceRules(0)
+  , m_mutex()
+{
+  m_logger.setLogLevel(OFLogger::TRACE_LOG_LEVEL);
+}
+
+
+DcmSvcDebugFilter::~DcmSvcDebugFilter()
+{
+}
+
+
+OFCondition DcmSvcDebugFilter::addRule(const OFString &rule)
+{
+  DcmSvcDebugRule parsed;
+  OFCondition cond = parseRule(rule, parsed);
+  if (cond.bad())
+    return cond;
+  m_mutex.lock();
+  OFListIterator(DcmSvcDebugRule) it = m_rules.begin();
+  while ((it != m_rules.end()) && !((it->type == parsed.type) && (it->value == parsed.value)))
+    ++it;
+  if (it != m_rules.end())
+    it->level = parsed.level;
+  else
+    m_rules.push_back(parsed);
+  updateCounts();
+  m_mutex.unlock();
+  DCMNET_INFO("Debug output enabled for " << rule);
+  return EC_Normal;
+}
+
+
+OFCondition DcmSvcDebugFilter::removeRule(const OFString &rule)
+{
+  DcmSvcDebugRule parsed;
+  OFCondition cond = parseRule(rule, parsed);
+  if (cond.bad())
+    return cond;
+  OFBool found = OFFalse;
+  m_mutex.lock();
+  OFListIterator(DcmSvcDebugRule) it = m_rules.begin();
+  while (it != m_rules.end())
+  {
+    if ((it->type == parsed.type) && (it->value == parsed.value))
+    {
+      it = m_rules.erase(it);
+      found = OFTrue;
+    }
+    else
+      ++it;
+  }
+  updateCounts();
+  m_mutex.unlock();
+  if (!found)
+    return EC_IllegalParameter;
+  DCMNET_INFO("Debug output disabled for " << rule);
+  return EC_Normal;
+}
+
+
+void DcmSvcDebugFilter::clear()
+{
+  m_mutex.lock();
+  m_rules.clear();
+  updateCounts();
+  m_mutex.unlock();
+  DCMNET_INFO("Debug output disabled for all peers");
+}
+
+
+OFString &DcmSvcDebugFilter::format(OFString &text)
+{
+  text.clear();
+  m_mutex.lock();
+  for (OFListIterator(DcmSvcDebugRule) it = m_rules.begin(); it != m_rules.end(); ++it)
+  {
+    text += getRuleTypeName(it->type);
+    text += '=';
+    text += it->value;
+    text += (it->level == OFLogger::TRACE_LOG_LEVEL) ? ",trace\n" : ",debug\n";
+  }
+  m_mutex.unlock();
+  return text;
+}
+
+
+OFCondition DcmSvcDebugFilter::handleQuery(const OFString &query,
+                                           OFString &text)
+{
+  size_t pos = 0;
+  while (pos < query.length())
+  {
+    size_t end = query.find('&', pos);
+    if (end == OFString_npos)
+      end = query.length();
+    const OFString parameter = query.substr(pos, end - pos);
+    pos = end + 1;
+    if (parameter.empty())
+      continue;
+    // the name is never encoded, the value is split off at the first '='
+    const size_t equals = parameter.find('=');
+    const OFString name = parameter.substr(0, equals);
+    const OFString value = (equals == OFString_npos) ? OFString() : decodeQueryValue(parameter.substr(equals + 1));
+    OFCondition cond = EC_Normal;
+    if (name == "add")
+      cond = addRule(value);
+    else if (name == "remove")
+      cond = removeRule(value);
+    else if (name == "clear")
+      clear();
+    else
+      cond = EC_IllegalParameter;
+    if (cond.bad())
+    {
+      text = "Invalid or unknown debug rule: ";
+      text += parameter;
+      text += '\n';
+      return cond;
+    }
+  }
+  format(text);
+  return EC_Normal;
+}
+
+
+OFLogger::LogLevel DcmSvcDebugFilter::matchAssociation(const char *aeTitle,
+                                                       const char *address)
+{
+  if (m_numPeerRules == 0)
+    return OFLogger::OFF_LOG_LEVEL;
+  OFLogger::LogLevel level = OFLogger::OFF_LOG_LEVEL;
+  m_mutex.lock();
+  for (OFListIterator(DcmSvcDebugRule) it = m_rules.begin(); it != m_rules.end(); ++it)
+  {
+    const char *value = (it->type == DCMSVC_DEBUG_AETITLE) ? aeTitle :
+                        (it->type == DCMSVC_DEBUG_ADDRESS) ? address : NULL;
+    if ((value != NULL) && (it->value == value) && (it->level < level))
+      level = it->level;
+  }
+  m_mutex.unlock();
+  return level;
+}
+
+
+OFBool DcmSvcDebugFilter::hasInstanceRules() const
+{
+  return m_numInstanceRules > 0;
+}
+
+
+OFLogger::LogLevel DcmSvcDebugFilter::matchInstance(const char *instanceUID)
+{
+  if ((m_numInstanceRules == 0) || (instanceUID == NULL) || (instanceUID[0] == '\0'))
+    return OFLogger::OFF_LOG_LEVEL;
+  OFLogger::LogLevel level = OFLogger::OFF_LOG_LEVEL;
+  m_mutex.lock();
+  for (OFListIterator(DcmSvcDebugRule) it = m_rules.begin(); it != m_rules.end(); ++it)
+  {
+    if ((it->type == DCMSVC_DEBUG_INSTANCE) && (it->value == instanceUID))
+    {
+      level = it->level;
+      break;
+    }
+  }
+  m_mutex.unlock();
+  return level;
+}
+
+
+OFLogger &DcmSvcDebugFilter::getLogger()
+{
+  return m_logger;
+}
+
+
+OFCondition DcmSvcDebugFilter::parseRule(const OFString &text,
+                                         DcmSvcDebugRule &rule)
+{
+  const size_t equals = text.find('=');
+  if (equals == OFString_npos)
+    return EC_IllegalParameter;
+  const OFString type = text.substr(0, equals);
+  if (type == "ae")
+    rule.type = DCMSVC_DEBUG_AETITLE;
+  else if (type == "ip")
+    rule.type = DCMSVC_DEBUG_ADDRESS;
+  else if (type == "uid")
+    rule.type = DCMSVC_DEBUG_INSTANCE;
+  else
+    return EC_IllegalParameter;
+  rule.value = text.substr(equals + 1);
+  rule.level = OFLogger::DEBUG_LOG_LEVEL;
+  // only a known level is split off, an AE title might contain a comma
+  const size_t comma = rule.value.rfind(',');
+  if (comma != OFString_npos)
+  {
+    const OFString level = rule.value.substr(comma + 1);
+    if (level == "trace")
+      rule.level = OFLogger::TRACE_LOG_LEVEL;
+    if ((level == "trace") || (level == "debug"))
+      rule.value.erase(comma);
+  }
+  if (rule.value.empty())
+    return EC_IllegalParameter;
+  return EC_Normal;
+}
+
+
+void DcmSvcDebugFilter::updateCounts()
+{
+  size_t numPeerRules = 0;
+  size_t numInstanceRules = 0;
+  for (OFListIterator(DcmSvcDebugRule) it = m_rules.begin(); it != m_rules.end(); ++it)
+  {
+    if (it->type == DCMSVC_DEBUG_INSTANCE)
+      ++numInstanceRules;
+    else
+      ++numPeerRules;
+  }
+  // read by the SCP thread without lock, a stale count only delays the effect of a
+  // change to the next association or request
+  m_numPeerRules = numPeerRules;
+  m_numInstanceRules = numInstanceRules;
+}
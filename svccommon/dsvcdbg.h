@@ -0,0 +1,166 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Filter raising the log level for selected peers and instances only
+ *
+ */
+
+#ifndef DSVCDBG_H
+#define DSVCDBG_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFMutex */
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/oflist.h"
+#include "dcmtk/ofstd/ofcond.h"
+#include "dcmtk/oflog/oflog.h"      /* for OFLogger */
+
+/** Kind of value a debug rule is compared with
+ */
+enum DcmSvcDebugRuleType
+{
+  /// calling AE title of the association
+  DCMSVC_DEBUG_AETITLE,
+  /// network address of the peer
+  DCMSVC_DEBUG_ADDRESS,
+  /// instance UID of a request, e.g.\ its SOP Instance UID or Transaction UID
+  DCMSVC_DEBUG_INSTANCE
+};
+
+/** Rule of the debug filter
+ */
+struct DcmSvcDebugRule
+{
+  /// kind of the compared value
+  DcmSvcDebugRuleType type;
+  /// value that must match exactly
+  OFString value;
+  /// log level used for matching associations or requests, debug or trace
+  OFLogger::LogLevel level;
+};
+
+/** Filter selecting the associations (by calling AE title or peer address) and the
+ *  requests (by instance UID) whose debug output is written regardless of the
+ *  log level of dcmnet. The SCP evaluates the peer rules once when an association is
+ *  requested and keeps the result for the whole association, so that associations
+ *  of other peers do not pay for dumping their messages. The rules can be changed at
+ *  any time by another thread (e.g.\ the metrics server); a change applies to the
+ *  associations and requests received afterwards.
+ *
+ *  Rules are written as "ae=TITLE", "ip=ADDRESS" or "uid=UID", optionally followed by
+ *  ",debug" (the default) or ",trace" (debug output including the datasets).
+ */
+class DcmSvcDebugFilter
+{
+
+  public:
+
+  /** constructor. Enables all levels of the logger of the filter, i.e.\ its output
+   *  is only restricted by the rules.
+   *  @param loggerName [in] Name of the logger, e.g.\ "dcmtk.mppsscp.peer"
+   */
+  DcmSvcDebugFilter(const char *loggerName);
+
+  /** destructor
+   */
+  ~DcmSvcDebugFilter();
+
+  /** Add a rule. An existing rule for the same value is replaced.
+   *  @param rule [in] The rule, e.g.\ "ae=CT01,trace"
+   *  @return EC_Normal if successful, an error code if the rule is invalid
+   */
+  OFCondition addRule(const OFString &rule);
+
+  /** Remove a rule. The level of the rule may be omitted.
+   *  @param rule [in] The rule, e.g.\ "ae=CT01"
+   *  @return EC_Normal if removed, an error code if invalid or not found
+   */
+  OFCondition removeRule(const OFString &rule);
+
+  /** Remove all rules
+   */
+  void clear();
+
+  /** Returns the rules, one per line
+   *  @param text [out] The rules
+   *  @return reference to text
+   */
+  OFString &format(OFString &text);
+
+  /** Change the rules as requested by the query string of an HTTP request, i.e.\ by
+   *  any sequence of "add=RULE", "remove=RULE" and "clear" separated by "&" (with the
+   *  rules URL encoded), and return the resulting rules
+   *  @param query [in]  The query string, without the leading "?"
+   *  @param text  [out] The rules after the change (see format()) or the error
+   *  @return EC_Normal if successful, an error code if a parameter is invalid
+   */
+  OFCondition handleQuery(const OFString &query,
+                          OFString &text);
+
+  /** Match an association against the peer rules
+   *  @param aeTitle [in] Calling AE title of the association
+   *  @param address [in] Network address of the peer
+   *  @return the lowest level of all matching rules, OFF_LOG_LEVEL if none matches
+   */
+  OFLogger::LogLevel matchAssociation(const char *aeTitle,
+                                      const char *address);
+
+  /** Check whether there are instance rules, i.e.\ whether the instance UID of a
+   *  request needs to be looked up at all (without locking)
+   *  @return OFTrue if there are instance rules, OFFalse otherwise
+   */
+  OFBool hasInstanceRules() const;
+
+  /** Match a request against the instance rules. Returns immediately (without
+   *  locking) if there are no instance rules.
+   *  @param instanceUID [in] Instance UID of the request (e.g.\ the Affected SOP
+   *                         Instance UID or the Transaction UID), may be NULL
+   *  @return the level of the matching rule, OFF_LOG_LEVEL if none matches
+   */
+  OFLogger::LogLevel matchInstance(const char *instanceUID);
+
+  /** Returns the logger receiving the output of matching associations and requests
+   *  @return the logger
+   */
+  OFLogger &getLogger();
+
+  private:
+
+  /** Parse a rule. Without a level, the rule gets the debug level.
+   *  @param text [in]  The rule
+   *  @param rule [out] The parsed rule
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  static OFCondition parseRule(const OFString &text,
+                               DcmSvcDebugRule &rule);
+
+  /** Count the rules of each kind, called with m_mutex locked
+   */
+  void updateCounts();
+
+  /// logger receiving the output of matching associations and requests
+  OFLogger m_logger;
+
+  /// the rules, only accessed with m_mutex locked
+  OFList<DcmSvcDebugRule> m_rules;
+
+  /// number of peer rules, read without lock to skip the matching if zero
+  volatile size_t m_numPeerRules;
+
+  /// number of instance rules, read without lock to skip the matching if zero
+  volatile size_t m_numInstanceRules;
+
+  /// mutex for accessing the rules
+  OFMutex m_mutex;
+
+  // private undefined copy constructor
+  DcmSvcDebugFilter(const DcmSvcDebugFilter &);
+
+  // private undefined assignment operator
+  DcmSvcDebugFilter &operator=(const DcmSvcDebugFilter &);
+
+};
+
+#endif // DSVCDBG_H
@@ -0,0 +1,116 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Log-bucketed latency histograms
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvchist.h"
+
+#include <time.h>
+
+DcmSvcLatencyHistogram::DcmSvcLatencyHistogram()
+  : m_count(0)
+  , m_sum(0)
+  , m_max(0)
+{
+  for (size_t i = 0; i < DCMSVC_HISTOGRAM_BUCKETS; i++)
+    m_buckets[i] = 0;
+}
+
+
+void DcmSvcLatencyHistogram::record(const Uint64 microseconds)
+{
+  ++m_buckets[getBucket(microseconds)];
+  ++m_count;
+  m_sum += microseconds;
+  if (microseconds > m_max)
+    m_max = microseconds;
+}
+
+
+void DcmSvcLatencyHistogram::add(const DcmSvcLatencyHistogram &other)
+{
+  for (size_t i = 0; i < DCMSVC_HISTOGRAM_BUCKETS; i++)
+    m_buckets[i] += other.m_buckets[i];
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+  if (other.m_max > m_max)
+    m_max = other.m_max;
+}
+
+
+Uint64 DcmSvcLatencyHistogram::getCount() const
+{
+  return m_count;
+}
+
+
+Uint64 DcmSvcLatencyHistogram::getSum() const
+{
+  return m_sum;
+}
+
+
+Uint64 DcmSvcLatencyHistogram::getPercentile(const double fraction) const
+{
+  // the buckets are counted before m_count, i.e. use their total while values are recorded
+  Uint64 total = 0;
+  for (size_t i = 0; i < DCMSVC_HISTOGRAM_BUCKETS; i++)
+    total += m_buckets[i];
+  if (total == 0)
+    return 0;
+  // the rank of the value, i.e. the number of values up to it (rounded up)
+  const double exactRank = fraction * OFstatic_cast(double, total);
+  Uint64 rank = OFstatic_cast(Uint64, exactRank);
+  if ((rank < 1) || (OFstatic_cast(double, rank) < exactRank))
+    ++rank;
+  Uint64 seen = 0;
+  for (size_t i = 0; i < DCMSVC_HISTOGRAM_BUCKETS; i++)
+  {
+    seen += m_buckets[i];
+    if (seen >= rank)
+    {
+      const Uint64 value = getHighestValue(i);
+      return (value < m_max) ? value : m_max;
+    }
+  }
+  return m_max;
+}
+
+
+Uint64 DcmSvcLatencyHistogram::getMonotonicTime()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return OFstatic_cast(Uint64, now.tv_sec) * 1000000 + OFstatic_cast(Uint64, now.tv_nsec / 1000);
+}
+
+
+size_t DcmSvcLatencyHistogram::getBucket(const Uint64 value)
+{
+  // values below DCMSVC_HISTOGRAM_SUB_BUCKETS are counted exactly
+  if (value < DCMSVC_HISTOGRAM_SUB_BUCKETS)
+    return OFstatic_cast(size_t, value);
+  if (value >> DCMSVC_HISTOGRAM_MAX_BITS)
+    return DCMSVC_HISTOGRAM_BUCKETS - 1;
+  // position of the highest bit, and the bits below it that select the sub-bucket
+  const int highestBit = 63 - __builtin_clzll(value);
+  const int shift = highestBit - DCMSVC_HISTOGRAM_PRECISION_BITS;
+  const size_t subBucket = OFstatic_cast(size_t, (value >> shift) & (DCMSVC_HISTOGRAM_SUB_BUCKETS - 1));
+  return OFstatic_cast(size_t, shift + 1) * DCMSVC_HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+
+Uint64 DcmSvcLatencyHistogram::getHighestValue(const size_t bucket)
+{
+  if (bucket < DCMSVC_HISTOGRAM_SUB_BUCKETS)
+    return OFstatic_cast(Uint64, bucket);
+  const int shift = OFstatic_cast(int, bucket / DCMSVC_HISTOGRAM_SUB_BUCKETS) - 1;
+  const Uint64 subBucket = OFstatic_cast(Uint64, bucket % DCMSVC_HISTOGRAM_SUB_BUCKETS);
+  return ((OFstatic_cast(Uint64, DCMSVC_HISTOGRAM_SUB_BUCKETS) + subBucket + 1) << shift) - 1;
+}
@@ -0,0 +1,119 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Log-bucketed latency histograms
+ *
+ */
+
+#ifndef DSVCHIST_H
+#define DSVCHIST_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/oftypes.h"    /* for Uint64 */
+
+/** Number of bits of a value kept below its highest bit, i.e.\ the relative error of a
+ *  recorded value is at most 2^-DCMSVC_HISTOGRAM_PRECISION_BITS (6.25%)
+ */
+#define DCMSVC_HISTOGRAM_PRECISION_BITS 4
+
+/** Number of sub-buckets per power of two
+ */
+#define DCMSVC_HISTOGRAM_SUB_BUCKETS (1 << DCMSVC_HISTOGRAM_PRECISION_BITS)
+
+/** Values (in microseconds) are recorded up to 2^DCMSVC_HISTOGRAM_MAX_BITS - 1, i.e.\
+ *  about 71 minutes; larger values are counted in the last bucket
+ */
+#define DCMSVC_HISTOGRAM_MAX_BITS 32
+
+/** Number of buckets of a histogram
+ */
+#define DCMSVC_HISTOGRAM_BUCKETS \
+  ((DCMSVC_HISTOGRAM_MAX_BITS - DCMSVC_HISTOGRAM_PRECISION_BITS + 1) * DCMSVC_HISTOGRAM_SUB_BUCKETS)
+
+/** Histogram of latencies in the style of an HDR histogram: the buckets are spaced
+ *  logarithmically (by powers of two), and each power of two is split linearly into
+ *  DCMSVC_HISTOGRAM_SUB_BUCKETS sub-buckets, so that percentiles are reported with a
+ *  bounded relative error over the complete range. Recording a value is a few integer
+ *  operations and two increments. A histogram is written by one thread only, without
+ *  lock or atomic operation, and may be read (e.g.\ merged with add()) by other threads
+ *  meanwhile; a reader then may miss the values being recorded.
+ */
+class DcmSvcLatencyHistogram
+{
+
+  public:
+
+  /** default constructor. Creates an empty histogram.
+   */
+  DcmSvcLatencyHistogram();
+
+  /** Record a value
+   *  @param microseconds [in] The value
+   */
+  void record(const Uint64 microseconds);
+
+  /** Add the values of another histogram
+   *  @param other [in] The histogram to add
+   */
+  void add(const DcmSvcLatencyHistogram &other);
+
+  /** Returns the number of recorded values
+   *  @return the number of values
+   */
+  Uint64 getCount() const;
+
+  /** Returns the sum of the recorded values
+   *  @return the sum in microseconds
+   */
+  Uint64 getSum() const;
+
+  /** Returns a percentile of the recorded values, i.e.\ the highest value that is
+   *  equivalent (within the precision of the histogram) to the value below which the
+   *  given fraction of the values is
+   *  @param fraction [in] The fraction, e.g.\ 0.99 for the 99th percentile
+   *  @return the percentile in microseconds, 0 if the histogram is empty
+   */
+  Uint64 getPercentile(const double fraction) const;
+
+  /** Returns a monotonic time, for measuring latencies
+   *  @return time in microseconds since an unspecified point
+   */
+  static Uint64 getMonotonicTime();
+
+  private:
+
+  /** Returns the bucket of a value
+   *  @param value [in] The value
+   *  @return the index of the bucket
+   */
+  static size_t getBucket(const Uint64 value);
+
+  /** Returns the highest value of a bucket
+   *  @param bucket [in] The index of the bucket
+   *  @return the highest value counted in the bucket
+   */
+  static Uint64 getHighestValue(const size_t bucket);
+
+  /// number of values per bucket
+  volatile Uint64 m_buckets[DCMSVC_HISTOGRAM_BUCKETS];
+
+  /// number of recorded values
+  volatile Uint64 m_count;
+
+  /// sum of the recorded values
+  volatile Uint64 m_sum;
+
+  /// largest recorded value, the percentiles do not exceed it
+  volatile Uint64 m_max;
+
+  // private undefined copy constructor
+  DcmSvcLatencyHistogram(const DcmSvcLatencyHistogram &);
+
+  // private undefined assignment operator
+  DcmSvcLatencyHistogram &operator=(const DcmSvcLatencyHistogram &);
+
+};
+
+#endif // DSVCHIST_H
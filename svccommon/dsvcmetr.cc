@@ -0,0 +1,956 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Runtime counters of an SCP and their export in the Prometheus text format
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvcmetr.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofmap.h"
+#include "dcmtk/ofstd/ofconsol.h"   /* for ofConsole */
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_ERROR() */
+#include "dcmtk/dcmdata/dcuid.h"   /* for UID_LittleEndianExplicitTransferSyntax et al. */
+#include "dcmtk/dcmnet/dimse.h"     /* for STATUS_Success */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+/* makes registered counters visible before the number of counters */
+#define MEMORY_BARRIER() __sync_synchronize()
+
+/* timeout for poll() in the server loop, i.e. maximum delay of stop() */
+#define POLL_TIMEOUT_MSEC   500
+
+/* timeout for reading the request header from a client */
+#define RECEIVE_TIMEOUT_SEC 2
+
+/* maximum size of a request header, requests of scrapers are much shorter */
+#define MAX_REQUEST_LENGTH  4096
+
+// ----------------------------------------------------------------------------
+
+static const char *statusName(const size_t status)
+{
+  switch (status)
+  {
+    case DCMSVC_METRICS_SUCCESS: return "success";
+    case DCMSVC_METRICS_WARNING: return "warning";
+    default:                     return "failure";
+  }
+}
+
+
+/* label values of the transfer syntaxes, in the order of DcmSvcMetricsTransferSyntax */
+static const char *const transferSyntaxNames[DCMSVC_METRICS_TRANSFER_SYNTAXES] =
+{
+  "implicit",
+  "explicit",
+  "big-endian",
+  "deflated",
+  "other"
+};
+
+
+/* label values of the refuse reasons, in the order of DcmRefuseReasonType */
+static const char *const refuseReasonNames[DCMSVC_METRICS_REFUSE_REASONS] =
+{
+  "too_many_associations",
+  "cannot_fork",
+  "bad_application_context_name",
+  "called_ae_title_not_recognized",
+  "calling_ae_title_not_recognized",
+  "forced",
+  "no_implementation_class_uid",
+  "no_presentation_contexts",
+  "internal_error"
+};
+
+
+static void appendJSONString(OFString &text,
+                             const OFString &value)
+{
+  // AE titles and addresses are printable ASCII, anything else is escaped anyway
+  char escaped[8];
+  text += '"';
+  for (size_t i = 0; i < value.length(); i++)
+  {
+    const unsigned char c = OFstatic_cast(unsigned char, value[i]);
+    if ((c == '"') || (c == '\\'))
+    {
+      text += '\\';
+      text += OFstatic_cast(char, c);
+    }
+    else if ((c < 0x20) || (c >= 0x7f))
+    {
+      OFStandard::snprintf(escaped, sizeof(escaped), "\\u%04x", OFstatic_cast(unsigned int, c));
+      text += escaped;
+    }
+    else
+      text += OFstatic_cast(char, c);
+  }
+  text += '"';
+}
+
+
+static void appendJSONNumber(OFString &text,
+                             const char *name,
+                             const Uint64 value)
+{
+  char member[128];
+  OFStandard::snprintf(member, sizeof(member), "\"%s\": %llu", name, OFstatic_cast(unsigned long long, value));
+  text += member;
+}
+
+
+static void appendJSONSeconds(OFString &text,
+                              const char *name,
+                              const Uint64 microseconds)
+{
+  char member[128];
+  OFStandard::snprintf(member, sizeof(member), "\"%s\": %llu.%06lu", name,
+    OFstatic_cast(unsigned long long, microseconds / 1000000),
+    OFstatic_cast(unsigned long, microseconds % 1000000));
+  text += member;
+}
+
+
+static void appendJSONPercentiles(OFString &text,
+                                  const char *name,
+                                  const DcmSvcLatencyHistogram &histogram)
+{
+  char member[192];
+  if (histogram.getCount() > 0)
+  {
+    OFStandard::snprintf(member, sizeof(member), "\"%s\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}", name,
+      OFstatic_cast(unsigned long long, histogram.getPercentile(0.5)),
+      OFstatic_cast(unsigned long long, histogram.getPercentile(0.99)),
+      OFstatic_cast(unsigned long long, histogram.getPercentile(0.999)));
+  }
+  else
+    OFStandard::snprintf(member, sizeof(member), "\"%s\": {\"p50\": null, \"p99\": null, \"p999\": null}", name);
+  text += member;
+}
+
+
+static void appendPeer(OFString &text,
+                       const DcmSvcPeerCounters &peer)
+{
+  text += "    {\"ae_title\": ";
+  appendJSONString(text, peer.aeTitle);
+  text += ", \"address\": ";
+  appendJSONString(text, peer.address);
+
+  // ISO 8601 in UTC
+  char lastSeen[32];
+  const time_t seconds = OFstatic_cast(time_t, peer.lastSeen);
+  struct tm utc;
+  if (gmtime_r(&seconds, &utc) == NULL)
+    lastSeen[0] = '\0';
+  else
+    strftime(lastSeen, sizeof(lastSeen), "%Y-%m-%dT%H:%M:%SZ", &utc);
+  text += ", \"last_seen\": ";
+  appendJSONString(text, lastSeen);
+
+  text += ", \"associations\": {";
+  appendJSONNumber(text, "accepted", peer.associationsAccepted);
+  text += ", ";
+  appendJSONNumber(text, "refused", peer.associationsRefused);
+  text += ", ";
+  appendJSONNumber(text, "released", peer.associationsReleased);
+  text += ", ";
+  appendJSONNumber(text, "aborted", peer.associationsAborted);
+  text += ", ";
+  appendJSONNumber(text, "failed", peer.associationsFailed);
+
+  text += "}, \"commands\": {";
+  for (size_t i = 0; i < peer.names.numCommands; i++)
+  {
+    if (i > 0)
+      text += ", ";
+    appendJSONString(text, peer.names.commands[i]);
+    text += ": {";
+    for (size_t j = 0; j < DCMSVC_METRICS_STATUS_CLASSES; j++)
+    {
+      if (j > 0)
+        text += ", ";
+      appendJSONNumber(text, statusName(j), peer.commands[i][j]);
+    }
+    text += '}';
+  }
+
+  text += "}, ";
+  appendJSONNumber(text, "received_bytes", peer.bytesReceived);
+  text += ", ";
+  appendJSONNumber(text, "sent_bytes", peer.bytesSent);
+
+  // percentiles are omitted (null) as long as no request was handled
+  text += ", \"request_duration_seconds\": {";
+  appendJSONNumber(text, "count", peer.requests.getCount());
+  if (peer.requests.getCount() > 0)
+  {
+    text += ", ";
+    appendJSONSeconds(text, "p50", peer.requests.getPercentile(0.5));
+    text += ", ";
+    appendJSONSeconds(text, "p99", peer.requests.getPercentile(0.99));
+    text += ", ";
+    appendJSONSeconds(text, "p999", peer.requests.getPercentile(0.999));
+  }
+  else
+    text += ", \"p50\": null, \"p99\": null, \"p999\": null";
+
+  // sizes and shapes of the received datasets
+  text += "}, \"datasets\": {";
+  for (size_t i = 0; i < peer.names.numPayloads; i++)
+  {
+    const DcmSvcPayloadHistograms &payload = peer.payloads[i];
+    if (i > 0)
+      text += ", ";
+    appendJSONString(text, peer.names.payloads[i]);
+    text += ": {";
+    appendJSONNumber(text, "count", payload.bytes.getCount());
+    text += ", ";
+    appendJSONPercentiles(text, "bytes", payload.bytes);
+    text += ", ";
+    appendJSONPercentiles(text, "elements", payload.elements);
+    text += ", ";
+    appendJSONPercentiles(text, "sequence_items", payload.items);
+    text += ", ";
+    appendJSONPercentiles(text, "nesting_depth", payload.depth);
+    text += '}';
+  }
+  text += "}}";
+}
+
+// ----------------------------------------------------------------------------
+
+void DcmSvcPayloadHistograms::record(const Uint64 numBytes,
+                                     const Uint64 numElements)
+{
+  bytes.record(numBytes);
+  elements.record(numElements);
+}
+
+
+void DcmSvcPayloadHistograms::recordSequences(const Uint64 numItems,
+                                              const Uint64 maxDepth)
+{
+  items.record(numItems);
+  depth.record(maxDepth);
+}
+
+
+void DcmSvcPayloadHistograms::add(const DcmSvcPayloadHistograms &other)
+{
+  bytes.add(other.bytes);
+  elements.add(other.elements);
+  items.add(other.items);
+  depth.add(other.depth);
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcPeerCounters::DcmSvcPeerCounters(const DcmSvcMetricsNames &metricsNames,
+                                       const OFString &peerAETitle,
+                                       const OFString &peerAddress)
+  : names(metricsNames)
+  , aeTitle(peerAETitle)
+  , address(peerAddress)
+  , associationsAccepted(0)
+  , associationsRefused(0)
+  , associationsReleased(0)
+  , associationsAborted(0)
+  , associationsFailed(0)
+  , bytesReceived(0)
+  , bytesSent(0)
+  , lastSeen(0)
+  , requests()
+  , payloads(new DcmSvcPayloadHistograms[metricsNames.numPayloads])
+  , next(NULL)
+{
+  for (size_t i = 0; i < DCMSVC_METRICS_MAX_COMMANDS; i++)
+    for (size_t j = 0; j < DCMSVC_METRICS_STATUS_CLASSES; j++)
+      commands[i][j] = 0;
+}
+
+
+DcmSvcPeerCounters::~DcmSvcPeerCounters()
+{
+  delete[] payloads;
+}
+
+
+void DcmSvcPeerCounters::countCommand(const Uint16 commandField,
+                                      const DcmSvcMetricsStatus status)
+{
+  ++commands[DcmSvcMetricsCounters::getCommand(names, commandField)][status];
+}
+
+
+void DcmSvcPeerCounters::add(const DcmSvcPeerCounters &other)
+{
+  associationsAccepted += other.associationsAccepted;
+  associationsRefused += other.associationsRefused;
+  associationsReleased += other.associationsReleased;
+  associationsAborted += other.associationsAborted;
+  associationsFailed += other.associationsFailed;
+  for (size_t i = 0; i < names.numCommands; i++)
+    for (size_t j = 0; j < DCMSVC_METRICS_STATUS_CLASSES; j++)
+      commands[i][j] += other.commands[i][j];
+  bytesReceived += other.bytesReceived;
+  bytesSent += other.bytesSent;
+  if (other.lastSeen > lastSeen)
+    lastSeen = other.lastSeen;
+  requests.add(other.requests);
+  for (size_t i = 0; i < names.numPayloads; i++)
+    payloads[i].add(other.payloads[i]);
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcMetricsCounters::DcmSvcMetricsCounters(const DcmSvcMetricsNames &metricsNames)
+  : names(metricsNames)
+  , associationsAccepted(0)
+  , associationsReleased(0)
+  , associationsAborted(0)
+  , transfer()
+  , payloads(new DcmSvcPayloadHistograms[metricsNames.numPayloads])
+  , peers(NULL)
+  , numPeers(0)
+{
+  for (size_t i = 0; i < DCMSVC_METRICS_REFUSE_REASONS; i++)
+    associationsRefused[i] = 0;
+  for (size_t i = 0; i < DCMSVC_METRICS_MAX_COMMANDS; i++)
+    for (size_t j = 0; j < DCMSVC_METRICS_STATUS_CLASSES; j++)
+      commands[i][j] = 0;
+  for (size_t i = 0; i < DCMSVC_METRICS_TRANSFER_SYNTAXES; i++)
+    acceptedSyntaxes[i] = 0;
+}
+
+
+DcmSvcMetricsCounters::~DcmSvcMetricsCounters()
+{
+  while (peers != NULL)
+  {
+    DcmSvcPeerCounters *peer = peers;
+    peers = peer->next;
+    delete peer;
+  }
+  delete[] payloads;
+}
+
+
+DcmSvcPeerCounters *DcmSvcMetricsCounters::getPeer(const OFString &peerAETitle,
+                                                   const OFString &peerAddress)
+{
+  // a modality usually sends its requests to the same thread, so the list stays short
+  for (DcmSvcPeerCounters *peer = peers; peer != NULL; peer = peer->next)
+  {
+    if ((peer->aeTitle == peerAETitle) && (peer->address == peerAddress))
+      return peer;
+  }
+  if (numPeers >= DCMSVC_METRICS_MAX_PEERS)
+    return NULL;
+  DcmSvcPeerCounters *peer = new DcmSvcPeerCounters(names, peerAETitle, peerAddress);
+  peer->next = peers;
+  // make the new counters visible to the reading thread only after they have been initialized
+  MEMORY_BARRIER();
+  peers = peer;
+  if (++numPeers == DCMSVC_METRICS_MAX_PEERS)
+    DCMNET_WARN("Too many peers for metrics, further peers of this thread are not counted");
+  return peer;
+}
+
+
+void DcmSvcMetricsCounters::countCommand(const Uint16 commandField,
+                                         const DcmSvcMetricsStatus status)
+{
+  ++commands[getCommand(names, commandField)][status];
+}
+
+
+void DcmSvcMetricsCounters::countAcceptedSyntax(const char *xferSyntax)
+{
+  size_t syntax = DCMSVC_METRICS_OTHER_SYNTAX;
+  if (strcmp(xferSyntax, UID_LittleEndianImplicitTransferSyntax) == 0)
+    syntax = DCMSVC_METRICS_IMPLICIT;
+  else if (strcmp(xferSyntax, UID_LittleEndianExplicitTransferSyntax) == 0)
+    syntax = DCMSVC_METRICS_EXPLICIT;
+  else if (strcmp(xferSyntax, UID_BigEndianExplicitTransferSyntax) == 0)
+    syntax = DCMSVC_METRICS_BIG_ENDIAN;
+  else if (strcmp(xferSyntax, UID_DeflatedExplicitVRLittleEndianTransferSyntax) == 0)
+    syntax = DCMSVC_METRICS_DEFLATED;
+  ++acceptedSyntaxes[syntax];
+}
+
+
+void DcmSvcMetricsCounters::add(const DcmSvcMetricsCounters &other)
+{
+  associationsAccepted += other.associationsAccepted;
+  for (size_t i = 0; i < DCMSVC_METRICS_REFUSE_REASONS; i++)
+    associationsRefused[i] += other.associationsRefused[i];
+  associationsReleased += other.associationsReleased;
+  associationsAborted += other.associationsAborted;
+  for (size_t i = 0; i < names.numCommands; i++)
+    for (size_t j = 0; j < DCMSVC_METRICS_STATUS_CLASSES; j++)
+      commands[i][j] += other.commands[i][j];
+  for (size_t i = 0; i < DCMSVC_METRICS_TRANSFER_SYNTAXES; i++)
+    acceptedSyntaxes[i] += other.acceptedSyntaxes[i];
+  transfer.add(other.transfer);
+  for (size_t i = 0; i < names.numPhases; i++)
+    phases[i].add(other.phases[i]);
+  for (size_t i = 0; i < names.numPayloads; i++)
+    payloads[i].add(other.payloads[i]);
+}
+
+
+size_t DcmSvcMetricsCounters::getCommand(const DcmSvcMetricsNames &names,
+                                         const Uint16 commandField)
+{
+  // requests and responses only differ in the highest bit, the last command counts the others
+  const Uint16 request = OFstatic_cast(Uint16, commandField & ~0x8000);
+  size_t command = 0;
+  while ((command < names.numCommands - 1) && (names.commandFields[command] != request))
+    ++command;
+  return command;
+}
+
+
+DcmSvcMetricsStatus DcmSvcMetricsCounters::classifyStatus(const Uint16 status)
+{
+  if (status == STATUS_Success)
+    return DCMSVC_METRICS_SUCCESS;
+  // attribute list error, attribute value out of range and the 0xBxxx range
+  if ((status == 0x0001) || (status == 0x0107) || (status == 0x0116) || ((status & 0xF000) == 0xB000))
+    return DCMSVC_METRICS_WARNING;
+  return DCMSVC_METRICS_FAILURE;
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcMetricsFormatter::DcmSvcMetricsFormatter(OFString &text,
+                                               const char *prefix)
+  : m_text(text)
+  , m_prefix(prefix)
+{
+}
+
+
+void DcmSvcMetricsFormatter::appendHeader(const char *name,
+                                          const char *type,
+                                          const char *help)
+{
+  m_text += "# HELP ";
+  m_text += m_prefix;
+  m_text += name;
+  m_text += ' ';
+  m_text += help;
+  m_text += "\n# TYPE ";
+  m_text += m_prefix;
+  m_text += name;
+  m_text += ' ';
+  m_text += type;
+  m_text += '\n';
+}
+
+
+void DcmSvcMetricsFormatter::appendSample(const char *name,
+                                          const char *labels,
+                                          const Uint64 value)
+{
+  char line[256];
+  OFStandard::snprintf(line, sizeof(line), "%s%s%s %llu\n",
+    m_prefix, name, labels, OFstatic_cast(unsigned long long, value));
+  m_text += line;
+}
+
+
+void DcmSvcMetricsFormatter::appendSeconds(const char *name,
+                                           const char *labels,
+                                           const Uint64 microseconds)
+{
+  char line[256];
+  OFStandard::snprintf(line, sizeof(line), "%s%s%s %llu.%06lu\n",
+    m_prefix, name, labels, OFstatic_cast(unsigned long long, microseconds / 1000000),
+    OFstatic_cast(unsigned long, microseconds % 1000000));
+  m_text += line;
+}
+
+
+void DcmSvcMetricsFormatter::appendSummary(const char *name,
+                                           const char *label,
+                                           const DcmSvcLatencyHistogram &histogram,
+                                           const OFBool inSeconds)
+{
+  // percentiles over the lifetime of the process, computed from the merged histograms
+  static const char *quantiles[] = { "0.5", "0.99", "0.999" };
+  static const double fractions[] = { 0.5, 0.99, 0.999 };
+  char labels[128];
+  for (size_t j = 0; j < 3; j++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "{%s,quantile=\"%s\"}", label, quantiles[j]);
+    if (histogram.getCount() == 0)
+    {
+      // the quantiles of no values are undefined
+      m_text += m_prefix;
+      m_text += name;
+      m_text += labels;
+      m_text += " NaN\n";
+    }
+    else if (inSeconds)
+      appendSeconds(name, labels, histogram.getPercentile(fractions[j]));
+    else
+      appendSample(name, labels, histogram.getPercentile(fractions[j]));
+  }
+  char sampleName[64];
+  OFStandard::snprintf(labels, sizeof(labels), "{%s}", label);
+  OFStandard::snprintf(sampleName, sizeof(sampleName), "%s_sum", name);
+  if (inSeconds)
+    appendSeconds(sampleName, labels, histogram.getSum());
+  else
+    appendSample(sampleName, labels, histogram.getSum());
+  OFStandard::snprintf(sampleName, sizeof(sampleName), "%s_count", name);
+  appendSample(sampleName, labels, histogram.getCount());
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcMetrics::DcmSvcMetrics(const DcmSvcMetricsNames &metricsNames)
+  : m_names(metricsNames)
+  , m_threadCounters()
+  , m_numCounters(0)
+  , m_countersMutex()
+{
+  for (size_t i = 0; i < DCMSVC_METRICS_MAX_THREADS; i++)
+    m_counters[i] = NULL;
+}
+
+
+DcmSvcMetrics::~DcmSvcMetrics()
+{
+  for (size_t i = 0; i < m_numCounters; i++)
+    delete m_counters[i];
+}
+
+
+DcmSvcMetricsCounters *DcmSvcMetrics::getThreadCounters()
+{
+  void *value = NULL;
+  if ((m_threadCounters.get(value) == 0) && (value != NULL))
+    return OFstatic_cast(DcmSvcMetricsCounters *, value);
+
+  DcmSvcMetricsCounters *counters = NULL;
+  m_countersMutex.lock();
+  if (m_numCounters < DCMSVC_METRICS_MAX_THREADS)
+  {
+    counters = createCounters();
+    m_counters[m_numCounters] = counters;
+    // make the counters visible to the scraping thread only after they have been stored
+    MEMORY_BARRIER();
+    m_numCounters = m_numCounters + 1;
+  }
+  m_countersMutex.unlock();
+
+  if (counters == NULL)
+    DCMNET_WARN("Too many threads for metrics, this thread is not counted");
+  else
+    m_threadCounters.set(counters);
+  return counters;
+}
+
+
+void DcmSvcMetrics::collect(DcmSvcMetricsCounters &total)
+{
+  const size_t numCounters = m_numCounters;
+  MEMORY_BARRIER();
+  // the counters may change meanwhile, but each single value is read atomically
+  for (size_t i = 0; i < numCounters; i++)
+    total.add(*m_counters[i]);
+}
+
+
+OFString &DcmSvcMetrics::format(OFString &text)
+{
+  DcmSvcMetricsCounters *total = createCounters();
+  collect(*total);
+
+  char labels[128];
+  text.clear();
+  DcmSvcMetricsFormatter formatter(text, m_names.prefix);
+  formatter.appendHeader("associations_total", "counter", "Associations by outcome.");
+  formatter.appendSample("associations_total", "{outcome=\"accepted\"}", total->associationsAccepted);
+  formatter.appendSample("associations_total", "{outcome=\"released\"}", total->associationsReleased);
+  formatter.appendSample("associations_total", "{outcome=\"aborted\"}", total->associationsAborted);
+
+  formatter.appendHeader("associations_refused_total", "counter", "Refused associations by reason.");
+  for (size_t i = 0; i < DCMSVC_METRICS_REFUSE_REASONS; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "{reason=\"%s\"}", refuseReasonNames[i]);
+    formatter.appendSample("associations_refused_total", labels, total->associationsRefused[i]);
+  }
+
+  // associations that were accepted but have not ended yet
+  const Uint64 ended = total->associationsReleased + total->associationsAborted;
+  formatter.appendHeader("active_associations", "gauge", "Associations currently in progress.");
+  formatter.appendSample("active_associations", "",
+    (total->associationsAccepted > ended) ? total->associationsAccepted - ended : 0);
+
+  formatter.appendHeader("accepted_transfer_syntax_total", "counter", "Accepted presentation contexts by transfer syntax.");
+  for (size_t i = 0; i < DCMSVC_METRICS_TRANSFER_SYNTAXES; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "{syntax=\"%s\"}", transferSyntaxNames[i]);
+    formatter.appendSample("accepted_transfer_syntax_total", labels, total->acceptedSyntaxes[i]);
+  }
+
+  formatter.appendHeader("dimse_commands_total", "counter", "DIMSE requests by command and response status.");
+  for (size_t i = 0; i < m_names.numCommands; i++)
+  {
+    for (size_t j = 0; j < DCMSVC_METRICS_STATUS_CLASSES; j++)
+    {
+      OFStandard::snprintf(labels, sizeof(labels), "{command=\"%s\",status=\"%s\"}",
+        m_names.commands[i], statusName(j));
+      formatter.appendSample("dimse_commands_total", labels, total->commands[i][j]);
+    }
+  }
+  formatGauges(*total, formatter);
+
+  formatter.appendHeader("received_bytes_total", "counter", "Bytes received from DIMSE peers.");
+  formatter.appendSample("received_bytes_total", "", total->transfer.bytesReceived);
+  formatter.appendHeader("sent_bytes_total", "counter", "Bytes sent to DIMSE peers.");
+  formatter.appendSample("sent_bytes_total", "", total->transfer.bytesSent);
+
+  formatter.appendHeader("phase_duration_seconds", "summary", "Durations of the phases of associations and requests.");
+  for (size_t i = 0; i < m_names.numPhases; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "phase=\"%s\"", m_names.phases[i]);
+    formatter.appendSummary("phase_duration_seconds", labels, total->phases[i], OFTrue);
+  }
+
+  // the datasets are only broken down by request, the peers are listed by "/peers"
+  formatter.appendHeader("dataset_bytes", "summary", "Sizes of the received datasets in bytes.");
+  for (size_t i = 0; i < m_names.numPayloads; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "command=\"%s\"", m_names.payloads[i]);
+    formatter.appendSummary("dataset_bytes", labels, total->payloads[i].bytes);
+  }
+  formatter.appendHeader("dataset_elements", "summary", "Numbers of top-level elements of the received datasets.");
+  for (size_t i = 0; i < m_names.numPayloads; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "command=\"%s\"", m_names.payloads[i]);
+    formatter.appendSummary("dataset_elements", labels, total->payloads[i].elements);
+  }
+  formatter.appendHeader("dataset_sequence_items", "summary", "Numbers of sequence items of the decoded datasets.");
+  for (size_t i = 0; i < m_names.numPayloads; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "command=\"%s\"", m_names.payloads[i]);
+    formatter.appendSummary("dataset_sequence_items", labels, total->payloads[i].items);
+  }
+  formatter.appendHeader("dataset_nesting_depth", "summary", "Maximum sequence nesting depths of the decoded datasets.");
+  for (size_t i = 0; i < m_names.numPayloads; i++)
+  {
+    OFStandard::snprintf(labels, sizeof(labels), "command=\"%s\"", m_names.payloads[i]);
+    formatter.appendSummary("dataset_nesting_depth", labels, total->payloads[i].depth);
+  }
+  delete total;
+  return text;
+}
+
+
+OFString &DcmSvcMetrics::formatPeers(OFString &text)
+{
+  // the same peer may be counted by different threads, sum them up ordered by AE title
+  // and address (which never contain a backslash)
+  OFMap<OFString, DcmSvcPeerCounters *> total;
+  const size_t numCounters = m_numCounters;
+  MEMORY_BARRIER();
+  for (size_t i = 0; i < numCounters; i++)
+  {
+    DcmSvcPeerCounters *peer = m_counters[i]->peers;
+    MEMORY_BARRIER();
+    for (; peer != NULL; peer = peer->next)
+    {
+      const OFString key = peer->aeTitle + "\\" + peer->address;
+      OFMap<OFString, DcmSvcPeerCounters *>::iterator it = total.find(key);
+      if (it == total.end())
+        it = total.insert(OFMake_pair(key, new DcmSvcPeerCounters(m_names, peer->aeTitle, peer->address))).first;
+      it->second->add(*peer);
+    }
+  }
+
+  text = "{\"peers\": [";
+  for (OFMap<OFString, DcmSvcPeerCounters *>::iterator it = total.begin(); it != total.end(); ++it)
+  {
+    text += (it == total.begin()) ? "\n" : ",\n";
+    appendPeer(text, *it->second);
+    delete it->second;
+  }
+  text += "\n]}\n";
+  return text;
+}
+
+
+DcmSvcMetricsCounters *DcmSvcMetrics::createCounters()
+{
+  return new DcmSvcMetricsCounters(m_names);
+}
+
+
+void DcmSvcMetrics::formatGauges(const DcmSvcMetricsCounters & /* total */,
+                                 DcmSvcMetricsFormatter & /* formatter */)
+{
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcMetricsServer::DcmSvcMetricsServer(DcmSvcMetrics &metrics)
+  : OFThread()
+  , m_metrics(metrics)
+  , m_socket(-1)
+  , m_stopRequested(OFFalse)
+  , m_dumpSignal(0)
+  , m_debugFilter(NULL)
+{
+}
+
+
+DcmSvcMetricsServer::~DcmSvcMetricsServer()
+{
+  stop();
+}
+
+
+OFCondition DcmSvcMetricsServer::listen(const Uint16 port,
+                                        const OFString &address)
+{
+  if (m_socket >= 0)
+    return EC_IllegalCall;
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &server.sin_addr) != 1)
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Invalid address for metrics socket");
+
+  m_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (m_socket < 0)
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot create metrics socket");
+
+  // allow a restart while connections of the previous run are in TIME_WAIT
+  int reuse = 1;
+  setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if ((bind(m_socket, OFreinterpret_cast(struct sockaddr *, &server), sizeof(server)) < 0) ||
+      (::listen(m_socket, 8) < 0))
+  {
+    DCMNET_ERROR("Cannot bind metrics socket to " << address << ":" << port << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    close(m_socket);
+    m_socket = -1;
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot bind metrics socket");
+  }
+  m_stopRequested = OFFalse;
+
+  // changing the debug rules must not be possible from other hosts
+  if ((m_debugFilter != NULL) && ((ntohl(server.sin_addr.s_addr) >> 24) != 127))
+  {
+    DCMNET_WARN("Not serving debug rules on /debug, the metrics socket is not bound to a loopback address");
+    m_debugFilter = NULL;
+  }
+
+  if (start() != 0)
+  {
+    close(m_socket);
+    m_socket = -1;
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot start metrics thread");
+  }
+  DCMNET_INFO("Serving metrics on http://" << address << ":" << port << "/metrics");
+  return EC_Normal;
+}
+
+
+OFCondition DcmSvcMetricsServer::setDumpSignal(const int signalNumber)
+{
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, signalNumber);
+  // threads inherit the signal mask, i.e. the signal stays pending until taken in run()
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot block signal for dumping peer statistics");
+  m_dumpSignal = signalNumber;
+  return EC_Normal;
+}
+
+
+void DcmSvcMetricsServer::setDebugFilter(DcmSvcDebugFilter *debugFilter)
+{
+  m_debugFilter = debugFilter;
+}
+
+
+void DcmSvcMetricsServer::stop()
+{
+  if (m_socket < 0)
+    return;
+  m_stopRequested = OFTrue;
+  join();
+  close(m_socket);
+  m_socket = -1;
+}
+
+
+void DcmSvcMetricsServer::run()
+{
+  struct pollfd pfd;
+  sigset_t signals;
+  sigemptyset(&signals);
+  if (m_dumpSignal != 0)
+    sigaddset(&signals, m_dumpSignal);
+  struct timespec noWait;
+  noWait.tv_sec = 0;
+  noWait.tv_nsec = 0;
+  while (!m_stopRequested)
+  {
+    // take a pending dump request, at the latest after the poll timeout
+    if ((m_dumpSignal != 0) && (sigtimedwait(&signals, NULL, &noWait) == m_dumpSignal))
+    {
+      OFString peers;
+      m_metrics.formatPeers(peers);
+      ofConsole.lockCout() << peers << OFflush;
+      ofConsole.unlockCout();
+    }
+    pfd.fd = m_socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    const int ready = poll(&pfd, 1, POLL_TIMEOUT_MSEC);
+    if ((ready < 0) && (errno != EINTR))
+    {
+      DCMNET_ERROR("Metrics socket failed, no longer serving metrics");
+      break;
+    }
+    if ((ready > 0) && (pfd.revents & POLLIN))
+    {
+      const int clientSocket = accept(m_socket, NULL, NULL);
+      if (clientSocket >= 0)
+      {
+        handleConnection(clientSocket);
+        close(clientSocket);
+      }
+    }
+  }
+}
+
+
+void DcmSvcMetricsServer::handleConnection(int clientSocket)
+{
+  // make sure that a client that never sends a request cannot block the server
+  struct timeval timeout;
+  timeout.tv_sec = RECEIVE_TIMEOUT_SEC;
+  timeout.tv_usec = 0;
+  setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // read the request header, i.e. up to the empty line; a body is never expected (POST
+  // takes its parameters from the query string as well)
+  char buffer[MAX_REQUEST_LENGTH];
+  size_t length = 0;
+  OFBool complete = OFFalse;
+  while (!complete && (length < sizeof(buffer) - 1))
+  {
+    const ssize_t bytes = recv(clientSocket, buffer + length, sizeof(buffer) - 1 - length, 0);
+    if (bytes <= 0)
+      break;
+    length += OFstatic_cast(size_t, bytes);
+    buffer[length] = '\0';
+    complete = (strstr(buffer, "\r\n\r\n") != NULL) || (strstr(buffer, "\n\n") != NULL);
+  }
+  if (!complete)
+    return;
+
+  // request line: METHOD PATH VERSION
+  const OFString header(buffer, length);
+  const size_t methodEnd = header.find(' ');
+  const size_t pathEnd = (methodEnd == OFString_npos) ? OFString_npos : header.find_first_of(" \r\n", methodEnd + 1);
+  OFString status;
+  OFString body;
+  const char *contentType = "text/plain; version=0.0.4; charset=utf-8";
+  const OFString method = (methodEnd == OFString_npos) ? OFString() : header.substr(0, methodEnd);
+  if (pathEnd == OFString_npos)
+    status = "400 Bad Request";
+  else if ((method != "GET") && (method != "POST"))
+    status = "405 Method Not Allowed";
+  else
+  {
+    OFString path = header.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+    // the query string is only used by "/debug"
+    OFString query;
+    const size_t queryStart = path.find('?');
+    if (queryStart != OFString_npos)
+    {
+      query = path.substr(queryStart + 1);
+      path.erase(queryStart);
+    }
+    // only the debug rules may be changed, and only by POST (i.e. not by following a link)
+    const OFBool changesRules = (path == "/debug") && !query.empty();
+    if ((path != "/metrics") && (path != "/peers") && ((path != "/debug") || (m_debugFilter == NULL)))
+      status = "404 Not Found";
+    else if ((method == "POST") != changesRules)
+      status = "405 Method Not Allowed";
+    else if (path == "/metrics")
+    {
+      status = "200 OK";
+      m_metrics.format(body);
+    }
+    else if (path == "/peers")
+    {
+      status = "200 OK";
+      contentType = "application/json";
+      m_metrics.formatPeers(body);
+    }
+    else
+    {
+      contentType = "text/plain; charset=utf-8";
+      status = m_debugFilter->handleQuery(query, body).good() ? "200 OK" : "400 Bad Request";
+    }
+  }
+  if (body.empty())
+  {
+    body = status;
+    body += '\n';
+  }
+
+  char contentLength[64];
+  OFStandard::snprintf(contentLength, sizeof(contentLength), "Content-Length: %lu\r\n",
+    OFstatic_cast(unsigned long, body.length()));
+  OFString response = "HTTP/1.0 ";
+  response += status;
+  response += "\r\nContent-Type: ";
+  response += contentType;
+  response += "\r\n";
+  response += contentLength;
+  response += "Connection: close\r\n\r\n";
+  response += body;
+
+  // send the response, the client may have gone away in the meantime
+  const char *data = response.c_str();
+  size_t remaining = response.length();
+  while (remaining > 0)
+  {
+    const ssize_t bytes = send(clientSocket, data, remaining, MSG_NOSIGNAL);
+    if (bytes <= 0)
+      break;
+    data += bytes;
+    remaining -= OFstatic_cast(size_t, bytes);
+  }
+}
@@ -0,0 +1,581 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Runtime counters of an SCP and their export in the Prometheus text format
+ *
+ */
+
+#ifndef DSVCMETR_H
+#define DSVCMETR_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFThread, OFMutex */
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/ofcond.h"
+
+#include "dsvchist.h"               /* for DcmSvcLatencyHistogram */
+#include "dsvcdbg.h"                /* for DcmSvcDebugFilter */
+#include "dsvctrans.h"              /* for DcmSvcTransferCounters */
+
+/** Maximum number of threads that may count
+ */
+#define DCMSVC_METRICS_MAX_THREADS 64
+
+/** Size of a cache line, i.e.\ distance between the counters of different threads
+ */
+#define DCMSVC_CACHE_LINE_SIZE 64
+
+/** Maximum number of peers counted separately by each thread
+ */
+#define DCMSVC_METRICS_MAX_PEERS 1024
+
+/** Number of reasons for refusing an association (see DcmRefuseReasonType)
+ */
+#define DCMSVC_METRICS_REFUSE_REASONS 9
+
+/** Maximum number of commands counted separately, see DcmSvcMetricsNames
+ */
+#define DCMSVC_METRICS_MAX_COMMANDS 8
+
+/** Maximum number of phases whose durations are recorded, see DcmSvcMetricsNames
+ */
+#define DCMSVC_METRICS_MAX_PHASES 8
+
+/** Classes of DIMSE status values
+ */
+enum DcmSvcMetricsStatus
+{
+  /// success
+  DCMSVC_METRICS_SUCCESS,
+  /// warning
+  DCMSVC_METRICS_WARNING,
+  /// failure, or no response at all (or no request could be sent)
+  DCMSVC_METRICS_FAILURE,
+  /// number of status classes
+  DCMSVC_METRICS_STATUS_CLASSES
+};
+
+/** Transfer syntaxes of accepted presentation contexts counted separately, named like
+ *  the keywords of a negotiation policy file (see DcmSvcNegotiationPolicy::loadFile())
+ */
+enum DcmSvcMetricsTransferSyntax
+{
+  /// Implicit VR Little Endian
+  DCMSVC_METRICS_IMPLICIT,
+  /// Explicit VR Little Endian
+  DCMSVC_METRICS_EXPLICIT,
+  /// Explicit VR Big Endian
+  DCMSVC_METRICS_BIG_ENDIAN,
+  /// Deflated Explicit VR Little Endian
+  DCMSVC_METRICS_DEFLATED,
+  /// any other transfer syntax
+  DCMSVC_METRICS_OTHER_SYNTAX,
+  /// number of counted transfer syntaxes
+  DCMSVC_METRICS_TRANSFER_SYNTAXES
+};
+
+/** Commands, phases and profiled datasets of an SCP. Each SCP defines a constant table
+ *  whose entries are in the order of its own enums, which are used as indexes into the
+ *  counters.
+ */
+struct DcmSvcMetricsNames
+{
+  /// prefix of all metric names, e.g.\ "mppsscp_"
+  const char *prefix;
+
+  /// request command field of each counted command except the last one
+  const Uint16 *commandFields;
+
+  /// name of each counted command, the last one counts all other commands
+  const char *const *commands;
+
+  /// number of counted commands, at most DCMSVC_METRICS_MAX_COMMANDS
+  size_t numCommands;
+
+  /// name of each phase, used as label value
+  const char *const *phases;
+
+  /// number of phases, at most DCMSVC_METRICS_MAX_PHASES
+  size_t numPhases;
+
+  /// name of the request of each profiled dataset, e.g.\ "N-CREATE"
+  const char *const *payloads;
+
+  /// number of profiled datasets
+  size_t numPayloads;
+};
+
+/** Size and shape of the datasets received with one kind of request. The histograms
+ *  count plain numbers rather than microseconds, which fits their buckets just as well.
+ *  The sequences are only profiled if the dataset is decoded, i.e.\ not with lazy
+ *  decoding, so items and depth may count fewer datasets than bytes and elements.
+ */
+struct DcmSvcPayloadHistograms
+{
+  /** Record the size of a dataset
+   *  @param numBytes    [in] Size of the encoded dataset in bytes
+   *  @param numElements [in] Number of top-level elements
+   */
+  void record(const Uint64 numBytes,
+              const Uint64 numElements);
+
+  /** Record the sequences of a decoded dataset
+   *  @param numItems [in] Number of sequence items on all levels
+   *  @param maxDepth [in] Maximum nesting depth of the sequences, 0 if none
+   */
+  void recordSequences(const Uint64 numItems,
+                       const Uint64 maxDepth);
+
+  /** Add the values of other histograms
+   *  @param other [in] The histograms to add
+   */
+  void add(const DcmSvcPayloadHistograms &other);
+
+  /// sizes of the encoded datasets in bytes
+  DcmSvcLatencyHistogram bytes;
+
+  /// numbers of top-level elements
+  DcmSvcLatencyHistogram elements;
+
+  /// numbers of sequence items on all levels
+  DcmSvcLatencyHistogram items;
+
+  /// maximum nesting depths of the sequences
+  DcmSvcLatencyHistogram depth;
+};
+
+/** Counters of one peer, i.e.\ of one calling AE title and IP address, in one thread.
+ *  Only the owning thread changes them, without any lock or atomic operation; the
+ *  AE title and address are not changed once the counters are published.
+ */
+struct DcmSvcPeerCounters
+{
+  /** constructor. Sets all counters to 0.
+   *  @param metricsNames [in] Commands and profiled datasets. Must exist as long as the counters.
+   *  @param peerAETitle  [in] Calling AE title of the peer
+   *  @param peerAddress  [in] IP address of the peer
+   */
+  DcmSvcPeerCounters(const DcmSvcMetricsNames &metricsNames,
+                     const OFString &peerAETitle,
+                     const OFString &peerAddress);
+
+  /** destructor
+   */
+  ~DcmSvcPeerCounters();
+
+  /** Count a handled request
+   *  @param commandField [in] Command field of the request or of its response
+   *  @param status       [in] Class of the response status
+   */
+  void countCommand(const Uint16 commandField,
+                    const DcmSvcMetricsStatus status);
+
+  /** Add the counters of the same peer in another thread
+   *  @param other [in] The counters to add
+   */
+  void add(const DcmSvcPeerCounters &other);
+
+  /// commands and profiled datasets
+  const DcmSvcMetricsNames &names;
+
+  /// calling AE title of the peer
+  const OFString aeTitle;
+
+  /// IP address of the peer
+  const OFString address;
+
+  /// acknowledged associations
+  volatile Uint64 associationsAccepted;
+
+  /// refused associations
+  volatile Uint64 associationsRefused;
+
+  /// associations released by the peer
+  volatile Uint64 associationsReleased;
+
+  /// associations aborted by the peer
+  volatile Uint64 associationsAborted;
+
+  /// associations ended because of an error (e.g.\ a timeout or an invalid message)
+  volatile Uint64 associationsFailed;
+
+  /// handled requests, indexed by command and status class
+  volatile Uint64 commands[DCMSVC_METRICS_MAX_COMMANDS][DCMSVC_METRICS_STATUS_CLASSES];
+
+  /// bytes received from the peer
+  volatile Uint64 bytesReceived;
+
+  /// bytes sent to the peer
+  volatile Uint64 bytesSent;
+
+  /// time (seconds since the epoch) an association with the peer was last requested or ended
+  volatile Uint64 lastSeen;
+
+  /// durations of the requests, from the received command to the sent response
+  DcmSvcLatencyHistogram requests;
+
+  /// received datasets, indexed like names.payloads (owned)
+  DcmSvcPayloadHistograms *const payloads;
+
+  /// next peer of the same thread, NULL if none
+  DcmSvcPeerCounters *volatile next;
+
+  private:
+
+  // private undefined copy constructor
+  DcmSvcPeerCounters(const DcmSvcPeerCounters &);
+
+  // private undefined assignment operator
+  DcmSvcPeerCounters &operator=(const DcmSvcPeerCounters &);
+};
+
+/** Counters of one thread. Only the owning thread changes them, without any lock or
+ *  atomic operation; they are read (i.e.\ summed up) by the thread answering a scrape.
+ *  The padding keeps the counters of different threads in different cache lines.
+ *  An SCP with additional counters derives from this class and overrides add().
+ */
+struct DcmSvcMetricsCounters
+{
+  /** constructor. Sets all counters to 0.
+   *  @param metricsNames [in] Commands, phases and profiled datasets. Must exist as
+   *                           long as the counters.
+   */
+  DcmSvcMetricsCounters(const DcmSvcMetricsNames &metricsNames);
+
+  /** destructor. Deletes the counters of the peers.
+   */
+  virtual ~DcmSvcMetricsCounters();
+
+  /** Get the counters of a peer, create and publish them if needed. Must only be
+   *  called by the owning thread.
+   *  @param peerAETitle [in] Calling AE title of the peer
+   *  @param peerAddress [in] IP address of the peer
+   *  @return the counters, NULL if this thread already counts too many peers
+   */
+  DcmSvcPeerCounters *getPeer(const OFString &peerAETitle,
+                              const OFString &peerAddress);
+
+  /** Count a handled request
+   *  @param commandField [in] Command field of the request or of its response
+   *  @param status       [in] Class of the response status
+   */
+  void countCommand(const Uint16 commandField,
+                    const DcmSvcMetricsStatus status);
+
+  /** Count an accepted presentation context
+   *  @param xferSyntax [in] UID of the accepted transfer syntax
+   */
+  void countAcceptedSyntax(const char *xferSyntax);
+
+  /** Add the counters of another thread
+   *  @param other [in] The counters to add, created with the same names
+   */
+  virtual void add(const DcmSvcMetricsCounters &other);
+
+  /** Returns the counted command of a command field
+   *  @param names        [in] Commands of the SCP
+   *  @param commandField [in] Command field of a request or of its response
+   *  @return the index of the command in names.commands
+   */
+  static size_t getCommand(const DcmSvcMetricsNames &names,
+                           const Uint16 commandField);
+
+  /** Returns the class of a DIMSE status
+   *  @param status [in] The status
+   *  @return the class of the status
+   */
+  static DcmSvcMetricsStatus classifyStatus(const Uint16 status);
+
+  /// padding against false sharing with the preceding allocation
+  char paddingBefore[DCMSVC_CACHE_LINE_SIZE];
+
+  /// commands, phases and profiled datasets
+  const DcmSvcMetricsNames &names;
+
+  /// acknowledged associations
+  volatile Uint64 associationsAccepted;
+
+  /// refused associations, indexed by DcmRefuseReasonType
+  volatile Uint64 associationsRefused[DCMSVC_METRICS_REFUSE_REASONS];
+
+  /// associations released by the peer
+  volatile Uint64 associationsReleased;
+
+  /// associations aborted by the peer or because of an error
+  volatile Uint64 associationsAborted;
+
+  /// handled requests, indexed by command and status class
+  volatile Uint64 commands[DCMSVC_METRICS_MAX_COMMANDS][DCMSVC_METRICS_STATUS_CLASSES];
+
+  /// accepted presentation contexts, indexed by DcmSvcMetricsTransferSyntax
+  volatile Uint64 acceptedSyntaxes[DCMSVC_METRICS_TRANSFER_SYNTAXES];
+
+  /// bytes received from and sent to the network
+  DcmSvcTransferCounters transfer;
+
+  /// durations of the phases, indexed like names.phases
+  DcmSvcLatencyHistogram phases[DCMSVC_METRICS_MAX_PHASES];
+
+  /// received datasets, indexed like names.payloads (owned)
+  DcmSvcPayloadHistograms *const payloads;
+
+  /// counters of the peers, most recent first (owned), read without lock
+  DcmSvcPeerCounters *volatile peers;
+
+  /// number of entries in peers
+  size_t numPeers;
+
+  /// padding against false sharing with the following allocation
+  char paddingAfter[DCMSVC_CACHE_LINE_SIZE];
+
+  private:
+
+  // private undefined copy constructor
+  DcmSvcMetricsCounters(const DcmSvcMetricsCounters &);
+
+  // private undefined assignment operator
+  DcmSvcMetricsCounters &operator=(const DcmSvcMetricsCounters &);
+};
+
+/** Helper appending metrics to a text in the Prometheus text exposition format
+ */
+class DcmSvcMetricsFormatter
+{
+
+  public:
+
+  /** constructor
+   *  @param text   [inout] The text to append to. Must exist as long as the formatter.
+   *  @param prefix [in] Prefix of all metric names, e.g.\ "mppsscp_"
+   */
+  DcmSvcMetricsFormatter(OFString &text,
+                         const char *prefix);
+
+  /** Append the HELP and TYPE lines of a metric
+   *  @param name [in] Name of the metric without prefix
+   *  @param type [in] Type of the metric, e.g.\ "counter"
+   *  @param help [in] Description of the metric
+   */
+  void appendHeader(const char *name,
+                    const char *type,
+                    const char *help);
+
+  /** Append a sample
+   *  @param name   [in] Name of the metric without prefix
+   *  @param labels [in] Labels including the braces, empty for none
+   *  @param value  [in] The value
+   */
+  void appendSample(const char *name,
+                    const char *labels,
+                    const Uint64 value);
+
+  /** Append a sample in seconds
+   *  @param name         [in] Name of the metric without prefix
+   *  @param labels       [in] Labels including the braces, empty for none
+   *  @param microseconds [in] The value in microseconds
+   */
+  void appendSeconds(const char *name,
+                     const char *labels,
+                     const Uint64 microseconds);
+
+  /** Append the quantiles, sum and count of a histogram as a summary
+   *  @param name      [in] Name of the metric without prefix
+   *  @param label     [in] Label distinguishing the summary, without braces
+   *  @param histogram [in] The histogram
+   *  @param inSeconds [in] Format the quantiles and the sum in seconds if OFTrue
+   */
+  void appendSummary(const char *name,
+                     const char *label,
+                     const DcmSvcLatencyHistogram &histogram,
+                     const OFBool inSeconds = OFFalse);
+
+  private:
+
+  /// the text to append to
+  OFString &m_text;
+
+  /// prefix of all metric names
+  const char *m_prefix;
+
+  // private undefined copy constructor
+  DcmSvcMetricsFormatter(const DcmSvcMetricsFormatter &);
+
+  // private undefined assignment operator
+  DcmSvcMetricsFormatter &operator=(const DcmSvcMetricsFormatter &);
+
+};
+
+/** Runtime metrics of an SCP. Each counting thread gets its own counters (see
+ *  getThreadCounters()), so that counting never touches a cache line shared with
+ *  another thread; the counters are only summed up when the metrics are formatted.
+ *  An SCP with additional counters derives from this class, overrides createCounters()
+ *  and formats its additional metrics in formatGauges().
+ */
+class DcmSvcMetrics
+{
+
+  public:
+
+  /** constructor
+   *  @param metricsNames [in] Commands, phases and profiled datasets of the SCP. Must
+   *                           exist as long as the metrics.
+   */
+  DcmSvcMetrics(const DcmSvcMetricsNames &metricsNames);
+
+  /** destructor
+   */
+  virtual ~DcmSvcMetrics();
+
+  /** Get the counters of the calling thread, create and register them if needed
+   *  @return the counters, NULL if too many threads are counting
+   */
+  DcmSvcMetricsCounters *getThreadCounters();
+
+  /** Sum up the counters of all threads
+   *  @param total [inout] The counters to add to (initially 0)
+   */
+  void collect(DcmSvcMetricsCounters &total);
+
+  /** Format the current metrics in the Prometheus text exposition format
+   *  @param text [out] The metrics
+   *  @return reference to text
+   */
+  OFString &format(OFString &text);
+
+  /** Format the counters of the peers as a JSON object, with the counters of the
+   *  same peer in different threads summed up
+   *  @param text [out] The peer statistics, one peer per line
+   *  @return reference to text
+   */
+  OFString &formatPeers(OFString &text);
+
+  protected:
+
+  /** Create the counters of a thread. The default creates DcmSvcMetricsCounters.
+   *  @return the new counters
+   */
+  virtual DcmSvcMetricsCounters *createCounters();
+
+  /** Append the metrics of the additional counters, called after the DIMSE commands
+   *  are formatted. The default appends nothing.
+   *  @param total     [in] The counters of all threads, created by createCounters()
+   *  @param formatter [in] The formatter to append to
+   */
+  virtual void formatGauges(const DcmSvcMetricsCounters &total,
+                            DcmSvcMetricsFormatter &formatter);
+
+  /// commands, phases and profiled datasets of the SCP
+  const DcmSvcMetricsNames &m_names;
+
+  private:
+
+  /// the counters of each thread
+  OFThreadSpecificData m_threadCounters;
+
+  /// all counters, only changed with m_countersMutex locked (i.e.\ when a thread registers)
+  DcmSvcMetricsCounters *m_counters[DCMSVC_METRICS_MAX_THREADS];
+
+  /// number of valid entries in m_counters, read without lock
+  volatile size_t m_numCounters;
+
+  /// mutex for registering counters
+  OFMutex m_countersMutex;
+
+  // private undefined copy constructor
+  DcmSvcMetrics(const DcmSvcMetrics &);
+
+  // private undefined assignment operator
+  DcmSvcMetrics &operator=(const DcmSvcMetrics &);
+
+};
+
+/** Minimal HTTP server thread answering "GET /metrics" with the formatted metrics, for
+ *  scraping by Prometheus, and "GET /peers" with the peer statistics in JSON. If a
+ *  debug filter is set and the server listens on a loopback address, "GET /debug" lists
+ *  its rules and "POST /debug" changes them as requested by the query string (see
+ *  DcmSvcDebugFilter::handleQuery()). Each connection carries a single request and is
+ *  closed after the response (HTTP/1.0). Connections are served one at a time.
+ */
+class DcmSvcMetricsServer : public OFThread
+{
+
+  public:
+
+  /** constructor
+   *  @param metrics [in] The metrics to be served. Must exist as long as the server runs.
+   */
+  DcmSvcMetricsServer(DcmSvcMetrics &metrics);
+
+  /** destructor. Stops the server thread if still running, see stop().
+   */
+  virtual ~DcmSvcMetricsServer();
+
+  /** Create the socket and start serving requests in a separate thread
+   *  @param port    [in] TCP port to listen on
+   *  @param address [in] IPv4 address to listen on, e.g.\ "127.0.0.1" for local scrapers
+   *                      only or "0.0.0.0" for all interfaces
+   *  @return EC_Normal if the server was started, an error code otherwise
+   */
+  OFCondition listen(const Uint16 port,
+                     const OFString &address);
+
+  /** Print the peer statistics to the console whenever the given signal is received.
+   *  The signal is blocked in the calling thread and taken by the server thread, so
+   *  this must be called before any other thread is started (which would otherwise
+   *  receive the signal and be terminated).
+   *  @param signalNumber [in] The signal, e.g.\ SIGUSR1
+   *  @return EC_Normal if the signal could be blocked, an error code otherwise
+   */
+  OFCondition setDumpSignal(const int signalNumber);
+
+  /** Serve the rules of a debug filter on "/debug" and allow changing them. Anybody who
+   *  can connect to the server could then enable debug output, so the filter is only
+   *  served if listen() binds a loopback address (127.0.0.0/8). Must be called before
+   *  listen().
+   *  @param debugFilter [in] The filter, NULL for none. Must exist as long as the server runs.
+   */
+  void setDebugFilter(DcmSvcDebugFilter *debugFilter);
+
+  /** Stop the server thread and close the socket
+   */
+  void stop();
+
+  protected:
+
+  /** Thread entry point, serves connections until stop() is called
+   */
+  virtual void run();
+
+  /** Read a request from a connected client, answer it and close the connection
+   *  @param clientSocket [in] The connected socket
+   */
+  void handleConnection(int clientSocket);
+
+  private:
+
+  /// the metrics to be served
+  DcmSvcMetrics &m_metrics;
+
+  /// listening socket, -1 if not open
+  int m_socket;
+
+  /// set by stop() to end the server loop
+  volatile OFBool m_stopRequested;
+
+  /// signal requesting to print the peer statistics, 0 if none
+  int m_dumpSignal;
+
+  /// debug filter served on "/debug" (not owned), NULL if none or not bound to loopback
+  DcmSvcDebugFilter *m_debugFilter;
+
+  // private undefined copy constructor
+  DcmSvcMetricsServer(const DcmSvcMetricsServer &);
+
+  // private undefined assignment operator
+  DcmSvcMetricsServer &operator=(const DcmSvcMetricsServer &);
+
+};
+
+#endif // DSVCMETR_H
@@ -0,0 +1,342 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Transfer syntax negotiation policy ranking by configurable order, and cache of
+ *           negotiation results
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvcneg.h"
+#include "dsvcmetr.h"                 /* for DcmSvcMetricsCounters */
+#include "dcmtk/ofstd/ofstream.h"     /* for STD_NAMESPACE ifstream */
+#include "dcmtk/dcmdata/dcerror.h"    /* for EC_ codes */
+#include "dcmtk/dcmdata/dcuid.h"      /* for UID_ constants, dcmFindNameOfUID() */
+#include "dcmtk/dcmdata/dcxfer.h"     /* for gLocalByteOrder */
+#include "dcmtk/dcmnet/diutil.h"      /* for DCMNET_DEBUG() */
+
+/* characters separating the transfer syntaxes of a ranking */
+#define RANKING_SEPARATORS " \t\r,"
+
+/* returns whether a list of UIDs contains a UID */
+static OFBool containsUID(const OFList<OFString> &list,
+                          const char *uid)
+{
+  for (OFListConstIterator(OFString) it = list.begin(); it != list.end(); ++it)
+  {
+    if (*it == uid)
+      return OFTrue;
+  }
+  return OFFalse;
+}
+
+
+DcmSvcNegotiationPolicy::DcmSvcNegotiationPolicy()
+  : m_enabled(OFFalse)
+  , m_defaultRanking()
+  , m_aeRankings()
+  , m_supported()
+  , m_acceptedCounts()
+{
+  // Explicit VR in local byte order needs neither dictionary lookups nor byte swapping
+  if (gLocalByteOrder == EBO_BigEndian)
+  {
+    m_defaultRanking.push_back(UID_BigEndianExplicitTransferSyntax);
+    m_defaultRanking.push_back(UID_LittleEndianExplicitTransferSyntax);
+  }
+  else
+  {
+    m_defaultRanking.push_back(UID_LittleEndianExplicitTransferSyntax);
+    m_defaultRanking.push_back(UID_BigEndianExplicitTransferSyntax);
+  }
+  m_defaultRanking.push_back(UID_LittleEndianImplicitTransferSyntax);
+  m_defaultRanking.push_back(UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+}
+
+
+void DcmSvcNegotiationPolicy::addSupportedTransferSyntaxes(const OFString &abstractSyntax,
+                                                           const OFList<OFString> &xferSyntaxes)
+{
+  OFList<OFString> &supported = m_supported[abstractSyntax];
+  for (OFListConstIterator(OFString) it = xferSyntaxes.begin(); it != xferSyntaxes.end(); ++it)
+  {
+    if (!containsUID(supported, it->c_str()))
+      supported.push_back(*it);
+  }
+}
+
+
+OFCondition DcmSvcNegotiationPolicy::loadFile(const OFString &filename)
+{
+  STD_NAMESPACE ifstream file(filename.c_str());
+  if (!file)
+  {
+    DCMNET_ERROR("Cannot open negotiation policy file " << filename);
+    return EC_CannotOpenFile;
+  }
+  OFString line;
+  unsigned long lineNumber = 0;
+  while (getline(file, line))
+  {
+    ++lineNumber;
+    const size_t start = line.find_first_not_of(RANKING_SEPARATORS);
+    if ((start == OFString_npos) || (line[start] == '#'))
+      continue;
+    const size_t equals = line.find('=');
+    if (equals == OFString_npos)
+    {
+      DCMNET_ERROR("Negotiation policy file " << filename << ", line " << lineNumber << ": missing '='");
+      return EC_IllegalParameter;
+    }
+    OFString aeTitle = line.substr(start, equals - start);
+    aeTitle.erase(aeTitle.find_last_not_of(" \t") + 1);
+    OFList<OFString> ranking;
+    if (aeTitle.empty() || parseRanking(line.substr(equals + 1), ranking).bad() || ranking.empty())
+    {
+      DCMNET_ERROR("Negotiation policy file " << filename << ", line " << lineNumber << ": invalid ranking");
+      return EC_IllegalParameter;
+    }
+    if (aeTitle == "*")
+      m_defaultRanking = ranking;
+    else
+      m_aeRankings[aeTitle] = ranking;
+  }
+  m_enabled = OFTrue;
+  return EC_Normal;
+}
+
+
+void DcmSvcNegotiationPolicy::apply(T_ASC_Parameters *params) const
+{
+  if (!m_enabled)
+    return;
+  const OFList<OFString> &ranking = getRanking(params->DULparams.callingAPTitle);
+  const int count = ASC_countPresentationContexts(params);
+  for (int i = 0; i < count; ++i)
+  {
+    T_ASC_PresentationContext pc;
+    if (ASC_getPresentationContext(params, i, &pc).bad() || (pc.resultReason != ASC_P_ACCEPTANCE))
+      continue;
+    STD_NAMESPACE map<OFString, OFList<OFString> >::const_iterator supported = m_supported.find(pc.abstractSyntax);
+    if (supported == m_supported.end())
+      continue;
+    // first ranked transfer syntax that has been proposed and is supported
+    const char *best = NULL;
+    for (OFListConstIterator(OFString) it = ranking.begin(); (it != ranking.end()) && (best == NULL); ++it)
+    {
+      if (!containsUID(supported->second, it->c_str()))
+        continue;
+      for (int j = 0; j < pc.transferSyntaxCount; ++j)
+      {
+        if (*it == pc.proposedTransferSyntaxes[j])
+        {
+          best = it->c_str();
+          break;
+        }
+      }
+    }
+    if ((best != NULL) && (strcmp(best, pc.acceptedTransferSyntax) != 0))
+    {
+      DCMNET_DEBUG("Presentation context " << OFstatic_cast(unsigned int, pc.presentationContextID)
+        << ": accepting " << dcmFindNameOfUID(best, best) << " instead of "
+        << dcmFindNameOfUID(pc.acceptedTransferSyntax, pc.acceptedTransferSyntax));
+      ASC_acceptPresentationContext(params, pc.presentationContextID, best, pc.acceptedRole);
+    }
+  }
+}
+
+
+void DcmSvcNegotiationPolicy::countAccepted(T_ASC_Parameters *params,
+                                            DcmSvcMetricsCounters *counters)
+{
+  const int count = ASC_countPresentationContexts(params);
+  for (int i = 0; i < count; ++i)
+  {
+    T_ASC_PresentationContext pc;
+    if (ASC_getPresentationContext(params, i, &pc).good() && (pc.resultReason == ASC_P_ACCEPTANCE))
+    {
+      ++m_acceptedCounts[pc.acceptedTransferSyntax];
+      if (counters != NULL)
+        counters->countAcceptedSyntax(pc.acceptedTransferSyntax);
+    }
+  }
+}
+
+
+unsigned long DcmSvcNegotiationPolicy::getAcceptedCount(const OFString &xferSyntax) const
+{
+  STD_NAMESPACE map<OFString, unsigned long>::const_iterator it = m_acceptedCounts.find(xferSyntax);
+  return (it != m_acceptedCounts.end()) ? it->second : 0;
+}
+
+
+OFString &DcmSvcNegotiationPolicy::dumpCounters(OFString &text) const
+{
+  OFOStringStream stream;
+  for (STD_NAMESPACE map<OFString, unsigned long>::const_iterator it = m_acceptedCounts.begin();
+       it != m_acceptedCounts.end(); ++it)
+  {
+    if (it != m_acceptedCounts.begin())
+      stream << OFendl;
+    stream << dcmFindNameOfUID(it->first.c_str(), it->first.c_str()) << ": " << it->second;
+  }
+  stream << OFStringStream_ends;
+  OFSTRINGSTREAM_GETOFSTRING(stream, text)
+  return text;
+}
+
+
+const OFList<OFString> &DcmSvcNegotiationPolicy::getRanking(const OFString &callingAETitle) const
+{
+  STD_NAMESPACE map<OFString, OFList<OFString> >::const_iterator it = m_aeRankings.find(callingAETitle);
+  return (it != m_aeRankings.end()) ? it->second : m_defaultRanking;
+}
+
+
+OFCondition DcmSvcNegotiationPolicy::parseRanking(const OFString &text,
+                                                  OFList<OFString> &ranking)
+{
+  size_t pos = text.find_first_not_of(RANKING_SEPARATORS);
+  while (pos != OFString_npos)
+  {
+    const size_t end = text.find_first_of(RANKING_SEPARATORS, pos);
+    const OFString token = text.substr(pos, (end == OFString_npos) ? OFString_npos : end - pos);
+    if (token == "explicit")
+      ranking.push_back(UID_LittleEndianExplicitTransferSyntax);
+    else if (token == "big-endian")
+      ranking.push_back(UID_BigEndianExplicitTransferSyntax);
+    else if (token == "implicit")
+      ranking.push_back(UID_LittleEndianImplicitTransferSyntax);
+    else if (token == "deflated")
+      ranking.push_back(UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+    else if ((token[0] >= '0') && (token[0] <= '9'))
+      ranking.push_back(token);
+    else
+      return EC_IllegalParameter;
+    pos = (end == OFString_npos) ? OFString_npos : text.find_first_not_of(RANKING_SEPARATORS, end);
+  }
+  return EC_Normal;
+}
+
+
+DcmSvcNegotiationCache::DcmSvcNegotiationCache()
+  : m_entries()
+  , m_hits(0)
+  , m_misses(0)
+{
+}
+
+
+OFBool DcmSvcNegotiationCache::replay(T_ASC_Parameters *params)
+{
+  OFString key;
+  if (!buildKey(params, key))
+    return OFFalse;
+  STD_NAMESPACE map<Uint32, Entry>::const_iterator it = m_entries.find(hash(key));
+  if ((it == m_entries.end()) || (it->second.key != key))
+  {
+    ++m_misses;
+    return OFFalse;
+  }
+  for (OFListConstIterator(Decision) decision = it->second.decisions.begin();
+       decision != it->second.decisions.end(); ++decision)
+  {
+    if (decision->resultReason == ASC_P_ACCEPTANCE)
+      ASC_acceptPresentationContext(params, decision->presentationContextID,
+                                    decision->acceptedTransferSyntax.c_str(), decision->acceptedRole);
+    else
+      ASC_refusePresentationContext(params, decision->presentationContextID, decision->resultReason);
+  }
+  ++m_hits;
+  return OFTrue;
+}
+
+
+void DcmSvcNegotiationCache::store(T_ASC_Parameters *params)
+{
+  OFString key;
+  if (!buildKey(params, key))
+    return;
+  if (m_entries.size() >= DCMSVC_NEGOTIATION_CACHE_SIZE)
+    clear();
+  Entry &entry = m_entries[hash(key)];
+  entry.key = key;
+  entry.decisions.clear();
+  const int count = ASC_countPresentationContexts(params);
+  for (int i = 0; i < count; ++i)
+  {
+    T_ASC_PresentationContext pc;
+    if (ASC_getPresentationContext(params, i, &pc).bad())
+      continue;
+    Decision decision;
+    decision.presentationContextID = pc.presentationContextID;
+    decision.resultReason = pc.resultReason;
+    if (pc.resultReason == ASC_P_ACCEPTANCE)
+      decision.acceptedTransferSyntax = pc.acceptedTransferSyntax;
+    decision.acceptedRole = pc.acceptedRole;
+    entry.decisions.push_back(decision);
+  }
+}
+
+
+void DcmSvcNegotiationCache::clear()
+{
+  m_entries.clear();
+}
+
+
+unsigned long DcmSvcNegotiationCache::getHits() const
+{
+  return m_hits;
+}
+
+
+unsigned long DcmSvcNegotiationCache::getMisses() const
+{
+  return m_misses;
+}
+
+
+OFBool DcmSvcNegotiationCache::buildKey(T_ASC_Parameters *params,
+                                        OFString &key)
+{
+  // the association configuration also evaluates extended negotiation
+  if ((params->DULparams.requestedExtNegList != NULL) && !params->DULparams.requestedExtNegList->empty())
+    return OFFalse;
+  key = params->DULparams.callingAPTitle;
+  key += '\n';
+  key += params->DULparams.calledAPTitle;
+  const int count = ASC_countPresentationContexts(params);
+  for (int i = 0; i < count; ++i)
+  {
+    T_ASC_PresentationContext pc;
+    if (ASC_getPresentationContext(params, i, &pc).bad())
+      return OFFalse;
+    // presentation context IDs are odd, i.e. never 0
+    key += '\n';
+    key += OFstatic_cast(char, pc.presentationContextID);
+    key += OFstatic_cast(char, '0' + pc.proposedRole);
+    key += pc.abstractSyntax;
+    for (int j = 0; j < pc.transferSyntaxCount; ++j)
+    {
+      key += ' ';
+      key += pc.proposedTransferSyntaxes[j];
+    }
+  }
+  return OFTrue;
+}
+
+
+Uint32 DcmSvcNegotiationCache::hash(const OFString &key)
+{
+  Uint32 value = 2166136261U;
+  for (size_t i = 0; i < key.length(); ++i)
+  {
+    value ^= OFstatic_cast(unsigned char, key[i]);
+    value *= 16777619U;
+  }
+  return value;
+}
@@ -0,0 +1,248 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Transfer syntax negotiation policy ranking by configurable order, and cache of
+ *           negotiation results
+ *
+ */
+
+#ifndef DSVCNEG_H
+#define DSVCNEG_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/oflist.h"
+#include "dcmtk/ofstd/ofcond.h"
+#include "dcmtk/dcmnet/assoc.h"     /* for T_ASC_Parameters */
+
+#include <map>
+
+struct DcmSvcMetricsCounters;
+
+/** Maximum number of entries of a DcmSvcNegotiationCache
+ */
+#define DCMSVC_NEGOTIATION_CACHE_SIZE 256
+
+/** Policy selecting the transfer syntax of each accepted presentation context. The
+ *  association configuration accepts the first of its transfer syntaxes that has been
+ *  proposed, i.e.\ the order in which they were added, so that the preferences of the
+ *  SCP (e.g.\ Deflated Explicit VR Little Endian for the service datasets) are kept.
+ *  Only if a policy file has been loaded (see loadFile()), the policy instead ranks the
+ *  proposed and supported transfer syntaxes, in general and for individual calling AE
+ *  titles as given in the file. If the file has no general ranking, the other calling
+ *  AE titles are ranked by the cost of decoding on this host, cheapest first, i.e.\ Explicit
+ *  VR in local byte order (no dictionary lookup, no byte swapping), Explicit VR in the
+ *  other byte order (byte swapping of binary values only), Implicit VR Little Endian
+ *  (dictionary lookup for each element) and Deflated Explicit VR Little Endian
+ *  (inflating the complete stream). The policy also counts how often each transfer
+ *  syntax has been accepted.
+ */
+class DcmSvcNegotiationPolicy
+{
+
+  public:
+
+  /** default constructor. The transfer syntaxes are not ranked until a policy file
+   *  has been loaded.
+   */
+  DcmSvcNegotiationPolicy();
+
+  /** Register the transfer syntaxes supported for an abstract syntax, i.e.\ the ones
+   *  that may be selected
+   *  @param abstractSyntax [in] The UID of the abstract syntax
+   *  @param xferSyntaxes   [in] List of supported transfer syntax UIDs
+   */
+  void addSupportedTransferSyntaxes(const OFString &abstractSyntax,
+                                    const OFList<OFString> &xferSyntaxes);
+
+  /** Load rankings from a policy file. Each line has the form
+   *  "<calling AE title or *> = <transfer syntax> ...", where a transfer syntax is a UID
+   *  or one of the keywords "explicit", "big-endian", "implicit" and "deflated". The
+   *  line for "*" replaces the default ranking by decoding cost, the other lines apply to
+   *  associations from the given AE title only. Empty lines and lines starting with "#"
+   *  are ignored. If successful, apply() ranks the transfer syntaxes from now on.
+   *  @param filename [in] The policy file
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition loadFile(const OFString &filename);
+
+  /** Select the best ranked transfer syntax for each accepted presentation context of
+   *  a negotiated (but not yet acknowledged) association. Transfer syntaxes that are
+   *  not ranked are only kept if no ranked one has been proposed. Does nothing if no
+   *  policy file has been loaded, i.e.\ the configuration order applies.
+   *  @param params [inout] The association parameters
+   */
+  void apply(T_ASC_Parameters *params) const;
+
+  /** Count the transfer syntaxes of the accepted presentation contexts of an
+   *  acknowledged association
+   *  @param params   [in] The association parameters
+   *  @param counters [in] Metrics counters of the calling thread to count them in as
+   *                       well, NULL for none
+   */
+  void countAccepted(T_ASC_Parameters *params,
+                     DcmSvcMetricsCounters *counters = NULL);
+
+  /** Returns the number of presentation contexts accepted with a transfer syntax
+   *  @param xferSyntax [in] The transfer syntax UID
+   *  @return number of accepted presentation contexts since program start
+   */
+  unsigned long getAcceptedCount(const OFString &xferSyntax) const;
+
+  /** Returns the accepted transfer syntax counters as text, e.g.\ for a log message
+   *  @param text [out] One line per transfer syntax, "<name>: <count>"
+   *  @return reference to text
+   */
+  OFString &dumpCounters(OFString &text) const;
+
+  protected:
+
+  /** Returns the ranking for a calling AE title
+   *  @param callingAETitle [in] The calling AE title
+   *  @return the ranking of the AE title if configured, the default ranking otherwise
+   */
+  const OFList<OFString> &getRanking(const OFString &callingAETitle) const;
+
+  /** Parse a list of transfer syntax keywords and UIDs
+   *  @param text    [in]  Whitespace separated keywords and UIDs
+   *  @param ranking [out] The transfer syntax UIDs
+   *  @return EC_Normal if successful, an error code for an unknown keyword
+   */
+  static OFCondition parseRanking(const OFString &text,
+                                  OFList<OFString> &ranking);
+
+  private:
+
+  /// OFTrue if a policy file has been loaded, i.e.\ apply() ranks the transfer syntaxes
+  OFBool m_enabled;
+
+  /// ranking applied if the calling AE title has none
+  OFList<OFString> m_defaultRanking;
+
+  /// rankings per calling AE title
+  STD_NAMESPACE map<OFString, OFList<OFString> > m_aeRankings;
+
+  /// supported transfer syntaxes per abstract syntax
+  STD_NAMESPACE map<OFString, OFList<OFString> > m_supported;
+
+  /// number of accepted presentation contexts per transfer syntax
+  STD_NAMESPACE map<OFString, unsigned long> m_acceptedCounts;
+
+  // private undefined copy constructor
+  DcmSvcNegotiationPolicy(const DcmSvcNegotiationPolicy &);
+
+  // private undefined assignment operator
+  DcmSvcNegotiationPolicy &operator=(const DcmSvcNegotiationPolicy &);
+
+};
+
+/** Cache of presentation context negotiation results. The same peers usually request
+ *  associations with identical presentation contexts again and again. For such a
+ *  request, the accept/reject decisions (and accepted transfer syntaxes and roles) of
+ *  the first one are replayed instead of evaluating the association configuration and
+ *  the negotiation policy again. An entry is keyed by a hash of the calling and called
+ *  AE title and the proposed presentation contexts (ID, abstract syntax, role and
+ *  transfer syntaxes); the complete key is compared as well, so that a hash collision
+ *  cannot replay wrong decisions. Requests with extended negotiation are not cached.
+ *  The cache must be cleared whenever the configuration of the SCP changes. If it is
+ *  full, it is cleared as well, which is sufficient for the small number of different
+ *  peers of an SCP.
+ */
+class DcmSvcNegotiationCache
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmSvcNegotiationCache();
+
+  /** Apply the cached decisions for an association request, if any
+   *  @param params [inout] The association parameters
+   *  @return OFTrue if the decisions have been applied, OFFalse if not cached
+   */
+  OFBool replay(T_ASC_Parameters *params);
+
+  /** Store the decisions of a negotiated association request
+   *  @param params [in] The association parameters
+   */
+  void store(T_ASC_Parameters *params);
+
+  /** Remove all entries, e.g.\ after a configuration change
+   */
+  void clear();
+
+  /** Returns the number of replayed negotiations
+   *  @return number of cache hits since program start
+   */
+  unsigned long getHits() const;
+
+  /** Returns the number of negotiations that were not cached
+   *  @return number of cache misses since program start
+   */
+  unsigned long getMisses() const;
+
+  protected:
+
+  /// Decision for one presentation context
+  struct Decision
+  {
+    /// presentation context ID
+    T_ASC_PresentationContextID presentationContextID;
+
+    /// ASC_P_ACCEPTANCE or the reason of the rejection
+    T_ASC_P_ResultReason resultReason;
+
+    /// accepted transfer syntax, empty if rejected
+    OFString acceptedTransferSyntax;
+
+    /// accepted role
+    T_ASC_SC_ROLE acceptedRole;
+  };
+
+  /// Cached negotiation result
+  struct Entry
+  {
+    /// the complete key of the request
+    OFString key;
+
+    /// the decisions in the order of the presentation contexts
+    OFList<Decision> decisions;
+  };
+
+  /** Build the key of an association request
+   *  @param params [in]  The association parameters
+   *  @param key    [out] The key
+   *  @return OFTrue if successful, OFFalse if the request must not be cached
+   */
+  static OFBool buildKey(T_ASC_Parameters *params,
+                         OFString &key);
+
+  /** Compute the hash of a key (FNV-1a)
+   *  @param key [in] The key
+   *  @return the hash value
+   */
+  static Uint32 hash(const OFString &key);
+
+  private:
+
+  /// cached results by hash of their key
+  STD_NAMESPACE map<Uint32, Entry> m_entries;
+
+  /// number of cache hits
+  unsigned long m_hits;
+
+  /// number of cache misses
+  unsigned long m_misses;
+
+  // private undefined copy constructor
+  DcmSvcNegotiationCache(const DcmSvcNegotiationCache &);
+
+  // private undefined assignment operator
+  DcmSvcNegotiationCache &operator=(const DcmSvcNegotiationCache &);
+
+};
+
+#endif // DSVCNEG_H
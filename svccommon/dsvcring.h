@@ -0,0 +1,334 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Lock-free single-producer/single-consumer rings and their per-thread registry
+ *
+ */
+
+#ifndef DSVCRING_H
+#define DSVCRING_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFThreadSpecificData, OFMutex */
+#include "dcmtk/ofstd/oftypes.h"    /* for OFBool */
+
+/** Maximum number of threads that may register a ring, see DcmSvcRingRegistry
+ */
+#define DCMSVC_RING_MAX_THREADS 64
+
+/** Full memory barrier between the producing thread and the consuming thread of a ring
+ */
+#define DCMSVC_MEMORY_BARRIER() __sync_synchronize()
+
+/** Single-producer/single-consumer ring of items, e.g.\ of bytes or of fixed-size
+ *  records. The producing thread only advances the head, the consuming thread only
+ *  advances the tail, so that neither needs a lock. Both counters increase
+ *  monotonically and are reduced modulo the capacity.
+ */
+template <class T>
+class DcmSvcRing
+{
+
+  public:
+
+  /** constructor
+   *  @param capacity [in] Number of items of the ring, must be a power of two
+   */
+  DcmSvcRing(const size_t capacity)
+    : m_items(new T[capacity])
+    , m_capacity(capacity)
+    , m_head(0)
+    , m_tail(0)
+    , m_dropped(0)
+  {
+  }
+
+  /** destructor
+   */
+  ~DcmSvcRing()
+  {
+    delete[] m_items;
+  }
+
+  /** Append items completely or not at all (called by the producing thread only)
+   *  @param items [in] The items, copied
+   *  @param count [in] Number of items
+   *  @return OFTrue if the items were added, OFFalse (and counted as dropped) if there
+   *    was not enough space
+   */
+  OFBool push(const T *items,
+              const size_t count)
+  {
+    const size_t head = m_head;
+    const size_t tail = m_tail;
+    DCMSVC_MEMORY_BARRIER();
+    if (count > m_capacity - (head - tail))
+    {
+      ++m_dropped;
+      return OFFalse;
+    }
+    // copy the items, possibly wrapping around the end of the buffer
+    const size_t start = head & (m_capacity - 1);
+    const size_t first = (count < m_capacity - start) ? count : m_capacity - start;
+    copy(m_items + start, items, first);
+    copy(m_items, items + first, count - first);
+    // publish the items only after they have been copied completely
+    DCMSVC_MEMORY_BARRIER();
+    m_head = head + count;
+    return OFTrue;
+  }
+
+  /** Append an item (called by the producing thread only)
+   *  @param item [in] The item, copied
+   *  @return OFTrue if the item was added, OFFalse (and counted as dropped) if the ring is full
+   */
+  OFBool push(const T &item)
+  {
+    return push(&item, 1);
+  }
+
+  /** Count a record as dropped that was not even offered, e.g.\ because it could never
+   *  fit into the ring (called by the producing thread only)
+   */
+  void countDrop()
+  {
+    ++m_dropped;
+  }
+
+  /** Returns the number of items that can be consumed (called by the consuming thread
+   *  only). Records are pushed completely, i.e.\ a record is available as a whole.
+   *  @return number of items between tail and head
+   */
+  size_t getAvailable() const
+  {
+    const size_t head = m_head;
+    DCMSVC_MEMORY_BARRIER();
+    return head - m_tail;
+  }
+
+  /** Get the available items without consuming them (called by the consuming thread
+   *  only). The items may wrap around the end of the buffer, so only the contiguous
+   *  part starting at the given offset is returned.
+   *  @param offset [in]  Offset of the first item from the tail
+   *  @param count  [in]  Number of items wanted, at most getAvailable() - offset
+   *  @param length [out] Number of contiguous items returned, at most count
+   *  @return pointer to the item at the given offset
+   */
+  const T *peek(const size_t offset,
+                const size_t count,
+                size_t &length) const
+  {
+    const size_t start = (m_tail + offset) & (m_capacity - 1);
+    length = (count < m_capacity - start) ? count : m_capacity - start;
+    return m_items + start;
+  }
+
+  /** Release consumed items, e.g.\ after peek() (called by the consuming thread only)
+   *  @param count [in] Number of items, at most getAvailable()
+   */
+  void consume(const size_t count)
+  {
+    // release the space only after the items have been used
+    DCMSVC_MEMORY_BARRIER();
+    m_tail = m_tail + count;
+  }
+
+  /** Copy items from the tail of the ring and remove them (called by the consuming
+   *  thread only)
+   *  @param items [out] Buffer for the items
+   *  @param count [in]  Number of items to copy, at most getAvailable()
+   */
+  void pop(T *items,
+           const size_t count)
+  {
+    size_t first = 0;
+    const T *data = peek(0, count, first);
+    copy(items, data, first);
+    copy(items + first, m_items, count - first);
+    consume(count);
+  }
+
+  /** Remove the oldest item (called by the consuming thread only)
+   *  @param item [out] The item
+   *  @return OFTrue if an item was removed, OFFalse if the ring is empty
+   */
+  OFBool pop(T &item)
+  {
+    if (getAvailable() == 0)
+      return OFFalse;
+    pop(&item, 1);
+    return OFTrue;
+  }
+
+  /** Returns the capacity of the ring
+   *  @return number of items of the ring
+   */
+  size_t getCapacity() const
+  {
+    return m_capacity;
+  }
+
+  /** Returns the number of records dropped so far (may be called by any thread)
+   *  @return number of records dropped because the ring was full
+   */
+  size_t getNumberOfDropped() const
+  {
+    return m_dropped;
+  }
+
+  private:
+
+  /** Copy items between contiguous buffers (a loop the compiler turns into memcpy()
+   *  for plain types)
+   *  @param to    [out] The target
+   *  @param from  [in]  The source
+   *  @param count [in]  Number of items
+   */
+  static void copy(T *to,
+                   const T *from,
+                   const size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+      to[i] = from[i];
+  }
+
+  /// buffer of m_capacity items
+  T *m_items;
+
+  /// capacity of the buffer in items (power of two)
+  const size_t m_capacity;
+
+  /// total number of items added by the producer
+  volatile size_t m_head;
+
+  /// total number of items consumed
+  volatile size_t m_tail;
+
+  /// number of records dropped because the ring was full
+  volatile size_t m_dropped;
+
+  // private undefined copy constructor
+  DcmSvcRing(const DcmSvcRing &);
+
+  // private undefined assignment operator
+  DcmSvcRing &operator=(const DcmSvcRing &);
+
+};
+
+/** Registry of one ring per producing thread, consumed by a single thread. A thread
+ *  creates and registers its ring on first use (with a mutex, i.e.\ once); the
+ *  consuming thread reads the rings registered so far without any lock.
+ *  @tparam R ring class, DcmSvcRing or derived from it, constructed from its capacity
+ */
+template <class R>
+class DcmSvcRingRegistry
+{
+
+  public:
+
+  /** constructor
+   *  @param ringCapacity [in] Capacity of each ring (power of two)
+   */
+  DcmSvcRingRegistry(const size_t ringCapacity)
+    : m_ringCapacity(ringCapacity)
+    , m_threadRing()
+    , m_numRings(0)
+    , m_ringsMutex()
+  {
+    for (size_t i = 0; i < DCMSVC_RING_MAX_THREADS; i++)
+      m_rings[i] = NULL;
+  }
+
+  /** destructor. Deletes the rings, i.e.\ no thread may use them any longer.
+   */
+  ~DcmSvcRingRegistry()
+  {
+    for (size_t i = 0; i < m_numRings; i++)
+      delete m_rings[i];
+  }
+
+  /** Get the ring of the calling thread, create and register it if needed
+   *  @return the ring, NULL if too many threads have registered one
+   */
+  R *getThreadRing()
+  {
+    void *value = NULL;
+    if ((m_threadRing.get(value) == 0) && (value != NULL))
+      return OFstatic_cast(R *, value);
+
+    R *ring = NULL;
+    m_ringsMutex.lock();
+    if (m_numRings < DCMSVC_RING_MAX_THREADS)
+    {
+      ring = new R(m_ringCapacity);
+      m_rings[m_numRings] = ring;
+      // make the ring visible to the consuming thread only after it has been stored
+      DCMSVC_MEMORY_BARRIER();
+      m_numRings = m_numRings + 1;
+    }
+    m_ringsMutex.unlock();
+
+    if (ring != NULL)
+      m_threadRing.set(ring);
+    return ring;
+  }
+
+  /** Returns the number of registered rings, read without lock
+   *  @return number of rings, the rings with a lower index can be accessed by getRing()
+   */
+  size_t getNumberOfRings() const
+  {
+    const size_t numRings = m_numRings;
+    DCMSVC_MEMORY_BARRIER();
+    return numRings;
+  }
+
+  /** Returns a registered ring, in the order of registration
+   *  @param index [in] Index of the ring, less than getNumberOfRings()
+   *  @return the ring
+   */
+  R *getRing(const size_t index) const
+  {
+    return m_rings[index];
+  }
+
+  /** Returns the number of records dropped so far by all rings
+   *  @return number of dropped records
+   */
+  size_t getNumberOfDropped() const
+  {
+    size_t dropped = 0;
+    const size_t numRings = getNumberOfRings();
+    for (size_t i = 0; i < numRings; i++)
+      dropped += m_rings[i]->getNumberOfDropped();
+    return dropped;
+  }
+
+  private:
+
+  /// capacity of each ring
+  const size_t m_ringCapacity;
+
+  /// the ring of each thread
+  OFThreadSpecificData m_threadRing;
+
+  /// all rings, only changed with m_ringsMutex locked (i.e.\ when a thread registers)
+  R *m_rings[DCMSVC_RING_MAX_THREADS];
+
+  /// number of valid entries in m_rings, read by the consuming thread without lock
+  volatile size_t m_numRings;
+
+  /// mutex for registering rings
+  OFMutex m_ringsMutex;
+
+  // private undefined copy constructor
+  DcmSvcRingRegistry(const DcmSvcRingRegistry &);
+
+  // private undefined assignment operator
+  DcmSvcRingRegistry &operator=(const DcmSvcRingRegistry &);
+
+};
+
+#endif // DSVCRING_H
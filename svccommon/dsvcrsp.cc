@@ -0,0 +1,132 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Pre-encoded DIMSE response command sets
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvcrsp.h"
+
+/* maximum length of a UID value */
+#define MAX_UID_LENGTH 64
+
+/* length of the Command Group Length element */
+#define GROUP_LENGTH_ELEMENT_LENGTH 12
+
+DcmSvcResponseTemplate::DcmSvcResponseTemplate(const Uint16 commandField)
+  : m_commandField(commandField)
+  , m_sopClassUID()
+  , m_prefixLength(0)
+  , m_messageIDOffset(0)
+  , m_statusOffset(0)
+  , m_length(0)
+{
+}
+
+
+OFBool DcmSvcResponseTemplate::encode(const char *sopClassUID,
+                                      const Uint16 messageID,
+                                      const Uint16 status,
+                                      const char *sopInstanceUID)
+{
+  // the SOP Class normally does not change between the responses on an association
+  if ((m_prefixLength == 0) || (m_sopClassUID != sopClassUID))
+  {
+    if (!build(sopClassUID))
+      return OFFalse;
+  }
+  writeUint16(m_messageIDOffset, messageID);
+  writeUint16(m_statusOffset, status);
+  m_length = m_prefixLength;
+  if (sopInstanceUID != NULL)
+  {
+    m_length = writeUID(m_prefixLength, 0x1000 /* AffectedSOPInstanceUID */, sopInstanceUID);
+    if (m_length == 0)
+      return OFFalse;
+  }
+  // Command Group Length counts the bytes after its own element
+  const Uint32 groupLength = OFstatic_cast(Uint32, m_length - GROUP_LENGTH_ELEMENT_LENGTH);
+  m_buffer[8] = OFstatic_cast(Uint8, groupLength);
+  m_buffer[9] = OFstatic_cast(Uint8, groupLength >> 8);
+  m_buffer[10] = OFstatic_cast(Uint8, groupLength >> 16);
+  m_buffer[11] = OFstatic_cast(Uint8, groupLength >> 24);
+  return OFTrue;
+}
+
+
+const Uint8 *DcmSvcResponseTemplate::getData() const
+{
+  return m_buffer;
+}
+
+
+size_t DcmSvcResponseTemplate::getLength() const
+{
+  return m_length;
+}
+
+
+OFBool DcmSvcResponseTemplate::build(const char *sopClassUID)
+{
+  m_prefixLength = 0;
+  m_sopClassUID.clear();
+  // elements in ascending order of their tags
+  size_t pos = writeHeader(0, 0x0000 /* CommandGroupLength */, 4);
+  pos = writeUID(pos + 4, 0x0002 /* AffectedSOPClassUID */, sopClassUID);
+  if (pos == 0)
+    return OFFalse;
+  pos = writeHeader(pos, 0x0100 /* CommandField */, 2);
+  writeUint16(pos, m_commandField);
+  m_messageIDOffset = writeHeader(pos + 2, 0x0120 /* MessageIDBeingRespondedTo */, 2);
+  pos = writeHeader(m_messageIDOffset + 2, 0x0800 /* CommandDataSetType */, 2);
+  writeUint16(pos, 0x0101 /* no dataset */);
+  m_statusOffset = writeHeader(pos + 2, 0x0900 /* Status */, 2);
+  m_prefixLength = m_statusOffset + 2;
+  m_sopClassUID = sopClassUID;
+  return OFTrue;
+}
+
+
+size_t DcmSvcResponseTemplate::writeHeader(size_t pos,
+                                           const Uint16 element,
+                                           const Uint32 length)
+{
+  // group 0000
+  m_buffer[pos++] = 0;
+  m_buffer[pos++] = 0;
+  m_buffer[pos++] = OFstatic_cast(Uint8, element);
+  m_buffer[pos++] = OFstatic_cast(Uint8, element >> 8);
+  m_buffer[pos++] = OFstatic_cast(Uint8, length);
+  m_buffer[pos++] = OFstatic_cast(Uint8, length >> 8);
+  m_buffer[pos++] = OFstatic_cast(Uint8, length >> 16);
+  m_buffer[pos++] = OFstatic_cast(Uint8, length >> 24);
+  return pos;
+}
+
+
+void DcmSvcResponseTemplate::writeUint16(const size_t pos,
+                                         const Uint16 value)
+{
+  m_buffer[pos] = OFstatic_cast(Uint8, value);
+  m_buffer[pos + 1] = OFstatic_cast(Uint8, value >> 8);
+}
+
+
+size_t DcmSvcResponseTemplate::writeUID(const size_t pos,
+                                        const Uint16 element,
+                                        const char *uid)
+{
+  const size_t length = strlen(uid);
+  if (length > MAX_UID_LENGTH)
+    return 0;
+  const size_t paddedLength = length + (length & 1);
+  const size_t valuePos = writeHeader(pos, element, OFstatic_cast(Uint32, paddedLength));
+  memcpy(m_buffer + valuePos, uid, length);
+  if (paddedLength > length)
+    m_buffer[valuePos + length] = 0;
+  return valuePos + paddedLength;
+}
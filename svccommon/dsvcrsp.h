@@ -0,0 +1,127 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Pre-encoded DIMSE response command sets
+ *
+ */
+
+#ifndef DSVCRSP_H
+#define DSVCRSP_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+
+/** Size of the buffer of a DcmSvcResponseTemplate. Sufficient for a response command
+ *  set with two UIDs of maximum length.
+ */
+#define DCMSVC_RESPONSE_BUFFER_SIZE 256
+
+/** Encoded command set of a DIMSE response without dataset and status detail, i.e.\
+ *  Affected SOP Class UID, Command Field, Message ID Being Responded To, Command Data
+ *  Set Type, Status and (optionally) Affected SOP Instance UID, in Implicit VR Little
+ *  Endian as required for command sets. The elements up to Status are encoded once per
+ *  SOP Class and reused; for each response, only the message ID and status are patched
+ *  and the SOP Instance UID (the last element) and group length are written. This
+ *  replaces building and encoding a DcmDataset in DIMSE_sendMessageUsingMemoryData().
+ */
+class DcmSvcResponseTemplate
+{
+
+  public:
+
+  /** constructor
+   *  @param commandField [in] The response command, e.g.\ DIMSE_N_CREATE_RSP
+   */
+  DcmSvcResponseTemplate(const Uint16 commandField);
+
+  /** Encode a response into the buffer of the template
+   *  @param sopClassUID    [in] Affected SOP Class UID
+   *  @param messageID      [in] Message ID Being Responded To
+   *  @param status         [in] DIMSE status
+   *  @param sopInstanceUID [in] Affected SOP Instance UID, NULL if not sent
+   *  @return OFTrue if successful, OFFalse if a UID is too long (i.e.\ invalid)
+   */
+  OFBool encode(const char *sopClassUID,
+                const Uint16 messageID,
+                const Uint16 status,
+                const char *sopInstanceUID);
+
+  /** Returns the encoded command set, valid after encode()
+   *  @return pointer to the encoded command set
+   */
+  const Uint8 *getData() const;
+
+  /** Returns the length of the encoded command set
+   *  @return length in bytes
+   */
+  size_t getLength() const;
+
+  protected:
+
+  /** Encode the elements up to Status for a SOP Class
+   *  @param sopClassUID [in] Affected SOP Class UID
+   *  @return OFTrue if successful, OFFalse if the UID is too long
+   */
+  OFBool build(const char *sopClassUID);
+
+  /** Write an element header (Implicit VR Little Endian)
+   *  @param pos     [in] Offset of the element in the buffer
+   *  @param element [in] Element number (group 0000)
+   *  @param length  [in] Value length
+   *  @return offset of the value
+   */
+  size_t writeHeader(size_t pos,
+                     const Uint16 element,
+                     const Uint32 length);
+
+  /** Write an US value (Little Endian)
+   *  @param pos   [in] Offset of the value in the buffer
+   *  @param value [in] The value
+   */
+  void writeUint16(const size_t pos,
+                   const Uint16 value);
+
+  /** Write an UI element, padded with a NULL byte to even length
+   *  @param pos     [in] Offset of the element in the buffer
+   *  @param element [in] Element number (group 0000)
+   *  @param uid     [in] The UID
+   *  @return offset after the element, 0 if the UID is too long
+   */
+  size_t writeUID(const size_t pos,
+                  const Uint16 element,
+                  const char *uid);
+
+  private:
+
+  /// the encoded command set
+  Uint8 m_buffer[DCMSVC_RESPONSE_BUFFER_SIZE];
+
+  /// response command
+  Uint16 m_commandField;
+
+  /// SOP Class UID of the encoded elements, empty if not built yet
+  OFString m_sopClassUID;
+
+  /// length of the elements up to Status
+  size_t m_prefixLength;
+
+  /// offset of the value of Message ID Being Responded To
+  size_t m_messageIDOffset;
+
+  /// offset of the value of Status
+  size_t m_statusOffset;
+
+  /// length of the encoded command set
+  size_t m_length;
+
+  // private undefined copy constructor
+  DcmSvcResponseTemplate(const DcmSvcResponseTemplate &);
+
+  // private undefined assignment operator
+  DcmSvcResponseTemplate &operator=(const DcmSvcResponseTemplate &);
+
+};
+
+#endif // DSVCRSP_H
@@ -0,0 +1,267 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Log of slow DIMSE operations with a compact diagnostic record each
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvcslow.h"
+#include "dsvchist.h"               /* for DcmSvcLatencyHistogram::getMonotonicTime() */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmnet/dimse.h"     /* for DIMSE_N_CREATE_RQ et al. */
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_INFO() */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+#include <time.h>
+
+/* length of the interval of the rate limit in microseconds */
+#define RATE_INTERVAL_USEC 60000000
+
+// Name of a request in the log
+static const char *getCommandName(const Uint16 commandField)
+{
+  switch (commandField)
+  {
+    case DIMSE_C_ECHO_RQ:   return "C-ECHO";
+    case DIMSE_N_CREATE_RQ: return "N-CREATE";
+    case DIMSE_N_SET_RQ:    return "N-SET";
+    case DIMSE_N_ACTION_RQ: return "N-ACTION";
+    default:                return "unsupported command";
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcSlowLog::DcmSvcSlowLog()
+  : m_file(NULL)
+  , m_maxRecords(DCMSVC_SLOW_DEFAULT_RATE)
+  , m_intervalStart(0)
+  , m_intervalRecords(0)
+  , m_pendingSuppressed(0)
+  , m_suppressed(0)
+{
+  for (size_t i = 0; i < DCMSVC_SLOW_OPERATIONS; i++)
+    m_thresholds[i] = OFstatic_cast(Uint64, DCMSVC_SLOW_DEFAULT_THRESHOLD) * 1000;
+}
+
+
+DcmSvcSlowLog::~DcmSvcSlowLog()
+{
+  close();
+}
+
+
+void DcmSvcSlowLog::setThreshold(const Uint16 commandField,
+                                 const Uint32 threshold)
+{
+  const size_t operation = getOperation(commandField);
+  if (operation < DCMSVC_SLOW_OPERATIONS)
+    m_thresholds[operation] = OFstatic_cast(Uint64, threshold) * 1000;
+}
+
+
+void DcmSvcSlowLog::setThresholds(const Uint32 threshold)
+{
+  for (size_t i = 0; i < DCMSVC_SLOW_OPERATIONS; i++)
+    m_thresholds[i] = OFstatic_cast(Uint64, threshold) * 1000;
+}
+
+
+void DcmSvcSlowLog::setRateLimit(const unsigned int maxRecords)
+{
+  m_maxRecords = maxRecords;
+}
+
+
+OFCondition DcmSvcSlowLog::open(const OFString &filename)
+{
+  if (m_file != NULL)
+    return EC_IllegalCall;
+
+  m_file = fopen(filename.c_str(), "a");
+  if (m_file == NULL)
+  {
+    DCMNET_ERROR("Cannot open slow operation log " << filename << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot open slow operation log");
+  }
+  DCMNET_INFO("Logging slow operations to " << filename);
+  return EC_Normal;
+}
+
+
+void DcmSvcSlowLog::close()
+{
+  if (m_file != NULL)
+  {
+    fclose(m_file);
+    m_file = NULL;
+  }
+}
+
+
+OFBool DcmSvcSlowLog::isSlow(const Uint16 commandField,
+                             const Uint64 latency) const
+{
+  const size_t operation = getOperation(commandField);
+  return (operation < DCMSVC_SLOW_OPERATIONS) && (latency >= m_thresholds[operation]);
+}
+
+
+void DcmSvcSlowLog::write(const DcmSvcSlowRecord &record,
+                          const OFString &peerAETitle,
+                          const OFString &peerAddress)
+{
+  if (m_file == NULL)
+    return;
+
+  // a new interval starts with the first record after the previous one has ended
+  const Uint64 now = DcmSvcLatencyHistogram::getMonotonicTime();
+  if ((m_intervalRecords == 0) || (now - m_intervalStart >= RATE_INTERVAL_USEC))
+  {
+    m_intervalStart = now;
+    m_intervalRecords = 0;
+  }
+  if ((m_maxRecords > 0) && (m_intervalRecords >= m_maxRecords))
+  {
+    ++m_pendingSuppressed;
+    ++m_suppressed;
+    return;
+  }
+  ++m_intervalRecords;
+
+  char timestamp[32];
+  struct timespec wallClock;
+  clock_gettime(CLOCK_REALTIME, &wallClock);
+  const time_t seconds = wallClock.tv_sec;
+  struct tm local;
+  localtime_r(&seconds, &local);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+
+  char status[16];
+  if (record.status >= 0)
+    OFStandard::snprintf(status, sizeof(status), "0x%04x", OFstatic_cast(unsigned int, record.status));
+  else
+    OFStandard::strlcpy(status, "none", sizeof(status));
+
+  char text[256];
+  OFStandard::snprintf(text, sizeof(text), "%s.%03u %s assoc %u msg %u AE \"%s\" %s status %s %llu us:",
+    timestamp, OFstatic_cast(unsigned int, wallClock.tv_nsec / 1000000), getCommandName(record.commandField),
+    OFstatic_cast(unsigned int, record.associationID), OFstatic_cast(unsigned int, record.messageID),
+    peerAETitle.c_str(), peerAddress.c_str(), status, OFstatic_cast(unsigned long long, record.latency));
+  OFString line = text;
+  OFStandard::snprintf(text, sizeof(text), " command %llu us, dataset %llu us, handler %llu us, response %llu us",
+    OFstatic_cast(unsigned long long, record.commandReceiveTime),
+    OFstatic_cast(unsigned long long, record.datasetReceiveTime),
+    OFstatic_cast(unsigned long long, record.handlerTime),
+    OFstatic_cast(unsigned long long, record.responseSendTime));
+  line += text;
+  if (record.reportTime > 0)
+  {
+    OFStandard::snprintf(text, sizeof(text), ", report %llu us",
+      OFstatic_cast(unsigned long long, record.reportTime));
+    line += text;
+  }
+  line += ';';
+  if (record.datasetCaptured)
+  {
+    OFStandard::snprintf(text, sizeof(text), " %lu bytes, %lu elements:",
+      OFstatic_cast(unsigned long, record.datasetSize), OFstatic_cast(unsigned long, record.numElements));
+    line += text;
+    for (size_t i = 0; i < record.numTags; i++)
+    {
+      OFStandard::snprintf(text, sizeof(text), "%s (%04x,%04x) %s%lu", (i > 0) ? "," : "",
+        OFstatic_cast(unsigned int, record.tags[i] >> 16), OFstatic_cast(unsigned int, record.tags[i] & 0xffff),
+        record.sequences[i] ? "SQ " : "", OFstatic_cast(unsigned long, record.lengths[i]));
+      line += text;
+    }
+    if (record.numElements > record.numTags)
+    {
+      OFStandard::snprintf(text, sizeof(text), ", ... (%lu more)",
+        OFstatic_cast(unsigned long, record.numElements - record.numTags));
+      line += text;
+    }
+  }
+  else if (record.datasetSize > 0)
+  {
+    // e.g. the request became slow only after its dataset was released
+    OFStandard::snprintf(text, sizeof(text), " %lu bytes, elements not captured",
+      OFstatic_cast(unsigned long, record.datasetSize));
+    line += text;
+  }
+  else
+    line += " no dataset";
+  if (m_pendingSuppressed > 0)
+  {
+    OFStandard::snprintf(text, sizeof(text), "; %lu earlier records suppressed",
+      OFstatic_cast(unsigned long, m_pendingSuppressed));
+    line += text;
+    m_pendingSuppressed = 0;
+  }
+  line += '\n';
+  fputs(line.c_str(), m_file);
+  fflush(m_file);
+}
+
+
+size_t DcmSvcSlowLog::getNumberOfSuppressedRecords() const
+{
+  return m_suppressed;
+}
+
+
+void DcmSvcSlowLog::resetRecord(DcmSvcSlowRecord &record)
+{
+  record.status = -1;
+  record.latency = 0;
+  record.commandReceiveTime = 0;
+  record.datasetReceiveTime = 0;
+  record.handlerTime = 0;
+  record.responseSendTime = 0;
+  record.reportTime = 0;
+  record.datasetSize = 0;
+  record.datasetCaptured = OFFalse;
+  record.numElements = 0;
+  record.numTags = 0;
+}
+
+
+void DcmSvcSlowLog::summarizeDataset(DcmDataset &dataset,
+                                     DcmSvcSlowRecord &record)
+{
+  if (record.datasetSize == 0)
+    record.datasetSize = dataset.getLength(EXS_LittleEndianExplicit);
+  record.numElements = dataset.card();
+  record.numTags = 0;
+  for (unsigned long i = 0; (i < dataset.card()) && (record.numTags < DCMSVC_SLOW_MAX_TAGS); i++)
+  {
+    DcmElement *element = dataset.getElement(i);
+    const DcmTag &tag = element->getTag();
+    record.tags[record.numTags] = (OFstatic_cast(Uint32, tag.getGroup()) << 16) | tag.getElement();
+    record.sequences[record.numTags] = (element->ident() == EVR_SQ);
+    if (record.sequences[record.numTags])
+      record.lengths[record.numTags] = OFstatic_cast(DcmSequenceOfItems *, element)->card();
+    else
+      record.lengths[record.numTags] = element->getLength();
+    ++record.numTags;
+  }
+  record.datasetCaptured = OFTrue;
+}
+
+
+size_t DcmSvcSlowLog::getOperation(const Uint16 commandField)
+{
+  switch (commandField)
+  {
+    case DIMSE_C_ECHO_RQ:   return 0;
+    case DIMSE_N_CREATE_RQ: return 1;
+    case DIMSE_N_SET_RQ:    return 2;
+    case DIMSE_N_ACTION_RQ: return 3;
+    default:                return DCMSVC_SLOW_OPERATIONS;
+  }
+}
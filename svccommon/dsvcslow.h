@@ -0,0 +1,218 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Log of slow DIMSE operations with a compact diagnostic record each
+ *
+ */
+
+#ifndef DSVCSLOW_H
+#define DSVCSLOW_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/ofcond.h"
+#include "dcmtk/dcmdata/dctk.h"     /* Covers most common dcmdata classes */
+
+#include <stdio.h>
+
+/** Maximum number of top-level elements listed in a record
+ */
+#define DCMSVC_SLOW_MAX_TAGS 16
+
+/** Default threshold of all operations in milliseconds
+ */
+#define DCMSVC_SLOW_DEFAULT_THRESHOLD 1000
+
+/** Default maximum number of records written per minute
+ */
+#define DCMSVC_SLOW_DEFAULT_RATE 10
+
+/** Number of DIMSE operations with a threshold of their own, i.e.\ C-ECHO, N-CREATE,
+ *  N-SET and N-ACTION
+ */
+#define DCMSVC_SLOW_OPERATIONS 4
+
+/** Diagnostic record of a slow request. The SCP fills it while handling each request;
+ *  the dataset summary is only taken once the request is known to be slow.
+ */
+struct DcmSvcSlowRecord
+{
+  /// number of the association (counted from program start)
+  Uint32 associationID;
+
+  /// message ID of the request
+  Uint16 messageID;
+
+  /// command field of the request
+  Uint16 commandField;
+
+  /// DIMSE status of the response, -1 if none has been sent
+  int status;
+
+  /// time from receiving the command to sending the response, microseconds
+  Uint64 latency;
+
+  /// time spent receiving the command, microseconds
+  Uint64 commandReceiveTime;
+
+  /// time spent receiving the dataset, microseconds
+  Uint64 datasetReceiveTime;
+
+  /// time spent in the handler, i.e.\ neither receiving nor sending, microseconds
+  Uint64 handlerTime;
+
+  /// time spent sending the response, microseconds
+  Uint64 responseSendTime;
+
+  /// time spent waiting for and sending a subsequent request on the same association
+  /// (e.g.\ an N-EVENT-REPORT), microseconds, 0 if none
+  Uint64 reportTime;
+
+  /// size of the encoded dataset, 0 if none or not known
+  size_t datasetSize;
+
+  /// OFTrue if the following dataset summary is valid
+  OFBool datasetCaptured;
+
+  /// number of top-level elements of the dataset
+  size_t numElements;
+
+  /// number of entries of tags and lengths, at most DCMSVC_SLOW_MAX_TAGS
+  size_t numTags;
+
+  /// tags of the first top-level elements, group in the upper 16 bits
+  Uint32 tags[DCMSVC_SLOW_MAX_TAGS];
+
+  /// value lengths of these elements in bytes, for the sequences of a decoded
+  /// dataset the number of items
+  Uint32 lengths[DCMSVC_SLOW_MAX_TAGS];
+
+  /// OFTrue for the sequences among these elements (only known if decoded)
+  OFBool sequences[DCMSVC_SLOW_MAX_TAGS];
+};
+
+/** Log of requests that exceed the latency threshold of their DIMSE operation. Each
+ *  slow request is written as one line with its phase timings, peer, dataset size and
+ *  a summary of the top-level elements of its dataset, so that outliers can be
+ *  analyzed without dumping every message. The number of lines per minute is limited;
+ *  records above the limit are only counted, and the count is reported with the next
+ *  line that is written. The log is not thread safe.
+ */
+class DcmSvcSlowLog
+{
+
+  public:
+
+  /** default constructor
+   */
+  DcmSvcSlowLog();
+
+  /** destructor. Closes the file.
+   */
+  ~DcmSvcSlowLog();
+
+  /** Set the threshold of a DIMSE operation
+   *  @param commandField [in] Command field of the request, e.g.\ DIMSE_N_CREATE_RQ
+   *  @param threshold    [in] Threshold in milliseconds, 0 to log every request
+   */
+  void setThreshold(const Uint16 commandField,
+                    const Uint32 threshold);
+
+  /** Set the threshold of all DIMSE operations, see setThreshold()
+   *  @param threshold [in] Threshold in milliseconds
+   */
+  void setThresholds(const Uint32 threshold);
+
+  /** Set the maximum number of records written per minute
+   *  @param maxRecords [in] Maximum number of records, 0 for no limit
+   */
+  void setRateLimit(const unsigned int maxRecords);
+
+  /** Create the log file. An existing file is appended to.
+   *  @param filename [in] The log file
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition open(const OFString &filename);
+
+  /** Close the log file
+   */
+  void close();
+
+  /** Check whether a request exceeds the threshold of its operation. Requests other
+   *  than C-ECHO, N-CREATE, N-SET and N-ACTION are never slow.
+   *  @param commandField [in] Command field of the request
+   *  @param latency      [in] Time since the request was received, microseconds
+   *  @return OFTrue if the request is slow, OFFalse otherwise
+   */
+  OFBool isSlow(const Uint16 commandField,
+                const Uint64 latency) const;
+
+  /** Write a record unless the rate limit is reached
+   *  @param record      [in] The record of the request
+   *  @param peerAETitle [in] Calling AE title of the peer
+   *  @param peerAddress [in] Network address of the peer
+   */
+  void write(const DcmSvcSlowRecord &record,
+             const OFString &peerAETitle,
+             const OFString &peerAddress);
+
+  /** Returns the number of records not written because of the rate limit
+   *  @return number of suppressed records
+   */
+  size_t getNumberOfSuppressedRecords() const;
+
+  /** Clear the dataset summary and the phase timings of a record, before handling
+   *  the next request
+   *  @param record [out] The record
+   */
+  static void resetRecord(DcmSvcSlowRecord &record);
+
+  /** Fill the dataset summary of a record from a decoded dataset. If the size of the
+   *  dataset is not known from receiving it, the size in Explicit VR Little Endian is
+   *  used instead.
+   *  @param dataset [in]  The dataset
+   *  @param record  [out] The record
+   */
+  static void summarizeDataset(DcmDataset &dataset,
+                               DcmSvcSlowRecord &record);
+
+  private:
+
+  /** Returns the operation of a request, i.e.\ the index of its threshold
+   *  @param commandField [in] Command field of the request
+   *  @return the index in m_thresholds, DCMSVC_SLOW_OPERATIONS if none
+   */
+  static size_t getOperation(const Uint16 commandField);
+
+  /// the log file, NULL if not open
+  FILE *m_file;
+
+  /// thresholds of the operations, see getOperation(), microseconds
+  Uint64 m_thresholds[DCMSVC_SLOW_OPERATIONS];
+
+  /// maximum number of records per minute, 0 for no limit
+  unsigned int m_maxRecords;
+
+  /// monotonic time (in microseconds) the current minute of the rate limit started
+  Uint64 m_intervalStart;
+
+  /// number of records written in the current minute
+  unsigned int m_intervalRecords;
+
+  /// number of records suppressed since the last record written
+  size_t m_pendingSuppressed;
+
+  /// total number of records suppressed
+  size_t m_suppressed;
+
+  // private undefined copy constructor
+  DcmSvcSlowLog(const DcmSvcSlowLog &);
+
+  // private undefined assignment operator
+  DcmSvcSlowLog &operator=(const DcmSvcSlowLog &);
+
+};
+
+#endif // DSVCSLOW_H
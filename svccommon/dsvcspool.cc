@@ -0,0 +1,197 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Buffer for received datasets that spills to a memory-mapped spool file
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvcspool.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmdata/dcerror.h"    /* for EC_ codes */
+#include "dcmtk/dcmnet/diutil.h"      /* for DCMNET_DEBUG() */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>                   /* for mkstemp() */
+
+/* initial size of the memory buffer */
+#define INITIAL_CAPACITY 16384
+
+DcmSvcSpoolBuffer::DcmSvcSpoolBuffer(const char *prefix)
+  : m_buffer(NULL)
+  , m_capacity(0)
+  , m_length(0)
+  , m_threshold(0)
+  , m_directory()
+  , m_prefix(prefix)
+  , m_fd(-1)
+  , m_mapping(NULL)
+{
+}
+
+
+DcmSvcSpoolBuffer::~DcmSvcSpoolBuffer()
+{
+  clear();
+  delete[] m_buffer;
+}
+
+
+void DcmSvcSpoolBuffer::setSpooling(const size_t threshold,
+                                    const OFString &directory)
+{
+  m_threshold = threshold;
+  m_directory = directory;
+}
+
+
+size_t DcmSvcSpoolBuffer::getSpoolThreshold() const
+{
+  return m_threshold;
+}
+
+
+void DcmSvcSpoolBuffer::clear()
+{
+  if (m_mapping != NULL)
+  {
+    munmap(m_mapping, m_length);
+    m_mapping = NULL;
+  }
+  if (m_fd >= 0)
+  {
+    close(m_fd);
+    m_fd = -1;
+  }
+  m_length = 0;
+}
+
+
+OFCondition DcmSvcSpoolBuffer::append(const void *data,
+                                      const size_t length)
+{
+  OFCondition cond = EC_Normal;
+  if ((m_fd < 0) && (m_threshold > 0) && (length > m_threshold - OFMin(m_length, m_threshold)))
+    cond = startSpooling();
+  if (cond.bad())
+    return cond;
+  if (m_fd >= 0)
+  {
+    cond = writeSpoolFile(OFstatic_cast(const char *, data), length);
+    if (cond.good())
+      m_length += length;
+    return cond;
+  }
+
+  // keep the data in memory
+  if (length > m_capacity - m_length)
+  {
+    size_t capacity = (m_capacity > 0) ? m_capacity : INITIAL_CAPACITY;
+    while (length > capacity - m_length)
+      capacity *= 2;
+    char *newBuffer = new char[capacity];
+    if (m_length > 0)
+      memcpy(newBuffer, m_buffer, m_length);
+    delete[] m_buffer;
+    m_buffer = newBuffer;
+    m_capacity = capacity;
+  }
+  memcpy(m_buffer + m_length, data, length);
+  m_length += length;
+  return EC_Normal;
+}
+
+
+OFCondition DcmSvcSpoolBuffer::finish()
+{
+  if ((m_fd < 0) || (m_mapping != NULL) || (m_length == 0))
+    return EC_Normal;
+  void *mapping = mmap(NULL, m_length, PROT_READ, MAP_PRIVATE, m_fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    DCMNET_ERROR("Cannot map spool file: " << OFStandard::getLastSystemErrorCode().message());
+    return EC_MemoryExhausted;
+  }
+  // the dataset is parsed (or indexed) from front to back
+  madvise(mapping, m_length, MADV_SEQUENTIAL);
+  m_mapping = mapping;
+  DCMNET_DEBUG("Spooled dataset of " << m_length << " bytes to disk");
+  return EC_Normal;
+}
+
+
+const char *DcmSvcSpoolBuffer::getData() const
+{
+  if (m_mapping != NULL)
+    return OFstatic_cast(const char *, m_mapping);
+  return m_buffer;
+}
+
+
+size_t DcmSvcSpoolBuffer::getLength() const
+{
+  return m_length;
+}
+
+
+OFBool DcmSvcSpoolBuffer::isSpooled() const
+{
+  return (m_fd >= 0);
+}
+
+
+OFCondition DcmSvcSpoolBuffer::startSpooling()
+{
+  OFString pathTemplate = m_directory.empty() ? OFString(".") : m_directory;
+  pathTemplate += '/';
+  pathTemplate += m_prefix;
+  pathTemplate += "XXXXXX";
+  // mkstemp() modifies the template in place
+  char *path = new char[pathTemplate.length() + 1];
+  OFStandard::strlcpy(path, pathTemplate.c_str(), pathTemplate.length() + 1);
+  m_fd = mkstemp(path);
+  if (m_fd < 0)
+  {
+    DCMNET_ERROR("Cannot create spool file in " << m_directory << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    delete[] path;
+    return EC_CannotOpenFile;
+  }
+  // the file is only accessed through the descriptor (and the mapping)
+  unlink(path);
+  delete[] path;
+
+  // move the data buffered so far to the file
+  const OFCondition cond = writeSpoolFile(m_buffer, m_length);
+  if (cond.bad())
+  {
+    close(m_fd);
+    m_fd = -1;
+  }
+  return cond;
+}
+
+
+OFCondition DcmSvcSpoolBuffer::writeSpoolFile(const char *data,
+                                              size_t length)
+{
+  while (length > 0)
+  {
+    const ssize_t written = write(m_fd, data, length);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      DCMNET_ERROR("Cannot write spool file: " << OFStandard::getLastSystemErrorCode().message());
+      return EC_WriteToFileFailed;
+    }
+    data += written;
+    length -= OFstatic_cast(size_t, written);
+  }
+  return EC_Normal;
+}
@@ -0,0 +1,135 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Buffer for received datasets that spills to a memory-mapped spool file
+ *
+ */
+
+#ifndef DSVCSPOOL_H
+#define DSVCSPOOL_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/ofcond.h"
+
+/** Buffer collecting the PDV fragments of a received dataset. Up to a threshold, the
+ *  fragments are kept in memory. If a dataset exceeds the threshold, the buffered data
+ *  and all further fragments are written to a spool file as they arrive, and the
+ *  complete dataset is accessed through a read-only memory mapping of that file. The
+ *  pages of the mapping are backed by the file, so the kernel can reclaim them under
+ *  memory pressure, unlike heap memory. The spool file is unlinked right after it has
+ *  been created, so that it disappears once it is closed, even if the process ends
+ *  abnormally. The memory buffer keeps its capacity for the next dataset.
+ */
+class DcmSvcSpoolBuffer
+{
+
+  public:
+
+  /** constructor. Spooling is disabled.
+   *  @param prefix [in] prefix of the names of the spool files, e.g.\ "mppsspool"
+   */
+  DcmSvcSpoolBuffer(const char *prefix);
+
+  /** destructor
+   */
+  ~DcmSvcSpoolBuffer();
+
+  /** Configure spooling
+   *  @param threshold [in] size in bytes above which a dataset is spooled to disk,
+   *                        0 to keep all datasets in memory
+   *  @param directory [in] directory for the spool files
+   */
+  void setSpooling(const size_t threshold,
+                   const OFString &directory);
+
+  /** Returns the spool threshold
+   *  @return threshold in bytes, 0 if spooling is disabled
+   */
+  size_t getSpoolThreshold() const;
+
+  /** Remove the data, i.e.\ unmap and close the spool file (if any)
+   */
+  void clear();
+
+  /** Append a received fragment
+   *  @param data   [in] The fragment
+   *  @param length [in] Length of the fragment in bytes
+   *  @return EC_Normal if successful, an error code if the spool file cannot be written
+   */
+  OFCondition append(const void *data,
+                     const size_t length);
+
+  /** Make the complete data available via getData() after the last fragment was
+   *  appended, i.e.\ map the spool file if the data was spooled
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition finish();
+
+  /** Returns the data, only valid after finish()
+   *  @return pointer to the data, valid until the buffer is changed
+   */
+  const char *getData() const;
+
+  /** Returns the length of the data
+   *  @return length in bytes
+   */
+  size_t getLength() const;
+
+  /** Returns whether the data has been spooled to disk
+   *  @return OFTrue if spooled, OFFalse if kept in memory
+   */
+  OFBool isSpooled() const;
+
+  protected:
+
+  /** Create the spool file and write the data buffered so far
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition startSpooling();
+
+  /** Write data to the spool file
+   *  @param data   [in] The data
+   *  @param length [in] Length of the data in bytes
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition writeSpoolFile(const char *data,
+                             size_t length);
+
+  private:
+
+  /// memory buffer
+  char *m_buffer;
+
+  /// size of m_buffer
+  size_t m_capacity;
+
+  /// number of bytes received (in memory or spooled)
+  size_t m_length;
+
+  /// spool threshold in bytes, 0 if disabled
+  size_t m_threshold;
+
+  /// directory for the spool files
+  OFString m_directory;
+
+  /// prefix of the names of the spool files
+  OFString m_prefix;
+
+  /// file descriptor of the (unlinked) spool file, -1 if not spooling
+  int m_fd;
+
+  /// read-only mapping of the spool file, NULL if not mapped
+  void *m_mapping;
+
+  // private undefined copy constructor
+  DcmSvcSpoolBuffer(const DcmSvcSpoolBuffer &);
+
+  // private undefined assignment operator
+  DcmSvcSpoolBuffer &operator=(const DcmSvcSpoolBuffer &);
+
+};
+
+#endif // DSVCSPOOL_H
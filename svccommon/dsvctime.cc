@@ -0,0 +1,305 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Timeline of associations and DIMSE operations in the Chrome trace event format
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvctime.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/dcmnet/diutil.h"    /* for DCMNET_INFO() */
+#include "dcmtk/dcmnet/dul.h"       /* for DULC_TCPINITERROR */
+#include "dcmtk/dcmnet/cond.h"      /* for makeDcmnetCondition() */
+
+#include <unistd.h>                 /* for getpid() */
+
+/* time the writer thread waits for new spans, i.e. maximum delay before they are written */
+#define FLUSH_INTERVAL_MSEC 100
+
+// ----------------------------------------------------------------------------
+
+static void appendJSONString(OFString &text,
+                             const char *value)
+{
+  // names are literals and AE titles printable ASCII, anything else is escaped anyway
+  char escaped[8];
+  text += '"';
+  for (const char *p = value; *p != '\0'; p++)
+  {
+    const unsigned char c = OFstatic_cast(unsigned char, *p);
+    if ((c == '"') || (c == '\\'))
+    {
+      text += '\\';
+      text += OFstatic_cast(char, c);
+    }
+    else if ((c < 0x20) || (c >= 0x7f))
+    {
+      OFStandard::snprintf(escaped, sizeof(escaped), "\\u%04x", OFstatic_cast(unsigned int, c));
+      text += escaped;
+    }
+    else
+      text += OFstatic_cast(char, c);
+  }
+  text += '"';
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcTimeline::DcmSvcTimeline(const char *processName)
+  : OFThread()
+  , m_file(NULL)
+  , m_firstEvent(OFTrue)
+  , m_processID(OFstatic_cast(long, getpid()))
+  , m_processName(processName)
+  , m_running(OFFalse)
+  , m_stopRequested(OFFalse)
+  , m_reportedDrops(0)
+  , m_namedTracks(0)
+  , m_asyncSpans(0)
+  , m_rings(DCMSVC_TIMELINE_RING_SIZE)
+{
+}
+
+
+DcmSvcTimeline::~DcmSvcTimeline()
+{
+  close();
+}
+
+
+OFCondition DcmSvcTimeline::open(const OFString &filename)
+{
+  if (m_running || (m_file != NULL))
+    return EC_IllegalCall;
+
+  m_file = fopen(filename.c_str(), "w");
+  if (m_file == NULL)
+  {
+    DCMNET_ERROR("Cannot create timeline file " << filename << ": "
+      << OFStandard::getLastSystemErrorCode().message());
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot create timeline file");
+  }
+  fputs("[", m_file);
+  m_firstEvent = OFTrue;
+  char event[128];
+  OFStandard::snprintf(event, sizeof(event),
+    "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %ld, \"args\": {\"name\": \"%s\"}}", m_processID,
+    m_processName.c_str());
+  writeEvent(event);
+
+  m_stopRequested = OFFalse;
+  if (start() != 0)
+  {
+    fclose(m_file);
+    m_file = NULL;
+    return makeDcmnetCondition(DULC_TCPINITERROR, OF_error, "Cannot start timeline thread");
+  }
+  m_running = OFTrue;
+  DCMNET_INFO("Writing timeline of associations and requests to " << filename);
+  return EC_Normal;
+}
+
+
+void DcmSvcTimeline::close()
+{
+  if (m_running)
+  {
+    m_stopRequested = OFTrue;
+    join();
+    m_running = OFFalse;
+  }
+  if (m_file != NULL)
+  {
+    fputs("\n]\n", m_file);
+    fclose(m_file);
+    m_file = NULL;
+  }
+}
+
+
+void DcmSvcTimeline::addSpan(const char *name,
+                             const char *category,
+                             const Uint64 start,
+                             const Uint64 end,
+                             const Uint32 association,
+                             const Uint16 messageID,
+                             const int status,
+                             const char *peer)
+{
+  DcmSvcTimelineRing *ring = m_rings.getThreadRing();
+  if (ring == NULL)
+  {
+    DCMNET_WARN("Too many threads for the timeline, spans of this thread are not recorded");
+    return;
+  }
+  DcmSvcTimelineSpan span;
+  span.name = name;
+  span.category = category;
+  span.start = start;
+  span.duration = (end > start) ? end - start : 0;
+  span.association = association;
+  span.messageID = messageID;
+  span.status = status;
+  if (peer != NULL)
+    OFStandard::strlcpy(span.peer, peer, sizeof(span.peer));
+  else
+    span.peer[0] = '\0';
+  span.async = OFFalse;
+  ring->push(span);
+}
+
+
+void DcmSvcTimeline::addAsyncSpan(const char *name,
+                                  const char *category,
+                                  const Uint64 start,
+                                  const Uint64 end,
+                                  const Uint32 association,
+                                  const Uint16 messageID,
+                                  const int status)
+{
+  DcmSvcTimelineRing *ring = m_rings.getThreadRing();
+  if (ring == NULL)
+  {
+    DCMNET_WARN("Too many threads for the timeline, spans of this thread are not recorded");
+    return;
+  }
+  DcmSvcTimelineSpan span;
+  span.name = name;
+  span.category = category;
+  span.start = start;
+  span.duration = (end > start) ? end - start : 0;
+  span.association = association;
+  span.messageID = messageID;
+  span.status = status;
+  span.peer[0] = '\0';
+  span.async = OFTrue;
+  ring->push(span);
+}
+
+
+size_t DcmSvcTimeline::getNumberOfDroppedSpans()
+{
+  return m_rings.getNumberOfDropped();
+}
+
+
+void DcmSvcTimeline::run()
+{
+  while (!m_stopRequested)
+  {
+    if (writeSpans() == 0)
+      OFStandard::milliSleep(FLUSH_INTERVAL_MSEC);
+  }
+  // write what is left
+  while (writeSpans() > 0)
+    ;
+}
+
+
+size_t DcmSvcTimeline::writeSpans()
+{
+  size_t count = 0;
+  char number[64];
+  const size_t numRings = m_rings.getNumberOfRings();
+  // name the tracks of newly registered threads
+  while (m_namedTracks < numRings)
+  {
+    const unsigned long thread = OFstatic_cast(unsigned long, m_namedTracks + 1);
+    char metadata[160];
+    OFStandard::snprintf(metadata, sizeof(metadata),
+      "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, \"tid\": %lu, \"args\": {\"name\": \"SCP thread %lu\"}}",
+      m_processID, thread, thread);
+    writeEvent(metadata);
+    ++m_namedTracks;
+  }
+  DcmSvcTimelineSpan span;
+  OFString event;
+  for (size_t i = 0; i < numRings; i++)
+  {
+    const unsigned long thread = OFstatic_cast(unsigned long, i + 1);
+    while (m_rings.getRing(i)->pop(span))
+    {
+      event = "{\"name\": ";
+      appendJSONString(event, span.name);
+      event += ", \"cat\": ";
+      appendJSONString(event, span.category);
+      // the begin event of an asynchronous span is followed by its end event, see below
+      const size_t nameLength = event.length();
+      OFStandard::snprintf(number, sizeof(number), ", \"ph\": \"%s\", \"ts\": %llu",
+        span.async ? "b" : "X", OFstatic_cast(unsigned long long, span.start));
+      event += number;
+      if (!span.async)
+      {
+        OFStandard::snprintf(number, sizeof(number), ", \"dur\": %llu",
+          OFstatic_cast(unsigned long long, span.duration));
+        event += number;
+      }
+      OFStandard::snprintf(number, sizeof(number), ", \"pid\": %ld, \"tid\": %lu",
+        m_processID, thread);
+      event += number;
+      if (span.async)
+      {
+        OFStandard::snprintf(number, sizeof(number), ", \"id\": %lu", ++m_asyncSpans);
+        event += number;
+      }
+      OFStandard::snprintf(number, sizeof(number), ", \"args\": {\"association\": %lu",
+        OFstatic_cast(unsigned long, span.association));
+      event += number;
+      if (span.messageID != 0)
+      {
+        OFStandard::snprintf(number, sizeof(number), ", \"messageID\": %u",
+          OFstatic_cast(unsigned int, span.messageID));
+        event += number;
+      }
+      if (span.status >= 0)
+      {
+        OFStandard::snprintf(number, sizeof(number), ", \"status\": \"0x%04x\"",
+          OFstatic_cast(unsigned int, span.status));
+        event += number;
+      }
+      if (span.peer[0] != '\0')
+      {
+        event += ", \"peer\": ";
+        appendJSONString(event, span.peer);
+      }
+      event += "}}";
+      writeEvent(event);
+      if (span.async)
+      {
+        event.erase(nameLength);
+        OFStandard::snprintf(number, sizeof(number), ", \"ph\": \"e\", \"ts\": %llu",
+          OFstatic_cast(unsigned long long, span.start + span.duration));
+        event += number;
+        OFStandard::snprintf(number, sizeof(number), ", \"pid\": %ld, \"tid\": %lu, \"id\": %lu}",
+          m_processID, thread, m_asyncSpans);
+        event += number;
+        writeEvent(event);
+      }
+      ++count;
+    }
+  }
+  if (count > 0)
+    fflush(m_file);
+  // report drops once per batch rather than for each dropped span
+  const size_t dropped = getNumberOfDroppedSpans();
+  if (dropped > m_reportedDrops)
+  {
+    DCMNET_WARN("Timeline cannot keep up, " << (dropped - m_reportedDrops) << " spans dropped");
+    m_reportedDrops = dropped;
+  }
+  return count;
+}
+
+
+void DcmSvcTimeline::writeEvent(const OFString &event)
+{
+  // the separator precedes the event, so that a file ending with a complete event
+  // only lacks the closing bracket
+  fputs(m_firstEvent ? "\n" : ",\n", m_file);
+  fputs(event.c_str(), m_file);
+  m_firstEvent = OFFalse;
+}
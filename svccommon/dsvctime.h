@@ -0,0 +1,196 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: Timeline of associations and DIMSE operations in the Chrome trace event format
+ *
+ */
+
+#ifndef DSVCTIME_H
+#define DSVCTIME_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/ofstd/ofthread.h"   /* for OFThread, OFMutex */
+#include "dcmtk/ofstd/ofstring.h"
+#include "dcmtk/ofstd/ofcond.h"
+
+#include "dsvcring.h"               /* for DcmSvcRing, DcmSvcRingRegistry */
+
+#include <stdio.h>
+
+/** Number of spans of the ring of each thread (power of two)
+ */
+#define DCMSVC_TIMELINE_RING_SIZE 4096
+
+/** Span on the timeline, i.e.\ a named interval of one thread
+ */
+struct DcmSvcTimelineSpan
+{
+  /// name of the span, a string literal (not copied)
+  const char *name;
+
+  /// category of the span, a string literal (not copied)
+  const char *category;
+
+  /// begin (microseconds on the monotonic clock)
+  Uint64 start;
+
+  /// duration in microseconds
+  Uint64 duration;
+
+  /// number of the association (0 if none)
+  Uint32 association;
+
+  /// message ID of the request (0 if none)
+  Uint16 messageID;
+
+  /// DIMSE status of the response, -1 if none
+  int status;
+
+  /// AE title of the peer, empty if not shown
+  char peer[17];
+
+  /// OFTrue if the span may overlap others of the thread, i.e.\ is not nested on its track
+  OFBool async;
+};
+
+/** Ring of the spans of one producing thread
+ */
+typedef DcmSvcRing<DcmSvcTimelineSpan> DcmSvcTimelineRing;
+
+/** Timeline writing the associations and DIMSE operations of the SCP as "complete"
+ *  events of the Chrome trace event format (JSON array), which can be loaded into
+ *  about://tracing or Perfetto. Each thread gets its own track; spans that outlast the
+ *  request they were started by (e.g.\ a pending commitment) are written as
+ *  asynchronous events, shown on tracks of their own. A span only copies a
+ *  few integers into the lock-free ring of the calling thread; a writer thread formats
+ *  the spans and appends them to the file in batches. If the writer cannot keep up
+ *  and the ring of a thread is full, further spans are dropped (and counted) rather
+ *  than blocking. The closing bracket of the array is written by close(); a file
+ *  without it (e.g.\ after a crash) is still accepted by both viewers.
+ */
+class DcmSvcTimeline : public OFThread
+{
+
+  public:
+
+  /** constructor
+   *  @param processName [in] Name of the process shown on the timeline, e.g.\ "mppsscp"
+   */
+  DcmSvcTimeline(const char *processName);
+
+  /** destructor. Writes the remaining spans and stops the writer thread, see close().
+   */
+  virtual ~DcmSvcTimeline();
+
+  /** Create the output file and start the writer thread
+   *  @param filename [in] Name of the file, an existing file is replaced
+   *  @return EC_Normal if successful, an error code otherwise
+   */
+  OFCondition open(const OFString &filename);
+
+  /** Write all remaining spans, stop the writer thread and complete the file
+   */
+  void close();
+
+  /** Add a span of the calling thread (may be called by any thread)
+   *  @param name        [in] Name of the span, a string literal
+   *  @param category    [in] Category of the span, a string literal
+   *  @param start       [in] Begin (microseconds on the monotonic clock, see
+   *                          DcmSvcLatencyHistogram::getMonotonicTime())
+   *  @param end         [in] End, on the same clock
+   *  @param association [in] Number of the association, 0 if none
+   *  @param messageID   [in] Message ID of the request, 0 if none
+   *  @param status      [in] DIMSE status of the response, -1 if none
+   *  @param peer        [in] AE title of the peer, NULL if not shown
+   */
+  void addSpan(const char *name,
+               const char *category,
+               const Uint64 start,
+               const Uint64 end,
+               const Uint32 association,
+               const Uint16 messageID = 0,
+               const int status = -1,
+               const char *peer = NULL);
+
+  /** Add a span of the calling thread that may overlap its other spans, e.g.\ from a
+   *  request to a later one (may be called by any thread)
+   *  @param name        [in] Name of the span, a string literal
+   *  @param category    [in] Category of the span, a string literal
+   *  @param start       [in] Begin (microseconds on the monotonic clock)
+   *  @param end         [in] End, on the same clock
+   *  @param association [in] Number of the association the span was started by
+   *  @param messageID   [in] Message ID of the request the span was started by
+   *  @param status      [in] DIMSE status the span ended with, -1 if none
+   */
+  void addAsyncSpan(const char *name,
+                    const char *category,
+                    const Uint64 start,
+                    const Uint64 end,
+                    const Uint32 association,
+                    const Uint16 messageID,
+                    const int status = -1);
+
+  /** Returns the number of spans dropped so far because a ring was full
+   *  @return number of dropped spans
+   */
+  size_t getNumberOfDroppedSpans();
+
+  protected:
+
+  /** Thread entry point, writes spans until close() is called
+   */
+  virtual void run();
+
+  /** Format and write all spans currently in the rings
+   *  @return number of spans written
+   */
+  size_t writeSpans();
+
+  /** Append an event to the output, separated from the previous one
+   *  @param event [in] The event, a JSON object
+   */
+  void writeEvent(const OFString &event);
+
+  private:
+
+  /// the output file, NULL if not open
+  FILE *m_file;
+
+  /// OFTrue until the first event has been written
+  OFBool m_firstEvent;
+
+  /// process ID shown on the timeline
+  long m_processID;
+
+  /// process name shown on the timeline
+  OFString m_processName;
+
+  /// OFTrue while the writer thread is running
+  OFBool m_running;
+
+  /// set by close() to end the writer thread
+  volatile OFBool m_stopRequested;
+
+  /// number of dropped spans already reported by the writer thread
+  size_t m_reportedDrops;
+
+  /// number of rings whose track has been named by the writer thread
+  size_t m_namedTracks;
+
+  /// number of asynchronous spans written, i.e.\ the last ID assigned to one
+  unsigned long m_asyncSpans;
+
+  /// the ring of each producing thread, whose track is numbered by its index plus 1
+  DcmSvcRingRegistry<DcmSvcTimelineRing> m_rings;
+
+  // private undefined copy constructor
+  DcmSvcTimeline(const DcmSvcTimeline &);
+
+  // private undefined assignment operator
+  DcmSvcTimeline &operator=(const DcmSvcTimeline &);
+
+};
+
+#endif // DSVCTIME_H
@@ -0,0 +1,296 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: TCP transport layer with buffered reads and gathered writes
+ *
+ */
+
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+
+#include "dsvctrans.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+/* number of bytes at the end of directly sent data that are kept in the write buffer,
+ * so that the final send of a message is never empty and always clears MSG_MORE
+ */
+#define WRITE_TAIL_LENGTH 1024
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+DcmSvcTransferCounters::DcmSvcTransferCounters()
+  : bytesReceived(0)
+  , bytesSent(0)
+{
+}
+
+
+void DcmSvcTransferCounters::add(const DcmSvcTransferCounters &other)
+{
+  bytesReceived += other.bytesReceived;
+  bytesSent += other.bytesSent;
+}
+
+// ----------------------------------------------------------------------------
+
+DcmSvcTransportConnection::DcmSvcTransportConnection(DcmNativeSocketType openSocket,
+                                                     DcmSvcTransportLayer &layer)
+  : DcmTCPConnection(openSocket)
+  , m_layer(layer)
+  , m_counters(layer.getCounters())
+  , m_readBuffer(layer.acquireBuffer())
+  , m_readPos(0)
+  , m_readLength(0)
+  , m_writeBuffer(layer.acquireBuffer())
+  , m_writeLength(0)
+{
+}
+
+
+DcmSvcTransportConnection::~DcmSvcTransportConnection()
+{
+  // the base class destructor only calls DcmTCPConnection::close()
+  flush();
+  m_layer.releaseBuffer(m_readBuffer);
+  m_layer.releaseBuffer(m_writeBuffer);
+}
+
+
+ssize_t DcmSvcTransportConnection::read(void *buf,
+                                        size_t nbyte)
+{
+  if (m_readPos == m_readLength)
+  {
+    // the peer does not send anything before it has received our data
+    if (!flush())
+      return -1;
+    // a large read does not benefit from the buffer
+    if (nbyte >= DCMSVC_TRANSPORT_BUFFER_SIZE)
+    {
+      const ssize_t received = DcmTCPConnection::read(buf, nbyte);
+      if (received > 0)
+      {
+        if (m_counters != NULL)
+          m_counters->bytesReceived += OFstatic_cast(Uint64, received);
+        m_layer.noteDataArrival();
+      }
+      return received;
+    }
+    const ssize_t received = DcmTCPConnection::read(m_readBuffer, DCMSVC_TRANSPORT_BUFFER_SIZE);
+    if (received <= 0)
+      return received;
+    if (m_counters != NULL)
+      m_counters->bytesReceived += OFstatic_cast(Uint64, received);
+    m_readPos = 0;
+    m_readLength = OFstatic_cast(size_t, received);
+  }
+  const size_t length = OFMin(nbyte, m_readLength - m_readPos);
+  memcpy(buf, m_readBuffer + m_readPos, length);
+  m_readPos += length;
+  m_layer.noteDataArrival();
+  return OFstatic_cast(ssize_t, length);
+}
+
+
+ssize_t DcmSvcTransportConnection::write(void *buf,
+                                         size_t nbyte)
+{
+  const char *data = OFstatic_cast(const char *, buf);
+  if (nbyte > DCMSVC_TRANSPORT_BUFFER_SIZE - m_writeLength)
+  {
+    // send the collected data together with the new data, except for its tail
+    const size_t tail = OFMin(nbyte, OFstatic_cast(size_t, WRITE_TAIL_LENGTH));
+    if (!send(data, nbyte - tail, OFTrue))
+      return -1;
+    data += nbyte - tail;
+    memcpy(m_writeBuffer, data, tail);
+    m_writeLength = tail;
+  }
+  else
+  {
+    memcpy(m_writeBuffer + m_writeLength, data, nbyte);
+    m_writeLength += nbyte;
+  }
+  return OFstatic_cast(ssize_t, nbyte);
+}
+
+
+void DcmSvcTransportConnection::close()
+{
+  flush();
+  DcmTCPConnection::close();
+}
+
+
+OFBool DcmSvcTransportConnection::networkDataAvailable(int timeout)
+{
+  if (m_readPos < m_readLength)
+    return OFTrue;
+  if (!flush())
+    return OFFalse;
+  return DcmTCPConnection::networkDataAvailable(timeout);
+}
+
+
+OFBool DcmSvcTransportConnection::isTransparentConnection()
+{
+  return OFFalse;
+}
+
+
+OFBool DcmSvcTransportConnection::flush()
+{
+  if (m_writeLength == 0)
+    return OFTrue;
+  return send(NULL, 0, OFFalse);
+}
+
+
+OFBool DcmSvcTransportConnection::send(const char *data,
+                                       size_t length,
+                                       const OFBool more)
+{
+  const DcmNativeSocketType socket = getSocket();
+  if (socket == OFstatic_cast(DcmNativeSocketType, -1))
+    return OFFalse;
+  struct iovec iov[2];
+  iov[0].iov_base = m_writeBuffer;
+  iov[0].iov_len = m_writeLength;
+  iov[1].iov_base = OFconst_cast(char *, data);
+  iov[1].iov_len = length;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = (m_writeLength > 0) ? iov : iov + 1;
+  message.msg_iovlen = ((m_writeLength > 0) ? 1 : 0) + ((length > 0) ? 1 : 0);
+  int flags = SEND_FLAGS;
+#ifdef MSG_MORE
+  if (more)
+    flags |= MSG_MORE;
+#else
+  (void) more;
+#endif
+  m_writeLength = 0;
+  while (message.msg_iovlen > 0)
+  {
+    ssize_t sent = sendmsg(socket, &message, flags);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return OFFalse;
+    }
+    if (m_counters != NULL)
+      m_counters->bytesSent += OFstatic_cast(Uint64, sent);
+    // skip what has been sent, in case of a partial send
+    while ((message.msg_iovlen > 0) && (OFstatic_cast(size_t, sent) >= message.msg_iov->iov_len))
+    {
+      sent -= OFstatic_cast(ssize_t, message.msg_iov->iov_len);
+      ++message.msg_iov;
+      --message.msg_iovlen;
+    }
+    if (message.msg_iovlen > 0)
+    {
+      message.msg_iov->iov_base = OFstatic_cast(char *, message.msg_iov->iov_base) + sent;
+      message.msg_iov->iov_len -= OFstatic_cast(size_t, sent);
+    }
+  }
+  return OFTrue;
+}
+
+
+DcmSvcTransportLayer::DcmSvcTransportLayer(DcmSvcTransferCounters *counters)
+  : DcmTransportLayer()
+  , m_counters(counters)
+  , m_connectionTime(0)
+  , m_dataArrivalTime(0)
+{
+  m_idleBuffers[0] = NULL;
+  m_idleBuffers[1] = NULL;
+}
+
+
+DcmSvcTransportLayer::~DcmSvcTransportLayer()
+{
+  delete[] m_idleBuffers[0];
+  delete[] m_idleBuffers[1];
+}
+
+
+DcmTransportConnection *DcmSvcTransportLayer::createConnection(DcmNativeSocketType openSocket,
+                                                               OFBool useSecureLayer)
+{
+  if (useSecureLayer)
+    return NULL;
+  // the connection has just been accepted (or connected, for the SCU)
+  m_connectionTime = DcmSvcLatencyHistogram::getMonotonicTime();
+  return new DcmSvcTransportConnection(openSocket, *this);
+}
+
+
+char *DcmSvcTransportLayer::acquireBuffer()
+{
+  for (size_t i = 0; i < 2; ++i)
+  {
+    if (m_idleBuffers[i] != NULL)
+    {
+      char *buffer = m_idleBuffers[i];
+      m_idleBuffers[i] = NULL;
+      return buffer;
+    }
+  }
+  return new char[DCMSVC_TRANSPORT_BUFFER_SIZE];
+}
+
+
+void DcmSvcTransportLayer::releaseBuffer(char *buffer)
+{
+  for (size_t i = 0; i < 2; ++i)
+  {
+    if (m_idleBuffers[i] == NULL)
+    {
+      m_idleBuffers[i] = buffer;
+      return;
+    }
+  }
+  delete[] buffer;
+}
+
+
+DcmSvcTransferCounters *DcmSvcTransportLayer::getCounters()
+{
+  return m_counters;
+}
+
+
+Uint64 DcmSvcTransportLayer::getConnectionTime() const
+{
+  return m_connectionTime;
+}
+
+
+void DcmSvcTransportLayer::resetDataArrivalTime()
+{
+  m_dataArrivalTime = 0;
+}
+
+
+Uint64 DcmSvcTransportLayer::getDataArrivalTime() const
+{
+  return m_dataArrivalTime;
+}
+
+
+void DcmSvcTransportLayer::noteDataArrival()
+{
+  if (m_dataArrivalTime == 0)
+    m_dataArrivalTime = DcmSvcLatencyHistogram::getMonotonicTime();
+}
@@ -0,0 +1,239 @@
+/*
+ *
+ *  Module:  svccommon
+ *
+ *  Purpose: TCP transport layer with buffered reads and gathered writes
+ *
+ */
+
+#ifndef DSVCTRANS_H
+#define DSVCTRANS_H
+
+#include "dcmtk/config/osconfig.h"  /* make sure OS specific configuration is included first */
+
+#include "dcmtk/dcmnet/dcmlayer.h"  /* for DcmTransportLayer */
+#include "dcmtk/dcmnet/dcmtrans.h"  /* for DcmTCPConnection */
+
+#include "dsvchist.h"               /* for DcmSvcLatencyHistogram */
+
+/** Size of the read buffer and of the write buffer of a DcmSvcTransportConnection
+ */
+#define DCMSVC_TRANSPORT_BUFFER_SIZE 65536
+
+/** Numbers of bytes received and sent by the connections of a DcmSvcTransportLayer.
+ *  Only the thread using the transport layer changes them, without any lock or atomic
+ *  operation.
+ */
+struct DcmSvcTransferCounters
+{
+  /** default constructor. Sets all counters to 0.
+   */
+  DcmSvcTransferCounters();
+
+  /** Add the counters of another thread
+   *  @param other [in] The counters to add
+   */
+  void add(const DcmSvcTransferCounters &other);
+
+  /// bytes received from the network
+  volatile Uint64 bytesReceived;
+
+  /// bytes sent to the network
+  volatile Uint64 bytesSent;
+};
+
+class DcmSvcTransportLayer;
+
+/** TCP connection that reduces the number of system calls of the DUL layer. Reads are
+ *  served from a large buffer that is filled with as much data as available. Writes
+ *  (i.e.\ the PDU header, the PDV headers and the PDV data, which the DUL layer writes
+ *  separately) are collected and sent with a single gathering sendmsg() when the
+ *  connection waits for data from the peer or is closed, so that a message (or several
+ *  messages sent in a row) goes out in as few TCP segments as possible. Large data is
+ *  not copied but sent directly together with the collected data; such intermediate
+ *  sends are flagged with MSG_MORE (where available), since the rest of the message
+ *  follows. TLS is not supported by this connection.
+ */
+class DcmSvcTransportConnection: public DcmTCPConnection
+{
+
+  public:
+
+  /** constructor
+   *  @param openSocket [in] The connected socket
+   *  @param layer      [in] The transport layer providing the buffers
+   */
+  DcmSvcTransportConnection(DcmNativeSocketType openSocket,
+                            DcmSvcTransportLayer &layer);
+
+  /** destructor. Sends collected data and gives the buffers back to the layer.
+   */
+  virtual ~DcmSvcTransportConnection();
+
+  /** Read data, from the read buffer if possible
+   *  @param buf   [out] The buffer to read into
+   *  @param nbyte [in]  Maximum number of bytes to read
+   *  @return number of bytes read, 0 on end of file, -1 on error
+   */
+  virtual ssize_t read(void *buf,
+                       size_t nbyte);
+
+  /** Write data, i.e.\ collect it for the next gathered send
+   *  @param buf   [in] The data
+   *  @param nbyte [in] Number of bytes
+   *  @return nbyte if successful, -1 on error
+   */
+  virtual ssize_t write(void *buf,
+                        size_t nbyte);
+
+  /** Send the collected data and close the connection
+   */
+  virtual void close();
+
+  /** Check whether data is available, after sending the collected data (the peer
+   *  cannot answer before)
+   *  @param timeout [in] Timeout in seconds
+   *  @return OFTrue if data is available, OFFalse otherwise
+   */
+  virtual OFBool networkDataAvailable(int timeout);
+
+  /** Returns OFFalse, since data may be available in the read buffer even if the
+   *  socket is not readable
+   *  @return OFFalse
+   */
+  virtual OFBool isTransparentConnection();
+
+  /** Send the collected data
+   *  @return OFTrue if successful, OFFalse on error
+   */
+  OFBool flush();
+
+  protected:
+
+  /** Send the collected data and optionally further data with a single sendmsg()
+   *  (repeated for partial sends)
+   *  @param data   [in] Further data, NULL if none
+   *  @param length [in] Length of the further data
+   *  @param more   [in] OFTrue if the message is not complete yet (MSG_MORE)
+   *  @return OFTrue if successful, OFFalse on error
+   */
+  OFBool send(const char *data,
+              size_t length,
+              const OFBool more);
+
+  private:
+
+  /// transport layer that owns the buffers
+  DcmSvcTransportLayer &m_layer;
+
+  /// counters of received and sent bytes (not owned), NULL if not counted
+  DcmSvcTransferCounters *m_counters;
+
+  /// read buffer
+  char *m_readBuffer;
+
+  /// offset of the first unread byte in the read buffer
+  size_t m_readPos;
+
+  /// number of valid bytes in the read buffer
+  size_t m_readLength;
+
+  /// write buffer
+  char *m_writeBuffer;
+
+  /// number of collected bytes in the write buffer
+  size_t m_writeLength;
+
+  // private undefined copy constructor
+  DcmSvcTransportConnection(const DcmSvcTransportConnection &);
+
+  // private undefined assignment operator
+  DcmSvcTransportConnection &operator=(const DcmSvcTransportConnection &);
+
+};
+
+/** Transport layer creating DcmSvcTransportConnection objects for unencrypted
+ *  connections. The buffers of a closed connection are kept for the next one, so that
+ *  an SCP handling one association after the other allocates them only once.
+ */
+class DcmSvcTransportLayer: public DcmTransportLayer
+{
+
+  public:
+
+  /** constructor
+   *  @param counters [in] Counters of received and sent bytes, NULL if not counted.
+   *                       Not owned, must exist as long as the layer.
+   */
+  DcmSvcTransportLayer(DcmSvcTransferCounters *counters = NULL);
+
+  /** destructor
+   */
+  virtual ~DcmSvcTransportLayer();
+
+  /** Create a connection object for an open socket
+   *  @param openSocket     [in] The connected socket
+   *  @param useSecureLayer [in] Must be OFFalse, TLS is not supported
+   *  @return the connection, NULL if TLS was requested
+   */
+  virtual DcmTransportConnection *createConnection(DcmNativeSocketType openSocket,
+                                                   OFBool useSecureLayer);
+
+  /** Get a buffer of DCMSVC_TRANSPORT_BUFFER_SIZE bytes
+   *  @return the buffer, to be given back with releaseBuffer()
+   */
+  char *acquireBuffer();
+
+  /** Give back a buffer obtained by acquireBuffer()
+   *  @param buffer [in] The buffer
+   */
+  void releaseBuffer(char *buffer);
+
+  /** Get the counters of received and sent bytes
+   *  @return the counters, NULL if not counted
+   */
+  DcmSvcTransferCounters *getCounters();
+
+  /** Returns the time the last connection was accepted (i.e.\ created)
+   *  @return monotonic time in microseconds, see DcmSvcLatencyHistogram::getMonotonicTime()
+   */
+  Uint64 getConnectionTime() const;
+
+  /** Forget the time data was last received, see getDataArrivalTime()
+   */
+  void resetDataArrivalTime();
+
+  /** Returns the time data was received first since the last call of
+   *  resetDataArrivalTime(), i.e.\ the time a read returned data (from the network or
+   *  from the read buffer)
+   *  @return monotonic time in microseconds, 0 if no data was received since
+   */
+  Uint64 getDataArrivalTime() const;
+
+  /** Note that a connection received data, see getDataArrivalTime()
+   */
+  void noteDataArrival();
+
+  private:
+
+  /// idle buffers (two per connection)
+  char *m_idleBuffers[2];
+
+  /// counters of received and sent bytes (not owned), NULL if not counted
+  DcmSvcTransferCounters *m_counters;
+
+  /// time the last connection was created
+  Uint64 m_connectionTime;
+
+  /// time data was received first since the last reset, 0 if none
+  Uint64 m_dataArrivalTime;
+
+  // private undefined copy constructor
+  DcmSvcTransportLayer(const DcmSvcTransportLayer &);
+
+  // private undefined assignment operator
+  DcmSvcTransportLayer &operator=(const DcmSvcTransportLayer &);
+
+};
+
+#endif // DSVCTRANS_H